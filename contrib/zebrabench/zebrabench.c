@@ -0,0 +1,812 @@
+/**
+ * Test bench for the LiveView overlay kernels (src/zebra_kernels.c)
+ *
+ * Runs the same code as the camera (histogram/waveform/vectorscope, zebras, the single pass doing both, zebras refreshed tile by tile,
+ * focus peaking, waveform drawing)
+ * on frames saved from the camera, reports ms/frame for each kernel, and checks the results against a golden file
+ * (and focus peaking against a plain pixel-by-pixel reference, with all the display settings).
+ *
+ * Usage: zebrabench [options] [files]
+ *   file.422    LiveView image (UYVY), e.g. VRAMx.422 from the screenshot menu
+ *   file.RAW    raw_rec clip (14-bit); every frame feeds the RAW zebras, and a gray preview of it the YUV kernels
+ *   no files    synthetic test frames
+ *
+ *   -n N        run each kernel N times on each frame (default 10)
+ *   -f N        use at most N frames from each clip (default 10)
+ *   -s WxH      size of the .422 images (default: guessed from the file size)
+ *   -w file     save the results as golden file
+ *   -c file     compare the results with a golden file (exit code 1 if anything is different)
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdint.h"
+#include "math.h"
+#include <sys/time.h>
+#include <getopt.h>
+
+#include <imgconv.h>
+#include <histogram.h>
+#include <raw_pack.h>
+#include <zebra_kernels.h>
+#include "../../modules/lv_rec/raw_reader.h"
+
+#define FAIL(fmt,...) { fprintf(stderr, "Error: "); fprintf(stderr, fmt, ## __VA_ARGS__); fprintf(stderr, "\n"); exit(1); }
+#define CHECK(ok, fmt,...) { if (!(ok)) FAIL(fmt, ## __VA_ARGS__); }
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+/* camera-side helpers used by the kernels (same as imgconv.c, REC 601) */
+int yuv2rgb_RV[256];
+int yuv2rgb_GU[256];
+int yuv2rgb_GV[256];
+int yuv2rgb_BU[256];
+
+void precompute_yuv2rgb()
+{
+    for (int u = 0; u < 256; u++)
+    {
+        int8_t U = u;
+        yuv2rgb_GU[u] = (-352 * U) >> 10;
+        yuv2rgb_BU[u] = (1812 * U) >> 10;
+    }
+
+    for (int v = 0; v < 256; v++)
+    {
+        int8_t V = v;
+        yuv2rgb_RV[v] = (1437 * V) >> 10;
+        yuv2rgb_GV[v] = (-731 * V) >> 10;
+    }
+}
+
+void little_cleanup(void* BP, void* MP)
+{
+    uint8_t* bp = BP; uint8_t* mp = MP;
+    if (*bp != 0 && *bp == *mp) *mp = *bp = 0;
+    bp++; mp++;
+    if (*bp != 0 && *bp == *mp) *mp = *bp = 0;
+    bp++; mp++;
+    if (*bp != 0 && *bp == *mp) *mp = *bp = 0;
+    bp++; mp++;
+    if (*bp != 0 && *bp == *mp) *mp = *bp = 0;
+}
+
+/* screen layout: LCD, 720x480 overlay area inside a 960x540 BMP buffer (same as BMPPITCH/BMP_HDMI_OFFSET on DIGIC 5) */
+#define BMP_PITCH 960
+#define BMP_ROWS 540
+#define BMP_X_OFF 120
+#define BMP_Y_OFF 30
+#define OS_W 720
+#define OS_H 480
+
+#define WAVEFORM_W 180
+#define WAVEFORM_H 120
+#define VECTORSCOPE_SIZE 256
+
+/* one input frame */
+struct frame
+{
+    char name[300];
+    int lv_width, lv_height;
+    uint8_t* lv;                    /* UYVY, lv_width * 2 bytes per row, with one guard row above and below */
+    void* raw;                      /* 0 = no RAW data */
+    struct raw_info raw_info;
+};
+
+static uint8_t* bmp_buf;
+static uint8_t* mirror_buf;
+static uint32_t* peak_dst;
+static int bm2lv_x_table[OS_W];
+static int bm2lv_r_table[OS_H];
+
+static int iterations = 10;
+
+static double get_time()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static uint8_t* alloc_lv(int width, int height)
+{
+    /* guard rows: focus peaking looks at the neighbour rows */
+    uint8_t* buf = calloc(width * 2, height + 2);
+    CHECK(buf, "malloc");
+    return buf + width * 2;
+}
+
+static void free_frame(struct frame* f)
+{
+    free(f->lv - f->lv_width * 2);
+    free(f->raw);
+}
+
+/* overlay area mapped on the whole LV image (and on the RAW active area, if any) */
+static void setup_vram(struct overlay_vram* v, struct frame* f)
+{
+    memset(v, 0, sizeof(*v));
+    v->lv = f->lv;
+    v->lv_pitch = f->lv_width * 2;
+    v->bmp = bmp_buf + BMP_Y_OFF * BMP_PITCH + BMP_X_OFF;
+    v->mirror = mirror_buf + BMP_Y_OFF * BMP_PITCH + BMP_X_OFF;
+    v->bmp_pitch = BMP_PITCH;
+    v->bmp_h = BMP_ROWS - BMP_Y_OFF;
+    v->x0 = 0;
+    v->y0 = 0;
+    v->x_max = OS_W;
+    v->y_max = OS_H;
+
+    int sx = f->lv_width * 1024 / OS_W;
+    for (int x = 0; x < OS_W; x++)
+        bm2lv_x_table[x] = (x * sx) >> 10;
+    v->bm2lv_x = bm2lv_x_table;
+    v->bm2lv_sy = f->lv_height * 1024 / OS_H;
+    v->bm2lv_ty = 0;
+    for (int y = 0; y < OS_H; y++)
+        bm2lv_r_table[y] = OVERLAY_BM2LV_Y(v, y) * v->lv_pitch;
+    v->bm2lv_r = bm2lv_r_table;
+
+    if (f->raw)
+    {
+        struct raw_info* r = &f->raw_info;
+        v->raw = f->raw;
+        v->raw_width = r->width;
+        v->raw_x1 = r->active_area.x1;
+        v->raw_x2 = r->active_area.x2;
+        /* the RAW zebras look at the rows above (the camera always has a few black rows there) */
+        v->raw_y1 = MAX(r->active_area.y1, 4);
+        v->raw_y2 = r->active_area.y2;
+        v->lv2raw_sx = (r->active_area.x2 - r->active_area.x1) * 1024 / f->lv_width;
+        v->lv2raw_tx = r->active_area.x1;
+        v->lv2raw_sy = (r->active_area.y2 - r->active_area.y1) * 1024 / f->lv_height;
+        v->lv2raw_ty = r->active_area.y1;
+    }
+}
+
+static void clear_bmp()
+{
+    memset(bmp_buf, 0, BMP_PITCH * BMP_ROWS);
+    memset(mirror_buf, 0, BMP_PITCH * BMP_ROWS);
+}
+
+/* results: golden file */
+
+static FILE* golden_out;
+static FILE* golden_in;
+static int golden_errors;
+
+static void golden(const char* kernel, void* data, int size)
+{
+    char name[64] = {0};
+    snprintf(name, sizeof(name), "%s", kernel);
+
+    if (golden_out)
+    {
+        fwrite(name, 1, sizeof(name), golden_out);
+        fwrite(&size, 1, sizeof(size), golden_out);
+        fwrite(data, 1, size, golden_out);
+    }
+
+    if (golden_in)
+    {
+        char ref_name[64];
+        int ref_size;
+        if (fread(ref_name, 1, sizeof(ref_name), golden_in) != sizeof(ref_name) ||
+            fread(&ref_size, 1, sizeof(ref_size), golden_in) != sizeof(ref_size))
+        {
+            printf("    %-16s no golden data\n", kernel);
+            golden_errors++;
+            return;
+        }
+        CHECK(strcmp(ref_name, name) == 0 && ref_size == size, "golden file does not match the inputs (%s, expected %s)", name, ref_name);
+        uint8_t* ref = malloc(size);
+        CHECK(ref, "malloc");
+        CHECK(fread(ref, 1, size, golden_in) == (size_t)size, "golden file truncated");
+
+        int diff = 0;
+        int first = -1;
+        for (int i = 0; i < size; i++)
+        {
+            if (ref[i] != ((uint8_t*)data)[i])
+            {
+                if (first < 0) first = i;
+                diff++;
+            }
+        }
+        if (diff)
+        {
+            printf("    %-16s %d bytes differ (first at offset %d)\n", kernel, diff, first);
+            golden_errors++;
+        }
+        free(ref);
+    }
+}
+
+/* kernels */
+
+struct timing
+{
+    const char* name;
+    double total;
+    int frames;
+};
+
+static struct timing timings[16];
+static int num_timings;
+
+static void add_time(const char* name, double t)
+{
+    int i;
+    for (i = 0; i < num_timings; i++)
+        if (strcmp(timings[i].name, name) == 0)
+            break;
+
+    if (i == num_timings)
+    {
+        CHECK(num_timings < (int)(sizeof(timings)/sizeof(timings[0])), "too many kernels");
+        timings[i].name = name;
+        num_timings++;
+    }
+
+    timings[i].total += t;
+    timings[i].frames++;
+}
+
+#define BENCH(name, setup, kernel) \
+{ \
+    double t = 0; \
+    for (int k = 0; k < iterations; k++) \
+    { \
+        setup; \
+        double t0 = get_time(); \
+        kernel; \
+        t += get_time() - t0; \
+    } \
+    add_time(name, t / iterations); \
+}
+
+static void draw_zebras(struct overlay_vram* v, int raw, int hi, int lo, int rgb)
+{
+    if (raw)
+        overlay_zebras_raw_lv(v, 0, hi, lo);
+    else
+        overlay_zebras_yuv(v, 0, hi, lo, rgb);
+}
+
+/* focus peaking, computed pixel by pixel from overlay_calc_peak, as overlay_peak_filter did before skipping the flat areas */
+static uint32_t peak_ref_pixel(const uint32_t* src, int pitch, const struct overlay_peak* p, int* n_over)
+{
+    int e = overlay_calc_peak((const uint8_t*)src + 1, pitch, p->filter_edges);
+    e = e < 255 ? MIN(e * OVERLAY_PEAK_FOCUSED_THR / p->thr, 255) : 0;
+    uint32_t cold = p->grayscale ? *src & 0xFF00FF00 : *src;
+
+    if (p->disp == 1)
+    {
+        if (e < OVERLAY_PEAK_FOCUSED_THR) return cold;
+        (*n_over)++;
+        return 0x4C7F4CD5;
+    }
+
+    if (e > OVERLAY_PEAK_FOCUSED_THR) (*n_over)++;
+    if (e < 20) return cold;
+
+    /* blend with red (peak_blend_alpha) */
+    const uint8_t* s8u = (const uint8_t*)src;
+    const int8_t* s8s = (const int8_t*)src;
+    int y = (s8u[1] * (255 - e) + 76 * e) >> 8;
+    int u = (s8s[0] * (255 - e) - 43 * e) >> 8;
+    int v = (s8s[2] * (255 - e) + 127 * e) >> 8;
+    return UYVY_PACK(u,y,v,y);
+}
+
+/* dots and alpha, with all the display settings, must give the same image as the reference */
+static void check_peak(const struct frame* f, int start, int end, int pitch)
+{
+    const uint32_t* src = (const uint32_t*)f->lv;
+    static const int thrs[] = { 10, 50, 100 };
+
+    for (int disp = 1; disp <= 2; disp++)
+    for (int grayscale = 0; grayscale <= 1; grayscale++)
+    for (int filter_edges = 0; filter_edges <= 2; filter_edges++)
+    for (int k = 0; k < (int)(sizeof(thrs)/sizeof(thrs[0])); k++)
+    {
+        struct overlay_peak p = {
+            .disp = disp,
+            .grayscale = grayscale,
+            .filter_edges = filter_edges,
+            .thr = thrs[k],
+        };
+        int n_over = overlay_peak_filter(src, peak_dst, start, end, pitch, &p);
+        int n_ref = 0;
+        int i;
+        for (i = start; i < end; i++)
+            if (peak_dst[i] != peak_ref_pixel(&src[i], pitch, &p, &n_ref))
+                break;
+
+        if (i < end || n_over != n_ref)
+        {
+            printf("    %-16s different from the reference (disp %d, grayscale %d, filter_edges %d, thr %d)\n",
+                "peak", disp, grayscale, filter_edges, thrs[k]);
+            golden_errors++;
+        }
+    }
+}
+
+/* incremental refresh: all the tiles, one by one, must draw the same zebras as the whole frame at once */
+static void check_tiles(struct overlay_vram* v, int raw, int hi, int lo, int rgb)
+{
+    static struct overlay_tiles tiles;
+    static uint8_t zebras_ref[BMP_PITCH * BMP_ROWS];
+    const char* name = raw ? "tiles_raw" : "tiles_yuv";
+
+    clear_bmp();
+    draw_zebras(v, raw, hi, lo, rgb);
+    memcpy(zebras_ref, bmp_buf, sizeof(zebras_ref));
+
+    overlay_tiles_reset(&tiles);
+    BENCH("tiles_update", , overlay_tiles_update(&tiles, v, 0));
+    golden(name, tiles.current, sizeof(tiles.current));
+
+    clear_bmp();
+    int i, n = 0;
+    while ((i = overlay_tiles_next(&tiles)) >= 0)
+    {
+        struct overlay_vram tile;
+        overlay_tiles_get(&tiles, v, i, &tile);
+        draw_zebras(&tile, raw, hi, lo, rgb);
+        overlay_tiles_done(&tiles, i);
+        n++;
+    }
+
+    if (n != OVERLAY_TILES || memcmp(zebras_ref, bmp_buf, sizeof(zebras_ref)))
+    {
+        printf("    %-16s different from the whole frame (%d tiles)\n", name, n);
+        golden_errors++;
+    }
+}
+
+static void run_kernels(struct frame* f)
+{
+    struct overlay_vram v;
+    setup_vram(&v, f);
+
+    /* histogram, waveform, vectorscope */
+    static struct Histogram hist;
+    static uint8_t waveform[WAVEFORM_W * WAVEFORM_H];
+    static uint8_t vectorscope[VECTORSCOPE_SIZE * VECTORSCOPE_SIZE];
+    struct overlay_scopes s = {
+        .hist = &hist,
+        .hist_rgb = 1,
+        .skip_mz = 1,
+        .waveform = waveform,
+        .waveform_w = WAVEFORM_W,
+        .waveform_h = WAVEFORM_H,
+        .vectorscope = vectorscope,
+        .vectorscope_w = VECTORSCOPE_SIZE,
+        .vectorscope_h = VECTORSCOPE_SIZE,
+        .vectorscope_gain = 0,
+    };
+
+    BENCH("hist_build",
+        memset(&hist, 0, sizeof(hist)); memset(waveform, 0, sizeof(waveform)); memset(vectorscope, 0, sizeof(vectorscope)),
+        overlay_hist_build(&v, 0, &s)
+    );
+    golden("histogram", &hist, sizeof(hist));
+    golden("waveform", waveform, sizeof(waveform));
+    golden("vectorscope", vectorscope, sizeof(vectorscope));
+
+    /* zebras, default thresholds (over 99%, no underexposure), and both of them in RGB */
+    BENCH("zebras_luma", clear_bmp(), overlay_zebras_yuv(&v, 0, 99 * 255 / 100 - 1, 0, 0));
+    golden("zebras_luma", bmp_buf, BMP_PITCH * BMP_ROWS);
+
+    BENCH("zebras_rgb", clear_bmp(), overlay_zebras_yuv(&v, 0, 99 * 255 / 100 - 1, 5 * 255 / 100, 1));
+    golden("zebras_rgb", bmp_buf, BMP_PITCH * BMP_ROWS);
+
+    /* single pass: all the above at once; same zebras, and the scopes from as many samples (but from the whole image) */
+    {
+        static struct Histogram hist2;
+        static uint8_t waveform2[WAVEFORM_W * WAVEFORM_H];
+        static uint8_t vectorscope2[VECTORSCOPE_SIZE * VECTORSCOPE_SIZE];
+        static uint8_t zebras2[BMP_PITCH * BMP_ROWS];
+        memcpy(zebras2, bmp_buf, sizeof(zebras2));
+        struct overlay_scopes s2 = s;
+        s2.hist = &hist2;
+        s2.waveform = waveform2;
+        s2.vectorscope = vectorscope2;
+        struct overlay_zebra z = {
+            .y_skip = 0,
+            .zlh = 99 * 255 / 100 - 1,
+            .zll = 5 * 255 / 100,
+            .rgb = 1,
+        };
+
+        BENCH("analyze",
+            clear_bmp(); memset(&hist2, 0, sizeof(hist2)); memset(waveform2, 0, sizeof(waveform2)); memset(vectorscope2, 0, sizeof(vectorscope2)),
+            overlay_analyze(&v, 0, &s2, &z)
+        );
+        golden("analyze_hist", &hist2, sizeof(hist2));
+        golden("analyze_waveform", waveform2, sizeof(waveform2));
+        golden("analyze_vectorscope", vectorscope2, sizeof(vectorscope2));
+        golden("analyze_zebras", bmp_buf, BMP_PITCH * BMP_ROWS);
+
+        if (hist.total_px != hist2.total_px || memcmp(zebras2, bmp_buf, sizeof(zebras2)))
+        {
+            printf("    %-16s different from the separate kernels\n", "analyze");
+            golden_errors++;
+        }
+    }
+
+    if (f->raw)
+    {
+        struct raw_info* r = &f->raw_info;
+        int white = r->white_level > 16383 ? 15000 : r->white_level;
+        double ev = -(r->dynamic_range - 100) / 100.0;
+        int underexposed = r->black_level + (int)((r->white_level - r->black_level) * pow(2, ev));
+        BENCH("zebras_raw_lv", clear_bmp(), overlay_zebras_raw_lv(&v, 0, white, underexposed));
+        golden("zebras_raw_lv", bmp_buf, BMP_PITCH * BMP_ROWS);
+
+        check_tiles(&v, 1, white, underexposed, 0);
+    }
+
+    check_tiles(&v, 0, 99 * 255 / 100 - 1, 5 * 255 / 100, 1);
+
+    /* focus peaking display filter, all modes, same range as peak_disp_filter */
+    static const char* peak_names[] = { 0, "peak_dots", "peak_alpha", "peak_sharp", "peak_raw" };
+    int start = 720 * (v.y0/2);
+    int end = MIN(720 * (v.y_max/2), f->lv_width * f->lv_height / 2);
+    for (int disp = 1; disp <= 4; disp++)
+    {
+        struct overlay_peak p = {
+            .disp = disp,
+            .grayscale = 0,
+            .filter_edges = 0,
+            .thr = 50,
+        };
+        int n_over = 0;
+        BENCH(peak_names[disp], memset(peak_dst, 0, end * 4), n_over = overlay_peak_filter((uint32_t*)f->lv, peak_dst, start, end, v.lv_pitch, &p));
+        golden(peak_names[disp], peak_dst, end * 4);
+        golden("peak_count", &n_over, sizeof(n_over));
+    }
+
+    check_peak(f, start, end, v.lv_pitch);
+
+    /* draw the waveform computed above, full screen size (factor 4) */
+    v.bmp = bmp_buf + BMP_Y_OFF * BMP_PITCH + BMP_X_OFF;
+    BENCH("waveform_draw", clear_bmp(), overlay_waveform_draw(&v, waveform, WAVEFORM_W, WAVEFORM_H, 4, 0x26, 0, 0, WAVEFORM_H * 4));
+    golden("waveform_draw", bmp_buf, BMP_PITCH * BMP_ROWS);
+}
+
+/* inputs */
+
+static int lv_width_arg, lv_height_arg;
+
+static int load_422(struct frame* f, char* filename)
+{
+    FILE* fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        printf("%s: could not open\n", filename);
+        return 0;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    /* LiveView and HD buffer sizes seen in .422 dumps */
+    static const int sizes[][2] = { { 720, 480 }, { 960, 540 }, { 1024, 680 }, { 1056, 704 }, { 1620, 1080 }, { 1728, 972 }, { 1920, 1080 } };
+    int w = lv_width_arg;
+    int h = lv_height_arg;
+    for (int i = 0; !w && i < (int)(sizeof(sizes)/sizeof(sizes[0])); i++)
+    {
+        if (size == sizes[i][0] * sizes[i][1] * 2)
+        {
+            w = sizes[i][0];
+            h = sizes[i][1];
+        }
+    }
+    if (!w || size < w * h * 2 || w < OS_W || h < OS_H)
+    {
+        printf("%s: unknown image size (%ld bytes), use -s WxH\n", filename, size);
+        fclose(fp);
+        return 0;
+    }
+
+    memset(f, 0, sizeof(*f));
+    snprintf(f->name, sizeof(f->name), "%s", filename);
+    f->lv_width = w;
+    f->lv_height = h;
+    f->lv = alloc_lv(w, h);
+    CHECK(fread(f->lv, 1, w * h * 2, fp) == (size_t)(w * h * 2), "%s: read error", filename);
+    fclose(fp);
+    return 1;
+}
+
+/* gray UYVY preview from the green channel, log curve */
+static void raw_preview(struct frame* f)
+{
+    struct raw_info* r = &f->raw_info;
+    int range = MAX(r->white_level - r->black_level, 1);
+    uint16_t* row = malloc(r->width * 2);
+    CHECK(row, "malloc");
+
+    for (int y = 0; y < f->lv_height; y++)
+    {
+        int ry = (r->active_area.y1 + y * (r->active_area.y2 - r->active_area.y1) / f->lv_height) & ~1;
+        raw_unpack_row(f->raw + ry * r->pitch, row, r->width);
+        uint32_t* out = (uint32_t*)(f->lv + y * f->lv_width * 2);
+        for (int x = 0; x < f->lv_width; x += 2)
+        {
+            int rx = (r->active_area.x1 + x * (r->active_area.x2 - r->active_area.x1) / f->lv_width) | 1;
+            int g = MAX(row[rx] - r->black_level, 1);
+            int Y = (int)(255 + log2f((float)g / range) * 255 / 10);
+            Y = Y < 0 ? 0 : Y > 255 ? 255 : Y;
+            out[x/2] = (Y << 8) | (Y << 24);
+        }
+    }
+    free(row);
+}
+
+static int load_raw_frame(struct frame* f, struct raw_reader* rr, char* filename, int index)
+{
+    struct raw_frame rf;
+    if (!raw_reader_get_frame(rr, index, &rf))
+    {
+        printf("%s: could not read frame %d\n", filename, index);
+        return 0;
+    }
+
+    memset(f, 0, sizeof(*f));
+    snprintf(f->name, sizeof(f->name), "%s:%d", filename, index);
+    f->raw_info = rr->footer.raw_info;
+    struct raw_info* r = &f->raw_info;
+
+    /* same as raw2dng: the resolution from the footer wins */
+    if (rr->footer.xRes != r->width)
+    {
+        r->width = rr->footer.xRes;
+        r->pitch = r->width * 14/8;
+        r->active_area.x1 = 0;
+        r->active_area.x2 = r->width;
+    }
+    if (rr->footer.yRes != r->height)
+    {
+        r->height = rr->footer.yRes;
+        r->active_area.y1 = 0;
+        r->active_area.y2 = r->height;
+    }
+
+    f->raw = malloc(r->pitch * r->height);
+    CHECK(f->raw, "malloc");
+    memcpy(f->raw, rf.data, r->pitch * r->height);
+    raw_reader_release_frame(&rf);
+
+    f->lv_width = OS_W;
+    f->lv_height = OS_H;
+    f->lv = alloc_lv(f->lv_width, f->lv_height);
+    raw_preview(f);
+    return 1;
+}
+
+/* synthetic frames: gradients, color bars, fine texture (for peaking) and clipped areas (for zebras) */
+static void make_synthetic(struct frame* f, int index)
+{
+    memset(f, 0, sizeof(*f));
+    snprintf(f->name, sizeof(f->name), "synthetic:%d", index);
+    f->lv_width = 720;
+    f->lv_height = 480;
+    f->lv = alloc_lv(f->lv_width, f->lv_height);
+
+    srand(1234 + index);
+    for (int y = 0; y < f->lv_height; y++)
+    {
+        uint32_t* out = (uint32_t*)(f->lv + y * f->lv_width * 2);
+        for (int x = 0; x < f->lv_width; x += 2)
+        {
+            int Y = x * 255 / f->lv_width;
+            int U = 0, V = 0;
+            if (y < 120)
+            {
+                /* color bars */
+                int bar = x * 8 / f->lv_width;
+                U = (int8_t)(bar * 37 - 128 + index * 8);
+                V = (int8_t)(bar * 71 - 100);
+                Y = 180;
+            }
+            else if (y < 300)
+            {
+                /* texture, sharper towards the right */
+                Y = 128 + (int)(100 * sin(x * (0.05 + 0.01 * index) + y * 0.07)) * x / f->lv_width + rand() % 8;
+            }
+            else if (y > 420)
+            {
+                /* clipped highlights */
+                Y = 255;
+            }
+            Y = Y < 0 ? 0 : Y > 255 ? 255 : Y;
+            out[x/2] = (U & 0xFF) | (Y << 8) | ((V & 0xFF) << 16) | (Y << 24);
+        }
+    }
+
+    /* RAW: 5D3-like full frame, with a gradient and clipped areas */
+    struct raw_info* r = &f->raw_info;
+    r->width = 1920;
+    r->height = 1080;
+    r->pitch = r->width * 14/8;
+    r->bits_per_pixel = 14;
+    r->black_level = 2048;
+    r->white_level = 15000;
+    r->dynamic_range = 1100;
+    r->active_area.x1 = 72;
+    r->active_area.y1 = 28;
+    r->active_area.x2 = r->width;
+    r->active_area.y2 = r->height;
+    f->raw = malloc(r->pitch * r->height);
+    CHECK(f->raw, "malloc");
+
+    uint16_t* row = malloc(r->width * 2);
+    CHECK(row, "malloc");
+    for (int y = 0; y < r->height; y++)
+    {
+        for (int x = 0; x < r->width; x++)
+        {
+            int v = r->black_level + (x * (16383 - r->black_level) / r->width) * y / r->height;
+            if ((x ^ y) & 1) v = v * 3 / 4;             /* a bit of color */
+            v += rand() % 16;
+            row[x] = MIN(v, 16383);
+        }
+        raw_pack_row(row, f->raw + y * r->pitch, r->width);
+    }
+    free(row);
+}
+
+int main(int argc, char** argv)
+{
+    int max_frames = 10;
+    char* golden_write = 0;
+    char* golden_check = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:f:s:w:c:")) != -1)
+    {
+        switch (c)
+        {
+            case 'n': iterations = atoi(optarg); break;
+            case 'f': max_frames = atoi(optarg); break;
+            case 's': CHECK(sscanf(optarg, "%dx%d", &lv_width_arg, &lv_height_arg) == 2, "bad size: %s", optarg); break;
+            case 'w': golden_write = optarg; break;
+            case 'c': golden_check = optarg; break;
+            default:
+                printf("usage: %s [-n iterations] [-f frames] [-s WxH] [-w golden] [-c golden] [file.422 | clip.RAW]...\n", argv[0]);
+                return 1;
+        }
+    }
+    CHECK(iterations > 0 && max_frames > 0, "bad args");
+
+    if (golden_write)
+    {
+        golden_out = fopen(golden_write, "wb");
+        CHECK(golden_out, "could not create %s", golden_write);
+    }
+    if (golden_check)
+    {
+        golden_in = fopen(golden_check, "rb");
+        CHECK(golden_in, "could not open %s", golden_check);
+    }
+
+    precompute_yuv2rgb();
+    bmp_buf = malloc(BMP_PITCH * BMP_ROWS);
+    mirror_buf = malloc(BMP_PITCH * BMP_ROWS);
+    peak_dst = malloc(1920 * 1080 * 2);
+    CHECK(bmp_buf && mirror_buf && peak_dst, "malloc");
+
+    int frames = 0;
+    struct frame f;
+
+    if (optind >= argc)
+    {
+        for (int i = 0; i < max_frames; i++)
+        {
+            make_synthetic(&f, i);
+            printf("%s\n", f.name);
+            run_kernels(&f);
+            free_frame(&f);
+            frames++;
+        }
+    }
+
+    for (int i = optind; i < argc; i++)
+    {
+        char* filename = argv[i];
+        char* ext = strrchr(filename, '.');
+
+        if (ext && strcasecmp(ext, ".RAW") == 0)
+        {
+            struct raw_reader rr;
+            if (!raw_reader_open(&rr, filename))
+                continue;
+
+            if (rr.footer.raw_info.bits_per_pixel != 14)
+            {
+                printf("%s: %d-bit clip, only 14-bit is supported\n", filename, rr.footer.raw_info.bits_per_pixel);
+                raw_reader_close(&rr);
+                continue;
+            }
+
+            for (int k = 0; k < MIN(rr.frame_count, max_frames); k++)
+            {
+                if (!load_raw_frame(&f, &rr, filename, k))
+                    break;
+                printf("%s\n", f.name);
+                run_kernels(&f);
+                free_frame(&f);
+                frames++;
+            }
+            raw_reader_close(&rr);
+        }
+        else
+        {
+            if (!load_422(&f, filename))
+                continue;
+            printf("%s (%dx%d)\n", f.name, f.lv_width, f.lv_height);
+            run_kernels(&f);
+            free_frame(&f);
+            frames++;
+        }
+    }
+
+    CHECK(frames, "no frames");
+
+    printf("\n%d frames, %d iterations\n", frames, iterations);
+    for (int i = 0; i < num_timings; i++)
+        printf("%-16s %8.3f ms/frame\n", timings[i].name, timings[i].total * 1000 / timings[i].frames);
+
+    if (golden_out)
+    {
+        fclose(golden_out);
+        printf("\nGolden results saved to %s\n", golden_write);
+    }
+
+    if (golden_in)
+    {
+        char extra;
+        if (fread(&extra, 1, 1, golden_in) == 1)
+        {
+            printf("    golden file has more results than this run\n");
+            golden_errors++;
+        }
+        fclose(golden_in);
+        printf("\nGolden check: %s\n", golden_errors ? "FAILED" : "OK");
+    }
+
+    free(bmp_buf);
+    free(mirror_buf);
+    free(peak_dst);
+    return golden_errors ? 1 : 0;
+}
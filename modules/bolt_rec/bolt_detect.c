@@ -0,0 +1,195 @@
+/**
+ * bolt_detect: trigger statistics straight from packed raw rows (see bolt_detect.h)
+ */
+
+#ifdef MODULE
+#include <dryos.h>
+#else
+#define FAST
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+#include "bolt_detect.h"
+
+/* 8 pixels from one raw_pixblock (7 words); same bit layout as raw_unpack_row_c, but kept in registers */
+static inline void bolt_detect_unpack8(const uint16_t *w, uint32_t *v)
+{
+    uint32_t w0 = w[0];
+    uint32_t w1 = w[1];
+    uint32_t w2 = w[2];
+    uint32_t w3 = w[3];
+    uint32_t w4 = w[4];
+    uint32_t w5 = w[5];
+    uint32_t w6 = w[6];
+
+    v[0] = w0 >> 2;
+    v[1] = ((w0 << 12) | (w1 >> 4))  & 0x3FFF;
+    v[2] = ((w1 << 10) | (w2 >> 6))  & 0x3FFF;
+    v[3] = ((w2 << 8)  | (w3 >> 8))  & 0x3FFF;
+    v[4] = ((w3 << 6)  | (w4 >> 10)) & 0x3FFF;
+    v[5] = ((w4 << 4)  | (w5 >> 12)) & 0x3FFF;
+    v[6] = ((w5 << 2)  | (w6 >> 14)) & 0x3FFF;
+    v[7] = w6 & 0x3FFF;
+}
+
+static unsigned int bolt_detect_log2(unsigned int x)
+{
+    unsigned int n = 0;
+    while(x > 1)
+    {
+        x >>= 1;
+        n++;
+    }
+    return n;
+}
+
+void bolt_detect_reset(struct bolt_detect *d)
+{
+    d->prev_valid = 0;
+}
+
+/* every pixel is a sample */
+static void FAST bolt_detect_line_full(struct bolt_detect *d, const uint16_t *w, const uint8_t *mask, uint16_t *prev, struct bolt_detect_result *res)
+{
+    unsigned int groups = d->width / 8;
+    uint32_t sum = 0;
+    uint32_t count = 0;
+    uint32_t peak = 0;
+    uint32_t delta = 0;
+
+    for(unsigned int g = 0; g < groups; g++, w += 7)
+    {
+        if(mask && !mask[g])
+        {
+            continue;
+        }
+
+        uint32_t v[8];
+        bolt_detect_unpack8(w, v);
+
+        /* max of the group first, then one compare for the peak */
+        uint32_t group_sum = 0;
+        uint32_t group_max = 0;
+        for(int k = 0; k < 8; k++)
+        {
+            group_sum += v[k];
+            group_max = MAX(group_max, v[k]);
+        }
+        sum += group_sum;
+        count += 8;
+        peak = MAX(peak, group_max);
+
+        if(prev)
+        {
+            uint16_t *p = &prev[g * 8];
+            for(int k = 0; k < 8; k++)
+            {
+                int diff = (int)v[k] - (int)p[k];
+                uint32_t ad = diff < 0 ? -diff : diff;
+                delta = MAX(delta, ad);
+                p[k] = v[k];
+            }
+        }
+    }
+
+    res->sum += sum;
+    res->count += count;
+    res->peak = MAX(res->peak, peak);
+    if(prev && d->prev_valid)
+    {
+        res->delta = MAX(res->delta, delta);
+    }
+}
+
+/* samples are block averages */
+static void FAST bolt_detect_line_blocks(struct bolt_detect *d, const uint16_t *w, const uint8_t *mask, uint16_t *prev, struct bolt_detect_result *res)
+{
+    unsigned int groups_per_block = d->block / 8;
+    unsigned int shift = bolt_detect_log2(d->block);
+    unsigned int blocks = d->width / d->block;
+    uint32_t sum = 0;
+    uint32_t count = 0;
+    uint32_t peak = 0;
+    uint32_t delta = 0;
+
+    for(unsigned int b = 0; b < blocks; b++, w += 7 * groups_per_block)
+    {
+        if(mask)
+        {
+            const uint8_t *m = &mask[b * groups_per_block];
+            unsigned int all = 1;
+            for(unsigned int j = 0; j < groups_per_block; j++)
+            {
+                all &= (m[j] != 0);
+            }
+            if(!all)
+            {
+                continue;
+            }
+        }
+
+        uint32_t block_sum = 0;
+        for(unsigned int j = 0; j < groups_per_block; j++)
+        {
+            uint32_t v[8];
+            bolt_detect_unpack8(w + 7 * j, v);
+            block_sum += v[0] + v[1] + v[2] + v[3] + v[4] + v[5] + v[6] + v[7];
+        }
+
+        uint32_t sample = block_sum >> shift;
+        sum += sample;
+        count++;
+        peak = MAX(peak, sample);
+
+        if(prev)
+        {
+            int diff = (int)sample - (int)prev[b];
+            uint32_t ad = diff < 0 ? -diff : diff;
+            delta = MAX(delta, ad);
+            prev[b] = sample;
+        }
+    }
+
+    res->sum += sum;
+    res->count += count;
+    res->peak = MAX(res->peak, peak);
+    if(prev && d->prev_valid)
+    {
+        res->delta = MAX(res->delta, delta);
+    }
+}
+
+void bolt_detect_line(struct bolt_detect *d, void *row, unsigned int line, struct bolt_detect_result *res)
+{
+    const uint8_t *mask = d->mask ? d->mask + line * d->mask_stride : 0;
+    uint16_t *prev = d->prev ? d->prev + line * BOLT_DETECT_SAMPLES(d) : 0;
+
+    if(d->block <= 1)
+    {
+        bolt_detect_line_full(d, row, mask, prev, res);
+    }
+    else
+    {
+        bolt_detect_line_blocks(d, row, mask, prev, res);
+    }
+}
+
+void bolt_detect_frame(struct bolt_detect *d, void *buf, unsigned int pitch, unsigned int x_start, const unsigned int *y, struct bolt_detect_result *res)
+{
+    res->sum = 0;
+    res->count = 0;
+    res->peak = 0;
+    res->delta = 0;
+
+    for(unsigned int line = 0; line < d->lines; line++)
+    {
+        void *row = (uint8_t *)buf + y[line] * pitch + x_start / 8 * 14;
+        bolt_detect_line(d, row, line, res);
+    }
+
+    /* from now on, we have something to compare with */
+    if(d->prev)
+    {
+        d->prev_valid = 1;
+    }
+}
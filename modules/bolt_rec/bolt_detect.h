@@ -0,0 +1,64 @@
+/**
+ * bolt_detect: trigger statistics for bolt_rec, computed straight from the packed 14-bit raw rows.
+ *
+ * For each scanline, in a single pass over the packed data (8 pixels = 14 bytes at a time, no raw_get_pixel calls):
+ * - sum and count of the samples (for the average brightness);
+ * - peak: brightest sample (absolute trigger);
+ * - delta: largest change of a sample since the previous frame (relative trigger).
+ *
+ * A sample is either a single pixel, or (with downsampling) the average of a block of 8...64 pixels on the same row.
+ * Blocks are cheaper to track (less memory for the previous values) and less noisy, so the relative trigger
+ * can go lower; the price is that a very thin bolt gets averaged with its neighbours.
+ *
+ * Region of interest: optional mask with one byte for each group of 8 pixels (nonzero = checked).
+ * Masked groups are not even decoded. With downsampling, a block is checked only if all its groups are.
+ *
+ * No camera dependencies (it's plain C), so it can be checked on the PC against raw_get_pixel.
+ */
+
+#ifndef _bolt_detect_h_
+#define _bolt_detect_h_
+
+#include <stdint.h>
+
+struct bolt_detect
+{
+    /* setup; call bolt_detect_reset after changing it */
+    unsigned int width;             /* pixels checked on each scanline, from x_start (multiple of 8, and of block) */
+    unsigned int block;             /* 1 = every pixel; 8, 16, 32 or 64 = average of that many pixels */
+    unsigned int lines;             /* number of scanlines */
+    const uint8_t *mask;            /* width / 8 bytes for each scanline; 0 = check everything */
+    unsigned int mask_stride;       /* bytes from one scanline to the next in mask; 0 = same mask for all */
+    uint16_t *prev;                 /* samples from the previous frame: lines * BOLT_DETECT_SAMPLES; 0 = no deltas */
+
+    /* state */
+    unsigned int prev_valid;        /* 0 = no previous frame yet (deltas are 0) */
+};
+
+struct bolt_detect_result
+{
+    uint32_t sum;                   /* of all checked samples */
+    uint32_t count;                 /* number of checked samples */
+    uint32_t peak;                  /* brightest sample */
+    uint32_t delta;                 /* largest difference from the previous frame */
+};
+
+/* samples on each scanline */
+#define BOLT_DETECT_SAMPLES(d) ((d)->width / (d)->block)
+
+/* next frame starts from scratch (no deltas); call it after changing the setup or the raw resolution */
+void bolt_detect_reset(struct bolt_detect *d);
+
+/**
+ * Check one scanline: row points to the packed pixel at x_start (x_start must be a multiple of 8).
+ * Results are added to res; line selects the mask and the previous values.
+ */
+void bolt_detect_line(struct bolt_detect *d, void *row, unsigned int line, struct bolt_detect_result *res);
+
+/**
+ * Check all scanlines of a raw frame (14-bit, raw_info layout): y[i] = row of scanline i.
+ * res is cleared first; the deltas are relative to the previous call.
+ */
+void bolt_detect_frame(struct bolt_detect *d, void *buf, unsigned int pitch, unsigned int x_start, const unsigned int *y, struct bolt_detect_result *res);
+
+#endif
@@ -18,9 +18,14 @@
  * Please remind that we are working on raw bayer pattern, so it will scan RGRGRGRG or GBGBGBGB depending on the line count.
  * But I dont think that is an issue, as we want to record lightnings that are usually white. At least in germany they are ;)
  *
- * Scanlines are distributed over the whole image. If you select 1, then there is a single scanline in the center of the screen.
- * When selecting 2 scanlines, they will divide the image into 3 blocks, so one is at y = 1/3 * yRes.
- * Generic formula: distance = yRes / (scanlines + 1)
+ * Scanlines are distributed over the detection area (whole image by default). If you select 1, then there is a single scanline in the center.
+ * When selecting 2 scanlines, they will divide the area into 3 blocks, so one is at y = 1/3 * height.
+ * Generic formula: distance = height / (scanlines + 1)
+ *
+ * The scanlines are checked straight from the packed raw data, in a single pass for both triggers (see bolt_detect.c).
+ * This runs in the capture path of raw_rec, so it has to be cheap. Downsampling (averaging blocks of 8...64 pixels)
+ * needs less memory for the relative trigger, so more scanlines can be watched, and it filters out the sensor noise.
+ * The detection area (top half for the sky, center...) also limits the columns being checked.
  *
  * Still missing is the "pre-buffering" as it requires a lot of changes in raw_rec that I didn't start yet.
  *
@@ -38,11 +43,15 @@
 #include <config.h>
 
 #include "raw.h"
+#include "bolt_detect.h"
 
 #define LOG_ENTRIES   100
-#define MAX_SCANLINES 20
+#define MAX_SCANLINES 100
 #define MAX_WIDTH     6000
 
+/* previous values for the relative trigger: 20 scanlines at full resolution, more with downsampling */
+#define MAX_SAMPLES   (20 * MAX_WIDTH)
+
 /* interface functions required by raw_rec */
 unsigned int raw_rec_cbr_starting();
 unsigned int raw_rec_cbr_stopping();
@@ -61,6 +70,8 @@ CONFIG_INT("rel_enabled", bolt_rec_rel_enabled, 1);
 CONFIG_INT("rel_trigger", bolt_rec_rel_trigger, 1000);
 CONFIG_INT("abs_enabled", bolt_rec_abs_enabled, 0);
 CONFIG_INT("abs_trigger", bolt_rec_abs_trigger, 10000);
+CONFIG_INT("downsample",  bolt_rec_downsample,  0);
+CONFIG_INT("area",        bolt_rec_area,        0);
 
 /* state variables */
 unsigned int bolt_rec_buffered = 0;
@@ -75,8 +86,7 @@ unsigned int bolt_rec_vsync_calls = 0;
 unsigned short bolt_rec_rel_max = 800;
 unsigned int bolt_rec_rel_log_pos = 0;
 unsigned short bolt_rec_rel_peak[LOG_ENTRIES];
-unsigned short *bolt_rec_rel_scanlines[MAX_SCANLINES];
-unsigned short bolt_rec_rel_scanline_buf[MAX_SCANLINES * MAX_WIDTH];
+unsigned short bolt_rec_rel_scanline_buf[MAX_SAMPLES];
 
 unsigned short bolt_rec_abs_max = 800;
 unsigned int bolt_rec_abs_log_pos = 0;
@@ -85,23 +95,92 @@ unsigned short bolt_rec_abs_avg[LOG_ENTRIES];
 
 
 /* resolution dependent information, updated every callback */
+unsigned int bolt_rec_y_start = 0;
 unsigned int bolt_rec_y_step = 0;
 unsigned int bolt_rec_x_start = 0;
-unsigned int bolt_rec_x_end = 0;
+unsigned int bolt_rec_lines = 0;
+unsigned int bolt_rec_area_used = 0;
+unsigned int bolt_rec_y[MAX_SCANLINES];
 
+/* detection engine and its region of interest (one byte per 8 pixels) */
+static struct bolt_detect bolt_rec_detect;
+static unsigned char bolt_rec_mask[MAX_WIDTH / 8];
+
+/* detection areas, in percent of the active area */
+static const struct { unsigned int x1, x2, y1, y2; } bolt_rec_areas[] =
+{
+    {   0, 100,   0, 100 },     /* full frame */
+    {   0, 100,   0,  50 },     /* top half */
+    {   0, 100,   0,  33 },     /* top third */
+    {  25,  75,  25,  75 },     /* center */
+    {   0,  50,   0, 100 },     /* left half */
+    {  50, 100,   0, 100 },     /* right half */
+};
+
+/* downsampling: pixels averaged into one sample */
+static const unsigned int bolt_rec_block_sizes[] = { 1, 8, 16, 32, 64 };
 
 /* this function reads raw_info */
 static void bolt_rec_update_resolution()
 {
-    bolt_rec_y_step = raw_info.height / (bolt_rec_scanlines + 1);
-    bolt_rec_x_start = raw_info.active_area.x1;
-    bolt_rec_x_end = raw_info.active_area.x2;
+    unsigned int area = COERCE(bolt_rec_area, 0, COUNT(bolt_rec_areas) - 1);
+    unsigned int block = bolt_rec_block_sizes[COERCE(bolt_rec_downsample, 0, COUNT(bolt_rec_block_sizes) - 1)];
+
+    /* scanlines start at a raw_pixblock boundary; width is a multiple of all block sizes */
+    unsigned int x_start = (raw_info.active_area.x1 + 7) & ~7;
+    unsigned int width = 0;
+    if(raw_info.active_area.x2 > (int)x_start)
+    {
+        width = MIN(raw_info.active_area.x2 - x_start, MAX_WIDTH) / 64 * 64;
+    }
+
+    /* as many scanlines as we can remember for the relative trigger */
+    unsigned int samples = width / block;
+    unsigned int lines = samples ? MIN(bolt_rec_scanlines, MAX_SAMPLES / samples) : 0;
+
+    int height = raw_info.active_area.y2 - raw_info.active_area.y1;
+    unsigned int y1 = raw_info.active_area.y1 + height * bolt_rec_areas[area].y1 / 100;
+    unsigned int y2 = raw_info.active_area.y1 + height * bolt_rec_areas[area].y2 / 100;
+    unsigned int y_step = (y2 - y1) / (lines + 1);
+    unsigned short *prev = bolt_rec_rel_enabled ? bolt_rec_rel_scanline_buf : NULL;
+
+    /* same as before? then we can keep comparing with the previous frame */
+    if(x_start == bolt_rec_x_start && width == bolt_rec_detect.width && block == bolt_rec_detect.block &&
+       lines == bolt_rec_lines && y1 == bolt_rec_y_start && y_step == bolt_rec_y_step && area == bolt_rec_area_used && prev == bolt_rec_detect.prev)
+    {
+        return;
+    }
+
+    bolt_rec_x_start = x_start;
+    bolt_rec_y_start = y1;
+    bolt_rec_y_step = y_step;
+    bolt_rec_area_used = area;
+    bolt_rec_lines = lines;
+    for(unsigned int line = 0; line < lines; line++)
+    {
+        bolt_rec_y[line] = y1 + (line + 1) * y_step;
+    }
+
+    /* columns outside the detection area are not checked */
+    unsigned int mx1 = width * bolt_rec_areas[area].x1 / 100;
+    unsigned int mx2 = width * bolt_rec_areas[area].x2 / 100;
+    for(unsigned int group = 0; group < width / 8; group++)
+    {
+        bolt_rec_mask[group] = (group * 8 >= mx1 && group * 8 + 8 <= mx2);
+    }
+
+    bolt_rec_detect.width = width;
+    bolt_rec_detect.block = block;
+    bolt_rec_detect.lines = lines;
+    bolt_rec_detect.mask = (mx1 == 0 && mx2 == width) ? NULL : bolt_rec_mask;
+    bolt_rec_detect.mask_stride = 0;
+    bolt_rec_detect.prev = prev;
+    bolt_detect_reset(&bolt_rec_detect);
 }
 
-static unsigned int bolt_rec_calculate_abs(unsigned char *buf)
+static unsigned int bolt_rec_calculate_abs(struct bolt_detect_result *res)
 {
-    unsigned int pixelCount = 0;
-    unsigned int peak = 0;
+    unsigned int peak = res->peak;
     unsigned int sum = 0;
 
     if(!bolt_rec_abs_enabled)
@@ -109,20 +188,11 @@ static unsigned int bolt_rec_calculate_abs(unsigned char *buf)
         return 0;
     }
 
-    for(unsigned int scanLine = 0; scanLine < bolt_rec_scanlines; scanLine++)
+    if(res->count)
     {
-        for(unsigned int pos = 0; pos < (bolt_rec_x_end-bolt_rec_x_start); pos++)
-        {
-            unsigned short value = raw_get_pixel_ex(buf, bolt_rec_x_start + pos, (scanLine + 1) * bolt_rec_y_step);
-
-            sum += value;
-            peak = MAX(value, peak);
-            pixelCount++;
-        }
+        sum = res->sum / res->count;
     }
 
-    sum /= pixelCount;
-
     /* update maximum value for plot */
     bolt_rec_abs_max = MAX(bolt_rec_abs_max, peak);
 
@@ -140,30 +210,15 @@ static unsigned int bolt_rec_calculate_abs(unsigned char *buf)
     return 0;
 }
 
-static unsigned int bolt_rec_calculate_rel(unsigned char *buf)
+static unsigned int bolt_rec_calculate_rel(struct bolt_detect_result *res)
 {
-    unsigned int peak = 0;
+    unsigned int peak = res->delta;
 
     if(!bolt_rec_rel_enabled)
     {
         return 0;
     }
 
-    for(unsigned int scanLine = 0; scanLine < bolt_rec_scanlines; scanLine++)
-    {
-        unsigned short *line = bolt_rec_rel_scanlines[scanLine];
-
-        for(unsigned int pos = 0; pos < MIN((bolt_rec_x_end-bolt_rec_x_start), MAX_WIDTH); pos++)
-        {
-            unsigned short value = raw_get_pixel_ex(buf, bolt_rec_x_start + pos, (scanLine + 1) * bolt_rec_y_step);
-            unsigned short last = line[pos];
-            unsigned short delta = ABS(value-last);
-
-            peak = MAX(delta, peak);
-            line[pos] = value;
-        }
-    }
-
     /* update maximum value for plot */
     bolt_rec_rel_max = MAX(bolt_rec_rel_max, peak);
 
@@ -182,8 +237,18 @@ static unsigned int bolt_rec_calculate_rel(unsigned char *buf)
 
 static void bolt_rec_calculate(unsigned char *buffer)
 {
-    unsigned int abs_detection = bolt_rec_calculate_abs(buffer);
-    unsigned int rel_detection = bolt_rec_calculate_rel(buffer);
+    struct bolt_detect_result res;
+
+    if(!bolt_rec_abs_enabled && !bolt_rec_rel_enabled)
+    {
+        return;
+    }
+
+    /* one pass over the scanlines for both triggers */
+    bolt_detect_frame(&bolt_rec_detect, buffer, raw_info.pitch, bolt_rec_x_start, bolt_rec_y, &res);
+
+    unsigned int abs_detection = bolt_rec_calculate_abs(&res);
+    unsigned int rel_detection = bolt_rec_calculate_rel(&res);
 
     /* yet is is hardcoded */
     if(abs_detection || rel_detection)
@@ -378,6 +443,14 @@ void bolt_rec_update_plots(int x, int y)
     bmp_printf(SHADOW_FONT(FONT_SMALL), x + 4, y + 2 * bolt_rec_plot_height + font_med.height + 2, "Buf: %d  ", bolt_rec_buffered);
 }
 
+static MENU_UPDATE_FUNC(bolt_rec_scanlines_update)
+{
+    if(bolt_rec_lines && bolt_rec_lines < (unsigned int)bolt_rec_scanlines)
+    {
+        MENU_SET_WARNING(MENU_WARN_ADVICE, "Only %d scanlines fit in memory at this resolution; try downsampling.", bolt_rec_lines);
+    }
+}
+
 static MENU_UPDATE_FUNC(bolt_rec_update_plot_menu)
 {
     if(entry->selected && bolt_rec_enabled && lv)
@@ -441,9 +514,25 @@ static struct menu_entry bolt_rec_menu[] =
             {
                 .name = "Scanlines",
                 .priv = &bolt_rec_scanlines,
+                .update = &bolt_rec_scanlines_update,
                 .min = 1,
                 .max = MAX_SCANLINES,
             },
+            {
+                .name = "Downsampling",
+                .priv = &bolt_rec_downsample,
+                .max = 4,
+                .choices = CHOICES("OFF", "8 pixels", "16 pixels", "32 pixels", "64 pixels"),
+                .help = "Check averages of pixel blocks: less noise and memory, more scanlines.",
+                .help2 = "Very thin bolts get averaged with their neighbours.",
+            },
+            {
+                .name = "Detection area",
+                .priv = &bolt_rec_area,
+                .max = 5,
+                .choices = CHOICES("Full frame", "Top half", "Top third", "Center", "Left half", "Right half"),
+                .help = "Only check this part of the image (e.g. the sky, away from city lights).",
+            },
             {
                 .name = "Abs: trigger enabled",
                 .priv = &bolt_rec_abs_enabled,
@@ -477,11 +566,6 @@ static struct menu_entry bolt_rec_menu[] =
 
 static unsigned int bolt_rec_init()
 {
-    for(int pos = 0; pos < MAX_SCANLINES; pos++)
-    {
-        bolt_rec_rel_scanlines[pos] = &bolt_rec_rel_scanline_buf[MAX_WIDTH * pos];
-    }
-
     menu_add("Movie", bolt_rec_menu, COUNT(bolt_rec_menu));
 
     if(bolt_rec_enabled)
@@ -529,4 +613,6 @@ MODULE_CONFIGS_START()
     MODULE_CONFIG(bolt_rec_rel_trigger)
     MODULE_CONFIG(bolt_rec_abs_enabled)
     MODULE_CONFIG(bolt_rec_abs_trigger)
+    MODULE_CONFIG(bolt_rec_downsample)
+    MODULE_CONFIG(bolt_rec_area)
 MODULE_CONFIGS_END()
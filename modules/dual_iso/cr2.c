@@ -0,0 +1,563 @@
+/**
+ * Minimal CR2 reader for cr2hdr: TIFF structure, lossless JPEG raw data and a few EXIF tags
+ *
+ * Replaces the dcraw/exiftool round trip (dcraw -v -i, dcraw -4 -E -c > tmp.pgm, exiftool -tagsFromFile).
+ * Output is the same as "dcraw -4 -E -t 0" (all pixels, including masked areas, no scaling).
+ *
+ * References: TIFF 6.0, ITU T.81 (lossless JPEG, process 14), dcraw (lossless_jpeg_load_raw)
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "cr2.h"
+
+#define ERR(fmt,...) { printf("CR2 reader     : " fmt "\n", ## __VA_ARGS__); goto err; }
+
+/* TIFF tags we care about */
+#define TAG_STRIP_OFFSETS       0x111
+#define TAG_ORIENTATION         0x112
+#define TAG_STRIP_BYTE_COUNTS   0x117
+#define TAG_MODEL               0x110
+#define TAG_EXIF_IFD            0x8769
+#define TAG_EXPOSURE_TIME       0x829A
+#define TAG_FNUMBER             0x829D
+#define TAG_ISO                 0x8827
+#define TAG_DATETIME_ORIGINAL   0x9003
+#define TAG_FOCAL_LENGTH        0x920A
+#define TAG_MAKERNOTE           0x927C
+#define TAG_CR2_SLICES          0xC640
+#define TAG_CANON_SENSOR_INFO   0x00E0
+
+struct tiff
+{
+    unsigned char * buf;
+    int size;
+};
+
+static int get16(struct tiff * t, int offset)
+{
+    if (offset < 0 || offset + 2 > t->size) return 0;
+    return t->buf[offset] | (t->buf[offset+1] << 8);
+}
+
+static int get32(struct tiff * t, int offset)
+{
+    if (offset < 0 || offset + 4 > t->size) return 0;
+    return t->buf[offset] | (t->buf[offset+1] << 8) | (t->buf[offset+2] << 16) | (t->buf[offset+3] << 24);
+}
+
+static int tiff_type_size(int type)
+{
+    switch (type)
+    {
+        case 1: case 2: case 6: case 7: return 1;   /* byte, ascii, sbyte, undefined */
+        case 3: case 8:                 return 2;   /* short, sshort */
+        case 4: case 9: case 11:        return 4;   /* long, slong, float */
+        case 5: case 10: case 12:       return 8;   /* rational, srational, double */
+    }
+    return 0;
+}
+
+/* look up a tag in the IFD at "ifd"; returns the offset of its data (0 if not found) */
+static int tiff_find_tag(struct tiff * t, int ifd, int tag, int* count)
+{
+    int n = get16(t, ifd);
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        int e = ifd + 2 + i * 12;
+        if (e + 12 > t->size)
+            return 0;
+
+        if (get16(t, e) == tag)
+        {
+            int type = get16(t, e+2);
+            int cnt = get32(t, e+4);
+            if (count) *count = cnt;
+            /* values up to 4 bytes are stored inline */
+            return (tiff_type_size(type) * cnt <= 4) ? e + 8 : get32(t, e+8);
+        }
+    }
+    return 0;
+}
+
+static int tiff_next_ifd(struct tiff * t, int ifd)
+{
+    return get32(t, ifd + 2 + get16(t, ifd) * 12);
+}
+
+static void tiff_get_rational(struct tiff * t, int ifd, int tag, int* out)
+{
+    int off = tiff_find_tag(t, ifd, tag, 0);
+    if (off)
+    {
+        out[0] = get32(t, off);
+        out[1] = get32(t, off + 4);
+    }
+}
+
+static void tiff_get_string(struct tiff * t, int ifd, int tag, char* out, int maxlen)
+{
+    int count = 0;
+    int off = tiff_find_tag(t, ifd, tag, &count);
+    if (off && count > 0 && off + count <= t->size)
+    {
+        int len = count < maxlen ? count : maxlen;
+        memcpy(out, t->buf + off, len);
+        out[len-1] = 0;
+    }
+}
+
+/* lossless JPEG decoder (SOF3), only the features used by Canon */
+
+struct huff
+{
+    unsigned short * lut;       /* 16-bit code prefix => (length << 8) | symbol */
+};
+
+struct ljpeg
+{
+    int bits, high, wide, clrs;
+    int psv;                    /* predictor selection */
+    int restart;                /* restart interval, in pixels (0 = none) */
+    int table[4];               /* huffman table for each component */
+    struct huff huff[4];
+
+    /* bit reader */
+    unsigned char * ptr;
+    unsigned char * end;
+    uint64_t acc;               /* bits are MSB-aligned */
+    int nbits;
+    int marker;                 /* hit a marker, will feed zeros from now on */
+
+    int errors;                 /* decoded samples out of range (clamped) */
+    int first_error_row;
+};
+
+static int ljpeg_build_huff(struct huff * h, unsigned char * counts, unsigned char * symbols, int nsym)
+{
+    if (!h->lut)
+        h->lut = malloc(65536 * sizeof(h->lut[0]));
+    if (!h->lut)
+        return 0;
+    memset(h->lut, 0, 65536 * sizeof(h->lut[0]));
+
+    int len, i;
+    int code = 0;
+    int k = 0;
+    for (len = 1; len <= 16; len++)
+    {
+        for (i = 0; i < counts[len-1]; i++)
+        {
+            if (k >= nsym || code >= (1 << len))
+                return 0;
+            int first = code << (16 - len);
+            int last = (code + 1) << (16 - len);
+            int j;
+            for (j = first; j < last; j++)
+                h->lut[j] = (len << 8) | symbols[k];
+            code++;
+            k++;
+        }
+        code <<= 1;
+    }
+    return 1;
+}
+
+static void ljpeg_fill(struct ljpeg * j)
+{
+    while (j->nbits <= 56)
+    {
+        int c = 0;
+        if (j->ptr < j->end && !j->marker)
+        {
+            c = *j->ptr++;
+            if (c == 0xFF)
+            {
+                if (j->ptr < j->end && *j->ptr == 0)
+                {
+                    /* stuffed zero byte */
+                    j->ptr++;
+                }
+                else
+                {
+                    /* marker; leave it there and feed zeros */
+                    j->ptr--;
+                    j->marker = 1;
+                    c = 0;
+                }
+            }
+        }
+        j->acc |= (uint64_t)c << (56 - j->nbits);
+        j->nbits += 8;
+    }
+}
+
+static inline int ljpeg_getbits(struct ljpeg * j, int n)
+{
+    if (n == 0) return 0;
+    if (j->nbits < n) ljpeg_fill(j);
+    int v = j->acc >> (64 - n);
+    j->acc <<= n;
+    j->nbits -= n;
+    return v;
+}
+
+static inline int ljpeg_diff(struct ljpeg * j, struct huff * h)
+{
+    if (j->nbits < 32) ljpeg_fill(j);
+    int e = h->lut[j->acc >> 48];
+    int len = e >> 8;
+    j->acc <<= len;
+    j->nbits -= len;
+
+    int sym = e & 0xFF;
+    if (sym == 16)
+        return -32768;
+
+    int diff = ljpeg_getbits(j, sym);
+    if (sym && (diff & (1 << (sym-1))) == 0)
+        diff -= (1 << sym) - 1;
+    return diff;
+}
+
+/* skip to the next restart marker and reset the bit reader */
+static void ljpeg_restart(struct ljpeg * j)
+{
+    while (j->ptr + 1 < j->end && !(j->ptr[0] == 0xFF && j->ptr[1] >= 0xD0 && j->ptr[1] <= 0xD7))
+        j->ptr++;
+    j->ptr += 2;
+    j->acc = 0;
+    j->nbits = 0;
+    j->marker = 0;
+}
+
+/* parse the JPEG headers, until start of scan */
+static int ljpeg_start(struct ljpeg * j, unsigned char * data, int size)
+{
+    unsigned char * p = data;
+    unsigned char * end = data + size;
+
+    if (size < 4 || p[0] != 0xFF || p[1] != 0xD8)
+        return 0;
+    p += 2;
+
+    int sof = 0;
+    int comp_id[4] = {0};
+    while (p + 4 <= end)
+    {
+        if (p[0] != 0xFF) return 0;
+        int tag = p[1];
+        int len = (p[2] << 8) | p[3];
+        unsigned char * d = p + 4;
+        if (len < 2 || p + 2 + len > end) return 0;
+        p += 2 + len;
+
+        switch (tag)
+        {
+            case 0xC3: /* SOF3: lossless, huffman */
+            {
+                j->bits = d[0];
+                j->high = (d[1] << 8) | d[2];
+                j->wide = (d[3] << 8) | d[4];
+                j->clrs = d[5];
+                if (j->clrs < 1 || j->clrs > 4) return 0;
+                int c;
+                for (c = 0; c < j->clrs; c++)
+                {
+                    comp_id[c] = d[6 + 3*c];
+                    /* subsampled components are used by sRAW/mRAW; not supported */
+                    if (d[7 + 3*c] != 0x11) return 0;
+                }
+                sof = 1;
+                break;
+            }
+            case 0xC0: case 0xC1: case 0xC2:
+                /* not lossless */
+                return 0;
+            case 0xC4: /* DHT */
+            {
+                unsigned char * q = d;
+                while (q + 17 <= d + len - 2)
+                {
+                    int id = q[0] & 0x0F;
+                    if (id > 3) return 0;
+                    int nsym = 0, i;
+                    for (i = 0; i < 16; i++)
+                        nsym += q[1+i];
+                    if (q + 17 + nsym > d + len - 2) return 0;
+                    if (!ljpeg_build_huff(&j->huff[id], q + 1, q + 17, nsym)) return 0;
+                    q += 17 + nsym;
+                }
+                break;
+            }
+            case 0xDD: /* DRI */
+                j->restart = (d[0] << 8) | d[1];
+                break;
+            case 0xDA: /* SOS */
+            {
+                if (!sof) return 0;
+                int ns = d[0];
+                int i, c;
+                for (i = 0; i < ns; i++)
+                {
+                    for (c = 0; c < j->clrs; c++)
+                        if (comp_id[c] == d[1 + 2*i])
+                            j->table[c] = d[2 + 2*i] >> 4;
+                }
+                j->psv = d[1 + ns*2];
+                j->bits -= d[3 + ns*2] & 15;   /* point transform */
+                for (c = 0; c < j->clrs; c++)
+                    if (!j->huff[j->table[c]].lut) return 0;
+                j->ptr = p;
+                j->end = end;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void ljpeg_free(struct ljpeg * j)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+        free(j->huff[i].lut);
+}
+
+/* decode one row (wide * clrs samples) into "row", using "prev" as the previous row */
+/* out-of-range samples (corrupted data) are clamped and counted, like dcraw does */
+static void ljpeg_row(struct ljpeg * j, int jrow, unsigned short * row, unsigned short * prev, int* vpred)
+{
+    int clrs = j->clrs;
+    int col, c;
+
+    if (jrow == 0 || (j->restart && (jrow * j->wide) % j->restart == 0))
+    {
+        for (c = 0; c < 4; c++)
+            vpred[c] = 1 << (j->bits - 1);
+        if (jrow)
+            ljpeg_restart(j);
+    }
+
+    for (col = 0; col < j->wide; col++)
+    {
+        for (c = 0; c < clrs; c++)
+        {
+            int diff = ljpeg_diff(j, &j->huff[j->table[c]]);
+            int i = col * clrs + c;
+            int pred;
+            if (col)
+                pred = row[i - clrs];
+            else
+                pred = (vpred[c] += diff) - diff;
+
+            if (jrow && col)
+            {
+                int up = prev[i];
+                int upleft = prev[i - clrs];
+                switch (j->psv)
+                {
+                    case 1: break;
+                    case 2: pred = up;                              break;
+                    case 3: pred = upleft;                          break;
+                    case 4: pred = pred + up - upleft;              break;
+                    case 5: pred = pred + ((up - upleft) >> 1);     break;
+                    case 6: pred = up + ((pred - upleft) >> 1);     break;
+                    case 7: pred = (pred + up) >> 1;                break;
+                    default: pred = 0;
+                }
+            }
+
+            int val = pred + diff;
+            if (val >> j->bits)
+            {
+                if (!j->errors++)
+                    j->first_error_row = jrow;
+                val = val < 0 ? 0 : (1 << j->bits) - 1;
+            }
+            row[i] = val;
+        }
+    }
+}
+
+int cr2_read(char* filename, struct cr2_info * cr2)
+{
+    struct tiff t = {0};
+    struct ljpeg j;
+    unsigned short * rows = 0;
+    memset(&j, 0, sizeof(j));
+    memset(cr2, 0, sizeof(*cr2));
+
+    FILE* f = fopen(filename, "rb");
+    if (!f) ERR("could not open %s", filename);
+    fseeko(f, 0, SEEK_END);
+    t.size = ftello(f);
+    fseeko(f, 0, SEEK_SET);
+    t.buf = malloc(t.size);
+    if (!t.buf) { fclose(f); ERR("malloc"); }
+    int r = fread(t.buf, 1, t.size, f);
+    fclose(f);
+    if (r != t.size) ERR("read error");
+
+    if (t.size < 16 || t.buf[0] != 'I' || t.buf[1] != 'I' || get16(&t, 2) != 42 || t.buf[8] != 'C' || t.buf[9] != 'R')
+        ERR("not a CR2 file");
+
+    /* IFD0: main info and EXIF; IFD3: raw data */
+    int ifd0 = get32(&t, 4);
+    int ifd = ifd0;
+    int raw_ifd = 0;
+    int i;
+    for (i = 0; i < 4 && ifd; i++)
+    {
+        raw_ifd = ifd;
+        ifd = tiff_next_ifd(&t, ifd);
+    }
+    if (i != 4) ERR("raw IFD not found");
+
+    tiff_get_string(&t, ifd0, TAG_MODEL, cr2->model, sizeof(cr2->model));
+    int off = tiff_find_tag(&t, ifd0, TAG_ORIENTATION, 0);
+    if (off) cr2->orientation = get16(&t, off);
+
+    int exif = tiff_find_tag(&t, ifd0, TAG_EXIF_IFD, 0);
+    int sensor_info = 0;
+    if (exif)
+    {
+        exif = get32(&t, exif);
+        tiff_get_rational(&t, exif, TAG_EXPOSURE_TIME, cr2->exposure);
+        tiff_get_rational(&t, exif, TAG_FNUMBER, cr2->fnumber);
+        tiff_get_rational(&t, exif, TAG_FOCAL_LENGTH, cr2->focal_length);
+        tiff_get_string(&t, exif, TAG_DATETIME_ORIGINAL, cr2->datetime, sizeof(cr2->datetime));
+        off = tiff_find_tag(&t, exif, TAG_ISO, 0);
+        if (off) cr2->iso = get16(&t, off);
+
+        /* Canon makernote is a plain IFD, with offsets relative to TIFF header */
+        int makernote = tiff_find_tag(&t, exif, TAG_MAKERNOTE, 0);
+        if (makernote)
+            sensor_info = tiff_find_tag(&t, makernote, TAG_CANON_SENSOR_INFO, 0);
+    }
+
+    /* raw data */
+    int strip = tiff_find_tag(&t, raw_ifd, TAG_STRIP_OFFSETS, 0);
+    int strip_size = tiff_find_tag(&t, raw_ifd, TAG_STRIP_BYTE_COUNTS, 0);
+    if (!strip || !strip_size) ERR("no raw data");
+    strip = get32(&t, strip);
+    strip_size = get32(&t, strip_size);
+    if (strip <= 0 || strip_size <= 0 || strip + strip_size > t.size) ERR("bad raw data offset");
+
+    int slices[3] = {0, 0, 0};
+    off = tiff_find_tag(&t, raw_ifd, TAG_CR2_SLICES, 0);
+    if (off)
+    {
+        slices[0] = get16(&t, off);
+        slices[1] = get16(&t, off + 2);
+        slices[2] = get16(&t, off + 4);
+    }
+
+    if (!ljpeg_start(&j, t.buf + strip, strip_size)) ERR("unsupported lossless JPEG stream");
+
+    int jwide = j.wide * j.clrs;
+    int total = jwide * j.high;
+    int raw_width = slices[0] ? slices[0] * slices[1] + slices[2] : jwide;
+    if (raw_width <= 0 || total % raw_width) ERR("bad slice info");
+    int raw_height = total / raw_width;
+
+    /* active area, from Canon SensorInfo: width, height, left, top, right, bottom borders */
+    if (!sensor_info) ERR("sensor info not found");
+    int left   = get16(&t, sensor_info + 5*2);
+    int top    = get16(&t, sensor_info + 6*2);
+    int right  = get16(&t, sensor_info + 7*2);
+    int bottom = get16(&t, sensor_info + 8*2);
+    if (right <= left || bottom <= top || right >= raw_width || bottom >= raw_height) ERR("bad sensor info");
+
+    cr2->raw_width = raw_width;
+    cr2->raw_height = raw_height;
+    cr2->out_width = right - left + 1;
+    cr2->out_height = bottom - top + 1;
+    cr2->left_margin = left;
+    cr2->top_margin = top;
+    cr2->right_margin = raw_width - 1 - right;
+    cr2->bottom_margin = raw_height - 1 - bottom;
+
+    /* 1 extra line for handling GBRG easier (see cr2hdr) */
+    cr2->buffer = calloc(raw_width * (raw_height + 1), sizeof(unsigned short));
+    rows = malloc(2 * jwide * sizeof(unsigned short));
+    if (!cr2->buffer || !rows) ERR("malloc");
+
+    /* decode and un-slice: the slices are stored one after another, each one top to bottom */
+    int vpred[4];
+    int row = 0, col = 0;
+    int jrow;
+    for (jrow = 0; jrow < j.high; jrow++)
+    {
+        unsigned short * rp = rows + jwide * (jrow & 1);
+        unsigned short * pp = rows + jwide * ((jrow + 1) & 1);
+        ljpeg_row(&j, jrow, rp, pp, vpred);
+
+        int jcol;
+        for (jcol = 0; jcol < jwide; jcol++)
+        {
+            if (slices[0])
+            {
+                int jidx = jrow * jwide + jcol;
+                int s = jidx / (slices[1] * raw_height);
+                int last = (s >= slices[0]);
+                if (last) s = slices[0];
+                jidx -= s * (slices[1] * raw_height);
+                row = jidx / slices[1 + last];
+                col = jidx % slices[1 + last] + s * slices[1];
+            }
+
+            /* same quirk as dcraw */
+            if (raw_width == 3984 && (col -= 2) < 0)
+                col += raw_width, row--;
+
+            /* unsigned: row is -1 after the quirk above, on the first row */
+            if ((unsigned) row < (unsigned) raw_height)
+                cr2->buffer[row * raw_width + col] = rp[jcol];
+
+            if (++col >= raw_width)
+            {
+                col = 0;
+                row++;
+            }
+        }
+    }
+
+    if (j.errors)
+        printf("CR2 reader     : corrupted data from row %d (%d samples out of range, clamped)\n", j.first_error_row, j.errors);
+
+    free(rows);
+    ljpeg_free(&j);
+    free(t.buf);
+    return 1;
+
+err:
+    free(rows);
+    ljpeg_free(&j);
+    free(t.buf);
+    free(cr2->buffer);
+    cr2->buffer = 0;
+    return 0;
+}
@@ -0,0 +1,57 @@
+/**
+ * Minimal CR2 reader for cr2hdr: TIFF structure, lossless JPEG raw data and a few EXIF tags
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _cr2_h_
+#define _cr2_h_
+
+struct cr2_info
+{
+    unsigned short * buffer;    /* raw data, 16-bit native endian, raw_width x raw_height (plus one spare line) */
+    int raw_width;              /* full sensor size, including masked areas (same as "dcraw -v -i": "Full size") */
+    int raw_height;
+    int out_width;              /* active area, from the SensorInfo makernote (not from dcraw's table of margins) */
+    int out_height;
+    int left_margin;            /* masked borders around the active area, from SensorInfo */
+    int top_margin;
+    int right_margin;
+    int bottom_margin;
+
+    /**
+     * Basic EXIF data, copied to the output DNG (0 = unknown)
+     * cr2hdr then copies all the EXIF and makernote tags with exiftool (lens, white balance...),
+     * unless it's run with -n.
+     */
+    char model[32];
+    char datetime[20];
+    int exposure[2];            /* rational, seconds */
+    int fnumber[2];             /* rational */
+    int focal_length[2];        /* rational, mm */
+    int iso;
+    int orientation;
+};
+
+/* decode the raw data and EXIF info from a CR2 file */
+/* returns 1=success, 0=failed (unsupported or corrupted file); buffer must be freed by the caller */
+int cr2_read(char* filename, struct cr2_info * cr2);
+
+#endif
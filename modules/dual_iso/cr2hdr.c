@@ -48,13 +48,16 @@
 #include <math.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "../../src/raw.h"
+#include "../../src/chdk-dng.h"
+#include "cr2.h"
 #include "qsort.h"  /* much faster than standard C qsort */
 
 #include "optmed.h"
 
 #define FAIL(fmt,...) { fprintf(stderr, "Error: "); fprintf(stderr, fmt, ## __VA_ARGS__); fprintf(stderr, "\n"); exit(1); }
-#define CHECK(ok, fmt,...) { if (!ok) FAIL(fmt, ## __VA_ARGS__); }
+#define CHECK(ok, fmt,...) { if (!(ok)) FAIL(fmt, ## __VA_ARGS__); }
 
 #define COERCE(x,lo,hi) MAX(MIN((x),(hi)),(lo))
 #define COUNT(x)        ((int)(sizeof(x)/sizeof((x)[0])))
@@ -137,79 +140,320 @@ static void reverse_bytes_order(char* buf, int count)
     }
 }
 
+/**
+ * Band-tiled processing engine
+ *
+ * Every stage of hdr_interpolate runs on horizontal stripes (bands) of the image,
+ * spread over a pool of worker threads. Each stage only writes the rows from its own band,
+ * and reads whatever it needs from the previous stages, so the output does not depend
+ * on the number of threads (it's bit-identical with the single-threaded version).
+ *
+ * Band height must be a multiple of 4, so the dual ISO line pattern lines up in every band.
+ */
+#define BAND_HEIGHT 64
+
+typedef void (*band_func_t)(int y0, int y1, int band, void* arg);
+
+static int num_threads = 0;     /* 0 = autodetect */
+static int reference_kernels = 0;   /* -r: scalar reference code for interpolation and chroma smoothing */
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    int num_workers;
+    int generation;             /* incremented for every new job */
+    int active;                 /* workers currently processing the job */
+
+    /* current job */
+    band_func_t func;
+    void* arg;
+    int y0, y1;
+    int num_bands;
+    int next_band;
+    int bands_done;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static int get_num_cpus()
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    return MAX((int)sysconf(_SC_NPROCESSORS_ONLN), 1);
+#else
+    char* n = getenv("NUMBER_OF_PROCESSORS");
+    return n ? MAX(atoi(n), 1) : 1;
+#endif
+}
+
+static int count_bands(int y0, int y1)
+{
+    return y1 > y0 ? (y1 - y0 + BAND_HEIGHT - 1) / BAND_HEIGHT : 0;
+}
+
+/* process bands from the current job until there's nothing left */
+static void band_work()
+{
+    while (1)
+    {
+        int band = __sync_fetch_and_add(&pool.next_band, 1);
+        if (band >= pool.num_bands)
+            break;
+
+        int ya = pool.y0 + band * BAND_HEIGHT;
+        int yb = MIN(ya + BAND_HEIGHT, pool.y1);
+        pool.func(ya, yb, band, pool.arg);
+
+        pthread_mutex_lock(&pool.lock);
+        pool.bands_done++;
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+static void* band_worker(void* unused)
+{
+    int seen = 0;
+    pthread_mutex_lock(&pool.lock);
+    while (1)
+    {
+        while (pool.generation == seen)
+            pthread_cond_wait(&pool.start, &pool.lock);
+        seen = pool.generation;
+        pool.active++;
+        pthread_mutex_unlock(&pool.lock);
+
+        band_work();
+
+        pthread_mutex_lock(&pool.lock);
+        pool.active--;
+        if (pool.active == 0 && pool.bands_done == pool.num_bands)
+            pthread_cond_signal(&pool.done);
+    }
+    return 0;
+}
+
+static void band_pool_init()
+{
+    if (num_threads <= 0)
+        num_threads = get_num_cpus();
+
+    int i;
+    for (i = 1; i < num_threads; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, band_worker, 0))
+            break;
+        pthread_detach(thread);
+        pool.num_workers++;
+    }
+
+    printf("Threads        : %d\n", pool.num_workers + 1);
+}
+
+/**
+ * Run func on rows [y0, y1), split in bands of BAND_HEIGHT lines (the last one may be shorter).
+ * Every band starts at y0 + k * BAND_HEIGHT, so it has the same (y % 4) phase as y0.
+ * Returns when all the bands were processed; the calling thread helps too.
+ */
+static void run_bands(int y0, int y1, band_func_t func, void* arg)
+{
+    int num_bands = count_bands(y0, y1);
+    if (num_bands == 0)
+        return;
+
+    if (pool.num_workers == 0 || num_bands == 1)
+    {
+        int band;
+        for (band = 0; band < num_bands; band++)
+            func(y0 + band * BAND_HEIGHT, MIN(y0 + (band+1) * BAND_HEIGHT, y1), band, arg);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+
+    /* a late worker may still be looking at the previous job */
+    while (pool.active > 0)
+        pthread_cond_wait(&pool.done, &pool.lock);
+
+    pool.func = func;
+    pool.arg = arg;
+    pool.y0 = y0;
+    pool.y1 = y1;
+    pool.num_bands = num_bands;
+    pool.next_band = 0;
+    pool.bands_done = 0;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    band_work();
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.bands_done < pool.num_bands || pool.active > 0)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* fallback for files not handled by cr2_read (e.g. other raw formats); requires dcraw in PATH */
+static void* dcraw_read(char* filename, int* raw_width, int* raw_height, int* out_width, int* out_height)
+{
+    int r;
+
+    /* per-process temp names, so several instances can run in the same directory */
+    char tmp_txt[50];
+    char tmp_pgm[50];
+    snprintf(tmp_txt, sizeof(tmp_txt), "tmp-%d.txt", (int)getpid());
+    snprintf(tmp_pgm, sizeof(tmp_pgm), "tmp-%d.pgm", (int)getpid());
+
+    char dcraw_cmd[1000];
+    snprintf(dcraw_cmd, sizeof(dcraw_cmd), "dcraw -v -i -t 0 \"%s\" > %s", filename, tmp_txt);
+    int exit_code = system(dcraw_cmd);
+    CHECK(exit_code == 0, "%s", filename);
+    
+    FILE* t = fopen(tmp_txt, "rb");
+    CHECK(t, "%s", tmp_txt);
+    
+    char line[100];
+    while (fgets(line, sizeof(line), t))
+    {
+        if (startswith(line, "Full size: "))
+        {
+            r = sscanf(line, "Full size: %d x %d\n", raw_width, raw_height);
+            CHECK(r == 2, "sscanf");
+        }
+        else if (startswith(line, "Output size: "))
+        {
+            r = sscanf(line, "Output size: %d x %d\n", out_width, out_height);
+            CHECK(r == 2, "sscanf");
+        }
+    }
+    fclose(t);
+    unlink(tmp_txt);
+
+    snprintf(dcraw_cmd, sizeof(dcraw_cmd), "dcraw -4 -E -c -t 0 \"%s\" > %s", filename, tmp_pgm);
+    exit_code = system(dcraw_cmd);
+    CHECK(exit_code == 0, "%s", filename);
+    
+    FILE* f = fopen(tmp_pgm, "rb");
+    CHECK(f, "%s", tmp_pgm);
+    
+    char magic0, magic1;
+    r = fscanf(f, "%c%c\n", &magic0, &magic1);
+    CHECK(r == 2, "fscanf");
+    CHECK(magic0 == 'P' && magic1 == '5', "pgm magic");
+    
+    int width, height;
+    r = fscanf(f, "%d %d\n", &width, &height);
+    CHECK(r == 2, "fscanf");
+    CHECK(width == *raw_width, "pgm width");
+    CHECK(height == *raw_height, "pgm height");
+    
+    int max_value;
+    r = fscanf(f, "%d\n", &max_value);
+    CHECK(r == 1, "fscanf");
+    CHECK(max_value == 65535, "pgm max");
+
+    void* buf = malloc(width * (height+1) * 2); /* 1 extra line for handling GBRG easier */
+    CHECK(buf, "malloc");
+    fseek(f, -width * height * 2, SEEK_END);
+    int size = fread(buf, 1, width * height * 2, f);
+    CHECK(size == width * height * 2, "fread");
+    fclose(f);
+    unlink(tmp_pgm);
+
+    /* PGM is big endian, need to reverse it */
+    reverse_bytes_order(buf, width * height * 2);
+    
+    return buf;
+}
+
 int main(int argc, char** argv)
 {
     int k;
-    int r;
+
+    /* -jN: number of threads */
+    /* -c: lossless JPEG compression */
+    /* -r: use the reference (scalar) interpolation and chroma smoothing code (slower, for checking the fast one) */
+    /* -n: don't run exiftool; only the basic EXIF tags from the CR2 reader are copied (see cr2.h) */
+    int compress = 0;
+    int no_exiftool = 0;
+    for (k = 1; k < argc; k++)
+    {
+        if (startswith(argv[k], "-j"))
+        {
+            num_threads = atoi(argv[k] + 2);
+        }
+        else if (!strcmp(argv[k], "-c"))
+        {
+            compress = 1;
+        }
+        else if (!strcmp(argv[k], "-r"))
+        {
+            reference_kernels = 1;
+        }
+        else if (!strcmp(argv[k], "-n"))
+        {
+            no_exiftool = 1;
+        }
+    }
+    band_pool_init();
+
+    if (compress)
+        set_dng_compression(7, num_threads);
+
     for (k = 1; k < argc; k++)
     {
         char* filename = argv[k];
 
+        if (startswith(filename, "-j") || !strcmp(filename, "-c") || !strcmp(filename, "-r") || !strcmp(filename, "-n"))
+            continue;
+
         printf("\nInput file     : %s\n", filename);
 
-        char dcraw_cmd[100];
-        snprintf(dcraw_cmd, sizeof(dcraw_cmd), "dcraw -v -i -t 0 \"%s\" > tmp.txt", filename);
-        int exit_code = system(dcraw_cmd);
-        CHECK(exit_code == 0, "%s", filename);
-        
-        FILE* t = fopen("tmp.txt", "rb");
-        CHECK(t, "tmp.txt");
         int raw_width = 0, raw_height = 0;
         int out_width = 0, out_height = 0;
-        
-        char line[100];
-        while (fgets(line, sizeof(line), t))
+        int left_margin = 0, top_margin = 0, right_margin = 0, bottom_margin = 0;
+        void* buf = 0;
+        int exif_copied = 0;
+
+        struct cr2_info cr2;
+        if (cr2_read(filename, &cr2))
         {
-            if (startswith(line, "Full size: "))
-            {
-                r = sscanf(line, "Full size: %d x %d\n", &raw_width, &raw_height);
-                CHECK(r == 2, "sscanf");
-            }
-            else if (startswith(line, "Output size: "))
-            {
-                r = sscanf(line, "Output size: %d x %d\n", &out_width, &out_height);
-                CHECK(r == 2, "sscanf");
-            }
+            buf = cr2.buffer;
+            raw_width = cr2.raw_width;
+            raw_height = cr2.raw_height;
+            out_width = cr2.out_width;
+            out_height = cr2.out_height;
+            left_margin = cr2.left_margin;
+            top_margin = cr2.top_margin;
+            right_margin = cr2.right_margin;
+            bottom_margin = cr2.bottom_margin;
+
+            if (cr2.model[0]) set_camera_name(cr2.model);
+            set_exif_datetime(cr2.datetime);
+            set_exif_exposure(cr2.exposure[0], cr2.exposure[1], cr2.fnumber[0], cr2.fnumber[1], cr2.iso);
+            set_exif_focal_length(cr2.focal_length[0], cr2.focal_length[1]);
+            set_orientation(cr2.orientation);
+            exif_copied = 1;
+        }
+        else
+        {
+            printf("Falling back to dcraw...\n");
+            buf = dcraw_read(filename, &raw_width, &raw_height, &out_width, &out_height);
+
+            /* dcraw only gives the sizes; assume the borders are on the left and on the top */
+            left_margin = raw_width - out_width;
+            top_margin = raw_height - out_height;
         }
-        fclose(t);
 
         printf("Full size      : %d x %d\n", raw_width, raw_height);
         printf("Active area    : %d x %d\n", out_width, out_height);
-        
-        int left_margin = raw_width - out_width;
-        int top_margin = raw_height - out_height;
-
-        snprintf(dcraw_cmd, sizeof(dcraw_cmd), "dcraw -4 -E -c -t 0 \"%s\" > tmp.pgm", filename);
-        exit_code = system(dcraw_cmd);
-        CHECK(exit_code == 0, "%s", filename);
-        
-        FILE* f = fopen("tmp.pgm", "rb");
-        CHECK(f, "tmp.pgm");
-        
-        char magic0, magic1;
-        r = fscanf(f, "%c%c\n", &magic0, &magic1);
-        CHECK(r == 2, "fscanf");
-        CHECK(magic0 == 'P' && magic1 == '5', "pgm magic");
-        
-        int width, height;
-        r = fscanf(f, "%d %d\n", &width, &height);
-        CHECK(r == 2, "fscanf");
-        CHECK(width == raw_width, "pgm width");
-        CHECK(height == raw_height, "pgm height");
-        
-        int max_value;
-        r = fscanf(f, "%d\n", &max_value);
-        CHECK(r == 1, "fscanf");
-        CHECK(max_value == 65535, "pgm max");
 
-        void* buf = malloc(width * (height+1) * 2); /* 1 extra line for handling GBRG easier */
-        fseek(f, -width * height * 2, SEEK_END);
-        int size = fread(buf, 1, width * height * 2, f);
-        CHECK(size == width * height * 2, "fread");
-        fclose(f);
-
-        /* PGM is big endian, need to reverse it */
-        reverse_bytes_order(buf, width * height * 2);
+        int width = raw_width;
+        int height = raw_height;
 
         raw_info.buffer = buf;
         
@@ -228,13 +472,13 @@ int main(int argc, char** argv)
         raw_info.frame_size = raw_info.height * raw_info.pitch;
 
         raw_info.active_area.x1 = left_margin;
-        raw_info.active_area.x2 = raw_info.width;
+        raw_info.active_area.x2 = raw_info.width - right_margin;
         raw_info.active_area.y1 = top_margin;
-        raw_info.active_area.y2 = raw_info.height;
+        raw_info.active_area.y2 = raw_info.height - bottom_margin;
         raw_info.jpeg.x = 0;
         raw_info.jpeg.y = 0;
-        raw_info.jpeg.width = raw_info.width - left_margin;
-        raw_info.jpeg.height = raw_info.height - top_margin;
+        raw_info.jpeg.width = raw_info.width - left_margin - right_margin;
+        raw_info.jpeg.height = raw_info.height - top_margin - bottom_margin;
 
         if (hdr_check())
         {
@@ -258,16 +502,17 @@ int main(int argc, char** argv)
                 /* run a second black subtract pass, to fix whatever our funky processing may do to blacks */
                 black_subtract_simple(left_margin, top_margin);
 
-                reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
-
                 printf("Output file    : %s\n", out_filename);
                 save_dng(out_filename);
 
-                char exif_cmd[100];
-                snprintf(exif_cmd, sizeof(exif_cmd), "exiftool -tagsFromFile \"%s\" -all:all \"%s\" -overwrite_original", filename, out_filename);
-                int r = system(exif_cmd);
-                if (r != 0)
-                    printf("Exiftool didn't work\n");
+                if (!exif_copied || !no_exiftool)
+                {
+                    char exif_cmd[100];
+                    snprintf(exif_cmd, sizeof(exif_cmd), "exiftool -tagsFromFile \"%s\" -all:all \"%s\" -overwrite_original", filename, out_filename);
+                    int r = system(exif_cmd);
+                    if (r != 0)
+                        printf(exif_copied ? "Exiftool didn't work, only the basic EXIF tags were copied\n" : "Exiftool didn't work\n");
+                }
             }
             else
             {
@@ -282,9 +527,6 @@ int main(int argc, char** argv)
             printf("Doesn't look like interlaced ISO\n");
         }
         
-        unlink("tmp.pgm");
-        unlink("tmp.txt");
-        
         free(buf);
     }
     
@@ -367,7 +609,6 @@ static int black_subtract(int left_margin, int top_margin)
     if (top_margin < 10) return 0;
 
 #if 0
-    reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
     save_dng("untouched.dng");
 #endif
 
@@ -495,7 +736,6 @@ static int black_subtract(int left_margin, int top_margin)
 #if 0 /* for debugging only */
     void* old_buffer = raw_info.buffer;
     raw_info.buffer = blackframe;
-    reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
     save_dng("black.dng");
     raw_info.buffer = old_buffer;
 #endif
@@ -527,7 +767,6 @@ static int black_subtract(int left_margin, int top_margin)
     printf("Black level    : %d\n", raw_info.black_level);
 
 #if 0
-    reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
     save_dng("subtracted.dng");
 #endif
 
@@ -976,6 +1215,96 @@ static int mean3(int a, int b, int c, int white, int* err)
 }
 #endif
 
+/**
+ * Fast kernels for mean23 and chroma smoothing (default; -r selects the scalar code, kept as reference)
+ * 
+ * They give the same output, bit for bit, but:
+ * - each pixel is converted to EV only once, into row buffers (the reference converts it again for every neighbour);
+ * - narrower tables: the 14-bit input needs only 16K entries of raw2ev, and ev2raw fits in 16 bits (1.5 MB instead of 3 MB);
+ * - the arithmetic and the median networks work on 4 pixels at a time (gcc vector extensions, SSE2 on x86).
+ * Table lookups are still done one by one (SSE2 has no gather).
+ */
+
+#if defined(__i386__) || defined(__x86_64__)
+#define SIMD_TARGET __attribute__((target("sse2")))
+#else
+#define SIMD_TARGET
+#endif
+
+typedef int v4si __attribute__((vector_size(16)));
+typedef unsigned int v4su __attribute__((vector_size(16)));
+
+static int use_fast_kernels()
+{
+    if (reference_kernels)
+        return 0;
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+#else
+    return 1;
+#endif
+}
+
+SIMD_TARGET
+static inline v4si load4(int* p)
+{
+    v4si v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+SIMD_TARGET
+static inline void store4(int* p, v4si v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+/* same network as opt_med25 from optmed.h, on 4 sets of 25 values at once */
+#define PIX_SORT4(a,b) { v4si _m = (a) > (b); v4si _t = ((a) ^ (b)) & _m; (a) ^= _t; (b) ^= _t; }
+
+SIMD_TARGET
+static inline v4si opt_med25_x4(v4si * p)
+{
+    PIX_SORT4(p[0], p[1]) ;   PIX_SORT4(p[3], p[4]) ;   PIX_SORT4(p[2], p[4]) ;
+    PIX_SORT4(p[2], p[3]) ;   PIX_SORT4(p[6], p[7]) ;   PIX_SORT4(p[5], p[7]) ;
+    PIX_SORT4(p[5], p[6]) ;   PIX_SORT4(p[9], p[10]) ;  PIX_SORT4(p[8], p[10]) ;
+    PIX_SORT4(p[8], p[9]) ;   PIX_SORT4(p[12], p[13]) ; PIX_SORT4(p[11], p[13]) ;
+    PIX_SORT4(p[11], p[12]) ; PIX_SORT4(p[15], p[16]) ; PIX_SORT4(p[14], p[16]) ;
+    PIX_SORT4(p[14], p[15]) ; PIX_SORT4(p[18], p[19]) ; PIX_SORT4(p[17], p[19]) ;
+    PIX_SORT4(p[17], p[18]) ; PIX_SORT4(p[21], p[22]) ; PIX_SORT4(p[20], p[22]) ;
+    PIX_SORT4(p[20], p[21]) ; PIX_SORT4(p[23], p[24]) ; PIX_SORT4(p[2], p[5]) ;
+    PIX_SORT4(p[3], p[6]) ;   PIX_SORT4(p[0], p[6]) ;   PIX_SORT4(p[0], p[3]) ;
+    PIX_SORT4(p[4], p[7]) ;   PIX_SORT4(p[1], p[7]) ;   PIX_SORT4(p[1], p[4]) ;
+    PIX_SORT4(p[11], p[14]) ; PIX_SORT4(p[8], p[14]) ;  PIX_SORT4(p[8], p[11]) ;
+    PIX_SORT4(p[12], p[15]) ; PIX_SORT4(p[9], p[15]) ;  PIX_SORT4(p[9], p[12]) ;
+    PIX_SORT4(p[13], p[16]) ; PIX_SORT4(p[10], p[16]) ; PIX_SORT4(p[10], p[13]) ;
+    PIX_SORT4(p[20], p[23]) ; PIX_SORT4(p[17], p[23]) ; PIX_SORT4(p[17], p[20]) ;
+    PIX_SORT4(p[21], p[24]) ; PIX_SORT4(p[18], p[24]) ; PIX_SORT4(p[18], p[21]) ;
+    PIX_SORT4(p[19], p[22]) ; PIX_SORT4(p[8], p[17]) ;  PIX_SORT4(p[9], p[18]) ;
+    PIX_SORT4(p[0], p[18]) ;  PIX_SORT4(p[0], p[9]) ;   PIX_SORT4(p[10], p[19]) ;
+    PIX_SORT4(p[1], p[19]) ;  PIX_SORT4(p[1], p[10]) ;  PIX_SORT4(p[11], p[20]) ;
+    PIX_SORT4(p[2], p[20]) ;  PIX_SORT4(p[2], p[11]) ;  PIX_SORT4(p[12], p[21]) ;
+    PIX_SORT4(p[3], p[21]) ;  PIX_SORT4(p[3], p[12]) ;  PIX_SORT4(p[13], p[22]) ;
+    PIX_SORT4(p[4], p[22]) ;  PIX_SORT4(p[4], p[13]) ;  PIX_SORT4(p[14], p[23]) ;
+    PIX_SORT4(p[5], p[23]) ;  PIX_SORT4(p[5], p[14]) ;  PIX_SORT4(p[15], p[24]) ;
+    PIX_SORT4(p[6], p[24]) ;  PIX_SORT4(p[6], p[15]) ;  PIX_SORT4(p[7], p[16]) ;
+    PIX_SORT4(p[7], p[19]) ;  PIX_SORT4(p[13], p[21]) ; PIX_SORT4(p[15], p[23]) ;
+    PIX_SORT4(p[7], p[13]) ;  PIX_SORT4(p[7], p[15]) ;  PIX_SORT4(p[1], p[9]) ;
+    PIX_SORT4(p[3], p[11]) ;  PIX_SORT4(p[5], p[17]) ;  PIX_SORT4(p[11], p[17]) ;
+    PIX_SORT4(p[9], p[17]) ;  PIX_SORT4(p[4], p[10]) ;  PIX_SORT4(p[6], p[12]) ;
+    PIX_SORT4(p[7], p[14]) ;  PIX_SORT4(p[4], p[6]) ;   PIX_SORT4(p[4], p[7]) ;
+    PIX_SORT4(p[12], p[14]) ; PIX_SORT4(p[10], p[14]) ; PIX_SORT4(p[6], p[7]) ;
+    PIX_SORT4(p[10], p[12]) ; PIX_SORT4(p[6], p[10]) ;  PIX_SORT4(p[6], p[17]) ;
+    PIX_SORT4(p[12], p[17]) ; PIX_SORT4(p[7], p[17]) ;  PIX_SORT4(p[7], p[10]) ;
+    PIX_SORT4(p[12], p[18]) ; PIX_SORT4(p[7], p[12]) ;  PIX_SORT4(p[10], p[18]) ;
+    PIX_SORT4(p[12], p[20]) ; PIX_SORT4(p[10], p[20]) ; PIX_SORT4(p[10], p[12]) ;
+
+    return (p[12]);
+}
+
+#undef PIX_SORT4
+
 #ifdef CHROMA_SMOOTH
 #if 0
 static void chroma_smooth_3x3(unsigned short * inp, unsigned short * out, int* raw2ev, int* ev2raw)
@@ -1021,13 +1350,26 @@ static void chroma_smooth_3x3(unsigned short * inp, unsigned short * out, int* r
 }
 #endif
 
-static void chroma_smooth_5x5(unsigned short * inp, unsigned short * out, int* raw2ev, int* ev2raw)
+struct chroma_smooth_args
+{
+    unsigned short * inp;
+    unsigned short * out;
+    int* raw2ev;
+    int* ev2raw;
+    unsigned short * ev2raw16;  /* fast version */
+};
+
+static void chroma_smooth_5x5_band(int y0, int y1, int band, void* arg)
 {
+    struct chroma_smooth_args * a = arg;
+    unsigned short * inp = a->inp;
+    unsigned short * out = a->out;
+    int* raw2ev = a->raw2ev;
+    int* ev2raw = a->ev2raw;
     int w = raw_info.width;
-    int h = raw_info.height;
     int x,y;
 
-    for (y = 4; y < h-5; y += 2)
+    for (y = y0; y < y1; y += 2)
     {
         for (x = 4; x < w-4; x += 2)
         {
@@ -1062,31 +1404,166 @@ static void chroma_smooth_5x5(unsigned short * inp, unsigned short * out, int* r
         }
     }
 }
-#endif
 
-static int hdr_interpolate()
+/**
+ * Fast version: for each 2x2 cell, r - g and b - g (in EV) are computed only once, in row buffers;
+ * the reference computes them 25 times, once for every pixel that has the cell in its 5x5 neighbourhood.
+ * The medians are then computed for 4 cells at a time.
+ */
+static void chroma_cell_row(unsigned short * p, int w, int nc, int* raw2ev, int* dr, int* db, int* ge)
 {
-    int ret = 1;
-    
-    int black = raw_info.black_level;
-    int white = raw_info.white_level;
+    int i;
+    for (i = 0; i < nc; i++, p += 2)
+    {
+        int g = (raw2ev[p[1]] + raw2ev[p[w]]) / 2;
+        dr[i] = raw2ev[p[0]] - g;
+        db[i] = raw2ev[p[w+1]] - g;
+        ge[i] = g;
+    }
+}
 
+SIMD_TARGET
+static void chroma_smooth_5x5_band_fast(int y0, int y1, int band, void* arg)
+{
+    struct chroma_smooth_args * a = arg;
+    unsigned short * inp = a->inp;
+    unsigned short * out = a->out;
+    int* raw2ev = a->raw2ev;
+    unsigned short * ev2raw = a->ev2raw16;
     int w = raw_info.width;
-    int h = raw_info.height;
+    int nc = w / 2;
+    int x, y, i, j;
+
+    /* r - g, b - g and g for cell rows y-4 ... y+4 (5 rows, reused as y advances) */
+    int* cells = malloc(3 * 5 * nc * sizeof(int));
+    CHECK(cells, "malloc");
+    #define DR(yy) (cells + ((yy)/2 % 5) * nc)
+    #define DB(yy) (cells + ((yy)/2 % 5 + 5) * nc)
+    #define GE(yy) (cells + ((yy)/2 % 5 + 10) * nc)
+
+    for (y = y0 - 4; y < y0 + 4; y += 2)
+        chroma_cell_row(inp + y * w, w, nc, raw2ev, DR(y), DB(y), GE(y));
+
+    for (y = y0; y < y1; y += 2)
+    {
+        /* one new cell row for every output row */
+        chroma_cell_row(inp + (y+4) * w, w, nc, raw2ev, DR(y+4), DB(y+4), GE(y+4));
+
+        int cx;
+        for (x = 4; x < w-4; x += 2);
+        int cxe = x / 2;
+        int* ge = GE(y);
+
+        for (cx = 2; cx < cxe; cx += 4)
+        {
+            int dr[4], db[4];
+            int n = MIN(cxe - cx, 4);
+
+            if (n == 4)
+            {
+                v4si med[25];
+                int k = 0;
+                for (i = -2; i <= 2; i++)
+                    for (j = -4; j <= 4; j += 2)
+                        med[k++] = load4(DR(y+j) + cx + i);
+                store4(dr, opt_med25_x4(med));
+
+                k = 0;
+                for (i = -2; i <= 2; i++)
+                    for (j = -4; j <= 4; j += 2)
+                        med[k++] = load4(DB(y+j) + cx + i);
+                store4(db, opt_med25_x4(med));
+            }
+            else
+            {
+                int c;
+                for (c = 0; c < n; c++)
+                {
+                    int med_r[25];
+                    int med_b[25];
+                    int k = 0;
+                    for (i = -2; i <= 2; i++)
+                    {
+                        for (j = -4; j <= 4; j += 2)
+                        {
+                            med_r[k] = DR(y+j)[cx + c + i];
+                            med_b[k] = DB(y+j)[cx + c + i];
+                            k++;
+                        }
+                    }
+                    dr[c] = opt_med25(med_r);
+                    db[c] = opt_med25(med_b);
+                }
+            }
+
+            for (i = 0; i < n; i++)
+            {
+                int g = ge[cx + i];
+                x = 2 * (cx + i);
+                out[x   +     y * w] = ev2raw[COERCE(g + dr[i], -10*EV_RESOLUTION, 14*EV_RESOLUTION)];
+                out[x+1 + (y+1) * w] = ev2raw[COERCE(g + db[i], -10*EV_RESOLUTION, 14*EV_RESOLUTION)];
+            }
+        }
+    }
 
+    #undef DR
+    #undef DB
+    #undef GE
+    free(cells);
+}
+
+static void chroma_smooth_5x5(unsigned short * inp, unsigned short * out, int* raw2ev, int* ev2raw, unsigned short * ev2raw16)
+{
+    struct chroma_smooth_args a = { inp, out, raw2ev, ev2raw, ev2raw16 };
+    /* odd widths: the reference wraps around to the next row at the right edge; not worth reproducing */
+    int fast = use_fast_kernels() && raw_info.width % 2 == 0;
+    run_bands(4, raw_info.height-5, fast ? chroma_smooth_5x5_band_fast : chroma_smooth_5x5_band, &a);
+}
+#endif
+
+/* state shared by the hdr_interpolate stages (read-only while a stage is running) */
+static struct
+{
+    int w, h;
+    int black, white;
+    int is_bright[4];
+    int* raw2ev;
+    int* ev2raw;
+    int* raw2ev14;              /* raw2ev for 14-bit input (fast kernels) */
+    unsigned short* ev2raw16;   /* ev2raw as 16-bit values (fast kernels) */
+    double corr;
+    int white_darkened;
+    double dark_noise;
+    int alias_map_max;
+
+    unsigned short* dark;
+    unsigned short* bright;
+    unsigned short* fullres;
+    unsigned short* halfres;
+    unsigned short* fullres_smooth;
+    unsigned short* halfres_smooth;
+    unsigned short* alias_map;
+    unsigned short* alias_aux;
+    unsigned short* overexposed;
+    unsigned short* hot;
+} hdr;
+
+/* mixing curves */
+static double mix_curve[65536];
+static double fullres_curve[65536];
+
+#define BRIGHT_ROW (is_bright[y % 4])
+
+/* RGGB or GBRG? (one pair of error sums per band) */
+static void hdr_detect_rggb(int y0, int y1, int band, void* arg)
+{
+    double* band_err = arg;
+    int w = hdr.w;
     int x, y;
 
-    /* for fast EV - raw conversion */
-    static int raw2ev[65536];   /* EV x EV_RESOLUTION */
-    static int ev2raw_0[24*EV_RESOLUTION];
-    
-    /* handle sub-black values (negative EV) */
-    int* ev2raw = ev2raw_0 + 10*EV_RESOLUTION;
-    
-    /* RGGB or GBRG? */
     double rggb_err = 0;
     double gbrg_err = 0;
-    for (y = 2; y < h-2; y += 2)
+    for (y = y0; y < y1; y += 2)
     {
         for (x = 2; x < w-2; x += 2)
         {
@@ -1100,183 +1577,81 @@ static int hdr_interpolate()
             gbrg_err += MIN(ABS(tl-br), ABS(tl-pr));
         }
     }
-    
-    /* which one looks more likely? */
-    int rggb = (rggb_err < gbrg_err);
-    
-    if (!rggb) /* this code assumes RGGB, so we need to skip one line */
-    {
-        raw_info.buffer += raw_info.pitch;
-        raw_info.active_area.y1++;
-        raw_info.active_area.y2--;
-        raw_info.jpeg.y++;
-        raw_info.jpeg.height -= 3;
-        raw_info.height--;
-        h--;
-    }
+    band_err[2*band] = rggb_err;
+    band_err[2*band+1] = gbrg_err;
+}
 
-    int i;
-    for (i = 0; i < 65536; i++)
-    {
-        double signal = MAX(i/4.0 - black/4.0, -1023);
-        if (signal > 0)
-            raw2ev[i] = (int)round(log2(1+signal) * EV_RESOLUTION);
-        else
-            raw2ev[i] = -(int)round(log2(1-signal) * EV_RESOLUTION);
-    }
+/* accumulate brightness for each line, mod 4 (4 sums per band) */
+static void hdr_accumulate_brightness(int y0, int y1, int band, void* arg)
+{
+    double* band_acc = arg;
+    double* acc_bright = band_acc + 4 * band;
+    int w = hdr.w;
+    int x, y;
 
-    for (i = -10*EV_RESOLUTION; i < 0; i++)
+    acc_bright[0] = acc_bright[1] = acc_bright[2] = acc_bright[3] = 0;
+    for (y = y0; y < y1; y ++)
     {
-        ev2raw[i] = COERCE(black+4 - round(4*pow(2, ((double)-i/EV_RESOLUTION))), 0, black);
+        for (x = 2; x < w-2; x ++)
+        {
+            acc_bright[y % 4] += raw_get_pixel16(x, y);
+        }
     }
+}
 
-    for (i = 0; i < 14*EV_RESOLUTION; i++)
+/* simple interpolation in 14-bit space, for estimating the ISO difference */
+static void hdr_interpolate_14bit(int y0, int y1, int band, void* arg)
+{
+    int w = hdr.w;
+    int* is_bright = hdr.is_bright;
+    unsigned short* dark = hdr.dark;
+    unsigned short* bright = hdr.bright;
+    int x, y;
+
+    for (y = y0; y < y1; y ++)
     {
-        ev2raw[i] = COERCE(black-4 + round(4*pow(2, ((double)i/EV_RESOLUTION))), black, white);
+        unsigned short* native = BRIGHT_ROW ? bright : dark;
+        unsigned short* interp = BRIGHT_ROW ? dark : bright;
         
-        if (i >= raw2ev[white])
+        for (x = 0; x < w; x ++)
         {
-            ev2raw[i] = white;
+            interp[x + y * w] = (raw_get_pixel(x, y+2) + raw_get_pixel(x, y-2)) / 2;
+            native[x + y * w] = raw_get_pixel(x, y);
         }
     }
-    
-    /* keep "bad" pixels, if any */
-    ev2raw[raw2ev[0]] = 0;
-    ev2raw[raw2ev[0]] = 0;
-    
-    /* check raw <--> ev conversion */
-    //~ printf("%d %d %d %d %d %d %d *%d* %d %d %d %d %d\n", raw2ev[0], raw2ev[1000], raw2ev[2000], raw2ev[8188], raw2ev[8189], raw2ev[8190], raw2ev[8191], raw2ev[8192], raw2ev[8193], raw2ev[8194], raw2ev[8195], raw2ev[8196], raw2ev[8200]);
-    //~ printf("%d %d %d %d %d %d %d *%d* %d %d %d %d %d\n", ev2raw[raw2ev[0]], ev2raw[raw2ev[1000]], ev2raw[raw2ev[2000]], ev2raw[raw2ev[8188]], ev2raw[raw2ev[8189]], ev2raw[raw2ev[8190]], ev2raw[raw2ev[8191]], ev2raw[raw2ev[8192]], ev2raw[raw2ev[8193]], ev2raw[raw2ev[8194]], ev2raw[raw2ev[8195]], ev2raw[raw2ev[8196]], ev2raw[raw2ev[8200]]);
+}
 
-    /* first we need to know which lines are dark and which are bright */
-    /* the pattern is not always the same, so we need to autodetect it */
+/* propagate the adjustments for black image, performed by estimate_iso */
+static void hdr_propagate_dark(int y0, int y1, int band, void* arg)
+{
+    int w = hdr.w;
+    int* is_bright = hdr.is_bright;
+    unsigned short* dark = hdr.dark;
+    int x, y;
 
-    /* it may look like this */                       /* or like this */
-    /*
-               ab cd ef gh  ab cd ef gh               ab cd ef gh  ab cd ef gh
-                                       
-            0  RG RG RG RG  RG RG RG RG            0  rg rg rg rg  rg rg rg rg
-            1  gb gb gb gb  gb gb gb gb            1  gb gb gb gb  gb gb gb gb
-            2  rg rg rg rg  rg rg rg rg            2  RG RG RG RG  RG RG RG RG
-            3  GB GB GB GB  GB GB GB GB            3  GB GB GB GB  GB GB GB GB
-            4  RG RG RG RG  RG RG RG RG            4  rg rg rg rg  rg rg rg rg
-            5  gb gb gb gb  gb gb gb gb            5  gb gb gb gb  gb gb gb gb
-            6  rg rg rg rg  rg rg rg rg            6  RG RG RG RG  RG RG RG RG
-            7  GB GB GB GB  GB GB GB GB            7  GB GB GB GB  GB GB GB GB
-            8  RG RG RG RG  RG RG RG RG            8  rg rg rg rg  rg rg rg rg
-    */
-
-    double acc_bright[4] = {0, 0, 0, 0};
-    for (y = 2; y < h-2; y ++)
-    {
-        for (x = 2; x < w-2; x ++)
-        {
-            acc_bright[y % 4] += raw_get_pixel16(x, y);
-        }
-    }
-    double avg_bright = (acc_bright[0] + acc_bright[1] + acc_bright[2] + acc_bright[3]) / 4;
-    int is_bright[4] = { acc_bright[0] > avg_bright, acc_bright[1] > avg_bright, acc_bright[2] > avg_bright, acc_bright[3] > avg_bright};
-
-    printf("ISO pattern    : %c%c%c%c %s\n", is_bright[0] ? 'B' : 'd', is_bright[1] ? 'B' : 'd', is_bright[2] ? 'B' : 'd', is_bright[3] ? 'B' : 'd', rggb ? "RGGB" : "GBRG");
-    
-    if (is_bright[0] + is_bright[1] + is_bright[2] + is_bright[3] != 2)
-    {
-        printf("Bright/dark detection error\n");
-        return 0;
-    }
-
-    if (is_bright[0] == is_bright[2] || is_bright[1] == is_bright[3])
-    {
-        printf("Interlacing method not supported\n");
-        return 0;
-    }
-
-    #define BRIGHT_ROW (is_bright[y % 4])
-    
-    double noise_std[4];
-    double noise_avg;
-    for (y = 0; y < 4; y++)
-        compute_black_noise(8, raw_info.active_area.x1 - 8, 20 + y, raw_info.active_area.y2 - 20, 1, 4, &noise_avg, &noise_std[y]);
-
-    printf("Noise levels   : %.02f %.02f %.02f %.02f (14-bit)\n", noise_std[0], noise_std[1], noise_std[2], noise_std[3]);
-    double dark_noise = MIN(MIN(noise_std[0], noise_std[1]), MIN(noise_std[2], noise_std[3]));
-    double bright_noise = MAX(MAX(noise_std[0], noise_std[1]), MAX(noise_std[2], noise_std[3]));
-    double dark_noise_ev = log2(dark_noise);
-    double bright_noise_ev = log2(bright_noise);
-
-    /* dark and bright exposures, interpolated */
-    unsigned short* dark   = malloc(w * h * sizeof(unsigned short));
-    CHECK(dark, "malloc");
-    unsigned short* bright = malloc(w * h * sizeof(unsigned short));
-    CHECK(bright, "malloc");
-    memset(dark, 0, w * h * sizeof(unsigned short));
-    memset(bright, 0, w * h * sizeof(unsigned short));
-    
-    /* fullres image (minimizes aliasing) */
-    unsigned short* fullres = malloc(w * h * sizeof(unsigned short));
-    CHECK(fullres, "malloc");
-    memset(fullres, 0, w * h * sizeof(unsigned short));
-    unsigned short* fullres_smooth = 0;
-
-    /* halfres image (minimizes noise and banding) */
-    unsigned short* halfres = malloc(w * h * sizeof(unsigned short));
-    CHECK(halfres, "malloc");
-    memset(halfres, 0, w * h * sizeof(unsigned short));
-    unsigned short* halfres_smooth = 0;
-
-    #ifdef ALIAS_BLEND
-    unsigned short* alias_map = malloc(w * h * sizeof(unsigned short));
-    CHECK(alias_map, "malloc");
-    unsigned short* overexposed = malloc(w * h * sizeof(unsigned short));
-    CHECK(overexposed, "malloc");
-    memset(alias_map, 0, w * h * sizeof(unsigned short));
-    memset(overexposed, 0, w * h * sizeof(unsigned short));
-    #endif
-
-    printf("Estimating ISO difference...\n");
-    /* use a simple interpolation in 14-bit space (the 16-bit one will trick the algorithm) */
-    for (y = 2; y < h-2; y ++)
-    {
-        unsigned short* native = BRIGHT_ROW ? bright : dark;
-        unsigned short* interp = BRIGHT_ROW ? dark : bright;
-        
-        for (x = 0; x < w; x ++)
-        {
-            interp[x + y * w] = (raw_get_pixel(x, y+2) + raw_get_pixel(x, y-2)) / 2;
-            native[x + y * w] = raw_get_pixel(x, y);
-        }
-    }
-    /* estimate ISO difference between bright and dark exposures */
-    double corr_ev = 0;
-    
-    /* don't forget that estimate_iso only works on 14-bit data, but we are working on 16 */
-    raw_info.black_level /= 4;
-    raw_info.white_level /= 4;
-    int ok = estimate_iso(dark, bright, &corr_ev);
-    raw_info.black_level *= 4;
-    raw_info.white_level *= 4;
-    if (!ok) goto err;
-
-    /* propagate the adjustments for black image, performed by estimate_iso */
-    for (y = 2; y < h-2; y ++)
+    for (y = y0; y < y1; y ++)
     {
         if (BRIGHT_ROW)
             continue;
         for (x = 0; x < w; x ++)
             raw_set_pixel16(x, y, dark[x + y*w]);
     }
+}
 
-    printf("Interpolation  : %s\n", INTERP_METHOD_NAME
-        #ifdef CHROMA_SMOOTH
-        "-chroma5x5"
-        #endif
-        #ifdef ALIAS_BLEND
-        "-alias"
-        #endif
-    );
-
+/* interpolate the missing lines for both exposures */
 #if defined(INTERP_MEAN23) || defined(INTERP_MEAN23_EDGE)
-    for (y = 2; y < h-2; y ++)
+static void hdr_interpolate_rows(int y0, int y1, int band, void* arg)
+{
+    int w = hdr.w;
+    int* is_bright = hdr.is_bright;
+    int white = hdr.white;
+    int* raw2ev = hdr.raw2ev;
+    int* ev2raw = hdr.ev2raw;
+    unsigned short* dark = hdr.dark;
+    unsigned short* bright = hdr.bright;
+    int x, y;
+
+    for (y = y0; y < y1; y ++)
     {
         unsigned short* native = BRIGHT_ROW ? bright : dark;
         unsigned short* interp = BRIGHT_ROW ? dark : bright;
@@ -1323,8 +1698,122 @@ static int hdr_interpolate()
             native[x+1 + y * w] = raw_get_pixel_14to16(x+1, y);
         }
     }
+}
+
+/* fast version: same output, computed from EV row buffers, 4 columns at a time */
+SIMD_TARGET
+static void hdr_interpolate_rows_fast(int y0, int y1, int band, void* arg)
+{
+    int w = hdr.w;
+    int* is_bright = hdr.is_bright;
+    int white = hdr.raw2ev[hdr.white];
+    int* raw2ev = hdr.raw2ev14;
+    unsigned short* ev2raw = hdr.ev2raw16;
+    unsigned short* dark = hdr.dark;
+    unsigned short* bright = hdr.bright;
+    unsigned short* raw = raw_info.buffer;
+    int x, y;
+
+    /* rows y-2 ... y+2 converted to EV (5 rows, reused as y advances) */
+    int* ev_rows = malloc(5 * w * sizeof(int));
+    int* mean = malloc(w * sizeof(int));
+    CHECK(ev_rows && mean, "malloc");
+    #define EV_ROW(yy) (ev_rows + ((yy) % 5) * w)
+
+    for (y = y0 - 2; y < y0 + 2; y++)
+        for (x = 0; x < w; x++)
+            EV_ROW(y)[x] = raw2ev[raw[x + y * w] & 16383];
+
+    /* same columns as the reference: x = 2, 4 ... while x < w-3, each one followed by x+1 */
+    for (x = 2; x < w-3; x += 2);
+    int xe = x;
+
+    v4si vwhite = {white, white, white, white};
+    v4si vwhite3 = vwhite * 3;
+
+    for (y = y0; y < y1; y ++)
+    {
+        for (x = 0; x < w; x++)
+            EV_ROW(y+2)[x] = raw2ev[raw[x + (y+2) * w] & 16383];
+
+        unsigned short* native = BRIGHT_ROW ? bright : dark;
+        unsigned short* interp = BRIGHT_ROW ? dark : bright;
+        int is_rg = (y % 2 == 0); /* RG or GB? */
+        int s = (is_bright[y%4] == is_bright[(y+1)%4]) ? -1 : 1;
+
+        /* red/blue: mean2 from (x,y-2) and (x,y+2) */
+        /* green: mean3 from (x+1,y+s), (x-1,y+s) and (x,y-2s); stored as a sum, divided by 3 below */
+        int* ea = EV_ROW(y-2);
+        int* eb = EV_ROW(y+2);
+        int* es = EV_ROW(y+s);
+        int* e2s = EV_ROW(y-2*s);
+
+        /* which columns are red/blue? on RG rows, the even ones; on GB rows, the odd ones */
+        v4si rb_mask = is_rg ? (v4si){-1, 0, -1, 0} : (v4si){0, -1, 0, -1};
+
+        for (x = 2; x + 4 <= xe; x += 4)
+        {
+            v4si a = load4(ea + x);
+            v4si b = load4(eb + x);
+            v4si m2 = a + b;
+            m2 = (m2 + (v4si)((v4su) m2 >> 31)) >> 1;     /* (a+b)/2, rounded towards 0, like in C */
+            v4si sat2 = (a >= vwhite) | (b >= vwhite);
+            m2 = (m2 & ~sat2) | (vwhite & sat2);
+
+            v4si ga = load4(es + x + 1);
+            v4si gb = load4(es + x - 1);
+            v4si gc = load4(e2s + x);
+            v4si m3 = ga + gb + gc;
+            v4si sat3 = (ga >= vwhite) | (gb >= vwhite) | (gc >= vwhite);
+            m3 = (m3 & ~sat3) | (vwhite3 & sat3);
+
+            store4(mean + x, (m2 & rb_mask) | (m3 & ~rb_mask));
+        }
+
+        for ( ; x < xe; x++)
+        {
+            int rb = (x % 2 == 0) == is_rg;
+            if (rb)
+                mean[x] = mean2(ea[x], eb[x], white, 0);
+            else
+                mean[x] = 3 * mean3(es[x+1], es[x-1], e2s[x], white, 0);
+        }
+
+        for (x = 2; x < xe; x += 2)
+        {
+            if (is_rg)
+            {
+                interp[x   + y * w] = ev2raw[mean[x]];
+                interp[x+1 + y * w] = ev2raw[mean[x+1] / 3];
+            }
+            else
+            {
+                interp[x   + y * w] = ev2raw[mean[x] / 3];
+                interp[x+1 + y * w] = ev2raw[mean[x+1]];
+            }
+
+            native[x   + y * w] = raw_get_pixel_14to16(x, y);
+            native[x+1 + y * w] = raw_get_pixel_14to16(x+1, y);
+        }
+    }
+
+    #undef EV_ROW
+    free(ev_rows);
+    free(mean);
+}
 #else
-    for (y = 2; y < h-2; y ++)
+static void hdr_interpolate_rows(int y0, int y1, int band, void* arg)
+{
+    int w = hdr.w;
+    int* is_bright = hdr.is_bright;
+    int white = hdr.white;
+    int* raw2ev = hdr.raw2ev;
+    int* ev2raw = hdr.ev2raw;
+    unsigned short* dark = hdr.dark;
+    unsigned short* bright = hdr.bright;
+    int x, y;
+
+    for (y = y0; y < y1; y ++)
     {
         unsigned short* native = BRIGHT_ROW ? bright : dark;
         unsigned short* interp = BRIGHT_ROW ? dark : bright;
@@ -1354,10 +1843,22 @@ static int hdr_interpolate()
             native[x   + y * w] = raw_get_pixel_14to16(x, y);
         }
     }
+}
 #endif
 
 #ifdef INTERP_MEAN23_EDGE /* second step, for detecting edges */
-    for (y = 2; y < h-2; y ++)
+static void hdr_interpolate_edges(int y0, int y1, int band, void* arg)
+{
+    int w = hdr.w;
+    int* is_bright = hdr.is_bright;
+    int white = hdr.white;
+    int* raw2ev = hdr.raw2ev;
+    int* ev2raw = hdr.ev2raw;
+    unsigned short* dark = hdr.dark;
+    unsigned short* bright = hdr.bright;
+    int x, y;
+
+    for (y = y0; y < y1; y ++)
     {
         unsigned short* interp = BRIGHT_ROW ? dark : bright;
         
@@ -1425,207 +1926,845 @@ static int hdr_interpolate()
             }
         }
     }
+}
 #endif
 
-    /* border interpolation */
-    for (y = 0; y < 3; y ++)
+/* darken bright image so it looks like the low-ISO one */
+static void hdr_match_brightness(int y0, int y1, int band, void* arg)
+{
+    int w = hdr.w;
+    int black = hdr.black;
+    double corr = hdr.corr;
+    unsigned short* bright = hdr.bright;
+    int x, y;
+
+    for (y = y0; y < y1; y ++)
     {
-        unsigned short* native = BRIGHT_ROW ? bright : dark;
-        unsigned short* interp = BRIGHT_ROW ? dark : bright;
-        
         for (x = 0; x < w; x ++)
         {
-            interp[x + y * w] = raw_get_pixel_14to16(x, y+2);
-            native[x + y * w] = raw_get_pixel_14to16(x, y);
+            {
+                /* darken bright image so it looks like the low-ISO one */
+                /* this is best done in linear space, to handle values under black level */
+                /* but it's important to work in 16-bit or more, to minimize quantization errors */
+                int b = bright[x + y*w];
+                int bd = (b - black) / corr + black;
+                bright[x + y*w] = bd;
+            }
         }
     }
+}
 
-    for (y = h-2; y < h; y ++)
+/* correct all hot pixels from the high-ISO image, which is usually clean */
+static void hdr_fix_hot_pixels(int y0, int y1, int band, void* arg)
+{
+    int w = hdr.w;
+    unsigned short* dark = hdr.dark;
+    unsigned short* bright = hdr.bright;
+    unsigned short* hot = hdr.hot;
+    int x, y;
+
+    for (y = y0; y < y1; y ++)
     {
-        unsigned short* native = BRIGHT_ROW ? bright : dark;
-        unsigned short* interp = BRIGHT_ROW ? dark : bright;
-        
         for (x = 0; x < w; x ++)
         {
-            interp[x + y * w] = raw_get_pixel_14to16(x, y-2);
-            native[x + y * w] = raw_get_pixel_14to16(x, y);
+            if (hot[x + y*w])
+            {
+                dark[x + y*w] = bright[x + y*w];
+            }
         }
     }
+}
 
-    for (y = 2; y < h; y ++)
-    {
-        unsigned short* native = BRIGHT_ROW ? bright : dark;
-        unsigned short* interp = BRIGHT_ROW ? dark : bright;
-        
-        for (x = 0; x < 2; x ++)
-        {
-            interp[x + y * w] = raw_get_pixel_14to16(x, y-2);
-            native[x + y * w] = raw_get_pixel_14to16(x, y);
-        }
-
-        for (x = w-3; x < w; x ++)
-        {
-            interp[x + y * w] = raw_get_pixel_14to16(x-2, y-2);
-            native[x + y * w] = raw_get_pixel_14to16(x-2, y);
-        }
-    }
-    
-    /* we have now switched to 16-bit, update noise numbers */
-    dark_noise *= 4;
-    bright_noise *= 4;
-    dark_noise_ev += 2;
-    bright_noise_ev += 2;
+/* reconstruct a full-resolution image (discard interpolated fields whenever possible) */
+static void hdr_fullres(int y0, int y1, int band, void* arg)
+{
+    int w = hdr.w;
+    int* is_bright = hdr.is_bright;
+    int white_darkened = hdr.white_darkened;
+    unsigned short* dark = hdr.dark;
+    unsigned short* bright = hdr.bright;
+    unsigned short* fullres = hdr.fullres;
+    int x, y;
 
-    double lowiso_dr = log2(white - black) - dark_noise_ev;
-    double highiso_dr = log2(white - black) - bright_noise_ev;
-    printf("Dynamic range  : %.02f (+) %.02f => %.02f EV (in theory)\n", lowiso_dr, highiso_dr, highiso_dr + corr_ev);
-    printf("Matching brightness...\n");
-    double corr = pow(2, corr_ev);
-    int white_darkened = (white - black) / corr + black;
-    for (y = 0; y < h; y ++)
+    for (y = y0; y < y1; y ++)
     {
         for (x = 0; x < w; x ++)
         {
+            if (BRIGHT_ROW)
             {
-                /* darken bright image so it looks like the low-ISO one */
-                /* this is best done in linear space, to handle values under black level */
-                /* but it's important to work in 16-bit or more, to minimize quantization errors */
-                int b = bright[x + y*w];
-                int bd = (b - black) / corr + black;
-                bright[x + y*w] = bd;
+                int f = bright[x + y*w];
+                /* if the brighter copy is overexposed, the guessed pixel for sure has higher brightness */
+                fullres[x + y*w] = f < white_darkened ? f : MAX(f, dark[x + y*w]);
+            }
+            else
+            {
+                fullres[x + y*w] = dark[x + y*w]; 
             }
         }
     }
-    
-    /* update bright noise measurements, so they can be compared after scaling */
-    bright_noise /= corr;
-    bright_noise_ev -= corr_ev;
-    
-#if 1
-    {
-        printf("Looking for hot/cold pixels...\n");
-        int hot_pixels = 0;
-        int cold_pixels = 0;
-        unsigned short* hot = malloc(w * h * sizeof(unsigned short));
-        CHECK(hot, "malloc");
-        memset(hot, 0, w * h * sizeof(unsigned short));
-        for (y = 6; y < h-6; y ++)
-        {
-            for (x = 6; x < w-6; x ++)
-            {
-                {
-                    int d = dark[x + y*w];
-                    int b = bright[x + y*w];
+}
 
-                    /* don't check hot pixels near overexposed areas */
-                    int i,j;
-                    int over = 0;
-                    for (i = -3; i <= 3; i++)
+/* mix the two images (half-res) */
+static void hdr_halfres(int y0, int y1, int band, void* arg)
+{
+    int w = hdr.w;
+    int* raw2ev = hdr.raw2ev;
+    int* ev2raw = hdr.ev2raw;
+    unsigned short* dark = hdr.dark;
+    unsigned short* bright = hdr.bright;
+    unsigned short* halfres = hdr.halfres;
+    int x, y;
+
+    for (y = y0; y < y1; y ++)
+    {
+        for (x = 0; x < w; x ++)
+        {
+            /* bright and dark source pixels  */
+            /* they may be real or interpolated */
+            /* they both have the same brightness (they were adjusted before this loop), so we are ready to mix them */ 
+            int b = bright[x + y*w];
+            int d = dark[x + y*w];
+
+            /* go from linear to EV space */
+            int bev = raw2ev[b];
+            int dev = raw2ev[d];
+
+            /* blending factor */
+            double k = COERCE(mix_curve[b & 65535], 0, 1);
+            
+            /* mix bright and dark exposures */
+            int mixed = bev * (1-k) + dev * k;
+            halfres[x + y*w] = ev2raw[mixed];
+        }
+    }
+}
+
+/* build the aliasing maps (where it's likely to get aliasing) */
+static void hdr_build_alias_map(int y0, int y1, int band, void* arg)
+{
+    int w = hdr.w;
+    int* raw2ev = hdr.raw2ev;
+    double dark_noise = hdr.dark_noise;
+    unsigned short* fullres_smooth = hdr.fullres_smooth;
+    unsigned short* halfres_smooth = hdr.halfres_smooth;
+    unsigned short* alias_map = hdr.alias_map;
+    int x, y;
+
+    for (y = y0; y < y1; y ++)
+    {
+        for (x = 0; x < w; x ++)
+        {
+            int f = fullres_smooth[x + y*w];
+            int h = halfres_smooth[x + y*w];
+            int fe = raw2ev[f];
+            int he = raw2ev[h];
+            int e_lin = ABS(f - h); /* error in linear space, for shadows (downweights noise) */
+            e_lin = MAX(e_lin - dark_noise, 0);
+            int e_log = ABS(fe - he); /* error in EV space, for highlights (highly sensitive to noise) */
+            alias_map[x + y*w] = MIN(e_lin*16, e_log/8);
+        }
+    }
+}
+
+/* dilate the alias map */
+static void hdr_dilate_alias_map(int y0, int y1, int band, void* arg)
+{
+    int w = hdr.w;
+    unsigned short* alias_map = hdr.alias_map;
+    unsigned short* alias_aux = hdr.alias_aux;
+    int x, y;
+
+    for (y = y0; y < y1; y ++)
+    {
+        for (x = 6; x < w-6; x ++)
+        {
+            /* optimizing... the brute force way */
+            int c0 = alias_map[x+0 + (y+0) * w];
+            int c1 = MAX(MAX(alias_map[x+0 + (y-2) * w], alias_map[x-2 + (y+0) * w]), MAX(alias_map[x+2 + (y+0) * w], alias_map[x+0 + (y+2) * w]));
+            int c2 = MAX(MAX(alias_map[x-2 + (y-2) * w], alias_map[x+2 + (y-2) * w]), MAX(alias_map[x-2 + (y+2) * w], alias_map[x+2 + (y+2) * w]));
+            int c3 = MAX(MAX(alias_map[x+0 + (y-4) * w], alias_map[x-4 + (y+0) * w]), MAX(alias_map[x+4 + (y+0) * w], alias_map[x+0 + (y+4) * w]));
+            //~ int c4 = MAX(MAX(alias_map[x-2 + (y-4) * w], alias_map[x+2 + (y-4) * w]), MAX(alias_map[x-4 + (y-2) * w], alias_map[x+4 + (y-2) * w]));
+            //~ int c5 = MAX(MAX(alias_map[x-4 + (y+2) * w], alias_map[x+4 + (y+2) * w]), MAX(alias_map[x-2 + (y+4) * w], alias_map[x+2 + (y+4) * w]));
+            //~ int c = MAX(MAX(MAX(c0, c1), MAX(c2, c3)), MAX(c4, c5));
+            int c = MAX(MAX(c0, c1), MAX(c2, c3));
+            
+            alias_aux[x + y * w] = c;
+        }
+    }
+}
+
+/* smooth the alias map (gaussian blur) */
+static void hdr_smooth_alias_map(int y0, int y1, int band, void* arg)
+{
+    int w = hdr.w;
+    unsigned short* alias_map = hdr.alias_map;
+    unsigned short* alias_aux = hdr.alias_aux;
+    int x, y;
+
+    for (y = y0; y < y1; y ++)
+    {
+        for (x = 6; x < w-6; x ++)
+        {
+
+/* code generation
+            const int blur[4][4] = {
+                {1024,  820,  421,  139},
+                { 820,  657,  337,  111},
+                { 421,  337,  173,   57},
+                { 139,  111,   57,    0},
+            };
+            const int blur_unique[] = {1024, 820, 657, 421, 337, 173, 139, 111, 57};
+
+            int k;
+            for (k = 0; k < COUNT(blur_unique); k++)
+            {
+                int dx, dy;
+                int c = 0;
+                printf("(");
+                for (dy = -3; dy <= 3; dy++)
+                {
+                    for (dx = -3; dx <= 3; dx++)
                     {
-                        for (j = -3; j <= 3; j++)
-                        {
-                            if (bright[x+j + (y+i)*w] >= white_darkened || dark[x+j + (y+i)*w] >= white_darkened)
-                            {
-                                over = 1;
-                                break;
-                            }
-                        }
+                        c += alias_aux[x + dx + (y + dy) * w] * blur[ABS(dx)][ABS(dy)] / 1024;
+                        if (blur[ABS(dx)][ABS(dy)] == blur_unique[k])
+                            printf("alias_aux[x%+d + (y%+d) * w] + ", dx, dy);
                     }
-                    if (over)
-                        continue;
-                    
-                    /* for speedup */
-                    int maybe_hot = (raw2ev[d] - raw2ev[b] > EV_RESOLUTION) && (d - b > dark_noise);
-                    int maybe_cold = (raw2ev[d] - raw2ev[b] < -EV_RESOLUTION) && (d - b < -dark_noise);
-                    if (!maybe_hot && !maybe_cold)
-                        continue;
-
-                    /* let's look at the neighbours: is this pixel clearly brigher? (isolated) */
-                    int neighbours[50];
-                    int k = 0;
-                    for (i = -3; i <= 3; i++)
+                }
+                printf("\b\b\b) * %d / 1024 + \n", blur_unique[k]);
+            }
+            exit(1);
+*/
+            /* optimizing... the brute force way */
+            int c = 
+                (alias_aux[x+0 + (y+0) * w])+ 
+                (alias_aux[x+0 + (y-2) * w] + alias_aux[x-2 + (y+0) * w] + alias_aux[x+2 + (y+0) * w] + alias_aux[x+0 + (y+2) * w]) * 820 / 1024 + 
+                (alias_aux[x-2 + (y-2) * w] + alias_aux[x+2 + (y-2) * w] + alias_aux[x-2 + (y+2) * w] + alias_aux[x+2 + (y+2) * w]) * 657 / 1024 + 
+                (alias_aux[x+0 + (y-2) * w] + alias_aux[x-2 + (y+0) * w] + alias_aux[x+2 + (y+0) * w] + alias_aux[x+0 + (y+2) * w]) * 421 / 1024 + 
+                (alias_aux[x-2 + (y-2) * w] + alias_aux[x+2 + (y-2) * w] + alias_aux[x-2 + (y-2) * w] + alias_aux[x+2 + (y-2) * w] + alias_aux[x-2 + (y+2) * w] + alias_aux[x+2 + (y+2) * w] + alias_aux[x-2 + (y+2) * w] + alias_aux[x+2 + (y+2) * w]) * 337 / 1024 + 
+                //~ (alias_aux[x-2 + (y-2) * w] + alias_aux[x+2 + (y-2) * w] + alias_aux[x-2 + (y+2) * w] + alias_aux[x+2 + (y+2) * w]) * 173 / 1024 + 
+                //~ (alias_aux[x+0 + (y-6) * w] + alias_aux[x-6 + (y+0) * w] + alias_aux[x+6 + (y+0) * w] + alias_aux[x+0 + (y+6) * w]) * 139 / 1024 + 
+                //~ (alias_aux[x-2 + (y-6) * w] + alias_aux[x+2 + (y-6) * w] + alias_aux[x-6 + (y-2) * w] + alias_aux[x+6 + (y-2) * w] + alias_aux[x-6 + (y+2) * w] + alias_aux[x+6 + (y+2) * w] + alias_aux[x-2 + (y+6) * w] + alias_aux[x+2 + (y+6) * w]) * 111 / 1024 + 
+                //~ (alias_aux[x-2 + (y-6) * w] + alias_aux[x+2 + (y-6) * w] + alias_aux[x-6 + (y-2) * w] + alias_aux[x+6 + (y-2) * w] + alias_aux[x-6 + (y+2) * w] + alias_aux[x+6 + (y+2) * w] + alias_aux[x-2 + (y+6) * w] + alias_aux[x+2 + (y+6) * w]) * 57 / 1024;
+                0;
+            alias_map[x + y * w] = c;
+        }
+    }
+}
+
+/* make the alias map grayscale */
+static void hdr_alias_map_grayscale(int y0, int y1, int band, void* arg)
+{
+    int w = hdr.w;
+    int ALIAS_MAP_MAX = hdr.alias_map_max;
+    unsigned short* alias_map = hdr.alias_map;
+    int x, y;
+
+    for (y = y0; y < y1; y += 2)
+    {
+        for (x = 2; x < w-2; x += 2)
+        {
+            int a = alias_map[x   +     y * w];
+            int b = alias_map[x+1 +     y * w];
+            int c = alias_map[x   + (y+1) * w];
+            int d = alias_map[x+1 + (y+1) * w];
+            int C = MAX(MAX(a,b), MAX(c,d));
+            
+            C = MIN(C, ALIAS_MAP_MAX);
+
+            alias_map[x   +     y * w] = 
+            alias_map[x+1 +     y * w] = 
+            alias_map[x   + (y+1) * w] = 
+            alias_map[x+1 + (y+1) * w] = C;
+        }
+    }
+}
+
+/* where the image is overexposed? */
+static void hdr_overexposed_map(int y0, int y1, int band, void* arg)
+{
+    int w = hdr.w;
+    int white = hdr.white;
+    int white_darkened = hdr.white_darkened;
+    unsigned short* dark = hdr.dark;
+    unsigned short* bright = hdr.bright;
+    unsigned short* overexposed = hdr.overexposed;
+    int x, y;
+
+    for (y = y0; y < y1; y ++)
+    {
+        for (x = 0; x < w; x ++)
+        {
+            overexposed[x + y * w] = bright[x + y * w] >= white_darkened || dark[x + y * w] >= white ? 100 : 0;
+        }
+    }
+}
+
+/* "blur" the overexposed map */
+static void hdr_blur_overexposed_map(int y0, int y1, int band, void* arg)
+{
+    int w = hdr.w;
+    unsigned short* overexposed = hdr.overexposed;
+    unsigned short* alias_aux = hdr.alias_aux;
+    int x, y;
+
+    for (y = y0; y < y1; y ++)
+    {
+        for (x = 3; x < w-3; x ++)
+        {
+            overexposed[x + y * w] = 
+                (alias_aux[x+0 + (y+0) * w])+ 
+                (alias_aux[x+0 + (y-1) * w] + alias_aux[x-1 + (y+0) * w] + alias_aux[x+1 + (y+0) * w] + alias_aux[x+0 + (y+1) * w]) * 820 / 1024 + 
+                (alias_aux[x-1 + (y-1) * w] + alias_aux[x+1 + (y-1) * w] + alias_aux[x-1 + (y+1) * w] + alias_aux[x+1 + (y+1) * w]) * 657 / 1024 + 
+                //~ (alias_aux[x+0 + (y-2) * w] + alias_aux[x-2 + (y+0) * w] + alias_aux[x+2 + (y+0) * w] + alias_aux[x+0 + (y+2) * w]) * 421 / 1024 + 
+                //~ (alias_aux[x-1 + (y-2) * w] + alias_aux[x+1 + (y-2) * w] + alias_aux[x-2 + (y-1) * w] + alias_aux[x+2 + (y-1) * w] + alias_aux[x-2 + (y+1) * w] + alias_aux[x+2 + (y+1) * w] + alias_aux[x-1 + (y+2) * w] + alias_aux[x+1 + (y+2) * w]) * 337 / 1024 + 
+                //~ (alias_aux[x-2 + (y-2) * w] + alias_aux[x+2 + (y-2) * w] + alias_aux[x-2 + (y+2) * w] + alias_aux[x+2 + (y+2) * w]) * 173 / 1024 + 
+                //~ (alias_aux[x+0 + (y-3) * w] + alias_aux[x-3 + (y+0) * w] + alias_aux[x+3 + (y+0) * w] + alias_aux[x+0 + (y+3) * w]) * 139 / 1024 + 
+                //~ (alias_aux[x-1 + (y-3) * w] + alias_aux[x+1 + (y-3) * w] + alias_aux[x-3 + (y-1) * w] + alias_aux[x+3 + (y-1) * w] + alias_aux[x-3 + (y+1) * w] + alias_aux[x+3 + (y+1) * w] + alias_aux[x-1 + (y+3) * w] + alias_aux[x+1 + (y+3) * w]) * 111 / 1024 + 
+                //~ (alias_aux[x-2 + (y-3) * w] + alias_aux[x+2 + (y-3) * w] + alias_aux[x-3 + (y-2) * w] + alias_aux[x+3 + (y-2) * w] + alias_aux[x-3 + (y+2) * w] + alias_aux[x+3 + (y+2) * w] + alias_aux[x-2 + (y+3) * w] + alias_aux[x+2 + (y+3) * w]) * 57 / 1024;
+                0;
+        }
+    }
+}
+
+/* look for hot/cold pixels (counts are stored for each band) */
+static void hdr_detect_hot_pixels(int y0, int y1, int band, void* arg)
+{
+    int* band_counts = arg;
+    int w = hdr.w;
+    int* is_bright = hdr.is_bright;
+    int* raw2ev = hdr.raw2ev;
+    int white_darkened = hdr.white_darkened;
+    double dark_noise = hdr.dark_noise;
+    unsigned short* dark = hdr.dark;
+    unsigned short* bright = hdr.bright;
+    unsigned short* hot = hdr.hot;
+    int hot_pixels = 0;
+    int cold_pixels = 0;
+    int x, y;
+
+    for (y = y0; y < y1; y ++)
+    {
+        for (x = 6; x < w-6; x ++)
+        {
+            {
+                int d = dark[x + y*w];
+                int b = bright[x + y*w];
+
+                /* don't check hot pixels near overexposed areas */
+                int i,j;
+                int over = 0;
+                for (i = -3; i <= 3; i++)
+                {
+                    for (j = -3; j <= 3; j++)
                     {
-                        for (j = -3; j <= 3; j++)
+                        if (bright[x+j + (y+i)*w] >= white_darkened || dark[x+j + (y+i)*w] >= white_darkened)
                         {
-                            if (ABS(i) <= 1 && ABS(j) <= 1)
-                                continue;
-                            
-                            int d = dark[x+j*2 + (y+i*2)*w];
-                            int b = bright[x+j*2 + (y+i*2)*w];
-                            int p = BRIGHT_ROW ? b : d;
-                            neighbours[k++] = p;
+                            over = 1;
+                            break;
                         }
                     }
-                    int max = 0;
-                    int imax = 0;
-                    int min = 1000000;
-                    int imin = 0;
-                    for (i = 0; i < k; i++)
+                }
+                if (over)
+                    continue;
+                
+                /* for speedup */
+                int maybe_hot = (raw2ev[d] - raw2ev[b] > EV_RESOLUTION) && (d - b > dark_noise);
+                int maybe_cold = (raw2ev[d] - raw2ev[b] < -EV_RESOLUTION) && (d - b < -dark_noise);
+                if (!maybe_hot && !maybe_cold)
+                    continue;
+
+                /* let's look at the neighbours: is this pixel clearly brigher? (isolated) */
+                int neighbours[50];
+                int k = 0;
+                for (i = -3; i <= 3; i++)
+                {
+                    for (j = -3; j <= 3; j++)
                     {
-                        if (neighbours[i] > max)
-                        {
-                            max = neighbours[i];
-                            imax = i;
-                        }
-                        if (neighbours[i] < min)
-                        {
-                            min = neighbours[i];
-                            imin = i;
-                        }
+                        if (ABS(i) <= 1 && ABS(j) <= 1)
+                            continue;
+                        
+                        int d = dark[x+j*2 + (y+i*2)*w];
+                        int b = bright[x+j*2 + (y+i*2)*w];
+                        int p = BRIGHT_ROW ? b : d;
+                        neighbours[k++] = p;
                     }
-
-                    int second_max = 0;
-                    int second_min = 1000000;
-                    for (i = 0; i < k; i++)
+                }
+                int max = 0;
+                int imax = 0;
+                int min = 1000000;
+                int imin = 0;
+                for (i = 0; i < k; i++)
+                {
+                    if (neighbours[i] > max)
                     {
-                        if (neighbours[i] > second_max && i != imax)
-                        {
-                            second_max = neighbours[i];
-                        }
-                        if (neighbours[i] < second_min && i != imin)
-                        {
-                            second_min = neighbours[i];
-                        }
+                        max = neighbours[i];
+                        imax = i;
                     }
-
-                    int is_hot =
-                        (raw2ev[d] - raw2ev[max] > -EV_RESOLUTION/2) &&
-                        (raw2ev[d] - raw2ev[second_max] > EV_RESOLUTION/2) &&
-                        (d - second_max > dark_noise/2);
-
-                    int is_cold = 
-                        (raw2ev[d] - raw2ev[min] < EV_RESOLUTION/2) &&
-                        (raw2ev[d] - raw2ev[second_min] < -EV_RESOLUTION/2) &&
-                        (d - second_min < -dark_noise);
-                    
-                    //~ int is_cold = d < black + dark_noise;
-
-                    if (is_hot)
+                    if (neighbours[i] < min)
                     {
-                        hot_pixels++;
-                        hot[x + y*w] = 1;
+                        min = neighbours[i];
+                        imin = i;
                     }
+                }
 
-                    if (is_cold)
+                int second_max = 0;
+                int second_min = 1000000;
+                for (i = 0; i < k; i++)
+                {
+                    if (neighbours[i] > second_max && i != imax)
+                    {
+                        second_max = neighbours[i];
+                    }
+                    if (neighbours[i] < second_min && i != imin)
                     {
-                        cold_pixels++;
-                        hot[x + y*w] = -1;
+                        second_min = neighbours[i];
                     }
                 }
+
+                int is_hot =
+                    (raw2ev[d] - raw2ev[max] > -EV_RESOLUTION/2) &&
+                    (raw2ev[d] - raw2ev[second_max] > EV_RESOLUTION/2) &&
+                    (d - second_max > dark_noise/2);
+
+                int is_cold = 
+                    (raw2ev[d] - raw2ev[min] < EV_RESOLUTION/2) &&
+                    (raw2ev[d] - raw2ev[second_min] < -EV_RESOLUTION/2) &&
+                    (d - second_min < -dark_noise);
+                
+                //~ int is_cold = d < black + dark_noise;
+
+                if (is_hot)
+                {
+                    hot_pixels++;
+                    hot[x + y*w] = 1;
+                }
+
+                if (is_cold)
+                {
+                    cold_pixels++;
+                    hot[x + y*w] = -1;
+                }
             }
         }
+    }
+
+    band_counts[2*band] = hot_pixels;
+    band_counts[2*band+1] = cold_pixels;
+}
+
+/* final blending: half-res, full-res and alias maps; output goes to raw buffer */
+static void hdr_final_blend(int y0, int y1, int band, void* arg)
+{
+    int w = hdr.w;
+    int* raw2ev = hdr.raw2ev;
+    int* ev2raw = hdr.ev2raw;
+    int ALIAS_MAP_MAX = hdr.alias_map_max;
+    unsigned short* bright = hdr.bright;
+    unsigned short* fullres = hdr.fullres;
+    unsigned short* fullres_smooth = hdr.fullres_smooth;
+    unsigned short* halfres_smooth = hdr.halfres_smooth;
+    unsigned short* alias_map = hdr.alias_map;
+    unsigned short* overexposed = hdr.overexposed;
+    int x, y;
+
+    for (y = y0; y < y1; y ++)
+    {
+        for (x = 0; x < w; x ++)
+        {
+            /* high-iso image (for measuring signal level) */
+            int b = bright[x + y*w];
+
+            /* half-res image (interpolated and chroma filtered, best for low-contrast shadows) */
+            int hr = halfres_smooth[x + y*w];
+            
+            /* full-res image (non-interpolated, except where one ISO is blown out) */
+            int fr = fullres[x + y*w];
+
+            #ifdef CHROMA_SMOOTH
+            /* full res with some smoothing applied to hide aliasing artifacts */
+            int frs = fullres_smooth[x + y*w];
+            #else
+            int frs = fr;
+            #endif
+
+            /* go from linear to EV space */
+            int hrev = raw2ev[hr];
+            int frev = raw2ev[fr];
+            int frsev = raw2ev[frs];
+
+#ifdef FULLRES_ONLY 
+            int output = frev;
+#else
+            /* blending factor */
+            int f = fullres_curve[b & 65535];
+            
+            #ifdef ALIAS_BLEND
+            int co = alias_map[x + y*w];
+            double c = COERCE(co / (double) ALIAS_MAP_MAX, 0, 1);
+            double ovf = COERCE(overexposed[x + y*w] / 200.0, 0, 1);
+            c = MAX(c, ovf);
+            //~ k = MIN(MAX(k, ovf*5), 1);
+            #else
+            double c = 1;
+            #endif
+
+            double noisy_or_overexposed = MAX(ovf, 1-f);
+
+            /* use data from both ISOs in high-detail areas, even if it's noisier (less aliasing) */
+            f = MAX(f, c);
+            
+            /* use smoothing in noisy near-overexposed areas to hide color artifacts */
+            double fev = noisy_or_overexposed * frsev + (1-noisy_or_overexposed) * frev;
+            
+            /* blend "half-res" and "full-res" images smoothly to avoid banding*/
+            int output = hrev * (1-f) + fev * f;
+
+            /* show full-res map (for debugging) */
+            //~ output = f * 14*EV_RESOLUTION;
+            
+            /* show alias map (for debugging) */
+            //~ output = c * 14*EV_RESOLUTION;
+#endif
+            /* safeguard */
+            output = COERCE(output, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1);
+            
+            /* back to linear space and commit */
+            raw_set_pixel16(x, y, ev2raw[output]);
+        }
+    }
+}
+
+/* fast EV - raw conversion tables, for the given black and white levels (hdr.raw2ev, hdr.ev2raw and the narrower ones) */
+static void hdr_ev_tables(int black, int white)
+{
+    static int raw2ev[65536];   /* EV x EV_RESOLUTION */
+    static int ev2raw_0[24*EV_RESOLUTION + 1];  /* +1: chroma smoothing clamps to 14*EV_RESOLUTION inclusive */
+    int i;
+    
+    /* handle sub-black values (negative EV) */
+    int* ev2raw = ev2raw_0 + 10*EV_RESOLUTION;
+    
+    for (i = 0; i < 65536; i++)
+    {
+        double signal = MAX(i/4.0 - black/4.0, -1023);
+        if (signal > 0)
+            raw2ev[i] = (int)round(log2(1+signal) * EV_RESOLUTION);
+        else
+            raw2ev[i] = -(int)round(log2(1-signal) * EV_RESOLUTION);
+    }
+
+    for (i = -10*EV_RESOLUTION; i < 0; i++)
+    {
+        ev2raw[i] = COERCE(black+4 - round(4*pow(2, ((double)-i/EV_RESOLUTION))), 0, black);
+    }
+
+    for (i = 0; i <= 14*EV_RESOLUTION; i++)
+    {
+        ev2raw[i] = COERCE(black-4 + round(4*pow(2, ((double)i/EV_RESOLUTION))), black, white);
+        
+        if (i >= raw2ev[white])
+        {
+            ev2raw[i] = white;
+        }
+    }
+    
+    /* keep "bad" pixels, if any */
+    ev2raw[raw2ev[0]] = 0;
+    ev2raw[raw2ev[0]] = 0;
+
+    /* narrower tables for the fast kernels */
+    static int raw2ev14[16384];
+    static unsigned short ev2raw16_0[24*EV_RESOLUTION + 1];
+    unsigned short* ev2raw16 = ev2raw16_0 + 10*EV_RESOLUTION;
+
+    for (i = 0; i < 16384; i++)
+        raw2ev14[i] = raw2ev[i << 2];
+
+    for (i = -10*EV_RESOLUTION; i <= 14*EV_RESOLUTION; i++)
+        ev2raw16[i] = ev2raw[i];
+
+    hdr.raw2ev = raw2ev;
+    hdr.ev2raw = ev2raw;
+    hdr.raw2ev14 = raw2ev14;
+    hdr.ev2raw16 = ev2raw16;
+}
+
+static int hdr_interpolate()
+{
+    int ret = 1;
+    
+    int black = raw_info.black_level;
+    int white = raw_info.white_level;
+
+    int w = raw_info.width;
+    int h = raw_info.height;
+
+    int x, y, i;
+
+    hdr.w = w;
+    hdr.h = h;
+
+    /* RGGB or GBRG? */
+    double rggb_err = 0;
+    double gbrg_err = 0;
+    int num_bands = count_bands(2, h-2);
+    double* band_acc = malloc(num_bands * 4 * sizeof(double));
+    CHECK(band_acc, "malloc");
+    run_bands(2, h-2, hdr_detect_rggb, band_acc);
+    for (i = 0; i < num_bands; i++)
+    {
+        rggb_err += band_acc[2*i];
+        gbrg_err += band_acc[2*i+1];
+    }
+    
+    /* which one looks more likely? */
+    int rggb = (rggb_err < gbrg_err);
+    
+    if (!rggb) /* this code assumes RGGB, so we need to skip one line */
+    {
+        raw_info.buffer += raw_info.pitch;
+        raw_info.active_area.y1++;
+        raw_info.active_area.y2--;
+        raw_info.jpeg.y++;
+        raw_info.jpeg.height -= 3;
+        raw_info.height--;
+        h--;
+        hdr.h = h;
+    }
+
+    hdr_ev_tables(black, white);
+    int* raw2ev = hdr.raw2ev;
+    int* ev2raw = hdr.ev2raw;
+    unsigned short* ev2raw16 = hdr.ev2raw16;
+    
+    /* check raw <--> ev conversion */
+    //~ printf("%d %d %d %d %d %d %d *%d* %d %d %d %d %d\n", raw2ev[0], raw2ev[1000], raw2ev[2000], raw2ev[8188], raw2ev[8189], raw2ev[8190], raw2ev[8191], raw2ev[8192], raw2ev[8193], raw2ev[8194], raw2ev[8195], raw2ev[8196], raw2ev[8200]);
+    //~ printf("%d %d %d %d %d %d %d *%d* %d %d %d %d %d\n", ev2raw[raw2ev[0]], ev2raw[raw2ev[1000]], ev2raw[raw2ev[2000]], ev2raw[raw2ev[8188]], ev2raw[raw2ev[8189]], ev2raw[raw2ev[8190]], ev2raw[raw2ev[8191]], ev2raw[raw2ev[8192]], ev2raw[raw2ev[8193]], ev2raw[raw2ev[8194]], ev2raw[raw2ev[8195]], ev2raw[raw2ev[8196]], ev2raw[raw2ev[8200]]);
+
+    /* first we need to know which lines are dark and which are bright */
+    /* the pattern is not always the same, so we need to autodetect it */
+
+    /* it may look like this */                       /* or like this */
+    /*
+               ab cd ef gh  ab cd ef gh               ab cd ef gh  ab cd ef gh
+                                       
+            0  RG RG RG RG  RG RG RG RG            0  rg rg rg rg  rg rg rg rg
+            1  gb gb gb gb  gb gb gb gb            1  gb gb gb gb  gb gb gb gb
+            2  rg rg rg rg  rg rg rg rg            2  RG RG RG RG  RG RG RG RG
+            3  GB GB GB GB  GB GB GB GB            3  GB GB GB GB  GB GB GB GB
+            4  RG RG RG RG  RG RG RG RG            4  rg rg rg rg  rg rg rg rg
+            5  gb gb gb gb  gb gb gb gb            5  gb gb gb gb  gb gb gb gb
+            6  rg rg rg rg  rg rg rg rg            6  RG RG RG RG  RG RG RG RG
+            7  GB GB GB GB  GB GB GB GB            7  GB GB GB GB  GB GB GB GB
+            8  RG RG RG RG  RG RG RG RG            8  rg rg rg rg  rg rg rg rg
+    */
+
+    double acc_bright[4] = {0, 0, 0, 0};
+    num_bands = count_bands(2, h-2);
+    run_bands(2, h-2, hdr_accumulate_brightness, band_acc);
+    for (i = 0; i < num_bands; i++)
+    {
+        acc_bright[0] += band_acc[4*i+0];
+        acc_bright[1] += band_acc[4*i+1];
+        acc_bright[2] += band_acc[4*i+2];
+        acc_bright[3] += band_acc[4*i+3];
+    }
+    free(band_acc);
+    double avg_bright = (acc_bright[0] + acc_bright[1] + acc_bright[2] + acc_bright[3]) / 4;
+    int* is_bright = hdr.is_bright;
+    is_bright[0] = acc_bright[0] > avg_bright;
+    is_bright[1] = acc_bright[1] > avg_bright;
+    is_bright[2] = acc_bright[2] > avg_bright;
+    is_bright[3] = acc_bright[3] > avg_bright;
+
+    printf("ISO pattern    : %c%c%c%c %s\n", is_bright[0] ? 'B' : 'd', is_bright[1] ? 'B' : 'd', is_bright[2] ? 'B' : 'd', is_bright[3] ? 'B' : 'd', rggb ? "RGGB" : "GBRG");
+    
+    if (is_bright[0] + is_bright[1] + is_bright[2] + is_bright[3] != 2)
+    {
+        printf("Bright/dark detection error\n");
+        return 0;
+    }
+
+    if (is_bright[0] == is_bright[2] || is_bright[1] == is_bright[3])
+    {
+        printf("Interlacing method not supported\n");
+        return 0;
+    }
+
+    hdr.black = black;
+    hdr.white = white;
+
+    double noise_std[4];
+    double noise_avg;
+    for (y = 0; y < 4; y++)
+        compute_black_noise(8, raw_info.active_area.x1 - 8, 20 + y, raw_info.active_area.y2 - 20, 1, 4, &noise_avg, &noise_std[y]);
+
+    printf("Noise levels   : %.02f %.02f %.02f %.02f (14-bit)\n", noise_std[0], noise_std[1], noise_std[2], noise_std[3]);
+    double dark_noise = MIN(MIN(noise_std[0], noise_std[1]), MIN(noise_std[2], noise_std[3]));
+    double bright_noise = MAX(MAX(noise_std[0], noise_std[1]), MAX(noise_std[2], noise_std[3]));
+    double dark_noise_ev = log2(dark_noise);
+    double bright_noise_ev = log2(bright_noise);
+
+    /* dark and bright exposures, interpolated */
+    unsigned short* dark   = malloc(w * h * sizeof(unsigned short));
+    CHECK(dark, "malloc");
+    unsigned short* bright = malloc(w * h * sizeof(unsigned short));
+    CHECK(bright, "malloc");
+    memset(dark, 0, w * h * sizeof(unsigned short));
+    memset(bright, 0, w * h * sizeof(unsigned short));
+    
+    /* fullres image (minimizes aliasing) */
+    unsigned short* fullres = malloc(w * h * sizeof(unsigned short));
+    CHECK(fullres, "malloc");
+    memset(fullres, 0, w * h * sizeof(unsigned short));
+    unsigned short* fullres_smooth = 0;
+
+    /* halfres image (minimizes noise and banding) */
+    unsigned short* halfres = malloc(w * h * sizeof(unsigned short));
+    CHECK(halfres, "malloc");
+    memset(halfres, 0, w * h * sizeof(unsigned short));
+    unsigned short* halfres_smooth = 0;
+
+    #ifdef ALIAS_BLEND
+    unsigned short* alias_map = malloc(w * h * sizeof(unsigned short));
+    CHECK(alias_map, "malloc");
+    unsigned short* overexposed = malloc(w * h * sizeof(unsigned short));
+    CHECK(overexposed, "malloc");
+    memset(alias_map, 0, w * h * sizeof(unsigned short));
+    memset(overexposed, 0, w * h * sizeof(unsigned short));
+    #endif
+
+    hdr.dark = dark;
+    hdr.bright = bright;
+    hdr.fullres = fullres;
+    hdr.halfres = halfres;
+    #ifdef ALIAS_BLEND
+    hdr.alias_map = alias_map;
+    hdr.overexposed = overexposed;
+    #endif
+
+    printf("Estimating ISO difference...\n");
+    /* use a simple interpolation in 14-bit space (the 16-bit one will trick the algorithm) */
+    run_bands(2, h-2, hdr_interpolate_14bit, 0);
+    /* estimate ISO difference between bright and dark exposures */
+    double corr_ev = 0;
+    
+    /* don't forget that estimate_iso only works on 14-bit data, but we are working on 16 */
+    raw_info.black_level /= 4;
+    raw_info.white_level /= 4;
+    int ok = estimate_iso(dark, bright, &corr_ev);
+    raw_info.black_level *= 4;
+    raw_info.white_level *= 4;
+    if (!ok) goto err;
+
+    /* propagate the adjustments for black image, performed by estimate_iso */
+    run_bands(2, h-2, hdr_propagate_dark, 0);
+
+    printf("Interpolation  : %s\n", INTERP_METHOD_NAME
+        #ifdef CHROMA_SMOOTH
+        "-chroma5x5"
+        #endif
+        #ifdef ALIAS_BLEND
+        "-alias"
+        #endif
+    );
+
+#if defined(INTERP_MEAN23) || defined(INTERP_MEAN23_EDGE)
+    run_bands(2, h-2, use_fast_kernels() ? hdr_interpolate_rows_fast : hdr_interpolate_rows, 0);
+#else
+    run_bands(2, h-2, hdr_interpolate_rows, 0);
+#endif
+
+#ifdef INTERP_MEAN23_EDGE /* second step, for detecting edges */
+    run_bands(2, h-2, hdr_interpolate_edges, 0);
+#endif
+
+    /* border interpolation */
+    for (y = 0; y < 3; y ++)
+    {
+        unsigned short* native = BRIGHT_ROW ? bright : dark;
+        unsigned short* interp = BRIGHT_ROW ? dark : bright;
+        
+        for (x = 0; x < w; x ++)
+        {
+            interp[x + y * w] = raw_get_pixel_14to16(x, y+2);
+            native[x + y * w] = raw_get_pixel_14to16(x, y);
+        }
+    }
+
+    for (y = h-2; y < h; y ++)
+    {
+        unsigned short* native = BRIGHT_ROW ? bright : dark;
+        unsigned short* interp = BRIGHT_ROW ? dark : bright;
+        
+        for (x = 0; x < w; x ++)
+        {
+            interp[x + y * w] = raw_get_pixel_14to16(x, y-2);
+            native[x + y * w] = raw_get_pixel_14to16(x, y);
+        }
+    }
+
+    for (y = 2; y < h; y ++)
+    {
+        unsigned short* native = BRIGHT_ROW ? bright : dark;
+        unsigned short* interp = BRIGHT_ROW ? dark : bright;
+        
+        for (x = 0; x < 2; x ++)
+        {
+            interp[x + y * w] = raw_get_pixel_14to16(x, y-2);
+            native[x + y * w] = raw_get_pixel_14to16(x, y);
+        }
+
+        for (x = w-3; x < w; x ++)
+        {
+            interp[x + y * w] = raw_get_pixel_14to16(x-2, y-2);
+            native[x + y * w] = raw_get_pixel_14to16(x-2, y);
+        }
+    }
+    
+    /* we have now switched to 16-bit, update noise numbers */
+    dark_noise *= 4;
+    bright_noise *= 4;
+    dark_noise_ev += 2;
+    bright_noise_ev += 2;
 
-        /* correct all hot pixels from the high-ISO image, which is usually clean */
-        for (y = 0; y < h; y ++)
+    double lowiso_dr = log2(white - black) - dark_noise_ev;
+    double highiso_dr = log2(white - black) - bright_noise_ev;
+    printf("Dynamic range  : %.02f (+) %.02f => %.02f EV (in theory)\n", lowiso_dr, highiso_dr, highiso_dr + corr_ev);
+    printf("Matching brightness...\n");
+    double corr = pow(2, corr_ev);
+    int white_darkened = (white - black) / corr + black;
+    hdr.corr = corr;
+    hdr.white_darkened = white_darkened;
+    run_bands(0, h, hdr_match_brightness, 0);
+    
+    /* update bright noise measurements, so they can be compared after scaling */
+    bright_noise /= corr;
+    bright_noise_ev -= corr_ev;
+    
+#if 1
+    {
+        printf("Looking for hot/cold pixels...\n");
+        int hot_pixels = 0;
+        int cold_pixels = 0;
+        unsigned short* hot = malloc(w * h * sizeof(unsigned short));
+        CHECK(hot, "malloc");
+        memset(hot, 0, w * h * sizeof(unsigned short));
+        hdr.hot = hot;
+        hdr.dark_noise = dark_noise;
+        num_bands = count_bands(6, h-6);
+        int* band_counts = malloc(num_bands * 2 * sizeof(int));
+        CHECK(band_counts, "malloc");
+        run_bands(6, h-6, hdr_detect_hot_pixels, band_counts);
+        for (i = 0; i < num_bands; i++)
         {
-            for (x = 0; x < w; x ++)
-            {
-                if (hot[x + y*w])
-                {
-                    dark[x + y*w] = bright[x + y*w];
-                }
-            }
+            hot_pixels += band_counts[2*i];
+            cold_pixels += band_counts[2*i+1];
         }
+        free(band_counts);
+
+        /* correct all hot pixels from the high-ISO image, which is usually clean */
+        run_bands(0, h, hdr_fix_hot_pixels, 0);
         free(hot);
 
         if (hot_pixels)
@@ -1640,22 +2779,7 @@ static int hdr_interpolate()
     /* this has full detail and lowest possible aliasing, but it has high shadow noise and color artifacts when high-iso starts clipping */
 
     printf("Full-res reconstruction...\n");
-    for (y = 0; y < h; y ++)
-    {
-        for (x = 0; x < w; x ++)
-        {
-            if (BRIGHT_ROW)
-            {
-                int f = bright[x + y*w];
-                /* if the brighter copy is overexposed, the guessed pixel for sure has higher brightness */
-                fullres[x + y*w] = f < white_darkened ? f : MAX(f, dark[x + y*w]);
-            }
-            else
-            {
-                fullres[x + y*w] = dark[x + y*w]; 
-            }
-        }
-    }
+    run_bands(0, h, hdr_fullres, 0);
  
     /* mix the two images */
     /* highlights:  keep data from dark image only */
@@ -1691,7 +2815,6 @@ static int hdr_interpolate()
 
     /* mixing curve */
     double max_ev = log2(white/4 - black/4);
-    static double mix_curve[65536];
     
     for (i = 0; i < 65536; i++)
     {
@@ -1721,28 +2844,7 @@ static int hdr_interpolate()
     system("octave --persist mix-curve.m");
 #endif
     
-    for (y = 0; y < h; y ++)
-    {
-        for (x = 0; x < w; x ++)
-        {
-            /* bright and dark source pixels  */
-            /* they may be real or interpolated */
-            /* they both have the same brightness (they were adjusted before this loop), so we are ready to mix them */ 
-            int b = bright[x + y*w];
-            int d = dark[x + y*w];
-
-            /* go from linear to EV space */
-            int bev = raw2ev[b];
-            int dev = raw2ev[d];
-
-            /* blending factor */
-            double k = COERCE(mix_curve[b & 65535], 0, 1);
-            
-            /* mix bright and dark exposures */
-            int mixed = bev * (1-k) + dev * k;
-            halfres[x + y*w] = ev2raw[mixed];
-        }
-    }
+    run_bands(0, h, hdr_halfres, 0);
 
 #ifdef CHROMA_SMOOTH
     printf("Chroma filtering...\n");
@@ -1753,52 +2855,47 @@ static int hdr_interpolate()
 
     memcpy(fullres_smooth, fullres, w * h * sizeof(unsigned short));
     memcpy(halfres_smooth, halfres, w * h * sizeof(unsigned short));
+    hdr.fullres_smooth = fullres_smooth;
+    hdr.halfres_smooth = halfres_smooth;
 #endif
 
 #ifdef CHROMA_SMOOTH
-    chroma_smooth_5x5(fullres, fullres_smooth, raw2ev, ev2raw);
-    chroma_smooth_5x5(halfres, halfres_smooth, raw2ev, ev2raw);
+    chroma_smooth_5x5(fullres, fullres_smooth, raw2ev, ev2raw, ev2raw16);
+    chroma_smooth_5x5(halfres, halfres_smooth, raw2ev, ev2raw, ev2raw16);
 #endif
 
 #if 0 /* for debugging only */
-    reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
     save_dng("normal.dng");
 
     for (y = 3; y < h-2; y ++)
         for (x = 2; x < w-2; x ++)
             raw_set_pixel16(x, y, bright[x + y*w]);
-    reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
     save_dng("bright.dng");
 
     for (y = 3; y < h-2; y ++)
         for (x = 2; x < w-2; x ++)
             raw_set_pixel16(x, y, dark[x + y*w]);
-    reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
     save_dng("dark.dng");
 
     for (y = 3; y < h-2; y ++)
         for (x = 2; x < w-2; x ++)
             raw_set_pixel16(x, y, fullres[x + y*w]);
-    reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
     save_dng("fullres.dng");
 
     for (y = 3; y < h-2; y ++)
         for (x = 2; x < w-2; x ++)
             raw_set_pixel16(x, y, halfres[x + y*w]);
-    reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
     save_dng("halfres.dng");
 
 #ifdef CHROMA_SMOOTH
     for (y = 3; y < h-2; y ++)
         for (x = 2; x < w-2; x ++)
             raw_set_pixel16(x, y, fullres_smooth[x + y*w]);
-    reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
     save_dng("fullres_smooth.dng");
 
     for (y = 3; y < h-2; y ++)
         for (x = 2; x < w-2; x ++)
             raw_set_pixel16(x, y, halfres_smooth[x + y*w]);
-    reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
     save_dng("halfres_smooth.dng");
 #endif
 
@@ -1819,7 +2916,6 @@ static int hdr_interpolate()
             yd++;
         }
     }
-    reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
     save_dng("split.dng");
 #endif
 
@@ -1828,30 +2924,17 @@ static int hdr_interpolate()
 
     unsigned short* alias_aux = malloc(w * h * sizeof(unsigned short));
     CHECK(alias_aux, "malloc");
+    hdr.alias_aux = alias_aux;
     
     /* build the aliasing maps (where it's likely to get aliasing) */
     /* do this by comparing fullres and halfres images */
     /* if the difference is small, we'll prefer halfres for less noise, otherwise fullres for less aliasing */
-    for (y = 0; y < h; y ++)
-    {
-        for (x = 0; x < w; x ++)
-        {
-            int f = fullres_smooth[x + y*w];
-            int h = halfres_smooth[x + y*w];
-            int fe = raw2ev[f];
-            int he = raw2ev[h];
-            int e_lin = ABS(f - h); /* error in linear space, for shadows (downweights noise) */
-            e_lin = MAX(e_lin - dark_noise, 0);
-            int e_log = ABS(fe - he); /* error in EV space, for highlights (highly sensitive to noise) */
-            alias_map[x + y*w] = MIN(e_lin*16, e_log/8);
-        }
-    }
+    run_bands(0, h, hdr_build_alias_map, 0);
 
 #if 0
     for (y = 3; y < h-2; y ++)
         for (x = 2; x < w-2; x ++)
             raw_set_pixel16(x, y, ev2raw[COERCE(alias_map[x + y*w] * 1024, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1)]);
-    reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
     save_dng("alias.dng");
 #endif
 
@@ -1859,158 +2942,52 @@ static int hdr_interpolate()
     
     /* trial and error - too high = aliasing, too low = noisy */
     int ALIAS_MAP_MAX = 15000;
+    hdr.alias_map_max = ALIAS_MAP_MAX;
 
     printf("Dilating alias map...\n");
-    for (y = 6; y < h-6; y ++)
-    {
-        for (x = 6; x < w-6; x ++)
-        {
-            /* optimizing... the brute force way */
-            int c0 = alias_map[x+0 + (y+0) * w];
-            int c1 = MAX(MAX(alias_map[x+0 + (y-2) * w], alias_map[x-2 + (y+0) * w]), MAX(alias_map[x+2 + (y+0) * w], alias_map[x+0 + (y+2) * w]));
-            int c2 = MAX(MAX(alias_map[x-2 + (y-2) * w], alias_map[x+2 + (y-2) * w]), MAX(alias_map[x-2 + (y+2) * w], alias_map[x+2 + (y+2) * w]));
-            int c3 = MAX(MAX(alias_map[x+0 + (y-4) * w], alias_map[x-4 + (y+0) * w]), MAX(alias_map[x+4 + (y+0) * w], alias_map[x+0 + (y+4) * w]));
-            //~ int c4 = MAX(MAX(alias_map[x-2 + (y-4) * w], alias_map[x+2 + (y-4) * w]), MAX(alias_map[x-4 + (y-2) * w], alias_map[x+4 + (y-2) * w]));
-            //~ int c5 = MAX(MAX(alias_map[x-4 + (y+2) * w], alias_map[x+4 + (y+2) * w]), MAX(alias_map[x-2 + (y+4) * w], alias_map[x+2 + (y+4) * w]));
-            //~ int c = MAX(MAX(MAX(c0, c1), MAX(c2, c3)), MAX(c4, c5));
-            int c = MAX(MAX(c0, c1), MAX(c2, c3));
-            
-            alias_aux[x + y * w] = c;
-        }
-    }
+    run_bands(6, h-6, hdr_dilate_alias_map, 0);
 
 #if 0
     for (y = 3; y < h-2; y ++)
         for (x = 2; x < w-2; x ++)
             raw_set_pixel16(x, y, ev2raw[COERCE(alias_aux[x + y*w] * 1024, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1)]);
-    reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
     save_dng("alias-dilated.dng");
 #endif
 
     printf("Smoothing alias map...\n");
     /* gaussian blur */
-    for (y = 6; y < h-6; y ++)
-    {
-        for (x = 6; x < w-6; x ++)
-        {
-
-/* code generation
-            const int blur[4][4] = {
-                {1024,  820,  421,  139},
-                { 820,  657,  337,  111},
-                { 421,  337,  173,   57},
-                { 139,  111,   57,    0},
-            };
-            const int blur_unique[] = {1024, 820, 657, 421, 337, 173, 139, 111, 57};
-
-            int k;
-            for (k = 0; k < COUNT(blur_unique); k++)
-            {
-                int dx, dy;
-                int c = 0;
-                printf("(");
-                for (dy = -3; dy <= 3; dy++)
-                {
-                    for (dx = -3; dx <= 3; dx++)
-                    {
-                        c += alias_aux[x + dx + (y + dy) * w] * blur[ABS(dx)][ABS(dy)] / 1024;
-                        if (blur[ABS(dx)][ABS(dy)] == blur_unique[k])
-                            printf("alias_aux[x%+d + (y%+d) * w] + ", dx, dy);
-                    }
-                }
-                printf("\b\b\b) * %d / 1024 + \n", blur_unique[k]);
-            }
-            exit(1);
-*/
-            /* optimizing... the brute force way */
-            int c = 
-                (alias_aux[x+0 + (y+0) * w])+ 
-                (alias_aux[x+0 + (y-2) * w] + alias_aux[x-2 + (y+0) * w] + alias_aux[x+2 + (y+0) * w] + alias_aux[x+0 + (y+2) * w]) * 820 / 1024 + 
-                (alias_aux[x-2 + (y-2) * w] + alias_aux[x+2 + (y-2) * w] + alias_aux[x-2 + (y+2) * w] + alias_aux[x+2 + (y+2) * w]) * 657 / 1024 + 
-                (alias_aux[x+0 + (y-2) * w] + alias_aux[x-2 + (y+0) * w] + alias_aux[x+2 + (y+0) * w] + alias_aux[x+0 + (y+2) * w]) * 421 / 1024 + 
-                (alias_aux[x-2 + (y-2) * w] + alias_aux[x+2 + (y-2) * w] + alias_aux[x-2 + (y-2) * w] + alias_aux[x+2 + (y-2) * w] + alias_aux[x-2 + (y+2) * w] + alias_aux[x+2 + (y+2) * w] + alias_aux[x-2 + (y+2) * w] + alias_aux[x+2 + (y+2) * w]) * 337 / 1024 + 
-                //~ (alias_aux[x-2 + (y-2) * w] + alias_aux[x+2 + (y-2) * w] + alias_aux[x-2 + (y+2) * w] + alias_aux[x+2 + (y+2) * w]) * 173 / 1024 + 
-                //~ (alias_aux[x+0 + (y-6) * w] + alias_aux[x-6 + (y+0) * w] + alias_aux[x+6 + (y+0) * w] + alias_aux[x+0 + (y+6) * w]) * 139 / 1024 + 
-                //~ (alias_aux[x-2 + (y-6) * w] + alias_aux[x+2 + (y-6) * w] + alias_aux[x-6 + (y-2) * w] + alias_aux[x+6 + (y-2) * w] + alias_aux[x-6 + (y+2) * w] + alias_aux[x+6 + (y+2) * w] + alias_aux[x-2 + (y+6) * w] + alias_aux[x+2 + (y+6) * w]) * 111 / 1024 + 
-                //~ (alias_aux[x-2 + (y-6) * w] + alias_aux[x+2 + (y-6) * w] + alias_aux[x-6 + (y-2) * w] + alias_aux[x+6 + (y-2) * w] + alias_aux[x-6 + (y+2) * w] + alias_aux[x+6 + (y+2) * w] + alias_aux[x-2 + (y+6) * w] + alias_aux[x+2 + (y+6) * w]) * 57 / 1024;
-                0;
-            alias_map[x + y * w] = c;
-        }
-    }
+    run_bands(6, h-6, hdr_smooth_alias_map, 0);
 
 #if 0
     for (y = 3; y < h-2; y ++)
         for (x = 2; x < w-2; x ++)
             raw_set_pixel16(x, y, ev2raw[COERCE(alias_map[x + y*w] * 128, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1)]);
-    reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
     save_dng("alias-smooth.dng");
 #endif
 
     /* make it grayscale */
-    for (y = 2; y < h-2; y += 2)
-    {
-        for (x = 2; x < w-2; x += 2)
-        {
-            int a = alias_map[x   +     y * w];
-            int b = alias_map[x+1 +     y * w];
-            int c = alias_map[x   + (y+1) * w];
-            int d = alias_map[x+1 + (y+1) * w];
-            int C = MAX(MAX(a,b), MAX(c,d));
-            
-            C = MIN(C, ALIAS_MAP_MAX);
-
-            alias_map[x   +     y * w] = 
-            alias_map[x+1 +     y * w] = 
-            alias_map[x   + (y+1) * w] = 
-            alias_map[x+1 + (y+1) * w] = C;
-        }
-    }
+    run_bands(2, h-2, hdr_alias_map_grayscale, 0);
 
 #if 0
     for (y = 3; y < h-2; y ++)
         for (x = 2; x < w-2; x ++)
             raw_set_pixel16(x, y, ev2raw[(long long)alias_map[x + y*w] * 13*EV_RESOLUTION / ALIAS_MAP_MAX]);
-    reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
     save_dng("alias-filtered.dng");
 #endif
 
     /* where the image is overexposed? */
-    for (y = 0; y < h; y ++)
-    {
-        for (x = 0; x < w; x ++)
-        {
-            overexposed[x + y * w] = bright[x + y * w] >= white_darkened || dark[x + y * w] >= white ? 100 : 0;
-        }
-    }
+    run_bands(0, h, hdr_overexposed_map, 0);
     
     /* "blur" the overexposed map */
     memcpy(alias_aux, overexposed, w * h * sizeof(unsigned short));
 
-    for (y = 3; y < h-3; y ++)
-    {
-        for (x = 3; x < w-3; x ++)
-        {
-            overexposed[x + y * w] = 
-                (alias_aux[x+0 + (y+0) * w])+ 
-                (alias_aux[x+0 + (y-1) * w] + alias_aux[x-1 + (y+0) * w] + alias_aux[x+1 + (y+0) * w] + alias_aux[x+0 + (y+1) * w]) * 820 / 1024 + 
-                (alias_aux[x-1 + (y-1) * w] + alias_aux[x+1 + (y-1) * w] + alias_aux[x-1 + (y+1) * w] + alias_aux[x+1 + (y+1) * w]) * 657 / 1024 + 
-                //~ (alias_aux[x+0 + (y-2) * w] + alias_aux[x-2 + (y+0) * w] + alias_aux[x+2 + (y+0) * w] + alias_aux[x+0 + (y+2) * w]) * 421 / 1024 + 
-                //~ (alias_aux[x-1 + (y-2) * w] + alias_aux[x+1 + (y-2) * w] + alias_aux[x-2 + (y-1) * w] + alias_aux[x+2 + (y-1) * w] + alias_aux[x-2 + (y+1) * w] + alias_aux[x+2 + (y+1) * w] + alias_aux[x-1 + (y+2) * w] + alias_aux[x+1 + (y+2) * w]) * 337 / 1024 + 
-                //~ (alias_aux[x-2 + (y-2) * w] + alias_aux[x+2 + (y-2) * w] + alias_aux[x-2 + (y+2) * w] + alias_aux[x+2 + (y+2) * w]) * 173 / 1024 + 
-                //~ (alias_aux[x+0 + (y-3) * w] + alias_aux[x-3 + (y+0) * w] + alias_aux[x+3 + (y+0) * w] + alias_aux[x+0 + (y+3) * w]) * 139 / 1024 + 
-                //~ (alias_aux[x-1 + (y-3) * w] + alias_aux[x+1 + (y-3) * w] + alias_aux[x-3 + (y-1) * w] + alias_aux[x+3 + (y-1) * w] + alias_aux[x-3 + (y+1) * w] + alias_aux[x+3 + (y+1) * w] + alias_aux[x-1 + (y+3) * w] + alias_aux[x+1 + (y+3) * w]) * 111 / 1024 + 
-                //~ (alias_aux[x-2 + (y-3) * w] + alias_aux[x+2 + (y-3) * w] + alias_aux[x-3 + (y-2) * w] + alias_aux[x+3 + (y-2) * w] + alias_aux[x-3 + (y+2) * w] + alias_aux[x+3 + (y+2) * w] + alias_aux[x-2 + (y+3) * w] + alias_aux[x+2 + (y+3) * w]) * 57 / 1024;
-                0;
-        }
-    }
+    run_bands(3, h-3, hdr_blur_overexposed_map, 0);
 
     free(alias_aux);
 #endif
 
 
     /* fullres mixing curve */
-    static double fullres_curve[65536];
-    
     static double fullres_start = 5;
     static double fullres_transition = 2;
     
@@ -2047,71 +3024,7 @@ static int hdr_interpolate()
     system("octave --persist mix-curve.m");
 #endif
     
-    for (y = 0; y < h; y ++)
-    {
-        for (x = 0; x < w; x ++)
-        {
-            /* high-iso image (for measuring signal level) */
-            int b = bright[x + y*w];
-
-            /* half-res image (interpolated and chroma filtered, best for low-contrast shadows) */
-            int hr = halfres_smooth[x + y*w];
-            
-            /* full-res image (non-interpolated, except where one ISO is blown out) */
-            int fr = fullres[x + y*w];
-
-            #ifdef CHROMA_SMOOTH
-            /* full res with some smoothing applied to hide aliasing artifacts */
-            int frs = fullres_smooth[x + y*w];
-            #else
-            int frs = fr;
-            #endif
-
-            /* go from linear to EV space */
-            int hrev = raw2ev[hr];
-            int frev = raw2ev[fr];
-            int frsev = raw2ev[frs];
-
-#ifdef FULLRES_ONLY 
-            int output = frev;
-#else
-            /* blending factor */
-            int f = fullres_curve[b & 65535];
-            
-            #ifdef ALIAS_BLEND
-            int co = alias_map[x + y*w];
-            double c = COERCE(co / (double) ALIAS_MAP_MAX, 0, 1);
-            double ovf = COERCE(overexposed[x + y*w] / 200.0, 0, 1);
-            c = MAX(c, ovf);
-            //~ k = MIN(MAX(k, ovf*5), 1);
-            #else
-            double c = 1;
-            #endif
-
-            double noisy_or_overexposed = MAX(ovf, 1-f);
-
-            /* use data from both ISOs in high-detail areas, even if it's noisier (less aliasing) */
-            f = MAX(f, c);
-            
-            /* use smoothing in noisy near-overexposed areas to hide color artifacts */
-            double fev = noisy_or_overexposed * frsev + (1-noisy_or_overexposed) * frev;
-            
-            /* blend "half-res" and "full-res" images smoothly to avoid banding*/
-            int output = hrev * (1-f) + fev * f;
-
-            /* show full-res map (for debugging) */
-            //~ output = f * 14*EV_RESOLUTION;
-            
-            /* show alias map (for debugging) */
-            //~ output = c * 14*EV_RESOLUTION;
-#endif
-            /* safeguard */
-            output = COERCE(output, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1);
-            
-            /* back to linear space and commit */
-            raw_set_pixel16(x, y, ev2raw[output]);
-        }
-    }
+    run_bands(0, h, hdr_final_blend, 0);
 
     /* let's see how much dynamic range we actually got */
     compute_black_noise(8, raw_info.active_area.x1 - 8, 20, raw_info.active_area.y2 - 20, 1, 1, &noise_avg, &noise_std[0]);
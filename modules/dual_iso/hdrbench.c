@@ -0,0 +1,254 @@
+/**
+ * Test bench for the cr2hdr interpolation (mean23) and chroma smoothing kernels
+ *
+ * Runs the reference and the fast versions on synthetic dual ISO frames (all 4 line patterns, even and odd widths),
+ * checks that they give the same output, bit for bit, then reports the timings.
+ * Usage: hdrbench [-jN] [width height]
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/* the kernels are static, so we include the whole program */
+#define main cr2hdr_main
+#include "cr2hdr.c"
+#undef main
+
+#include <sys/time.h>
+
+#if !defined(INTERP_MEAN23) || !defined(CHROMA_SMOOTH)
+#error "hdrbench only knows about mean23 and chroma smoothing"
+#endif
+
+#define BLACK 2048
+#define WHITE 15000
+
+static double get_time()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/* small LCG, so the frames are the same on every platform */
+static unsigned int seed = 1;
+static int rnd(int n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+/* linear scene (0...4095 above black on the dark lines): gradients, hard edges, some texture */
+static int scene(int x, int y, int w, int h)
+{
+    int v = x * 3000 / w + y * 1000 / h;
+    if ((x / 37 + y / 23) % 3 == 0)
+        v = v / 8;                              /* dark patches */
+    if ((x * 7 + y * 3) % 101 < 5)
+        v += 2500;                              /* thin bright lines */
+    return v;
+}
+
+/**
+ * 14-bit dual ISO frame, in 16-bit words (like raw_info.buffer in cr2hdr): bright lines are 3 EV brighter;
+ * we also want clipped pixels, pixels below black and a few "bad" (zero) pixels, since these take special paths
+ */
+static void make_frame(unsigned short * raw, int w, int h, int* is_bright)
+{
+    int x, y;
+    for (y = 0; y < h; y++)
+    {
+        for (x = 0; x < w; x++)
+        {
+            int v = scene(x, y, w, h);
+            if (is_bright[y % 4])
+                v *= 8;
+            v += BLACK + rnd(41) - 20;
+            if (rnd(1000) == 0)
+                v = rnd(2) ? 0 : 16383;
+            raw[x + y * w] = COERCE(v, 0, 16383);
+        }
+    }
+}
+
+/* 16-bit image for chroma smoothing, covering the entire range of raw2ev (and the clamps of ev2raw) */
+static void make_image16(unsigned short * img, int w, int h)
+{
+    int x, y;
+    for (y = 0; y < h; y++)
+    {
+        for (x = 0; x < w; x++)
+        {
+            int v = scene(x, y, w, h) * 16 + BLACK * 4 + rnd(401) - 200;
+            if (rnd(200) == 0)
+                v = rnd(65536);
+            img[x + y * w] = COERCE(v, 0, 65535);
+        }
+    }
+}
+
+static void compare(unsigned short * ref, unsigned short * fast, int w, int h, char* what)
+{
+    int i;
+    for (i = 0; i < w * h; i++)
+    {
+        CHECK(ref[i] == fast[i], "%s mismatch at (%d,%d): %d (reference) vs %d (fast), %dx%d",
+            what, i % w, i / w, ref[i], fast[i], w, h);
+    }
+}
+
+/* returns the time taken by the reference and the fast kernel, in t[0] and t[1] */
+static void test_interpolation(unsigned short * raw, int w, int h, int* is_bright, double* t)
+{
+    unsigned short * out[4];
+    int k;
+    for (k = 0; k < 4; k++)
+    {
+        out[k] = calloc(w * h, sizeof(unsigned short));
+        CHECK(out[k], "malloc");
+    }
+
+    raw_info.buffer = raw;
+    raw_info.width = w;
+    raw_info.height = h;
+    hdr.w = w;
+    hdr.h = h;
+    hdr.black = BLACK;
+    hdr.white = WHITE;
+    memcpy(hdr.is_bright, is_bright, sizeof(hdr.is_bright));
+
+    for (k = 0; k < 2; k++)
+    {
+        hdr.dark = out[2*k];
+        hdr.bright = out[2*k+1];
+        double t0 = get_time();
+        run_bands(2, h-2, k ? hdr_interpolate_rows_fast : hdr_interpolate_rows, 0);
+        t[k] = get_time() - t0;
+    }
+
+    compare(out[0], out[2], w, h, "mean23 (dark)");
+    compare(out[1], out[3], w, h, "mean23 (bright)");
+
+    for (k = 0; k < 4; k++)
+        free(out[k]);
+}
+
+static void test_chroma_smooth(unsigned short * img, int w, int h, double* t)
+{
+    unsigned short * out[2];
+    int k;
+
+    raw_info.width = w;
+    raw_info.height = h;
+
+    for (k = 0; k < 2; k++)
+    {
+        out[k] = malloc(w * h * sizeof(unsigned short));
+        CHECK(out[k], "malloc");
+        memcpy(out[k], img, w * h * sizeof(unsigned short));
+
+        /* same as chroma_smooth_5x5, with the kernel selected here */
+        struct chroma_smooth_args a = { img, out[k], hdr.raw2ev, hdr.ev2raw, hdr.ev2raw16 };
+        double t0 = get_time();
+        run_bands(4, h-5, k ? chroma_smooth_5x5_band_fast : chroma_smooth_5x5_band, &a);
+        t[k] = get_time() - t0;
+    }
+
+    compare(out[0], out[1], w, h, "chroma smoothing");
+
+    for (k = 0; k < 2; k++)
+        free(out[k]);
+}
+
+int main(int argc, char** argv)
+{
+    /* the first size can be given on the command line (for timing); the others are small, for checking the edge cases */
+    int sizes[][2] = {
+        { 1992, 1328 },
+        { 1001, 251 },      /* odd width (interpolation only, like in cr2hdr) */
+        { 1002, 250 },
+        { 32, 16 },
+    };
+
+    int k, p;
+    int n = 0;
+    for (k = 1; k < argc; k++)
+    {
+        if (startswith(argv[k], "-j"))
+            num_threads = atoi(argv[k] + 2);
+        else if (n < 2)
+            sizes[0][n++] = atoi(argv[k]);
+    }
+    CHECK(n == 0 || n == 2, "usage: hdrbench [-jN] [width height]");
+    CHECK(sizes[0][0] >= 16 && sizes[0][1] >= 16, "image too small");
+
+    if (!use_fast_kernels())
+    {
+        printf("The fast kernels are not used on this CPU, nothing to check.\n");
+        return 0;
+    }
+
+    band_pool_init();
+    hdr_ev_tables(BLACK, WHITE);
+
+    /* all line patterns accepted by hdr_interpolate */
+    int patterns[][4] = {
+        { 0, 0, 1, 1 },
+        { 1, 1, 0, 0 },
+        { 0, 1, 1, 0 },
+        { 1, 0, 0, 1 },
+    };
+
+    printf("\n%-12s %-10s %12s %12s %8s\n", "Size", "Kernel", "Reference", "Fast", "Speedup");
+
+    for (k = 0; k < COUNT(sizes); k++)
+    {
+        int w = sizes[k][0];
+        int h = sizes[k][1];
+        unsigned short * raw = malloc(w * h * sizeof(unsigned short));
+        CHECK(raw, "malloc");
+
+        double ti[2] = {0, 0};
+        for (p = 0; p < COUNT(patterns); p++)
+        {
+            double t[2];
+            make_frame(raw, w, h, patterns[p]);
+            test_interpolation(raw, w, h, patterns[p], t);
+            ti[0] += t[0];
+            ti[1] += t[1];
+        }
+
+        char size[32];
+        snprintf(size, sizeof(size), "%dx%d", w, h);
+        printf("%-12s %-10s %10.1fms %10.1fms %7.2fx\n", size, "mean23", ti[0] * 1000, ti[1] * 1000, ti[0] / ti[1]);
+
+        if (w % 2 == 0)
+        {
+            double tc[2];
+            make_image16(raw, w, h);
+            test_chroma_smooth(raw, w, h, tc);
+            printf("%-12s %-10s %10.1fms %10.1fms %7.2fx\n", size, "chroma5x5", tc[0] * 1000, tc[1] * 1000, tc[0] / tc[1]);
+        }
+
+        free(raw);
+    }
+
+    printf("\nAll kernels match.\n");
+    return 0;
+}
@@ -33,9 +33,59 @@ typedef struct
     unsigned int frameCount;
     unsigned int frameSkip;
     unsigned int sourceFpsx1000;
-    unsigned int reserved3;
+    unsigned int packing;               /* raw_rec 12/10-bit clips (raw_info.bits_per_pixel < 14): RAW_CURVE_* from raw_pack.h */
     unsigned int reserved4;
     struct raw_info raw_info;
 } lv_rec_file_footer_t;
 
+/**
+ * Optional indexed container (raw_rec, "File format: Indexed")
+ *
+ * The clip (all chunks together: RAW, R00, R01...) is a sequence of blocks, each one starting with raw_block_header_t:
+ * - RAWH: clip header, always at offset 0; the payload is the usual footer (frameCount = 0, unknown at that time);
+ * - RAWF: one video frame; all of them have the same size (RAW_FRAME_BLOCK_SIZE);
+ * - RAWX: index (frame numbers and timestamps), after every RAW_INDEX_INTERVAL frames, and at the end of the clip.
+ * There is no footer: a clip cut short (card full, battery pulled out) is still usable up to the last complete frame.
+ * Frame positions can be computed (RAW_FRAME_BLOCK_OFFSET), so readers don't have to scan the file;
+ * the block headers are only used for checking (and for frame numbers, if there is no index yet).
+ *
+ * Dual card recording (5D3) saves a striped clip: one file on each card, with the same name, each of them
+ * a complete clip as described above, holding some groups of frames. The clip header tells which part it is;
+ * frame_index counts the frames in each file, and frame_number is unique in the clip, so the parts can be merged.
+ */
+
+#define RAW_BLOCK_ALIGN         512         /* all block sizes are multiple of this */
+#define RAW_CLIP_HEADER_SIZE    512
+#define RAW_FRAME_HEADER_SIZE   4096        /* frame data stays aligned for EDMAC */
+#define RAW_INDEX_INTERVAL      256
+#define RAW_INDEX_BLOCK_SIZE    ((sizeof(raw_block_header_t) + RAW_INDEX_INTERVAL * sizeof(raw_index_entry_t) + RAW_BLOCK_ALIGN - 1) & ~(RAW_BLOCK_ALIGN - 1))
+
+#define RAW_FRAME_BLOCK_SIZE(frame_size) (RAW_FRAME_HEADER_SIZE + (frame_size))
+
+/* offset of the k-th frame block, from the start of the clip */
+#define RAW_FRAME_BLOCK_OFFSET(k, frame_size) \
+    (RAW_CLIP_HEADER_SIZE + (int64_t)(k) * RAW_FRAME_BLOCK_SIZE(frame_size) + (int64_t)((k) / RAW_INDEX_INTERVAL) * RAW_INDEX_BLOCK_SIZE)
+
+#define RAW_INDEX_LAST 1                    /* flag for the index written at the end of the clip */
+#define RAW_MAX_STRIPES 2                   /* one part on each card */
+
+typedef struct
+{
+    unsigned char magic[4];             /* RAWH, RAWF or RAWX */
+    unsigned int block_size;            /* whole block, including this header */
+    unsigned int data_offset;           /* payload position, from the start of the block */
+    unsigned int data_size;             /* payload size */
+    unsigned int frame_index;           /* RAWF: position in the file (0, 1, 2...); RAWX: first frame described; RAWH: part of a striped clip (0...) */
+    unsigned int frame_number;          /* RAWF: capture frame number (gaps = skipped frames); RAWX: number of entries; RAWH: parts (0 = not striped) */
+    unsigned int timestamp;             /* RAWF: milliseconds since capture started; RAWH: clip id (same in all parts) */
+    unsigned int flags;                 /* RAWX: RAW_INDEX_LAST */
+} raw_block_header_t;
+
+/* RAWX payload: one entry for each frame, starting from frame_index */
+typedef struct
+{
+    unsigned int frame_number;
+    unsigned int timestamp;
+} raw_index_entry_t;
+
 #endif
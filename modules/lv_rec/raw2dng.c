@@ -22,49 +22,146 @@
 #include "stdlib.h"
 #include "string.h"
 #include "math.h"
+#include <unistd.h>
+#include <pthread.h>
 #include "lv_rec.h"
+#include "raw_reader.h"
 #include <raw.h>
+#include <raw_pack.h>
 #include <chdk-dng.h>
 #include "qsort.h"  /* much faster than standard C qsort */
 
 lv_rec_file_footer_t lv_rec_footer;
 struct raw_info raw_info;
+static struct raw_reader rr;
 
 #define FAIL(fmt,...) { fprintf(stderr, "Error: "); fprintf(stderr, fmt, ## __VA_ARGS__); fprintf(stderr, "\n"); exit(1); }
-#define CHECK(ok, fmt,...) { if (!ok) FAIL(fmt, ## __VA_ARGS__); }
+#define CHECK(ok, fmt,...) { if (!(ok)) FAIL(fmt, ## __VA_ARGS__); }
 
+static void stripes_init(char* raw_filename, int num_frames, int num_threads);
 static void fix_vertical_stripes();
 static void hdr_process();
+static void unpack_frame(char* buf);
+static char* decode_frame(char* buf);
+static void* pack_row(int y, void* unused);
+static int fix_frame(char* buf);
+static void process_frame(char* buf, int frame_index);
+static int need_serial_processing();
+static void process_frames_threaded(int start, int num_threads, int readahead);
+static void prefetch_frames(int k, int count);
+
+/* frames to convert: frame_start, frame_start + frame_step ... up to frame_end (inclusive) */
+static int frame_start = 0;
+static int frame_end = -1;
+static int frame_step = 1;
+
+/* 12/10-bit clips (raw_rec): N-bit code => 14-bit value */
+static int packed_bits = 0;
+static uint16_t decode_table[4096];
+
+static int startswith(char* str, char* prefix)
+{
+    char* s = str;
+    char* p = prefix;
+    for (; *p; s++,p++)
+        if (*s != *p) return 0;
+    return 1;
+}
+
+static int get_num_cpus()
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+#else
+    char* n = getenv("NUMBER_OF_PROCESSORS");
+    return n && atoi(n) > 0 ? atoi(n) : 1;
+#endif
+}
+
+static char* prefix = "";
 
 int main(int argc, char** argv)
 {
-    if (argc < 2)
+    int num_threads = 1;
+    int readahead = 0;
+    int compress = 0;
+    int stripes_frames = 0;
+    char* filename = 0;
+    char* merge_filename = 0;
+    
+    int k;
+    for (k = 1; k < argc; k++)
+    {
+        if (startswith(argv[k], "-j"))
+            num_threads = atoi(argv[k] + 2);
+        else if (startswith(argv[k], "-q"))
+            readahead = atoi(argv[k] + 2);
+        else if (!strcmp(argv[k], "-c"))
+            compress = 1;
+        else if (startswith(argv[k], "--start="))
+            frame_start = atoi(argv[k] + 8);
+        else if (startswith(argv[k], "--end="))
+            frame_end = atoi(argv[k] + 6);
+        else if (startswith(argv[k], "--step="))
+            frame_step = atoi(argv[k] + 7);
+        else if (startswith(argv[k], "--merge="))
+            merge_filename = argv[k] + 8;
+        else if (startswith(argv[k], "-s"))
+            stripes_frames = atoi(argv[k] + 2);
+        else if (!filename)
+            filename = argv[k];
+        else
+            prefix = argv[k];
+    }
+
+    if (!filename)
     {
         printf(
             "\n"
             "usage:\n"
             "\n"
-            "%s file.raw [prefix]\n"
+            "%s [-jN] [-qN] [-sN] [-c] [--start=N] [--end=N] [--step=N] [--merge=file2.raw] file.raw [prefix]\n"
             "\n"
             " => will create prefix000000.dng, prefix0000001.dng and so on.\n"
+            "\n"
+            " -jN: process N frames at the same time (default 1; -j0 = one thread per CPU)\n"
+            " -qN: read ahead N frames (default 2 per thread)\n"
+            " -sN: compute vertical stripes correction from N frames and save it in file.raw.stripes\n"
+            "      (default: load it from there, or compute it from 8 frames if it's not there yet,\n"
+            "      or if it's for another clip; -sN always computes it again, e.g. after replacing the clip)\n"
+            " -c : lossless JPEG compression (smaller DNGs, a little slower)\n"
+            " --start=N, --end=N: convert only frames N...M (inclusive; frame numbers start at 0)\n"
+            " --step=N: convert only every N-th frame (e.g. for proxies)\n"
+            "           DNG files keep the frame number from the clip.\n"
+            " --merge=file2.raw: dual card clips: the part saved on the other card\n"
+            "                    (same file name, e.g. from A:/DCIM/100CANON and B:/DCIM/100CANON)\n"
             "\n",
             argv[0]
         );
         return 1;
     }
     
-    FILE* fi = fopen(argv[1], "rb");
-    CHECK(fi, "could not open %s", argv[1]);
+    if (num_threads <= 0)
+        num_threads = get_num_cpus();
+    if (readahead <= 0)
+        readahead = 2 * num_threads;
+    
+    /* with -j1, the compressor can use all the CPUs; otherwise, the DNGs are already saved in parallel */
+    if (compress)
+        set_dng_compression(7, num_threads > 1 ? 1 : 0);
+    
     if (sizeof(lv_rec_file_footer_t) != 192) FAIL("sizeof(lv_rec_file_footer_t) = %d, should be 192", sizeof(lv_rec_file_footer_t));
     
-    fseeko(fi, -192, SEEK_END);
-    int r = fread(&lv_rec_footer, 1, sizeof(lv_rec_file_footer_t), fi);
-    CHECK(r == sizeof(lv_rec_file_footer_t), "footer");
+    /* opens all the chunks (RAW, R00, R01...) and reads the footer from the last one (or the clip header from the first one) */
+    if (!raw_reader_open(&rr, filename))
+        FAIL("could not read %s", filename);
+    
+    /* dual card clips: frames from both files, in capture order */
+    if (merge_filename && !raw_reader_merge(&rr, merge_filename))
+        FAIL("could not merge %s", merge_filename);
+    lv_rec_footer = rr.footer;
     raw_info = lv_rec_footer.raw_info;
-    fseek(fi, 0, SEEK_SET);
-
-    if (strncmp((char*)lv_rec_footer.magic, "RAWM", 4))
-        FAIL("This ain't a lv_rec RAW file\n");
     
     if (raw_info.api_version != 1)
         FAIL("API version mismatch: %d\n", raw_info.api_version);
@@ -77,14 +174,21 @@ int main(int argc, char** argv)
     
     printf("Resolution  : %d x %d\n", lv_rec_footer.xRes, lv_rec_footer.yRes);
     printf("Frames      : %d\n", lv_rec_footer.frameCount);
+    if (rr.num_chunks > 1)
+        printf("Chunks      : %d\n", rr.num_chunks);
+    if (rr.indexed)
+        printf("Container   : indexed%s\n", rr.complete ? "" : " (recovered)");
+    if (rr.num_parts)
+        printf("Dual card   : %d parts, merged\n", rr.num_parts);
+    else if (rr.stripes)
+        printf("Dual card   : part %d of %d, only the frames from this card (use --merge=file)\n", rr.stripe + 1, rr.stripes);
+    if (rr.skipped_frames)
+        printf("Skipped     : %d frames (while recording)\n", rr.skipped_frames);
     printf("Frame size  : %d bytes\n", lv_rec_footer.frameSize);
     printf("FPS         : %d.%03d\n", lv_rec_footer.sourceFpsx1000/1000, lv_rec_footer.sourceFpsx1000%1000);
     printf("Black level : %d\n", lv_rec_footer.raw_info.black_level);
     printf("White level : %d\n", lv_rec_footer.raw_info.white_level);
     
-    char* raw = malloc(lv_rec_footer.frameSize);
-    CHECK(raw, "malloc");
-    
     /* override the resolution from raw_info with the one from lv_rec_footer, if they don't match */
     if (lv_rec_footer.xRes != raw_info.width)
     {
@@ -106,29 +210,76 @@ int main(int argc, char** argv)
     }
     
     raw_info.frame_size = lv_rec_footer.frameSize;
+    set_framerate(lv_rec_footer.sourceFpsx1000);
+    
+    /* 12/10-bit clips: frames are converted back to 14-bit as soon as they are read, the rest of the processing is unchanged */
+    if (raw_info.bits_per_pixel != 14)
+    {
+        CHECK(raw_info.bits_per_pixel == 12 || raw_info.bits_per_pixel == 10, "unsupported bit depth: %d", raw_info.bits_per_pixel);
+        packed_bits = raw_info.bits_per_pixel;
+        raw_curve_decode_table(decode_table, packed_bits, lv_rec_footer.packing, raw_info.black_level, raw_info.white_level);
+        printf("Bit depth   : %d (%s curve)\n", packed_bits, lv_rec_footer.packing == RAW_CURVE_SQRT ? "log-ish" : "linear");
+        raw_info.bits_per_pixel = 14;
+        raw_info.frame_size = raw_info.width * raw_info.height * 14/8;
+    }
     
-    char* prefix = argc > 2 ? argv[2] : "";
+    /* empty clip (e.g. recording stopped right away): nothing to convert, whatever the frame range */
+    if (rr.frame_count == 0)
+    {
+        printf("No frames to convert.\n");
+        raw_reader_close(&rr);
+        return 0;
+    }
+    
+    /* frame range: the reader goes straight to the requested frames (in any chunk), the others are not read at all */
+    if (frame_end < 0 || frame_end >= rr.frame_count)
+        frame_end = rr.frame_count - 1;
+    CHECK(frame_start >= 0 && frame_start < rr.frame_count, "start frame %d out of range (0...%d)", frame_start, rr.frame_count - 1);
+    CHECK(frame_end >= frame_start, "end frame %d is before start frame %d", frame_end, frame_start);
+    CHECK(frame_step > 0, "invalid step: %d", frame_step);
+    int num_frames = (frame_end - frame_start) / frame_step + 1;
+    if (num_frames < rr.frame_count)
+        printf("Converting  : frames %d...%d, step %d (%d frames)\n", frame_start, frame_end, frame_step, num_frames);
+    
+    /* vertical stripes: compute the correction factors for the entire clip, or load them from the sidecar */
+    stripes_init(filename, stripes_frames, num_threads);
 
-    int i;
-    for (i = 0; i < lv_rec_footer.frameCount; i++)
+    /* converting only a part of the clip? the first-frame statistics (dual ISO) still come from the first frame of the clip,
+     * so the DNGs are the same as when converting the entire clip */
+    if (frame_start > 0)
     {
-        printf("\rProcessing frame %d of %d...", i+1, lv_rec_footer.frameCount);
+        struct raw_frame frame;
+        CHECK(raw_reader_get_frame(&rr, 0, &frame), "could not read frame 0");
+        fix_frame(decode_frame(frame.data));
+        raw_reader_release_frame(&frame);
+    }
+
+    prefetch_frames(0, readahead);
+
+    /* the first frame(s) are always processed here, because they are used to compute the correction parameters */
+    for (k = 0; k < num_frames && (num_threads == 1 || need_serial_processing()); k++)
+    {
+        int i = frame_start + k * frame_step;
+        printf("\rProcessing frame %d of %d...", k+1, num_frames);
         fflush(stdout);
-        int r = fread(raw, 1, lv_rec_footer.frameSize, fi);
-        CHECK(r == lv_rec_footer.frameSize, "fread");
-        raw_info.buffer = raw;
+        
+        struct raw_frame frame;
+        CHECK(raw_reader_get_frame(&rr, i, &frame), "could not read frame %d", i);
+        prefetch_frames(k + readahead, 1);
         
         /* uncomment if the raw file is recovered from a DNG with dd */
-        //~ reverse_bytes_order(raw, lv_rec_footer.frameSize);
+        //~ reverse_bytes_order(frame.data, lv_rec_footer.frameSize);
         
-        char fn[100];
-        snprintf(fn, sizeof(fn), "%s%06d.dng", prefix, i);
-        fix_vertical_stripes();
-        hdr_process();
-        set_framerate(lv_rec_footer.sourceFpsx1000);
-        save_dng(fn);
+        process_frame(decode_frame(frame.data), i);
+        raw_reader_release_frame(&frame);
     }
-    fclose(fi);
+
+    if (k < num_frames)
+    {
+        printf("\nThreads     : %d (read ahead: %d frames)\n", num_threads, readahead);
+        process_frames_threaded(k, num_threads, readahead);
+    }
+    raw_reader_close(&rr);
     printf("\nDone.\n");
     printf("\nTo convert to jpg, you can try: \n");
     printf("    ufraw-batch --out-type=jpg %s*.dng\n", prefix);
@@ -168,6 +319,72 @@ int raw_set_pixel(int x, int y, int value)
     return p->a;
 }
 
+/* current frame, unpacked to 16 bits; all the processing is done here */
+/* one per thread, so several frames can be processed at the same time (-j) */
+static __thread uint16_t* raw16 = 0;
+
+static inline int raw_get_pixel16(int x, int y)
+{
+    return raw16[x + y * raw_info.width];
+}
+
+static inline void raw_set_pixel16(int x, int y, int value)
+{
+    raw16[x + y * raw_info.width] = value & 16383;
+}
+
+static void unpack_frame(char* buf)
+{
+    if (!raw16)
+    {
+        raw16 = malloc(raw_info.width * raw_info.height * sizeof(raw16[0]));
+        CHECK(raw16, "malloc");
+    }
+
+    int y;
+    for (y = 0; y < raw_info.height; y++)
+        raw_unpack_row(buf + y * raw_info.pitch, raw16 + y * raw_info.width, raw_info.width);
+}
+
+/* the processed frame is not packed back in place, but one row at a time, while saving the DNG (save_dng_rows) */
+/* 14-bit frame decoded from a 12/10-bit one, one for each thread */
+static __thread char* unpacked = 0;
+
+static char* decode_frame(char* buf)
+{
+    if (!packed_bits)
+        return buf;
+
+    if (!unpacked)
+    {
+        unpacked = malloc(raw_info.frame_size);
+        CHECK(unpacked, "malloc");
+    }
+
+    raw_repack_row(buf, packed_bits, unpacked, 14, decode_table, raw_info.width * raw_info.height);
+    return unpacked;
+}
+
+static __thread char* packed_row = 0;
+
+/* frame that was not processed: rows straight from its buffer (raw_info.buffer would be shared by all the threads) */
+static void* frame_row(int y, void* buf)
+{
+    return (char*)buf + y * raw_info.pitch;
+}
+
+static void* pack_row(int y, void* unused)
+{
+    if (!packed_row)
+    {
+        packed_row = malloc(raw_info.pitch);
+        CHECK(packed_row, "malloc");
+    }
+
+    raw_pack_row(raw16 + y * raw_info.width, packed_row, raw_info.width);
+    return packed_row;
+}
+
 /**
  * Fix vertical stripes (banding) from 5D Mark III (and maybe others).
  * 
@@ -179,7 +396,9 @@ int raw_set_pixel(int x, int y, int value)
  * whether to apply the correction or not.
  * 
  * For speed reasons:
- * - Correction factors are computed from the first frame only.
+ * - Correction factors are computed once per clip, from a few frames spread across it
+ *   (calibration, done in parallel), and saved next to the RAW file (.stripes sidecar);
+ *   later conversions of the same clip (or other machines working on parts of it) just load them.
  * - Only channels with error greater than 0.2% are corrected.
  */
 
@@ -207,29 +426,18 @@ static int stripes_correction_needed = 0;
 
 #define STR_APPEND(orig,fmt,...) ({ int _len = strlen(orig); snprintf(orig + _len, sizeof(orig) - _len, fmt, ## __VA_ARGS__); });
 
-#define PA ((int)(p->a))
-#define PB ((int)(p->b_lo | (p->b_hi << 12)))
-#define PC ((int)(p->c_lo | (p->c_hi << 10)))
-#define PD ((int)(p->d_lo | (p->d_hi << 8)))
-#define PE ((int)(p->e_lo | (p->e_hi << 6)))
-#define PF ((int)(p->f_lo | (p->f_hi << 4)))
-#define PG ((int)(p->g_lo | (p->g_hi << 2)))
-#define PH ((int)(p->h))
-
-#define SET_PA(x) { int v = (x); p->a = v; }
-#define SET_PB(x) { int v = (x); p->b_lo = v; p->b_hi = v >> 12; }
-#define SET_PC(x) { int v = (x); p->c_lo = v; p->c_hi = v >> 10; }
-#define SET_PD(x) { int v = (x); p->d_lo = v; p->d_hi = v >> 8; }
-#define SET_PE(x) { int v = (x); p->e_lo = v; p->e_hi = v >> 6; }
-#define SET_PF(x) { int v = (x); p->f_lo = v; p->f_hi = v >> 4; }
-#define SET_PG(x) { int v = (x); p->g_lo = v; p->g_hi = v >> 2; }
-#define SET_PH(x) { int v = (x); p->h = v; }
-
 #define RAW_MUL(p, x) ((((int)(p) - raw_info.black_level) * (int)(x) / FIXP_ONE) + raw_info.black_level)
 #define F2H(ev) COERCE((int)(FIXP_RANGE/2 + ev * FIXP_RANGE/2), 0, FIXP_RANGE-1)
 #define H2F(x) ((double)((x) - FIXP_RANGE/2) / (FIXP_RANGE/2))
 
-static void add_pixel(int hist[8][FIXP_RANGE], int num[8], int offset, int pa, int pb)
+/* rand_r is not available everywhere (e.g. mingw) */
+static inline int stripes_rand(unsigned int* seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) & 0x7FFF;
+}
+
+static void add_pixel(int hist[8][FIXP_RANGE], int num[8], int offset, int pa, int pb, unsigned int* seed)
 {
     int a = pa;
     int b = pb;
@@ -250,8 +458,8 @@ static void add_pixel(int hist[8][FIXP_RANGE], int num[8], int offset, int pa, i
      * 
      * this removes spikes on the histogram, thus canceling bias towards "round" values
      */
-    double af = a + (rand() % 1024) / 1024.0 - 0.5;
-    double bf = b + (rand() % 1024) / 1024.0 - 0.5;
+    double af = a + (stripes_rand(seed) % 1024) / 1024.0 - 0.5;
+    double bf = b + (stripes_rand(seed) % 1024) / 1024.0 - 0.5;
     double factor = af / bf;
     double ev = log2(factor);
     
@@ -264,38 +472,35 @@ static void add_pixel(int hist[8][FIXP_RANGE], int num[8], int offset, int pa, i
 }
 
 
-static void detect_vertical_stripes_coeffs()
+/* add the current frame (raw16) to the 8 little histograms */
+/* the noise is seeded from the frame number, so the result does not depend on how frames are split between threads */
+static void stripes_add_frame(int hist[8][FIXP_RANGE], int num[8], int frame_index)
 {
-    static int hist[8][FIXP_RANGE];
-    static int num[8];
-    
-    memset(hist, 0, sizeof(hist));
-    memset(num, 0, sizeof(num));
-
-    /* compute 8 little histograms */
-    struct raw_pixblock * row;
-    for (row = raw_info.buffer; (void*)row < (void*)raw_info.buffer + raw_info.pitch * raw_info.height; row += raw_info.pitch / sizeof(struct raw_pixblock))
+    unsigned int seed = frame_index + 1;
+    int x, y;
+    int w = raw_info.width;
+    int black = raw_info.black_level;
+    for (y = 0; y < raw_info.height; y++)
     {
-        struct raw_pixblock * p;
-        for (p = row; (void*)p < (void*)row + raw_info.pitch - sizeof(struct raw_pixblock);)
+        uint16_t* p = raw16 + y * w;
+        for (x = 0; x < w - 8; x += 8, p += 8)
         {
-            int pa = PA - raw_info.black_level;
-            int pb = PB - raw_info.black_level;
-            int pc = PC - raw_info.black_level;
-            int pd = PD - raw_info.black_level;
-            int pe = PE - raw_info.black_level;
-            int pf = PF - raw_info.black_level;
-            int pg = PG - raw_info.black_level;
-            int ph = PH - raw_info.black_level;
-            p++;
-            int pa2 = PA - raw_info.black_level;
-            int pb2 = PB - raw_info.black_level;
-            //~ int pc2 = PC - raw_info.black_level;
-            //~ int pd2 = PD - raw_info.black_level;
-            //~ int pe2 = PE - raw_info.black_level;
-            //~ int pf2 = PF - raw_info.black_level;
-            //~ int pg2 = PG - raw_info.black_level;
-            //~ int ph2 = PH - raw_info.black_level;
+            int pa = p[0] - black;
+            int pb = p[1] - black;
+            int pc = p[2] - black;
+            int pd = p[3] - black;
+            int pe = p[4] - black;
+            int pf = p[5] - black;
+            int pg = p[6] - black;
+            int ph = p[7] - black;
+            int pa2 = p[8] - black;
+            int pb2 = p[9] - black;
+            //~ int pc2 = p[10] - black;
+            //~ int pd2 = p[11] - black;
+            //~ int pe2 = p[12] - black;
+            //~ int pf2 = p[13] - black;
+            //~ int pg2 = p[14] - black;
+            //~ int ph2 = p[15] - black;
             
             /**
              * verification: introducing strong banding in one column
@@ -311,38 +516,42 @@ static void detect_vertical_stripes_coeffs()
              * the improvement is visible in horizontal gradients
              */
             
-            add_pixel(hist, num, 2, pa, pc);
-            add_pixel(hist, num, 2, pa, pc);
-            add_pixel(hist, num, 2, pa, pc);
-            add_pixel(hist, num, 2, pa2, pc);
-
-            add_pixel(hist, num, 3, pb, pd);
-            add_pixel(hist, num, 3, pb, pd);
-            add_pixel(hist, num, 3, pb, pd);
-            add_pixel(hist, num, 3, pb2, pd);
-
-            add_pixel(hist, num, 4, pa, pe);
-            add_pixel(hist, num, 4, pa, pe);
-            add_pixel(hist, num, 4, pa2, pe);
-            add_pixel(hist, num, 4, pa2, pe);
-
-            add_pixel(hist, num, 5, pb, pf);
-            add_pixel(hist, num, 5, pb, pf);
-            add_pixel(hist, num, 5, pb2, pf);
-            add_pixel(hist, num, 5, pb2, pf);
-
-            add_pixel(hist, num, 6, pa, pg);
-            add_pixel(hist, num, 6, pa2, pg);
-            add_pixel(hist, num, 6, pa2, pg);
-            add_pixel(hist, num, 6, pa2, pg);
-
-            add_pixel(hist, num, 7, pb, ph);
-            add_pixel(hist, num, 7, pb2, ph);
-            add_pixel(hist, num, 7, pb2, ph);
-            add_pixel(hist, num, 7, pb2, ph);
+            add_pixel(hist, num, 2, pa, pc, &seed);
+            add_pixel(hist, num, 2, pa, pc, &seed);
+            add_pixel(hist, num, 2, pa, pc, &seed);
+            add_pixel(hist, num, 2, pa2, pc, &seed);
+
+            add_pixel(hist, num, 3, pb, pd, &seed);
+            add_pixel(hist, num, 3, pb, pd, &seed);
+            add_pixel(hist, num, 3, pb, pd, &seed);
+            add_pixel(hist, num, 3, pb2, pd, &seed);
+
+            add_pixel(hist, num, 4, pa, pe, &seed);
+            add_pixel(hist, num, 4, pa, pe, &seed);
+            add_pixel(hist, num, 4, pa2, pe, &seed);
+            add_pixel(hist, num, 4, pa2, pe, &seed);
+
+            add_pixel(hist, num, 5, pb, pf, &seed);
+            add_pixel(hist, num, 5, pb, pf, &seed);
+            add_pixel(hist, num, 5, pb2, pf, &seed);
+            add_pixel(hist, num, 5, pb2, pf, &seed);
+
+            add_pixel(hist, num, 6, pa, pg, &seed);
+            add_pixel(hist, num, 6, pa2, pg, &seed);
+            add_pixel(hist, num, 6, pa2, pg, &seed);
+            add_pixel(hist, num, 6, pa2, pg, &seed);
+
+            add_pixel(hist, num, 7, pb, ph, &seed);
+            add_pixel(hist, num, 7, pb2, ph, &seed);
+            add_pixel(hist, num, 7, pb2, ph, &seed);
+            add_pixel(hist, num, 7, pb2, ph, &seed);
         }
     }
+}
 
+/* median of each histogram => correction factors */
+static void stripes_compute_coeffs(int hist[8][FIXP_RANGE], int num[8], int num_frames)
+{
     int j,k;
     
     int max[8] = {0};
@@ -353,7 +562,7 @@ static void detect_vertical_stripes_coeffs()
     /* compute the median correction factor (this will reject outliers) */
     for (j = 0; j < 8; j++)
     {
-        if (num[j] < raw_info.frame_size / 128) continue;
+        if (num[j] < num_frames * (raw_info.frame_size / 128)) continue;
         int t = 0;
         for (k = 0; k < FIXP_RANGE; k++)
         {
@@ -395,6 +604,11 @@ static void detect_vertical_stripes_coeffs()
 
     stripes_coeffs[0] = FIXP_ONE;
     stripes_coeffs[1] = FIXP_ONE;
+}
+
+static void stripes_check_needed()
+{
+    int j;
 
     /* do we really need stripe correction, or it won't be noticeable? or maybe it's just computation error? */
     stripes_correction_needed = 0;
@@ -419,6 +633,198 @@ static void detect_vertical_stripes_coeffs()
     }
 }
 
+/**
+ * Calibration: sample a few frames spread across the clip, in parallel
+ * (a single frame is not reliable, e.g. when the clip starts in the dark)
+ */
+static int calib_frames[256];
+static int calib_num_frames = 0;
+static int calib_next = 0;
+static int (*calib_hist)[8][FIXP_RANGE] = 0;    /* one set of histograms per thread */
+static int (*calib_num)[8] = 0;
+
+static void* calib_worker(void* arg)
+{
+    int id = (intptr_t) arg;
+
+    while (1)
+    {
+        int i = __sync_fetch_and_add(&calib_next, 1);
+        if (i >= calib_num_frames)
+            break;
+
+        int index = calib_frames[i];
+        struct raw_frame frame;
+        CHECK(raw_reader_get_frame(&rr, index, &frame), "could not read frame %d", index);
+        unpack_frame(decode_frame(frame.data));
+        raw_reader_release_frame(&frame);
+        stripes_add_frame(calib_hist[id], calib_num[id], index);
+    }
+
+    free(raw16); raw16 = 0;
+    free(unpacked); unpacked = 0;
+    return 0;
+}
+
+static void stripes_calibrate(int num_frames, int num_threads)
+{
+    int i, j, k;
+
+    num_frames = COERCE(num_frames, 1, MIN(rr.frame_count, (int)(sizeof(calib_frames)/sizeof(calib_frames[0]))));
+    num_threads = COERCE(num_threads, 1, num_frames);
+
+    /* frames from the middle of N equal slices of the clip */
+    calib_num_frames = num_frames;
+    for (i = 0; i < num_frames; i++)
+        calib_frames[i] = (int)(((int64_t) rr.frame_count * (2*i + 1)) / (2 * num_frames));
+
+    calib_hist = calloc(num_threads, sizeof(calib_hist[0]));
+    calib_num = calloc(num_threads, sizeof(calib_num[0]));
+    CHECK(calib_hist && calib_num, "malloc");
+
+    calib_next = 0;
+    pthread_t* threads = malloc(num_threads * sizeof(threads[0]));
+    CHECK(threads, "malloc");
+    for (i = 0; i < num_threads; i++)
+    {
+        int err = pthread_create(&threads[i], 0, calib_worker, (void*)(intptr_t) i);
+        CHECK(err == 0, "pthread_create");
+    }
+    for (i = 0; i < num_threads; i++)
+        pthread_join(threads[i], 0);
+
+    /* merge the histograms from all threads */
+    for (i = 1; i < num_threads; i++)
+    {
+        for (j = 0; j < 8; j++)
+        {
+            for (k = 0; k < FIXP_RANGE; k++)
+                calib_hist[0][j][k] += calib_hist[i][j][k];
+            calib_num[0][j] += calib_num[i][j];
+        }
+    }
+
+    stripes_compute_coeffs(calib_hist[0], calib_num[0], num_frames);
+
+    free(threads);
+    free(calib_hist); calib_hist = 0;
+    free(calib_num); calib_num = 0;
+}
+
+/**
+ * Sidecar file: M1234567.RAW => M1234567.RAW.stripes (plain text)
+ * 
+ * raw2dng vertical stripes
+ * resolution 1920 1080
+ * clip 250 3628800 907200000 23976
+ * frames 8
+ * coeffs 65536 65536 65412 ...
+ *
+ * The clip line (frame count, frame size, data bytes, fps x1000) ties the factors to the clip they were computed from;
+ * if the clip was replaced (e.g. a new recording with the same file name), they are computed again.
+ */
+struct stripes_clip
+{
+    int frames;
+    int frame_size;
+    double bytes;               /* double: exact for any clip size, and printf/scanf work the same everywhere */
+    int fps;
+};
+
+static struct stripes_clip stripes_current_clip()
+{
+    struct stripes_clip c;
+    c.frames = rr.frame_count;
+    c.frame_size = lv_rec_footer.frameSize;
+    c.fps = lv_rec_footer.sourceFpsx1000;
+
+    /* merged dual card clips: both files */
+    int64_t bytes = rr.data_size;
+    int i;
+    for (i = 0; i < rr.num_parts; i++)
+        bytes += rr.parts[i]->data_size;
+    c.bytes = bytes;
+    return c;
+}
+
+static int stripes_load(char* filename)
+{
+    FILE* f = fopen(filename, "r");
+    if (!f) return 0;
+
+    int w = 0, h = 0, n = 0;
+    struct stripes_clip clip;
+    int c[8];
+    int ok = 
+        fscanf(f, "raw2dng vertical stripes resolution %d %d ", &w, &h) == 2 &&
+        fscanf(f, "clip %d %d %lf %d ", &clip.frames, &clip.frame_size, &clip.bytes, &clip.fps) == 4 &&
+        fscanf(f, "frames %d ", &n) == 1 &&
+        fscanf(f, "coeffs %d %d %d %d %d %d %d %d", &c[0], &c[1], &c[2], &c[3], &c[4], &c[5], &c[6], &c[7]) == 8;
+    fclose(f);
+
+    if (!ok)
+    {
+        printf("Stripes     : %s is not valid (or from an older raw2dng), ignoring\n", filename);
+        return 0;
+    }
+    if (w != raw_info.width || h != raw_info.height)
+    {
+        printf("Stripes     : %s is for %dx%d, ignoring\n", filename, w, h);
+        return 0;
+    }
+
+    struct stripes_clip cur = stripes_current_clip();
+    if (clip.frames != cur.frames || clip.frame_size != cur.frame_size || clip.bytes != cur.bytes || clip.fps != cur.fps)
+    {
+        printf("Stripes     : %s is for another clip (%d frames, %.0f bytes), ignoring\n", filename, clip.frames, clip.bytes);
+        return 0;
+    }
+
+    memcpy(stripes_coeffs, c, sizeof(stripes_coeffs));
+    printf("Stripes     : loaded from %s (%d frames; -sN to compute it again)\n", filename, n);
+    return 1;
+}
+
+static void stripes_save(char* filename, int num_frames)
+{
+    FILE* f = fopen(filename, "w");
+    if (!f)
+    {
+        printf("Stripes     : could not create %s\n", filename);
+        return;
+    }
+    struct stripes_clip clip = stripes_current_clip();
+    fprintf(f, "raw2dng vertical stripes\n");
+    fprintf(f, "resolution %d %d\n", raw_info.width, raw_info.height);
+    fprintf(f, "clip %d %d %.0f %d\n", clip.frames, clip.frame_size, clip.bytes, clip.fps);
+    fprintf(f, "frames %d\n", num_frames);
+    fprintf(f, "coeffs %d %d %d %d %d %d %d %d\n", 
+        stripes_coeffs[0], stripes_coeffs[1], stripes_coeffs[2], stripes_coeffs[3],
+        stripes_coeffs[4], stripes_coeffs[5], stripes_coeffs[6], stripes_coeffs[7]
+    );
+    fclose(f);
+    printf("Stripes     : saved to %s\n", filename);
+}
+
+/* num_frames: how many frames to sample; 0 = use the sidecar if there is one, or calibrate with the default number */
+static void stripes_init(char* raw_filename, int num_frames, int num_threads)
+{
+    char sidecar[300];
+    snprintf(sidecar, sizeof(sidecar), "%s.stripes", raw_filename);
+
+    if (num_frames || !stripes_load(sidecar))
+    {
+        if (!num_frames)
+            num_frames = 8;
+        num_frames = MIN(num_frames, rr.frame_count);
+        printf("Stripes     : calibrating from %d frames...\n", num_frames);
+        stripes_calibrate(num_frames, num_threads);
+        stripes_save(sidecar, num_frames);
+    }
+
+    stripes_check_needed();
+}
+
 static void apply_vertical_stripes_correction()
 {
     /**
@@ -435,55 +841,41 @@ static void apply_vertical_stripes_correction()
      
     int white = raw_info.white_level * 2 / 3;
     
-    struct raw_pixblock * row;
+    int w = raw_info.width;
+    int h = raw_info.height;
+    int i;
     
-    for (row = raw_info.buffer; (void*)row < (void*)raw_info.buffer + raw_info.pitch * raw_info.height; row += raw_info.pitch / sizeof(struct raw_pixblock))
-    {
-        struct raw_pixblock * p;
-        for (p = row; (void*)p < (void*)row + raw_info.pitch; p++)
-        {
-            white = MAX(white, PA);
-            white = MAX(white, PB);
-            white = MAX(white, PC);
-            white = MAX(white, PD);
-            white = MAX(white, PE);
-            white = MAX(white, PF);
-            white = MAX(white, PG);
-            white = MAX(white, PH);
-        }
-    }
+    for (i = 0; i < w * h; i++)
+        white = MAX(white, raw16[i]);
     
     int black = raw_info.black_level;
-    for (row = raw_info.buffer; (void*)row < (void*)raw_info.buffer + raw_info.pitch * raw_info.height; row += raw_info.pitch / sizeof(struct raw_pixblock))
+    for (i = 0; i < w * h; i += 8)
     {
-        struct raw_pixblock * p;
-        for (p = row; (void*)p < (void*)row + raw_info.pitch; p++)
-        {
-            int pa = PA;
-            int pb = PB;
-            int pc = PC;
-            int pd = PD;
-            int pe = PE;
-            int pf = PF;
-            int pg = PG;
-            int ph = PH;
-            
-            /**
-             * Thou shalt not exceed the white level (the exact one, not the exif one)
-             * otherwise you'll be blessed with banding instead of nice and smooth highlight recovery
-             * 
-             * At very dark levels, you will introduce roundoff errors, so don't correct there
-             */
-            
-            if (stripes_coeffs[0] && pa && pa < white && pa > black + 64) SET_PA(MIN(white, RAW_MUL(pa, stripes_coeffs[0])));
-            if (stripes_coeffs[1] && pb && pb < white && pa > black + 64) SET_PB(MIN(white, RAW_MUL(pb, stripes_coeffs[1])));
-            if (stripes_coeffs[2] && pc && pc < white && pa > black + 64) SET_PC(MIN(white, RAW_MUL(pc, stripes_coeffs[2])));
-            if (stripes_coeffs[3] && pd && pd < white && pa > black + 64) SET_PD(MIN(white, RAW_MUL(pd, stripes_coeffs[3])));
-            if (stripes_coeffs[4] && pe && pe < white && pa > black + 64) SET_PE(MIN(white, RAW_MUL(pe, stripes_coeffs[4])));
-            if (stripes_coeffs[5] && pf && pf < white && pa > black + 64) SET_PF(MIN(white, RAW_MUL(pf, stripes_coeffs[5])));
-            if (stripes_coeffs[6] && pg && pg < white && pa > black + 64) SET_PG(MIN(white, RAW_MUL(pg, stripes_coeffs[6])));
-            if (stripes_coeffs[7] && ph && ph < white && pa > black + 64) SET_PH(MIN(white, RAW_MUL(ph, stripes_coeffs[7])));
-        }
+        uint16_t* p = raw16 + i;
+        int pa = p[0];
+        int pb = p[1];
+        int pc = p[2];
+        int pd = p[3];
+        int pe = p[4];
+        int pf = p[5];
+        int pg = p[6];
+        int ph = p[7];
+        
+        /**
+         * Thou shalt not exceed the white level (the exact one, not the exif one)
+         * otherwise you'll be blessed with banding instead of nice and smooth highlight recovery
+         * 
+         * At very dark levels, you will introduce roundoff errors, so don't correct there
+         */
+        
+        if (stripes_coeffs[0] && pa && pa < white && pa > black + 64) p[0] = MIN(white, RAW_MUL(pa, stripes_coeffs[0])) & 16383;
+        if (stripes_coeffs[1] && pb && pb < white && pa > black + 64) p[1] = MIN(white, RAW_MUL(pb, stripes_coeffs[1])) & 16383;
+        if (stripes_coeffs[2] && pc && pc < white && pa > black + 64) p[2] = MIN(white, RAW_MUL(pc, stripes_coeffs[2])) & 16383;
+        if (stripes_coeffs[3] && pd && pd < white && pa > black + 64) p[3] = MIN(white, RAW_MUL(pd, stripes_coeffs[3])) & 16383;
+        if (stripes_coeffs[4] && pe && pe < white && pa > black + 64) p[4] = MIN(white, RAW_MUL(pe, stripes_coeffs[4])) & 16383;
+        if (stripes_coeffs[5] && pf && pf < white && pa > black + 64) p[5] = MIN(white, RAW_MUL(pf, stripes_coeffs[5])) & 16383;
+        if (stripes_coeffs[6] && pg && pg < white && pa > black + 64) p[6] = MIN(white, RAW_MUL(pg, stripes_coeffs[6])) & 16383;
+        if (stripes_coeffs[7] && ph && ph < white && pa > black + 64) p[7] = MIN(white, RAW_MUL(ph, stripes_coeffs[7])) & 16383;
     }
 }
 
@@ -520,8 +912,8 @@ static int hdr_check()
     {
         for (x = 2; x < w-2; x ++)
         {
-            int p = raw_get_pixel(x, y);
-            int p2 = raw_get_pixel(x, y+2);
+            int p = raw_get_pixel16(x, y);
+            int p2 = raw_get_pixel16(x, y+2);
             if (p < white && p2 < white)
             {
                 avg_ev[y%4] += raw2ev[p];
@@ -735,9 +1127,11 @@ static int mean3(int a, int b, int c, int white, int* err)
 
 #define EV_RESOLUTION 2000
 
+/* all the statistics are computed on the first frame, then reused (read-only) for the following ones */
+static int first_frame = 1;
+
 static int hdr_interpolate()
 {
-    static int first_frame = 1;
 
     int black = raw_info.black_level;
     int white = raw_info.white_level;
@@ -752,12 +1146,15 @@ static int hdr_interpolate()
     static int ev2raw[14*EV_RESOLUTION];
     
     int i;
-    for (i = 0; i < 16384; i++)
-        raw2ev[i] = (int)round(log2(MAX(1, i - black)) * EV_RESOLUTION);
-    for (i = 0; i < 14*EV_RESOLUTION; i++)
+    if (first_frame)
     {
-        ev2raw[i] = COERCE(black + pow(2, ((double)i/EV_RESOLUTION)), black, white);
-        if (i >= raw2ev[white]) ev2raw[i] = white;
+        for (i = 0; i < 16384; i++)
+            raw2ev[i] = (int)round(log2(MAX(1, i - black)) * EV_RESOLUTION);
+        for (i = 0; i < 14*EV_RESOLUTION; i++)
+        {
+            ev2raw[i] = COERCE(black + pow(2, ((double)i/EV_RESOLUTION)), black, white);
+            if (i >= raw2ev[white]) ev2raw[i] = white;
+        }
     }
 
     /* first we need to know which lines are dark and which are bright */
@@ -783,7 +1180,7 @@ static int hdr_interpolate()
     {
         for (x = 2; x < w-2; x ++)
         {
-            acc_bright[y % 4] += raw_get_pixel(x, y);
+            acc_bright[y % 4] += raw_get_pixel16(x, y);
         }
     }
     double avg_bright = (acc_bright[0] + acc_bright[1] + acc_bright[2] + acc_bright[3]) / 4;
@@ -850,13 +1247,13 @@ static int hdr_interpolate()
             
             if (is_rg)
             {
-                int ra = raw_get_pixel(x, y-2);
-                int rb = raw_get_pixel(x, y+2);
+                int ra = raw_get_pixel16(x, y-2);
+                int rb = raw_get_pixel16(x, y+2);
                 int er=0; int ri = mean2(raw2ev[ra], raw2ev[rb], raw2ev[white], &er);
                 
-                int ga = raw_get_pixel(x+1+1, y+s);
-                int gb = raw_get_pixel(x+1-1, y+s);
-                int gc = raw_get_pixel(x+1, y-2*s);
+                int ga = raw_get_pixel16(x+1+1, y+s);
+                int gb = raw_get_pixel16(x+1-1, y+s);
+                int gc = raw_get_pixel16(x+1, y-2*s);
                 int eg=0; int gi = mean3(raw2ev[ga], raw2ev[gb], raw2ev[gc], raw2ev[white], &eg);
 
                 interp[x   + y * w] = ev2raw[ri];
@@ -869,13 +1266,13 @@ static int hdr_interpolate()
             }
             else
             {
-                int ba = raw_get_pixel(x+1  , y-2);
-                int bb = raw_get_pixel(x+1  , y+2);
+                int ba = raw_get_pixel16(x+1  , y-2);
+                int bb = raw_get_pixel16(x+1  , y+2);
                 int eb=0; int bi = mean2(raw2ev[ba], raw2ev[bb], raw2ev[white], &eb);
 
-                int ga = raw_get_pixel(x+1, y+s);
-                int gb = raw_get_pixel(x-1, y+s);
-                int gc = raw_get_pixel(x, y-2*s);
+                int ga = raw_get_pixel16(x+1, y+s);
+                int gb = raw_get_pixel16(x-1, y+s);
+                int gc = raw_get_pixel16(x, y-2*s);
                 int eg=0; int gi = mean3(raw2ev[ga], raw2ev[gb], raw2ev[gc], raw2ev[white], &eg);
 
                 interp[x   + y * w] = ev2raw[gi];
@@ -887,8 +1284,8 @@ static int hdr_interpolate()
                 #endif
             }
 
-            native[x   + y * w] = raw_get_pixel(x, y);
-            native[x+1 + y * w] = raw_get_pixel(x+1, y);
+            native[x   + y * w] = raw_get_pixel16(x, y);
+            native[x+1 + y * w] = raw_get_pixel16(x+1, y);
         }
     }
 #else
@@ -899,12 +1296,12 @@ static int hdr_interpolate()
         
         for (x = 2; x < w-2; x ++)
         {
-            int ra = raw_get_pixel(x, y-2);
-            int rb = raw_get_pixel(x, y+2);
-            int ral = raw_get_pixel(x-2, y-2);
-            int rbl = raw_get_pixel(x-2, y+2);
-            int rar = raw_get_pixel(x+2, y-2);
-            int rbr = raw_get_pixel(x+2, y+2);
+            int ra = raw_get_pixel16(x, y-2);
+            int rb = raw_get_pixel16(x, y+2);
+            int ral = raw_get_pixel16(x-2, y-2);
+            int rbl = raw_get_pixel16(x-2, y+2);
+            int rar = raw_get_pixel16(x+2, y-2);
+            int rbr = raw_get_pixel16(x+2, y+2);
 
             int ri = ev2raw[
                 interp6(
@@ -919,7 +1316,7 @@ static int hdr_interpolate()
             ];
             
             interp[x   + y * w] = ri;
-            native[x   + y * w] = raw_get_pixel(x, y);
+            native[x   + y * w] = raw_get_pixel16(x, y);
         }
     }
 #endif
@@ -932,8 +1329,8 @@ static int hdr_interpolate()
         
         for (x = 0; x < w; x ++)
         {
-            interp[x + y * w] = raw_get_pixel(x, y+2);
-            native[x + y * w] = raw_get_pixel(x, y);
+            interp[x + y * w] = raw_get_pixel16(x, y+2);
+            native[x + y * w] = raw_get_pixel16(x, y);
         }
     }
 
@@ -944,8 +1341,8 @@ static int hdr_interpolate()
         
         for (x = 0; x < w; x ++)
         {
-            interp[x + y * w] = raw_get_pixel(x, y-2);
-            native[x + y * w] = raw_get_pixel(x, y);
+            interp[x + y * w] = raw_get_pixel16(x, y-2);
+            native[x + y * w] = raw_get_pixel16(x, y);
         }
     }
 
@@ -956,14 +1353,14 @@ static int hdr_interpolate()
         
         for (x = 0; x < 2; x ++)
         {
-            interp[x + y * w] = raw_get_pixel(x, y-2);
-            native[x + y * w] = raw_get_pixel(x, y);
+            interp[x + y * w] = raw_get_pixel16(x, y-2);
+            native[x + y * w] = raw_get_pixel16(x, y);
         }
 
         for (x = w-2; x < w; x ++)
         {
-            interp[x + y * w] = raw_get_pixel(x, y-2);
-            native[x + y * w] = raw_get_pixel(x, y);
+            interp[x + y * w] = raw_get_pixel16(x, y-2);
+            native[x + y * w] = raw_get_pixel16(x, y);
         }
     }
 
@@ -1134,19 +1531,22 @@ static int hdr_interpolate()
     double max_ev = log2(white - black);
     static int mix_curve[16384];
     static int fullres_curve[16384];
-    for (i = 0; i < 16384; i++)
+    if (first_frame)
     {
-        double ev = log2(MAX(i - black, 1));
-        double c = -cos(MAX(MIN(ev-(max_ev-overlap),overlap),0)*M_PI/overlap);
-        double k = (c+1)/2;
-        double f = 1 - pow(c, 4);
-    
-        /* this looks very ugly at iso > 1600 */
-        if (corr_ev > 4.5)
-            f = 0;
+        for (i = 0; i < 16384; i++)
+        {
+            double ev = log2(MAX(i - black, 1));
+            double c = -cos(MAX(MIN(ev-(max_ev-overlap),overlap),0)*M_PI/overlap);
+            double k = (c+1)/2;
+            double f = 1 - pow(c, 4);
+        
+            /* this looks very ugly at iso > 1600 */
+            if (corr_ev > 4.5)
+                f = 0;
 
-        mix_curve[i] = FIXP_ONE * k;
-        fullres_curve[i] = FIXP_ONE * f;
+            mix_curve[i] = FIXP_ONE * k;
+            fullres_curve[i] = FIXP_ONE * f;
+        }
     }
 
 #if 0
@@ -1242,7 +1642,7 @@ static int hdr_interpolate()
             output = COERCE(output, 0, 14*EV_RESOLUTION-1);
             
             /* back to linear space and commit */
-            raw_set_pixel(x, y, ev2raw[output] + black_delta/8);
+            raw_set_pixel16(x, y, ev2raw[output] + black_delta/8);
             
             /* fixme: why black_delta/8? it looks good for the Batman shot, but why? */
         }
@@ -1256,7 +1656,8 @@ static int hdr_interpolate()
             printf(" [%d hot pixels]  ", hot_pixels);
     }
 
-    first_frame = 0;
+    if (first_frame)
+        first_frame = 0;
 
     free(dark);
     free(bright);
@@ -1284,16 +1685,9 @@ err:
     return 0;
 }
 
+/* correction factors are computed (or loaded) before processing, see stripes_init */
 static void fix_vertical_stripes()
 {
-    /* for speed: only detect correction factors from the first frame */
-    static int first_time = 1;
-    if (first_time)
-    {
-        detect_vertical_stripes_coeffs();
-        first_time = 0;
-    }
-    
     /* only apply stripe correction if we need it, since it takes a little CPU time */
     if (stripes_correction_needed)
     {
@@ -1302,14 +1696,15 @@ static void fix_vertical_stripes()
 }
 
 
+static int hdr_first_time = 1;
+static int hdr_needed = 0;
+
 static void hdr_process()
 {
-    static int first_time = 1;
-    static int hdr_needed = 0;
-    if (first_time)
+    if (hdr_first_time)
     {
         hdr_needed = hdr_check();
-        first_time = 0;
+        hdr_first_time = 0;
     }
     
     if (hdr_needed)
@@ -1317,3 +1712,117 @@ static void hdr_process()
         hdr_interpolate();
     }
 }
+
+/* true while the first-frame statistics are not computed yet; until then, frames must be processed in order, one at a time */
+static int need_serial_processing()
+{
+    return hdr_first_time || (hdr_needed && first_frame);
+}
+
+/* returns 1 if the frame was unpacked and processed (in raw16), 0 if there was nothing to fix */
+static int fix_frame(char* buf)
+{
+    if (need_serial_processing() || stripes_correction_needed || hdr_needed)
+    {
+        unpack_frame(buf);
+        fix_vertical_stripes();
+        hdr_process();
+        return 1;
+    }
+    return 0;
+}
+
+static void process_frame(char* buf, int frame_index)
+{
+    /* nothing to fix? don't touch the image data (it's mapped straight from the RAW file) */
+    int processed = fix_frame(buf);
+
+    char fn[100];
+    snprintf(fn, sizeof(fn), "%s%06d.dng", prefix, frame_index);
+
+    /* raw_info and the DNG settings are only changed before starting the threads, so the DNGs are saved in parallel */
+    if (processed)
+        save_dng_rows(fn, pack_row, 0);
+    else
+        save_dng_rows(fn, frame_row, buf);
+}
+
+/* read ahead "count" frames from the list of frames to convert, starting at position k */
+static void prefetch_frames(int k, int count)
+{
+    if (frame_step == 1)
+    {
+        /* contiguous range: one hint for all of them */
+        int i = frame_start + k;
+        raw_reader_prefetch(&rr, i, MIN(count, frame_end + 1 - i));
+        return;
+    }
+
+    for ( ; count > 0; k++, count--)
+    {
+        int i = frame_start + k * frame_step;
+        if (i > frame_end)
+            break;
+        raw_reader_prefetch(&rr, i, 1);
+    }
+}
+
+/**
+ * Multi-threaded processing (-j)
+ * 
+ * Each worker picks the next frame number, gets it from the reader (mapped from the RAW file, no copy),
+ * processes it and writes the DNG; files are written in whatever order the frames are finished.
+ * Frames are picked in order, so the file is still read sequentially; we only ask the OS
+ * to read a few frames ahead, so the workers don't have to wait for the disk.
+ */
+static int next_frame = 0;      /* position in the list of frames to convert, not frame number */
+static int frames_readahead = 0;
+
+static void* frame_worker(void* unused)
+{
+    int num_frames = (frame_end - frame_start) / frame_step + 1;
+
+    while (1)
+    {
+        int k = __sync_fetch_and_add(&next_frame, 1);
+        if (k >= num_frames)
+            break;
+        int i = frame_start + k * frame_step;
+        
+        printf("\rProcessing frame %d of %d...", k+1, num_frames);
+        fflush(stdout);
+        
+        struct raw_frame frame;
+        CHECK(raw_reader_get_frame(&rr, i, &frame), "could not read frame %d", i);
+        prefetch_frames(k + frames_readahead, 1);
+        process_frame(decode_frame(frame.data), i);
+        raw_reader_release_frame(&frame);
+    }
+    
+    free(raw16); raw16 = 0;
+    free(packed_row); packed_row = 0;
+    free(unpacked); unpacked = 0;
+    return 0;
+}
+
+/* process the remaining frames, starting at position "start" in the list of frames to convert */
+static void process_frames_threaded(int start, int num_threads, int readahead)
+{
+    int i;
+    
+    next_frame = start;
+    frames_readahead = readahead;
+    
+    pthread_t* threads = malloc(num_threads * sizeof(threads[0]));
+    CHECK(threads, "malloc");
+    for (i = 0; i < num_threads; i++)
+    {
+        int err = pthread_create(&threads[i], 0, frame_worker, 0);
+        CHECK(err == 0, "pthread_create");
+    }
+    
+    for (i = 0; i < num_threads; i++)
+        pthread_join(threads[i], 0);
+    
+    free(threads);
+}
@@ -0,0 +1,635 @@
+/**
+ * Memory-mapped reader for lv_rec / raw_rec files (desktop side)
+ *
+ * Each frame gets its own small mapping (private, copy-on-write), instead of mapping whole files:
+ * chunks can be up to 4GB and raw2dng is a 32-bit program, so they would not fit in the address space.
+ * A mapping costs a few microseconds, which is nothing compared to processing the frame.
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "raw_reader.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#define ERR(fmt,...) { printf("RAW reader  : " fmt "\n", ## __VA_ARGS__); goto err; }
+
+/* same as get_next_chunk_file_name from raw_rec: RAW, R00, R01 and so on */
+static void get_chunk_file_name(char* base_name, int chunk, char* out, int maxlen)
+{
+    snprintf(out, maxlen, "%s", base_name);
+    if (chunk == 0)
+        return;
+
+    int len = strlen(out);
+    if (len >= 2)
+        snprintf(out + len - 2, 3, "%02d", chunk-1);
+}
+
+/* OS-specific part: open, map, read */
+
+#ifdef _WIN32
+
+static int chunk_open(struct raw_chunk* c)
+{
+    c->fd = _open(c->filename, _O_RDONLY | _O_BINARY);
+    if (c->fd < 0)
+        return 0;
+
+    c->size = _filelengthi64(c->fd);
+    c->map_handle = 0;
+    if (c->size > 0)
+    {
+        c->map_handle = CreateFileMapping((HANDLE)_get_osfhandle(c->fd), 0, PAGE_WRITECOPY, 0, 0, 0);
+        if (!c->map_handle)
+        {
+            _close(c->fd);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void chunk_close(struct raw_chunk* c)
+{
+    if (c->map_handle)
+        CloseHandle(c->map_handle);
+    _close(c->fd);
+}
+
+static int get_map_align()
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwAllocationGranularity;
+}
+
+static void* chunk_map(struct raw_chunk* c, int64_t offset, int64_t size)
+{
+    void* addr = MapViewOfFile(c->map_handle, FILE_MAP_COPY, (DWORD)(offset >> 32), (DWORD)offset, size);
+    return addr;
+}
+
+static void chunk_unmap(void* addr, int64_t size)
+{
+    UnmapViewOfFile(addr);
+}
+
+static void chunk_advise(struct raw_chunk* c, void* addr, int64_t offset, int64_t size)
+{
+    /* no readahead hints on Windows */
+}
+
+/* positional read (does not depend on the file pointer, so it's thread-safe) */
+static int chunk_read(struct raw_chunk* c, int64_t offset, void* buf, int size)
+{
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD r = 0;
+    if (!ReadFile((HANDLE)_get_osfhandle(c->fd), buf, size, &r, &ov))
+        return 0;
+    return r == size;
+}
+
+#else
+
+static int chunk_open(struct raw_chunk* c)
+{
+    c->fd = open(c->filename, O_RDONLY);
+    if (c->fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(c->fd, &st))
+    {
+        close(c->fd);
+        return 0;
+    }
+    c->size = st.st_size;
+    c->map_handle = 0;
+    return 1;
+}
+
+static void chunk_close(struct raw_chunk* c)
+{
+    close(c->fd);
+}
+
+static int get_map_align()
+{
+    return sysconf(_SC_PAGESIZE);
+}
+
+static void* chunk_map(struct raw_chunk* c, int64_t offset, int64_t size)
+{
+    /* private mapping: we may write to the frame (e.g. processing in place), but the file stays unchanged */
+    void* addr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, c->fd, offset);
+    return addr == MAP_FAILED ? 0 : addr;
+}
+
+static void chunk_unmap(void* addr, int64_t size)
+{
+    munmap(addr, size);
+}
+
+static void chunk_advise(struct raw_chunk* c, void* addr, int64_t offset, int64_t size)
+{
+    if (addr)
+    {
+        /* frame just mapped: we'll read all of it, mostly in order */
+        madvise(addr, size, MADV_SEQUENTIAL);
+        madvise(addr, size, MADV_WILLNEED);
+    }
+    else
+    {
+        /* not mapped yet (prefetch) */
+        #ifdef POSIX_FADV_WILLNEED
+        posix_fadvise(c->fd, offset, size, POSIX_FADV_WILLNEED);
+        #endif
+    }
+}
+
+static int chunk_read(struct raw_chunk* c, int64_t offset, void* buf, int size)
+{
+    return pread(c->fd, buf, size, offset) == size;
+}
+
+#endif
+
+static struct raw_chunk* find_chunk(struct raw_reader* rr, int64_t offset)
+{
+    int i;
+    for (i = 0; i < rr->num_chunks; i++)
+        if (offset >= rr->chunks[i].start && offset < rr->chunks[i].start + rr->chunks[i].size)
+            return &rr->chunks[i];
+    return 0;
+}
+
+/* read from the clip, as if all chunks were a single file */
+static int clip_read(struct raw_reader* rr, int64_t offset, void* buf, int size)
+{
+    int done = 0;
+    while (done < size)
+    {
+        struct raw_chunk* c = find_chunk(rr, offset + done);
+        if (!c) return 0;
+        int64_t local = offset + done - c->start;
+        int part = c->size - local < size - done ? c->size - local : size - done;
+        if (!chunk_read(c, local, buf + done, part)) return 0;
+        done += part;
+    }
+    return 1;
+}
+
+/* where the image data of a frame starts, from the beginning of the clip */
+static int64_t frame_offset(struct raw_reader* rr, int index)
+{
+    if (rr->indexed)
+        return RAW_FRAME_BLOCK_OFFSET(index, rr->frame_size) + RAW_FRAME_HEADER_SIZE;
+    return (int64_t) index * rr->frame_size;
+}
+
+/* header fields are unsigned, our counters are int: compare them as int64_t, so nothing wraps around */
+static int is_frame_header(raw_block_header_t* hdr, int index, int frame_size)
+{
+    return !strncmp((char*)hdr->magic, "RAWF", 4) &&
+        (int64_t) hdr->frame_index == index && (int64_t) hdr->data_size == frame_size;
+}
+
+static int is_index_header(raw_block_header_t* hdr, int first, int count)
+{
+    return !strncmp((char*)hdr->magic, "RAWX", 4) &&
+        (int64_t) hdr->frame_index == first && (int64_t) hdr->frame_number == count;
+}
+
+/* count the gaps in frame numbers, from the index entries (or the frame headers, after the last index) */
+/* striped clips: also remember the frame numbers, for merging */
+static void check_frame_number(struct raw_reader* rr, int index, unsigned int frame_number, unsigned int* prev)
+{
+    if (*prev && frame_number > *prev + 1)
+        rr->skipped_frames += frame_number - *prev - 1;
+    *prev = frame_number;
+
+    if (rr->frame_numbers)
+        rr->frame_numbers[index] = frame_number;
+}
+
+/*
+ * Indexed container: metadata from the clip header, frame count from the file size.
+ * Only the block headers are checked (no scanning through image data):
+ * one read for each index block, and at most RAW_INDEX_INTERVAL frame headers after the last one.
+ */
+static int open_indexed(struct raw_reader* rr)
+{
+    raw_block_header_t hdr;
+    if (!clip_read(rr, 0, &hdr, sizeof(hdr)))
+        ERR("could not read clip header");
+    if (hdr.block_size != RAW_CLIP_HEADER_SIZE || hdr.data_offset + sizeof(lv_rec_file_footer_t) > hdr.block_size)
+        ERR("invalid clip header");
+    if (!clip_read(rr, hdr.data_offset, &rr->footer, sizeof(lv_rec_file_footer_t)))
+        ERR("could not read clip header");
+    if (strncmp((char*)rr->footer.magic, "RAWM", 4))
+        ERR("invalid clip header");
+
+    /* striped clip? (these fields are 0 in regular clips) */
+    if (hdr.frame_number > 1)
+    {
+        if (hdr.frame_number > RAW_MAX_STRIPES || hdr.frame_index >= hdr.frame_number)
+            ERR("invalid clip header (part %d of %d)", hdr.frame_index + 1, hdr.frame_number);
+        rr->stripe = hdr.frame_index;
+        rr->stripes = hdr.frame_number;
+        rr->clip_id = hdr.timestamp;
+    }
+
+    rr->indexed = 1;
+    rr->frame_size = rr->footer.frameSize;
+    if (rr->frame_size <= 0)
+        ERR("invalid frame size: %d", rr->frame_size);
+
+    /* how many frames fit in the clip? (the last index block may be missing) */
+    int64_t block = RAW_FRAME_BLOCK_SIZE(rr->frame_size);
+    int64_t group = RAW_INDEX_INTERVAL * block + RAW_INDEX_BLOCK_SIZE;
+    int64_t rem = rr->data_size - RAW_CLIP_HEADER_SIZE;
+    int groups = rem > 0 ? rem / group : 0;
+    int64_t tail = rem > 0 ? (rem - groups * group) / block : 0;
+    int frames = groups * RAW_INDEX_INTERVAL + (tail < RAW_INDEX_INTERVAL ? tail : RAW_INDEX_INTERVAL);
+
+    if (rr->stripes)
+    {
+        rr->frame_numbers = calloc(frames + 1, sizeof(rr->frame_numbers[0]));
+        if (!rr->frame_numbers)
+            ERR("out of memory");
+    }
+
+    /* check the index blocks, and get the frame numbers from them */
+    static raw_index_entry_t entries[RAW_INDEX_INTERVAL];
+    unsigned int prev = 0;
+    int g;
+    for (g = 0; g < groups; g++)
+    {
+        int first = g * RAW_INDEX_INTERVAL;
+        int64_t offset = RAW_FRAME_BLOCK_OFFSET(first + RAW_INDEX_INTERVAL, rr->frame_size) - RAW_INDEX_BLOCK_SIZE;
+        if (!clip_read(rr, offset, &hdr, sizeof(hdr)) || !is_index_header(&hdr, first, RAW_INDEX_INTERVAL) ||
+            !clip_read(rr, offset + hdr.data_offset, entries, sizeof(entries)))
+        {
+            /* recording interrupted while writing it? the frames before it may still be there */
+            printf("RAW reader  : index %d is missing or damaged\n", g);
+            frames = first + RAW_INDEX_INTERVAL;
+            break;
+        }
+        int i;
+        for (i = 0; i < RAW_INDEX_INTERVAL; i++)
+            check_frame_number(rr, first + i, entries[i].frame_number, &prev);
+    }
+
+    /* last frame may be incomplete (or not written at all, if the card was full) */
+    while (frames > 0)
+    {
+        if (clip_read(rr, RAW_FRAME_BLOCK_OFFSET(frames - 1, rr->frame_size), &hdr, sizeof(hdr)) && is_frame_header(&hdr, frames - 1, rr->frame_size))
+            break;
+        frames--;
+    }
+
+    /* the final index is right after the last frame (or after the last regular index) */
+    int first = frames - frames % RAW_INDEX_INTERVAL;
+    int64_t offset = RAW_FRAME_BLOCK_OFFSET(frames, rr->frame_size);
+    if (clip_read(rr, offset, &hdr, sizeof(hdr)) && is_index_header(&hdr, first, frames - first) && (hdr.flags & RAW_INDEX_LAST) &&
+        clip_read(rr, offset + hdr.data_offset, entries, (frames - first) * sizeof(entries[0])))
+    {
+        rr->complete = 1;
+        int i;
+        for (i = 0; i < frames - first; i++)
+            check_frame_number(rr, first + i, entries[i].frame_number, &prev);
+    }
+    else
+    {
+        /* no final index: recording was interrupted; take the frame numbers from the block headers */
+        int i;
+        for (i = first; i < frames; i++)
+        {
+            if (!clip_read(rr, RAW_FRAME_BLOCK_OFFSET(i, rr->frame_size), &hdr, sizeof(hdr)) || !is_frame_header(&hdr, i, rr->frame_size))
+            {
+                frames = i;
+                break;
+            }
+            check_frame_number(rr, i, hdr.frame_number, &prev);
+        }
+        printf("RAW reader  : no final index (recording interrupted?), recovered %d frames\n", frames);
+    }
+
+    if (rr->frame_numbers)
+    {
+        /* frames before a damaged index: we didn't get their numbers yet */
+        int i;
+        for (i = 0; i < frames; i++)
+        {
+            if (rr->frame_numbers[i])
+                continue;
+            if (!clip_read(rr, RAW_FRAME_BLOCK_OFFSET(i, rr->frame_size), &hdr, sizeof(hdr)) || !is_frame_header(&hdr, i, rr->frame_size))
+            {
+                frames = i;
+                break;
+            }
+            rr->frame_numbers[i] = hdr.frame_number;
+        }
+
+        /* the gaps are (mostly) the frames saved in the other part */
+        rr->skipped_frames = 0;
+    }
+
+    rr->frame_count = frames;
+    rr->footer.frameCount = frames;
+    return 1;
+
+err:
+    return 0;
+}
+
+int raw_reader_open(struct raw_reader* rr, char* filename)
+{
+    memset(rr, 0, sizeof(*rr));
+
+    int i;
+    for (i = 0; i < RAW_MAX_CHUNKS; i++)
+    {
+        struct raw_chunk* c = &rr->chunks[i];
+        get_chunk_file_name(filename, i, c->filename, sizeof(c->filename));
+        if (!chunk_open(c))
+        {
+            if (i == 0) ERR("could not open %s", filename);
+            break;
+        }
+        c->start = rr->data_size;
+        rr->data_size += c->size;
+        rr->num_chunks++;
+    }
+
+    /* indexed container? */
+    char magic[4];
+    if (chunk_read(&rr->chunks[0], 0, magic, 4) && !strncmp(magic, "RAWH", 4))
+    {
+        if (!open_indexed(rr))
+            goto err;
+        rr->map_align = get_map_align();
+        return 1;
+    }
+
+    /* footer is at the end of the last chunk */
+    struct raw_chunk* last = &rr->chunks[rr->num_chunks-1];
+    int footer_size = sizeof(lv_rec_file_footer_t);
+    if (last->size < footer_size)
+        ERR("%s: file too small", last->filename);
+    if (!chunk_read(last, last->size - footer_size, &rr->footer, footer_size))
+        ERR("%s: could not read footer", last->filename);
+    if (strncmp((char*)rr->footer.magic, "RAWM", 4))
+        ERR("This ain't a lv_rec RAW file");
+
+    last->size -= footer_size;
+    rr->data_size -= footer_size;
+
+    rr->frame_size = rr->footer.frameSize;
+    if (rr->frame_size <= 0)
+        ERR("invalid frame size: %d", rr->frame_size);
+
+    rr->frame_count = rr->footer.frameCount;
+    if ((int64_t) rr->frame_count * rr->frame_size > rr->data_size)
+    {
+        rr->frame_count = rr->data_size / rr->frame_size;
+        printf("RAW reader  : only %d of %d frames present (missing chunks?)\n", rr->frame_count, rr->footer.frameCount);
+    }
+
+    rr->map_align = get_map_align();
+    return 1;
+
+err:
+    raw_reader_close(rr);
+    return 0;
+}
+
+void raw_reader_close(struct raw_reader* rr)
+{
+    int i;
+    for (i = 0; i < rr->num_chunks; i++)
+        chunk_close(&rr->chunks[i]);
+    rr->num_chunks = 0;
+
+    for (i = 0; i < rr->num_parts; i++)
+    {
+        raw_reader_close(rr->parts[i]);
+        free(rr->parts[i]);
+    }
+    rr->num_parts = 0;
+
+    free(rr->part_frames); rr->part_frames = 0;
+    free(rr->frame_numbers); rr->frame_numbers = 0;
+}
+
+int raw_reader_merge(struct raw_reader* rr, char* filename)
+{
+    struct raw_reader* a = 0;
+    struct raw_reader* b = 0;
+
+    if (!rr->stripes || rr->num_parts)
+        ERR("%s is not part of a striped clip", rr->chunks[0].filename);
+
+    b = malloc(sizeof(*b));
+    if (!b)
+        ERR("out of memory");
+    if (!raw_reader_open(b, filename))
+    {
+        free(b);
+        return 0;
+    }
+
+    if (b->stripes != rr->stripes || b->clip_id != rr->clip_id)
+        ERR("%s is not from the same clip", filename);
+    if (b->stripe == rr->stripe)
+        ERR("%s is the same part of the clip (%d of %d)", filename, rr->stripe + 1, rr->stripes);
+    if (b->frame_size != rr->frame_size || b->footer.xRes != rr->footer.xRes || b->footer.yRes != rr->footer.yRes)
+        ERR("%s: different frame size", filename);
+
+    /* we keep the two parts as they are; the merged clip only has the frame map */
+    a = malloc(sizeof(*a));
+    if (!a)
+        ERR("out of memory");
+    *a = *rr;
+
+    struct raw_part_frame* map = malloc((a->frame_count + b->frame_count + 1) * sizeof(map[0]));
+    if (!map)
+        ERR("out of memory");
+
+    struct raw_reader* parts[2] = { a, b };
+    if (a->stripe > b->stripe) { parts[0] = b; parts[1] = a; }
+
+    /* both parts are in capture order; merge them by frame number */
+    int n = 0, i = 0, j = 0;
+    unsigned int prev = 0;
+    int skipped = 0;
+    while (i < parts[0]->frame_count || j < parts[1]->frame_count)
+    {
+        unsigned int fi = i < parts[0]->frame_count ? parts[0]->frame_numbers[i] : UINT32_MAX;
+        unsigned int fj = j < parts[1]->frame_count ? parts[1]->frame_numbers[j] : UINT32_MAX;
+        if (fi == fj)
+        {
+            free(map);
+            ERR("frame %u is present in both parts", fi);
+        }
+        if (fi < fj) { map[n].part = 0; map[n].index = i++; }
+        else         { map[n].part = 1; map[n].index = j++; }
+
+        unsigned int fn = fi < fj ? fi : fj;
+        if (prev && fn < prev)
+            printf("RAW reader  : frame %u out of order\n", fn);
+        if (prev && fn > prev + 1)
+            skipped += fn - prev - 1;
+        prev = fn;
+        n++;
+    }
+
+    memset(rr, 0, sizeof(*rr));
+    rr->footer = parts[0]->footer;
+    rr->footer.frameCount = n;
+    rr->frame_count = n;
+    rr->frame_size = parts[0]->frame_size;
+    rr->map_align = parts[0]->map_align;
+    rr->indexed = 1;
+    rr->complete = parts[0]->complete && parts[1]->complete;
+    rr->skipped_frames = skipped;
+    rr->stripes = parts[0]->stripes;
+    rr->clip_id = parts[0]->clip_id;
+    rr->num_parts = 2;
+    rr->parts[0] = parts[0];
+    rr->parts[1] = parts[1];
+    rr->part_frames = map;
+    return 1;
+
+err:
+    if (b)
+    {
+        raw_reader_close(b);
+        free(b);
+    }
+    if (a)
+        free(a);
+    return 0;
+}
+
+int raw_reader_get_frame(struct raw_reader* rr, int index, struct raw_frame* frame)
+{
+    memset(frame, 0, sizeof(*frame));
+
+    if (index < 0 || index >= rr->frame_count)
+        return 0;
+
+    if (rr->num_parts)
+    {
+        struct raw_part_frame* p = &rr->part_frames[index];
+        return raw_reader_get_frame(rr->parts[p->part], p->index, frame);
+    }
+
+    int64_t offset = frame_offset(rr, index);
+    int size = rr->frame_size;
+    struct raw_chunk* c = find_chunk(rr, offset);
+    if (!c) return 0;
+
+    int64_t local = offset - c->start;
+    if (local + size <= c->size)
+    {
+        /* whole frame in one file: map it */
+        int64_t aligned = local & ~(int64_t)(rr->map_align - 1);
+        int delta = local - aligned;
+        void* addr = chunk_map(c, aligned, delta + size);
+        if (!addr) return 0;
+        chunk_advise(c, addr, aligned, delta + size);
+        frame->map_addr = addr;
+        frame->map_size = delta + size;
+        frame->data = addr + delta;
+        return 1;
+    }
+
+    /* frame split between two (or more) files: copy it */
+    char* buf = malloc(size);
+    if (!buf) return 0;
+    if (!clip_read(rr, offset, buf, size))
+    {
+        free(buf);
+        return 0;
+    }
+    frame->data = buf;
+    return 1;
+}
+
+void raw_reader_release_frame(struct raw_frame* frame)
+{
+    if (frame->map_addr)
+        chunk_unmap(frame->map_addr, frame->map_size);
+    else
+        free(frame->data);
+    memset(frame, 0, sizeof(*frame));
+}
+
+void raw_reader_prefetch(struct raw_reader* rr, int index, int count)
+{
+    if (index < 0) { count += index; index = 0; }
+    if (index + count > rr->frame_count) count = rr->frame_count - index;
+    if (count <= 0) return;
+
+    if (rr->num_parts)
+    {
+        /* consecutive frames from the same part */
+        int i = index;
+        while (i < index + count)
+        {
+            struct raw_part_frame* p = &rr->part_frames[i];
+            int n = 1;
+            while (i + n < index + count && rr->part_frames[i + n].part == p->part && rr->part_frames[i + n].index == p->index + n)
+                n++;
+            raw_reader_prefetch(rr->parts[p->part], p->index, n);
+            i += n;
+        }
+        return;
+    }
+
+    int64_t offset = frame_offset(rr, index);
+    int64_t end = frame_offset(rr, index + count - 1) + rr->frame_size;
+
+    while (offset < end)
+    {
+        struct raw_chunk* c = find_chunk(rr, offset);
+        if (!c) break;
+        int64_t local = offset - c->start;
+        int64_t part = c->size - local < end - offset ? c->size - local : end - offset;
+        chunk_advise(c, 0, local, part);
+        offset += part;
+    }
+}
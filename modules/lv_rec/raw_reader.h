@@ -0,0 +1,109 @@
+/**
+ * Memory-mapped reader for lv_rec / raw_rec files (desktop side)
+ *
+ * A clip may be split in several files (M1234567.RAW, .R00, .R01 and so on, see get_next_chunk_file_name in raw_rec),
+ * with the footer at the end of the last one. The reader opens all of them and presents the clip
+ * as one array of frames, addressed by index. Frames are mapped straight from the files (no copy),
+ * so several threads can work on different frames at the same time.
+ *
+ * Clips saved with the indexed container (see lv_rec.h) have their metadata at the beginning, and no footer;
+ * if they were cut short, all the complete frames are still available.
+ *
+ * Striped clips (dual card recording) are saved as one file on each card. Each file can be opened on its own
+ * (only the frames saved on that card); raw_reader_merge adds the other part, and the frames are
+ * presented in capture order, as if they were saved in a single file.
+ **/
+
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _raw_reader_h_
+#define _raw_reader_h_
+
+#include <stdint.h>
+#include "lv_rec.h"
+
+/* RAW, R00 ... R99 */
+#define RAW_MAX_CHUNKS 101
+
+struct raw_chunk
+{
+    char filename[256];
+    int fd;
+    void* map_handle;           /* Windows only */
+    int64_t size;               /* data bytes in this file (without the footer) */
+    int64_t start;              /* offset of this file in the clip */
+};
+
+/* striped clips: where to find each frame */
+struct raw_part_frame
+{
+    int part;
+    int index;
+};
+
+struct raw_reader
+{
+    lv_rec_file_footer_t footer;
+    int frame_count;            /* number of complete frames available (normally footer.frameCount) */
+    int frame_size;             /* footer.frameSize (includes padding) */
+    int num_chunks;
+    struct raw_chunk chunks[RAW_MAX_CHUNKS];
+    int64_t data_size;          /* all chunks together */
+    int map_align;              /* page size (allocation granularity on Windows) */
+    int indexed;                /* indexed container: frames have block headers, footer.frameCount is filled by us */
+    int complete;               /* indexed container: the final index is present (recording stopped normally) */
+    int skipped_frames;         /* indexed container: gaps in frame numbers (skipped while recording) */
+    int stripe;                 /* striped clip: which part this file is (0...stripes-1) */
+    int stripes;                /* striped clip: number of parts; 0 = not striped */
+    uint32_t clip_id;           /* striped clip: same in all parts */
+    unsigned int* frame_numbers;/* striped clip: capture frame number of each frame in this file */
+
+    /* after raw_reader_merge: the parts, opened separately, and where each frame is */
+    int num_parts;
+    struct raw_reader* parts[RAW_MAX_STRIPES];
+    struct raw_part_frame* part_frames;
+};
+
+struct raw_frame
+{
+    void* data;                 /* frame_size bytes; writable, but changes are not saved back to the file */
+    void* map_addr;             /* what we have to unmap, or 0 if data was malloc'ed */
+    int64_t map_size;
+};
+
+/* open a RAW file and all its chunks, and read the footer */
+/* returns 1=success, 0=failed (error message already printed) */
+int raw_reader_open(struct raw_reader* rr, char* filename);
+void raw_reader_close(struct raw_reader* rr);
+
+/* striped clip: add the other part (the file saved on the other card); frames are then presented in capture order */
+/* returns 1=success, 0=failed (error message already printed; rr is still usable, with the first part only) */
+int raw_reader_merge(struct raw_reader* rr, char* filename);
+
+/* get a frame by index (0 ... frame_count-1); thread-safe */
+/* frames that span two chunks are copied in a temporary buffer; everything else is mapped directly */
+int raw_reader_get_frame(struct raw_reader* rr, int index, struct raw_frame* frame);
+void raw_reader_release_frame(struct raw_frame* frame);
+
+/* hint: we'll need these frames soon, start reading them in background */
+void raw_reader_prefetch(struct raw_reader* rr, int index, int count);
+
+#endif
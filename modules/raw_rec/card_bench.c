@@ -0,0 +1,245 @@
+/**
+ * Card write benchmark for raw_rec (per-card throughput profiles)
+ * See card_bench.h; this file must not depend on camera stuff other than FIO (it's also compiled on the PC).
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifdef MODULE
+#include <dryos.h>
+#else
+#include "fio_host.h"
+#endif
+#include "card_bench.h"
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+#define CARD_BENCH_REF_SIZE (16*1024*1024)  /* largest block size for the alignment and long file tests */
+#define CARD_BENCH_SEGMENTS 8               /* the long file is timed in this many pieces */
+
+/* KB/s */
+static int bench_speed(int bytes, int ms)
+{
+    return (bytes / 1024) * 1000.0f / MAX(ms, 1);
+}
+
+/**
+ * Write a new file with blocks of the same size, from buf + misalign, starting at file position misalign.
+ * If segments > 0, the time for each 1/segments of the file is stored in segment_ms.
+ * Returns the time spent in FIO_WriteFile (ms), or an error code (<0).
+ */
+static int bench_file(struct card_bench_params * p, int test, int block_size, int misalign, int total, int* segment_ms, int segments)
+{
+    FIO_RemoveFile(p->filename);
+    if (p->pause) msleep(p->pause);
+
+    FILE* f = FIO_CreateFileEx(p->filename);
+    if (!f || f == INVALID_PTR)
+        return CARD_BENCH_ERR_CREATE;
+
+    int err = 0;
+    if (misalign && FIO_WriteFile(f, p->buf, misalign) != misalign)
+        err = CARD_BENCH_ERR_WRITE;
+
+    void* buf = (char*) p->buf + misalign;
+    int n = MAX(total / block_size, 4);
+    int seg = 0;
+    int last_percent = -10;
+    int t0 = get_ms_clock_value();
+    int ts = t0;
+
+    for (int i = 0; i < n && !err; i++)
+    {
+        if (p->cancel && *p->cancel)
+        {
+            err = CARD_BENCH_CANCELLED;
+            break;
+        }
+
+        /* only report every 10%, so the progress display doesn't slow down the card */
+        int percent = i * 100 / n;
+        if (p->progress && percent / 10 != last_percent / 10)
+        {
+            int t = get_ms_clock_value();
+            p->progress(test, block_size, percent);
+            int dt = get_ms_clock_value() - t;
+            t0 += dt;
+            ts += dt;
+            last_percent = percent;
+        }
+
+        if (FIO_WriteFile(f, buf, block_size) != block_size)
+        {
+            err = CARD_BENCH_ERR_WRITE;
+            break;
+        }
+
+        if (segments && (i + 1) == (seg + 1) * n / segments)
+        {
+            int t = get_ms_clock_value();
+            segment_ms[seg++] = t - ts;
+            ts = t;
+        }
+    }
+
+    int t1 = get_ms_clock_value();
+    FIO_CloseFile(f);
+    FIO_RemoveFile(p->filename);
+
+    return err ? err : MAX(t1 - t0, 1);
+}
+
+/* same test with a misaligned buffer and file position: % of the aligned speed */
+static int bench_misaligned(struct card_bench_params * p, int test, int ref, int aligned_speed, int misalign)
+{
+    int block_size = CARD_BENCH_BLOCK_SIZE(ref);
+    int total = MAX(p->test_size, 4 * block_size) / block_size * block_size;
+    int ms = bench_file(p, test, block_size, misalign, total, 0, 0);
+    if (ms < 0)
+        return ms;
+
+    return MIN(100, bench_speed(total, ms) * 100 / MAX(aligned_speed, 1));
+}
+
+int card_bench_run(struct card_bench_params * p, struct card_profile * profile)
+{
+    int ref = -1;
+
+    /* speed vs block size */
+    for (int i = 0; i < CARD_BENCH_SIZES; i++)
+    {
+        int block_size = CARD_BENCH_BLOCK_SIZE(i);
+        profile->speed[i] = 0;
+
+        if (block_size > p->buf_size)
+            continue;
+
+        int total = MAX(p->test_size, 4 * block_size) / block_size * block_size;
+        int ms = bench_file(p, i, block_size, 0, total, 0, 0);
+        if (ms < 0)
+            return ms;
+
+        profile->speed[i] = bench_speed(total, ms);
+
+        if (block_size <= CARD_BENCH_REF_SIZE && block_size + 16 <= p->buf_size)
+            ref = i;
+    }
+
+    profile->align512 = profile->unaligned = profile->late = 100;
+    if (ref < 0)
+        return CARD_BENCH_OK;
+
+    /* alignment */
+    int r = bench_misaligned(p, CARD_BENCH_SIZES, ref, profile->speed[ref], 512);
+    if (r < 0) return r;
+    profile->align512 = r;
+
+    r = bench_misaligned(p, CARD_BENCH_SIZES + 1, ref, profile->speed[ref], 16);
+    if (r < 0) return r;
+    profile->unaligned = r;
+
+    /* long file: compare its slowest piece with the speed at the start of a file */
+    int block_size = CARD_BENCH_BLOCK_SIZE(ref);
+    int blocks = MAX(p->long_size / block_size, CARD_BENCH_SEGMENTS);
+    int segment_ms[CARD_BENCH_SEGMENTS];
+    int ms = bench_file(p, CARD_BENCH_SIZES + 2, block_size, 0, blocks * block_size, segment_ms, CARD_BENCH_SEGMENTS);
+    if (ms < 0)
+        return ms;
+
+    int slowest = profile->speed[ref];
+    for (int i = 0; i < CARD_BENCH_SEGMENTS; i++)
+    {
+        int n = (i + 1) * blocks / CARD_BENCH_SEGMENTS - i * blocks / CARD_BENCH_SEGMENTS;
+        slowest = MIN(slowest, bench_speed(n * block_size, segment_ms[i]));
+    }
+    profile->late = slowest * 100 / MAX(profile->speed[ref], 1);
+
+    return CARD_BENCH_OK;
+}
+
+static unsigned int hash_string(unsigned int h, const char * s)
+{
+    /* FNV-1a */
+    if (s)
+    {
+        while (*s)
+        {
+            h ^= (unsigned char) *s++;
+            h *= 16777619;
+        }
+    }
+    return h;
+}
+
+int card_bench_card_id(char drive, const char * maker, const char * model)
+{
+    char drv[2] = { drive, 0 };
+    unsigned int h = 2166136261u;
+    h = hash_string(h, drv);
+    h = hash_string(h, maker);
+    h = hash_string(h, "/");
+    h = hash_string(h, model);
+    return h ? (int) h : 1;
+}
+
+struct card_profile * card_profile_find(struct card_profile * profiles, int num_profiles, int card_id)
+{
+    for (int i = 0; i < num_profiles; i++)
+        if (card_id && profiles[i].card_id == card_id)
+            return &profiles[i];
+
+    return 0;
+}
+
+struct card_profile * card_profile_store(struct card_profile * profiles, int num_profiles, struct card_profile * profile, int * next_victim)
+{
+    struct card_profile * dst = card_profile_find(profiles, num_profiles, profile->card_id);
+
+    for (int i = 0; i < num_profiles && !dst; i++)
+        if (!profiles[i].card_id)
+            dst = &profiles[i];
+
+    if (!dst)
+    {
+        dst = &profiles[*next_victim % num_profiles];
+        *next_victim = (*next_victim + 1) % num_profiles;
+    }
+
+    *dst = *profile;
+    return dst;
+}
+
+int card_profile_factor(struct card_profile * profile, int start, int stride, int late)
+{
+    int a = start | stride;
+    int factor = (a & 511) ? profile->unaligned : (a & 4095) ? profile->align512 : 100;
+    factor = factor ? factor : 100;
+
+    if (late && profile->late)
+        factor = factor * profile->late / 100;
+
+    return factor;
+}
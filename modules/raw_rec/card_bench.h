@@ -0,0 +1,104 @@
+/**
+ * Card write benchmark for raw_rec (per-card throughput profiles)
+ *
+ * Writes test files with FIO_WriteFile and measures:
+ * - the write speed for each block size from 256K to 64M (aligned buffer, start of a new file);
+ * - the same at a reference block size, with the buffer and the file position misaligned
+ *   (by 512 bytes, like indexed clips and most frame sizes, and by 16 bytes, like the other frame sizes);
+ * - the speed along a long file (e.g. 1 GB), to catch cards that slow down after a while.
+ *
+ * No camera dependencies: on the PC, it runs on top of a stand-in FIO layer (fio_host.c, see cardbench.c),
+ * so it can also profile files on host storage.
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _card_bench_h_
+#define _card_bench_h_
+
+/* block sizes: 256K, 512K, 1M ... 64M */
+#define CARD_BENCH_SIZES 9
+#define CARD_BENCH_BLOCK_SIZE(i) ((256*1024) << (i))
+
+/* what we remember about one card */
+struct card_profile
+{
+    int card_id;                    /* from card_bench_card_id; 0 = unused */
+    int speed[CARD_BENCH_SIZES];    /* KB/s for each block size; 0 = not measured */
+    int align512;                   /* buffer and file position aligned at 512 bytes, but not 4K: % of the aligned speed */
+    int unaligned;                  /* same, misaligned by 16 bytes */
+    int late;                       /* slowest part of a long file: % of the speed at the start of a file */
+};
+
+struct card_bench_params
+{
+    const char * filename;          /* test file; removed after each test */
+    void * buf;                     /* data to write (contents don't matter) */
+    int buf_size;                   /* larger block sizes are skipped; needs 16 extra bytes for the misaligned tests */
+    int test_size;                  /* bytes written for each block size (at least 4 blocks) */
+    int long_size;                  /* bytes written for the long file test */
+    int pause;                      /* ms to wait between tests (let the card settle) */
+
+    /* optional: called before each test and every now and then (test = 0 ... CARD_BENCH_TESTS-1) */
+    void (*progress)(int test, int block_size, int percent);
+    volatile int * cancel;          /* optional: stop as soon as this becomes nonzero */
+};
+
+#define CARD_BENCH_TESTS (CARD_BENCH_SIZES + 3)
+
+/* card_bench_run return values */
+#define CARD_BENCH_OK           0
+#define CARD_BENCH_ERR_CREATE  -1   /* could not create the test file */
+#define CARD_BENCH_ERR_WRITE   -2   /* short write (card full?) */
+#define CARD_BENCH_CANCELLED   -3
+
+/**
+ * Run all the tests and fill the profile (card_id is left unchanged).
+ * The reference block size (for the alignment and long file tests) is the largest one
+ * up to 16M that fits in the buffer.
+ */
+int card_bench_run(struct card_bench_params * p, struct card_profile * profile);
+
+/**
+ * Card identifier, for keeping one profile per card.
+ * DryOS doesn't tell us the card serial number, so we go with what we have:
+ * drive letter, plus maker and model strings where the camera reports them (may be 0).
+ * Never returns 0.
+ */
+int card_bench_card_id(char drive, const char * maker, const char * model);
+
+/* profile for this card, or 0 */
+struct card_profile * card_profile_find(struct card_profile * profiles, int num_profiles, int card_id);
+
+/**
+ * Save a new profile: replaces the one for the same card, or an unused one,
+ * or one of the others, round-robin (next_victim: counter kept by the caller).
+ * Returns the saved profile.
+ */
+struct card_profile * card_profile_store(struct card_profile * profiles, int num_profiles, struct card_profile * profile, int * next_victim);
+
+/**
+ * Speed correction for the way the data will be written (% of the benchmark curve):
+ * alignment of the buffer and file position (the worst of start and stride), and late = 1 to include
+ * the slowdown along long files.
+ */
+int card_profile_factor(struct card_profile * profile, int start, int stride, int late);
+
+#endif
@@ -0,0 +1,113 @@
+/**
+ * Card write benchmark on the PC (same code as in raw_rec, on top of fio_host.c)
+ *
+ * Profiles the storage behind a file name (e.g. a card in a USB reader), and prints the curve
+ * raw_rec would save for this card.
+ * Usage: cardbench [--test=MB] [--long=MB] [--buf=MB] file
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "card_bench.h"
+
+#define FAIL(fmt,...) { fprintf(stderr, "Error: "); fprintf(stderr, fmt, ## __VA_ARGS__); fprintf(stderr, "\n"); exit(1); }
+#define CHECK(ok, fmt,...) { if (!(ok)) FAIL(fmt, ## __VA_ARGS__); }
+
+static void progress(int test, int block_size, int percent)
+{
+    const char * names[] = { "aligned at 512", "misaligned", "long file" };
+    const char * name = test < CARD_BENCH_SIZES ? "" : names[test - CARD_BENCH_SIZES];
+    fprintf(stderr, "\r[%d/%d] %dK blocks %s: %d%%   ", test + 1, CARD_BENCH_TESTS, block_size / 1024, name, percent);
+}
+
+int main(int argc, char** argv)
+{
+    int test_mb = 64;
+    int long_mb = 1024;
+    int buf_mb = 64;
+    char * filename = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--test=", 7) == 0)
+            test_mb = atoi(argv[i] + 7);
+        else if (strncmp(argv[i], "--long=", 7) == 0)
+            long_mb = atoi(argv[i] + 7);
+        else if (strncmp(argv[i], "--buf=", 6) == 0)
+            buf_mb = atoi(argv[i] + 6);
+        else if (argv[i][0] != '-' && !filename)
+            filename = argv[i];
+        else
+            FAIL("Unknown option: %s", argv[i]);
+    }
+
+    if (!filename)
+    {
+        printf("Card write benchmark (block sizes, alignment, long files)\n");
+        printf("Usage: %s [--test=MB] [--long=MB] [--buf=MB] file\n", argv[0]);
+        printf("  --test: data written for each block size (default 64)\n");
+        printf("  --long: size of the long file (default 1024)\n");
+        printf("  --buf:  largest block size (default 64)\n");
+        return 0;
+    }
+
+    CHECK(test_mb > 0 && long_mb > 0 && buf_mb > 0 && long_mb < 2048 && buf_mb <= 256, "Invalid sizes");
+
+    struct card_bench_params p = {
+        .filename = filename,
+        .buf_size = buf_mb * 1024 * 1024 + 16,
+        .test_size = test_mb * 1024 * 1024,
+        .long_size = long_mb * 1024 * 1024,
+        .progress = progress,
+    };
+
+    /* the contents don't matter, but make sure the pages are actually there */
+    p.buf = malloc(p.buf_size);
+    CHECK(p.buf, "malloc");
+    memset(p.buf, 0x55, p.buf_size);
+
+    struct card_profile profile;
+    int r = card_bench_run(&p, &profile);
+    fprintf(stderr, "\n");
+    CHECK(r != CARD_BENCH_ERR_CREATE, "Could not create %s", filename);
+    CHECK(r != CARD_BENCH_ERR_WRITE, "Write error (disk full?)");
+    CHECK(r == CARD_BENCH_OK, "Benchmark failed (%d)", r);
+
+    printf("Block size   Write speed\n");
+    for (int i = 0; i < CARD_BENCH_SIZES; i++)
+    {
+        int size = CARD_BENCH_BLOCK_SIZE(i) / 1024;
+        int speed = profile.speed[i] * 10 / 1024;
+        if (!profile.speed[i])
+            printf("%6d%s      (skipped)\n", size < 1024 ? size : size / 1024, size < 1024 ? "K" : "M");
+        else
+            printf("%6d%s      %d.%d MB/s\n", size < 1024 ? size : size / 1024, size < 1024 ? "K" : "M", speed / 10, speed % 10);
+    }
+    printf("Aligned at 512 bytes: %d%%\n", profile.align512);
+    printf("Misaligned          : %d%%\n", profile.unaligned);
+    printf("Long file (slowest) : %d%%\n", profile.late);
+
+    free(p.buf);
+    return 0;
+}
@@ -0,0 +1,202 @@
+/**
+ * Movie file writer for raw_rec (see clip_writer.h)
+ * This file must not depend on camera stuff other than FIO (it's also compiled on the PC).
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifdef MODULE
+#include <dryos.h>
+#else
+#include <string.h>
+#include "fio_host.h"
+#endif
+#include "clip_writer.h"
+
+/* change file extension, according to chunk number: RAW, R00, R01 and so on */
+static void get_chunk_file_name(char * out, int maxlen, const char * base_name, int chunk)
+{
+    int len = strlen(base_name);
+    if (len >= maxlen) len = maxlen - 1;
+    memcpy(out, base_name, len);
+    out[len] = 0;
+
+    if (chunk > 0 && len >= 2)
+    {
+        out[len-2] = '0' + (chunk-1) / 10;
+        out[len-1] = '0' + (chunk-1) % 10;
+    }
+}
+
+int clip_writer_create(struct clip_writer * w, const char * filename)
+{
+    memset(w, 0, sizeof(*w));
+    get_chunk_file_name(w->filename, sizeof(w->filename), filename, 0);
+    get_chunk_file_name(w->chunk_filename, sizeof(w->chunk_filename), filename, 0);
+
+    FILE* f = FIO_CreateFileEx(w->filename);
+    if (!f || f == INVALID_PTR)
+        return 0;
+
+    w->f = f;
+    return 1;
+}
+
+void clip_writer_close(struct clip_writer * w)
+{
+    if (w->f)
+    {
+        FIO_CloseFile(w->f);
+        w->f = 0;
+    }
+
+    if (!w->written && w->filename[0])
+        FIO_RemoveFile(w->filename);
+}
+
+int clip_writer_write(struct clip_writer * w, void * ptr, int size)
+{
+    int r = FIO_WriteFile(w->f, ptr, size);
+
+    if (r == size)
+    {
+        /* all fine */
+        w->written += size / 1024;
+        w->written_chunk += size;
+        return 1;
+    }
+
+    /* 4GB limit or card full? */
+
+    /* it failed right away? card must be full */
+    if (w->written == 0) return 0;
+
+    if (r == -1)
+    {
+        /* 4GB limit? it stops after writing 4294967295 bytes, but FIO_WriteFile may return -1 */
+        //if ((uint64_t)w->written_chunk + size > 4294967295)
+        if (1) // renato says it's not working?!
+        {
+            r = 4294967295u - w->written_chunk;
+
+            /* 5D2 does not write anything if the call failed, but 5D3 writes exactly 4294967295 */
+            /* this one should cover both cases in a portable way */
+            /* on 5D2 will succeed, on 5D3 should fail right away */
+            FIO_WriteFile(w->f, ptr, r);
+        }
+        else /* idk */
+        {
+            r = 0;
+        }
+    }
+
+    /* try to create a new chunk */
+    get_chunk_file_name(w->chunk_filename, sizeof(w->chunk_filename), w->filename, ++w->chunk);
+    FILE* g = FIO_CreateFileEx(w->chunk_filename);
+    if (!g || g == INVALID_PTR) goto fail;
+
+    /* write the remaining data in the new chunk */
+    int r2 = FIO_WriteFile(g, ptr + r, size - r);
+    if (r2 == size - r) /* new chunk worked, continue with it */
+    {
+        FIO_CloseFile(w->f);
+        w->f = g;
+        w->written += size / 1024;
+        w->written_chunk = r2;
+        return 2;
+    }
+
+    /* new chunk didn't work, card full */
+    /* let's hope we can still save the footer in the current chunk (don't create a new one) */
+    FIO_CloseFile(g);
+    FIO_RemoveFile(w->chunk_filename);
+fail:
+    get_chunk_file_name(w->chunk_filename, sizeof(w->chunk_filename), w->filename, --w->chunk);
+    return 0;
+}
+
+void raw_block_header_init(raw_block_header_t * hdr, char * magic, int block_size, int data_offset, int data_size)
+{
+    memset(hdr, 0, data_offset);
+    memcpy(hdr->magic, magic, 4);
+    hdr->block_size = block_size;
+    hdr->data_offset = data_offset;
+    hdr->data_size = data_size;
+}
+
+int clip_writer_save_header(struct clip_writer * w, lv_rec_file_footer_t * footer, int stripe, int stripes, uint32_t clip_id)
+{
+    /* the index block is not used yet */
+    memset(w->index_block, 0, sizeof(w->index_block));
+    raw_block_header_t * hdr = (void*) w->index_block;
+    raw_block_header_init(hdr, "RAWH", RAW_CLIP_HEADER_SIZE, sizeof(raw_block_header_t), sizeof(lv_rec_file_footer_t));
+    hdr->frame_index = stripe;
+    hdr->frame_number = stripes;
+    hdr->timestamp = clip_id;
+
+    lv_rec_file_footer_t * dst = (void*) w->index_block + hdr->data_offset;
+    memcpy(dst, footer, sizeof(lv_rec_file_footer_t));
+    dst->frameCount = 0;
+
+    return clip_writer_write(w, w->index_block, RAW_CLIP_HEADER_SIZE) == 1;
+}
+
+void clip_writer_index_add(struct clip_writer * w, raw_block_header_t * frame)
+{
+    raw_index_entry_t * entries = (void*) w->index_block + sizeof(raw_block_header_t);
+    raw_index_entry_t * e = &entries[w->frames_saved % RAW_INDEX_INTERVAL];
+    e->frame_number = frame->frame_number;
+    e->timestamp = frame->timestamp;
+    w->frames_saved++;
+}
+
+int clip_writer_save_index(struct clip_writer * w, int last)
+{
+    /* the regular ones are saved after every RAW_INDEX_INTERVAL frames; the last one may have fewer entries (even 0) */
+    int count = w->frames_saved % RAW_INDEX_INTERVAL;
+    if (count == 0 && !last)
+        count = RAW_INDEX_INTERVAL;
+
+    raw_block_header_t * hdr = (void*) w->index_block;
+    raw_block_header_init(hdr, "RAWX", RAW_INDEX_BLOCK_SIZE, sizeof(raw_block_header_t), count * sizeof(raw_index_entry_t));
+    hdr->frame_index = w->frames_saved - count;
+    hdr->frame_number = count;
+    hdr->flags = last ? RAW_INDEX_LAST : 0;
+
+    return clip_writer_write(w, w->index_block, RAW_INDEX_BLOCK_SIZE);
+}
+
+int clip_writer_save_footer(struct clip_writer * w, lv_rec_file_footer_t * footer)
+{
+    int size = sizeof(lv_rec_file_footer_t);
+    if (FIO_WriteFile(w->f, footer, size) == size)
+        return 1;
+
+    /* try to save footer in a new chunk */
+    FIO_CloseFile(w->f); w->f = 0;
+    get_chunk_file_name(w->chunk_filename, sizeof(w->chunk_filename), w->filename, ++w->chunk);
+    FILE* g = FIO_CreateFileEx(w->chunk_filename);
+    if (!g || g == INVALID_PTR)
+        return 0;
+
+    int ok = FIO_WriteFile(g, footer, size) == size;
+    FIO_CloseFile(g);
+    return ok;
+}
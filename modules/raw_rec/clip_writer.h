@@ -0,0 +1,88 @@
+/**
+ * Movie file writer for raw_rec: one clip (or one stripe of a clip) on one card
+ *
+ * Takes care of the things that don't depend on where the frames come from:
+ * - splitting the clip in chunks at the 4GB limit (RAW, R00, R01...);
+ * - the blocks of the indexed container (clip header, index blocks, see lv_rec.h), or the footer of classic clips.
+ *
+ * Dual card recording uses one writer for each card, with the frames striped between them
+ * (each file is a valid clip with part of the frames; raw2dng merges them back by frame number).
+ *
+ * No camera dependencies other than FIO: on the PC, it runs on top of fio_host.c (see rawstripe.c).
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _clip_writer_h_
+#define _clip_writer_h_
+
+#include <stdint.h>
+#include "../lv_rec/lv_rec.h"
+
+struct clip_writer
+{
+    void * f;                       /* FILE* of the current chunk (opaque here, so this header also works next to stdio.h) */
+    char filename[100];             /* first chunk (.RAW) */
+    char chunk_filename[100];       /* current chunk (.RAW, .R00, .R01...) */
+    int chunk;                      /* 0 = RAW, 1 = R00 and so on */
+    uint32_t written_chunk;         /* bytes in the current chunk */
+    uint32_t written;               /* KB, all chunks */
+    int frames_saved;               /* indexed container: frames in this file so far */
+    uint32_t index_block[RAW_INDEX_BLOCK_SIZE / 4];  /* RAWX block being filled (indexed container) */
+};
+
+/* start a new clip; returns 0 if the file could not be created */
+int clip_writer_create(struct clip_writer * w, const char * filename);
+
+/* close the current chunk (if any); the clip is removed if nothing was written */
+void clip_writer_close(struct clip_writer * w);
+
+/**
+ * Write to the clip; if the current chunk is full (4GB limit), continue in a new one.
+ * Returns 1 if all fine, 2 if we had to start a new chunk, 0 if the card is full.
+ */
+int clip_writer_write(struct clip_writer * w, void * ptr, int size);
+
+/* fill the common part of a block header (the rest is zeroed, up to data_offset) */
+void raw_block_header_init(raw_block_header_t * hdr, char * magic, int block_size, int data_offset, int data_size);
+
+/**
+ * Indexed container: save the clip header (metadata, frameCount = 0), at the start of the file.
+ * Striped clips (dual card): stripe = which part this file is, stripes = how many (0 = not striped),
+ * clip_id = anything, as long as it's the same in all parts.
+ */
+int clip_writer_save_header(struct clip_writer * w, lv_rec_file_footer_t * footer, int stripe, int stripes, uint32_t clip_id);
+
+/**
+ * Indexed container: one more frame saved (its RAWF header, with frame_index = w->frames_saved);
+ * remember it for the next index block. Call clip_writer_save_index after every RAW_INDEX_INTERVAL frames.
+ */
+void clip_writer_index_add(struct clip_writer * w, raw_block_header_t * frame);
+
+/* indexed container: save the index for the frames written since the previous one (last = at the end of the clip) */
+int clip_writer_save_index(struct clip_writer * w, int last);
+
+/* how many frames we may write before the next index block */
+#define CLIP_WRITER_INDEX_ROOM(w) (RAW_INDEX_INTERVAL - (w)->frames_saved % RAW_INDEX_INTERVAL)
+
+/* classic clips: save the footer at the end (in a new chunk, if it doesn't fit in the current one) */
+int clip_writer_save_footer(struct clip_writer * w, lv_rec_file_footer_t * footer);
+
+#endif
@@ -0,0 +1,86 @@
+/**
+ * Stand-in for the DryOS file I/O calls, on top of POSIX (see fio_host.h)
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "fio_host.h"
+
+struct host_file
+{
+    int fd;
+};
+
+FILE* FIO_CreateFileEx(const char* name)
+{
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_DSYNC, 0644);
+    if (fd < 0)
+        return INVALID_PTR;
+
+    FILE* f = malloc(sizeof(FILE));
+    if (!f)
+    {
+        close(fd);
+        return INVALID_PTR;
+    }
+    f->fd = fd;
+    return f;
+}
+
+int FIO_WriteFile(FILE* stream, const void* ptr, size_t count)
+{
+    /* a short count means the disk is full */
+    size_t done = 0;
+    while (done < count)
+    {
+        ssize_t r = write(stream->fd, (const char*) ptr + done, count - done);
+        if (r <= 0)
+            break;
+        done += r;
+    }
+    return done;
+}
+
+void FIO_CloseFile(FILE* stream)
+{
+    close(stream->fd);
+    free(stream);
+}
+
+int FIO_RemoveFile(const char* name)
+{
+    return unlink(name);
+}
+
+int get_ms_clock_value()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+void msleep(int ms)
+{
+    usleep(ms * 1000);
+}
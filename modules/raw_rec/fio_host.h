@@ -0,0 +1,45 @@
+/**
+ * Stand-in for the DryOS file I/O calls used by card_bench.c, for running it on the PC.
+ *
+ * Files are opened with O_DSYNC, so each FIO_WriteFile call returns only after the data reached
+ * the storage device, like on the camera (otherwise we would only benchmark the page cache).
+ * FILE is an opaque type here: don't include <stdio.h> together with this header.
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _fio_host_h_
+#define _fio_host_h_
+
+#include <stddef.h>
+
+typedef struct host_file FILE;
+
+#define INVALID_PTR ((void *)0xFFFFFFFF)
+
+FILE* FIO_CreateFileEx(const char* name);
+int FIO_WriteFile(FILE* stream, const void* ptr, size_t count);
+void FIO_CloseFile(FILE* stream);
+int FIO_RemoveFile(const char* name);
+
+int get_ms_clock_value();
+void msleep(int ms);
+
+#endif
@@ -0,0 +1,589 @@
+/**
+ * Frame slots and writing queue for raw_rec (buffering logic only)
+ * See frame_slots.h; this file must not depend on camera stuff (it's also compiled on the PC).
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <limits.h>
+#include "frame_slots.h"
+
+#ifndef FAST
+#define FAST
+#endif
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+#ifndef mod
+#define mod(x,m) ((((x) % (m)) + (m)) % (m))
+#endif
+
+#ifndef COUNT
+#define COUNT(x) ((int)(sizeof(x)/sizeof((x)[0])))
+#endif
+
+
+/* fit as many frames as we can in a piece of memory (aligned at 4K) */
+static int slots_add(struct frame_slot * slots, int slot_count, int max_slots, void* ptr, int size, int frame_size)
+{
+    /* align at 4K */
+    ptr = (void*)(((intptr_t)ptr + 4095) & ~4095);
+
+    while (size >= frame_size + 8192 && slot_count < max_slots)
+    {
+        slots[slot_count].ptr = ptr;
+        slots[slot_count].status = SLOT_FREE;
+        ptr += frame_size;
+        size -= frame_size;
+        slot_count++;
+    }
+    return slot_count;
+}
+
+int slots_setup(struct frame_slot * slots, int max_slots, struct mem_chunk * chunks, int num_chunks,
+                int buf_size, int frame_size, void** fullsize_buffer, int* chunk_list, int chunk_list_len)
+{
+    int i;
+
+    for (i = 0; i < chunk_list_len; i++)
+        chunk_list[i] = 0;
+
+    /* find the smallest chunk that we can use for buf_size */
+    *fullsize_buffer = 0;
+    int waste = INT_MAX;
+    for (i = 0; i < num_chunks; i++)
+    {
+        int size = chunks[i].size;
+        if (size >= buf_size)
+        {
+            if (size - buf_size < waste)
+            {
+                waste = size - buf_size;
+                *fullsize_buffer = chunks[i].ptr;
+            }
+        }
+    }
+    if (*fullsize_buffer == 0) return -1;
+
+    chunk_list[0] = waste;
+    int chunk_index = 1;
+
+    /* use all chunks larger than frame_size for recording */
+    int slot_count = 0;
+    for (i = 0; i < num_chunks; i++)
+    {
+        int size = chunks[i].size;
+        void* ptr = chunks[i].ptr;
+        if (ptr != *fullsize_buffer) /* already used */
+        {
+            /* write it down for future frame predictions */
+            if (chunk_index < chunk_list_len && size > 8192)
+            {
+                chunk_list[chunk_index] = size - 8192;
+                chunk_index++;
+            }
+
+            slot_count = slots_add(slots, slot_count, max_slots, ptr, size, frame_size);
+        }
+    }
+
+    /* try to recycle the waste */
+    if (waste >= frame_size + 8192)
+    {
+        slot_count = slots_add(slots, slot_count, max_slots, *fullsize_buffer + buf_size, waste, frame_size);
+    }
+
+    return slot_count;
+}
+
+void* chunks_reserve(struct mem_chunk * chunks, int num_chunks, int size)
+{
+    int best = -1;
+    int best_avail = INT_MAX;
+    for (int i = 0; i < num_chunks; i++)
+    {
+        int align = (4096 - ((intptr_t)chunks[i].ptr & 4095)) & 4095;
+        int avail = chunks[i].size - align;
+        if (avail >= size && avail < best_avail)
+        {
+            best = i;
+            best_avail = avail;
+        }
+    }
+    if (best < 0) return 0;
+
+    void* ptr = (void*)(((intptr_t)chunks[best].ptr + 4095) & ~4095);
+    chunks[best].ptr = ptr + size;
+    chunks[best].size = best_avail - size;
+    return ptr;
+}
+
+/* writing queue */
+
+#define QUEUE_SIZE (MAX_SLOTS + 1)
+
+void frame_queue_init(struct frame_queue * q)
+{
+    q->head = q->tail = 0;
+}
+
+int frame_queue_push(struct frame_queue * q, int item)
+{
+    int tail = q->tail;
+    int next = tail + 1 < QUEUE_SIZE ? tail + 1 : 0;
+    if (next == q->head)
+        return 0;
+
+    q->items[tail] = item;
+    memory_barrier();   /* item (and the frame behind it) before tail */
+    q->tail = next;
+    return 1;
+}
+
+int frame_queue_count(struct frame_queue * q)
+{
+    int n = mod(q->tail - q->head, QUEUE_SIZE);
+    memory_barrier();   /* tail before the items */
+    return n;
+}
+
+int frame_queue_peek(struct frame_queue * q, int i)
+{
+    return q->items[mod(q->head + i, QUEUE_SIZE)];
+}
+
+void frame_queue_pop(struct frame_queue * q, int n)
+{
+    memory_barrier();   /* done with the items before giving them back */
+    q->head = mod(q->head + n, QUEUE_SIZE);
+}
+
+/* free slot allocator */
+
+static inline int slots_contiguous(struct slot_allocator * a, int i)
+{
+    /* is slot i+1 right after slot i? */
+    return i + 1 < a->slot_count && a->slots[i + 1].ptr == a->slots[i].ptr + a->frame_size;
+}
+
+static void run_insert(struct slot_allocator * a, int start, int end)
+{
+    int len = end - start + 1;
+    a->run_end[start] = end;
+    a->run_start[end] = start;
+    a->prev[start] = -1;
+    a->next[start] = a->first_run[len];
+    if (a->next[start] >= 0)
+        a->prev[a->next[start]] = start;
+    a->first_run[len] = start;
+    a->run_lengths[len / 32] |= 1u << (len % 32);
+}
+
+static void run_remove(struct slot_allocator * a, int start)
+{
+    int len = a->run_end[start] - start + 1;
+    if (a->prev[start] >= 0)
+        a->next[a->prev[start]] = a->next[start];
+    else
+        a->first_run[len] = a->next[start];
+    if (a->next[start] >= 0)
+        a->prev[a->next[start]] = a->prev[start];
+    if (a->first_run[len] < 0)
+        a->run_lengths[len / 32] &= ~(1u << (len % 32));
+}
+
+/* allocate the first slot of a free run */
+static int run_take_first(struct slot_allocator * a, int start)
+{
+    int end = a->run_end[start];
+    run_remove(a, start);
+    if (end > start)
+        run_insert(a, start + 1, end);
+    a->slots[start].status = SLOT_FULL;
+    a->free_count--;
+    return start;
+}
+
+void slots_alloc_init(struct slot_allocator * a, struct frame_slot * slots, int slot_count, int frame_size)
+{
+    a->slots = slots;
+    a->slot_count = MIN(slot_count, MAX_SLOTS);
+    a->frame_size = frame_size;
+    a->free_count = 0;
+    for (int i = 0; i <= MAX_SLOTS; i++)
+        a->first_run[i] = -1;
+    for (int i = 0; i < COUNT(a->run_lengths); i++)
+        a->run_lengths[i] = 0;
+
+    for (int i = 0; i < a->slot_count; i++)
+    {
+        slots[i].status = SLOT_FREE;
+        a->free_count++;
+    }
+
+    /* one run for each contiguous area */
+    for (int start = 0; start < a->slot_count; )
+    {
+        int end = start;
+        while (slots_contiguous(a, end))
+            end++;
+        run_insert(a, start, end);
+        start = end + 1;
+    }
+}
+
+int FAST slots_choose_capture(struct slot_allocator * a, int capture_slot, volatile int* force_new_buffer)
+{
+    /* keep on rolling? */
+    /* if the current slot is still in use, a free slot right after it must start a free run */
+    /* (if it was already written and released, the writer has caught up and asked for a new buffer anyway) */
+    if (
+        capture_slot >= 0 && 
+        a->slots[capture_slot].status != SLOT_FREE &&
+        slots_contiguous(a, capture_slot) &&
+        a->slots[capture_slot + 1].status == SLOT_FREE &&
+        !*force_new_buffer
+       )
+        return run_take_first(a, capture_slot + 1);
+
+    /* choose a new buffer? */
+    /* choose the largest contiguous free section (highest bit in the run length bitmap) */
+    *force_new_buffer = 0;
+
+    /* note: 32MB writes are slower (they require two DMA calls) */
+    /* no need to avoid them here; the write scheduler learns this and writes smaller blocks */
+
+    for (int i = COUNT(a->run_lengths) - 1; i >= 0; i--)
+    {
+        if (a->run_lengths[i])
+        {
+            int len = i * 32 + 31 - __builtin_clz(a->run_lengths[i]);
+            return run_take_first(a, a->first_run[len]);
+        }
+    }
+
+    /* nothing free */
+    return -1;
+}
+
+void FAST slots_release(struct slot_allocator * a, int slot_index)
+{
+    int start = slot_index;
+    int end = slot_index;
+    
+    /* merge with the free runs on both sides, if any (they must end/start right next to us) */
+    if (slot_index > 0 && a->slots[slot_index - 1].status == SLOT_FREE && slots_contiguous(a, slot_index - 1))
+    {
+        start = a->run_start[slot_index - 1];
+        run_remove(a, start);
+    }
+    if (slots_contiguous(a, slot_index) && a->slots[slot_index + 1].status == SLOT_FREE)
+    {
+        end = a->run_end[slot_index + 1];
+        run_remove(a, slot_index + 1);
+    }
+    
+    run_insert(a, start, end);
+    a->slots[slot_index].status = SLOT_FREE;
+    a->free_count++;
+}
+
+int slots_group_writes(struct frame_slot * slots, struct frame_queue * q, int frame_size)
+{
+    int count = frame_queue_count(q);
+    if (count == 0)
+        return 0;
+
+    void* first_ptr = slots[frame_queue_peek(q, 0)].ptr;
+
+    /* group items from the queue in a contiguous block - as many as we can */
+    /* TBH, I don't care if these are part of the same group or not,
+     * as long as pointers are ordered correctly */
+    int n = 1;
+    while (n < count && slots[frame_queue_peek(q, n)].ptr == first_ptr + frame_size * n)
+        n++;
+
+    return n;
+}
+
+int slots_limit_writes(int num_frames, int free_slots, int fps, int write_speed, int frame_size)
+{
+    if (write_speed)
+    {
+        /* write_speed unit: 0.01 MB/s */
+        /* FPS unit: 0.001 Hz */
+        /* overflow time unit: 0.1 seconds */
+        int overflow_time = free_slots * 1000 * 10 / fps;
+        /* better underestimate write speed a little */
+        int frame_limit = overflow_time * 1024 / 10 * (write_speed * 9 / 100) * 1024 / frame_size / 10;
+        if (frame_limit >= 0 && frame_limit < num_frames)
+        {
+            //~ console_printf("careful, will overflow in %d.%d seconds, better write only %d frames\n", overflow_time/10, overflow_time%10, frame_limit);
+            num_frames = MAX(1, frame_limit - 1);
+        }
+    }
+    return num_frames;
+}
+
+int slots_predict_frames(int* chunk_list, int chunk_list_len, int frame_size, int fps, int write_speed)
+{
+    int capture_speed = frame_size / 1000 * fps;
+    int buffer_fill_speed = capture_speed - write_speed;
+    if (buffer_fill_speed <= 0)
+        return INT_MAX;
+    
+    int total_slots = 0;
+    for (int i = 0; i < chunk_list_len; i++)
+        total_slots += chunk_list[i] / frame_size;
+    
+    float buffer_fill_time = total_slots * frame_size / (float) buffer_fill_speed;
+    int frames = buffer_fill_time * fps / 1000;
+    return frames;
+}
+
+/* write size scheduler */
+
+#define WRITE_MODEL_MIN_SIZE_LOG 16         /* first bucket: 64K */
+#define WRITE_MODEL_MAX_SIZE (64*1024*1024) /* don't consider larger writes */
+#define WRITE_MODEL_DECAY 0.95f             /* forget old measurements in the fit */
+#define WRITE_MODEL_PRIOR_LATENCY 5         /* ms; assumed until we measure a few different block sizes */
+#define WRITE_MODEL_PRIOR_WEIGHT 0.1f
+#define WRITE_MODEL_DEFAULT_SPEED 2000      /* 0.01 MB/s, if we don't know anything */
+
+#define SCHED_MAX_FRAMES 64                 /* don't plan blocks larger than this */
+
+static int write_model_bucket(int size)
+{
+    if (size <= 0) return 0;
+    
+    /* half-octave steps */
+    int log = 31 - __builtin_clz(size);
+    int half = log > 0 ? (size >> (log - 1)) & 1 : 0;
+    int b = (log - WRITE_MODEL_MIN_SIZE_LOG) * 2 + half;
+    return MAX(0, MIN(WRITE_MODEL_BUCKETS - 1, b));
+}
+
+void write_model_init(struct write_model * m, int prior_speed)
+{
+    for (int i = 0; i < WRITE_MODEL_BUCKETS; i++)
+        m->speed[i] = 0;
+    m->sw = m->sx = m->sy = m->sxx = m->sxy = 0;
+    
+    if (!prior_speed)
+        prior_speed = WRITE_MODEL_DEFAULT_SPEED;
+    
+    /* 0.01 MB/s -> KB/s */
+    m->prior_speed = prior_speed * 1024 / 100;
+}
+
+void write_model_update(struct write_model * m, int size, int time_ms)
+{
+    /* the ms clock is too coarse for these */
+    if (size <= 0 || time_ms <= 0)
+        return;
+    
+    int speed = size / 1024 * 1000 / time_ms;
+    
+    int b = write_model_bucket(size);
+    if (m->speed[b] == 0)
+        m->speed[b] = speed;
+    else
+        m->speed[b] = (m->speed[b] * 3 + speed) / 4;
+    
+    float x = size / 1048576.0f;
+    float y = time_ms;
+    m->sw  = m->sw  * WRITE_MODEL_DECAY + 1;
+    m->sx  = m->sx  * WRITE_MODEL_DECAY + x;
+    m->sy  = m->sy  * WRITE_MODEL_DECAY + y;
+    m->sxx = m->sxx * WRITE_MODEL_DECAY + x * x;
+    m->sxy = m->sxy * WRITE_MODEL_DECAY + x * y;
+}
+
+int write_model_predict(struct write_model * m, int size)
+{
+    int b = write_model_bucket(size);
+    if (m->speed[b])
+        return MAX(m->speed[b], 1);
+    
+    /* not tried yet: fit time = latency + size / speed on all measurements */
+    /* the prior is one point at size 0, with some fixed latency; this gives a line even with a single block size */
+    float w = WRITE_MODEL_PRIOR_WEIGHT;
+    float sw  = m->sw + w;
+    float sy  = m->sy + w * WRITE_MODEL_PRIOR_LATENCY;
+    float den = sw * m->sxx - m->sx * m->sx;
+    
+    float latency, slope;               /* ms, ms/MB */
+    if (den > 1e-3f)
+    {
+        slope = (sw * m->sxy - m->sx * sy) / den;
+        latency = (sy - slope * m->sx) / sw;
+    }
+    else
+    {
+        /* no measurements yet */
+        slope = 1024000.0f / m->prior_speed;
+        latency = WRITE_MODEL_PRIOR_LATENCY;
+    }
+    slope = MAX(slope, 1.0f);           /* no card is faster than 1000 MB/s */
+    latency = MAX(latency, 0);
+    
+    float size_mb = size / 1048576.0f;
+    int speed = size_mb * 1024000.0f / (latency + slope * size_mb);
+    return MAX(speed, 1);
+}
+
+/* interpolated write time (ms) for a block of this size; sizes[i] <= size <= sizes[j], both measured */
+static float curve_time(const int* sizes, const int* speeds, int i, int j, int size)
+{
+    float ti = sizes[i] / 1024 * 1000.0f / speeds[i];
+    float tj = sizes[j] / 1024 * 1000.0f / speeds[j];
+    if (i == j)
+        return ti;
+    return ti + (tj - ti) * (size - sizes[i]) / (float)(sizes[j] - sizes[i]);
+}
+
+void write_model_add_curve(struct write_model * m, const int* sizes, const int* speeds, int n)
+{
+    int first = -1, last = -1;
+    for (int i = 0; i < n; i++)
+    {
+        if (!speeds[i])
+            continue;
+        
+        if (first < 0) first = i;
+        last = i;
+        
+        /* one write of this size */
+        float x = sizes[i] / 1048576.0f;
+        float y = sizes[i] / 1024 * 1000.0f / speeds[i];
+        m->sw  += 1;
+        m->sx  += x;
+        m->sy  += y;
+        m->sxx += x * x;
+        m->sxy += x * y;
+    }
+    
+    if (first < 0)
+        return;
+    
+    for (int b = 0; b < WRITE_MODEL_BUCKETS; b++)
+    {
+        /* bucket b: from 2^log (or 1.5 * 2^log) to the next half-octave */
+        int log = b / 2 + WRITE_MODEL_MIN_SIZE_LOG;
+        int lo = (b % 2) ? (3 << log) / 2 : 1 << log;
+        int hi = (b % 2) ? 2 << log : (3 << log) / 2;
+        if (hi <= sizes[first] || lo > sizes[last])
+            continue;
+        
+        /* middle of the bucket, or the measurement inside it */
+        int size = MIN(MAX(lo / 2 + hi / 2, sizes[first]), sizes[last]);
+        int i = first, j = last;
+        for (int k = first; k <= last; k++)
+        {
+            if (!speeds[k]) continue;
+            if (sizes[k] <= size) i = k;
+            if (sizes[k] >= size) { j = k; break; }
+        }
+        
+        float t = curve_time(sizes, speeds, i, j, size);
+        m->speed[b] = MAX(1, size / 1024 * 1000.0f / t);
+    }
+}
+
+/* frames that will be captured while writing n frames */
+static int sched_incoming(struct write_model * m, int n, int fps, int frame_size)
+{
+    int size = frame_size * n;
+    int write_time = size / 1024 * 1000 / write_model_predict(m, size);
+    return write_time * (fps / 100) / 10000 + 1;
+}
+
+int slots_schedule_writes(struct write_model * m, int num_ready, int free_slots, int fps, int frame_size)
+{
+    /* only called from the writer task, so keep these off its (small) stack */
+    static float write_time[SCHED_MAX_FRAMES + 1];  /* expected time to write n frames, ms */
+    static float cost[SCHED_MAX_FRAMES + 1];        /* best time to write k contiguous frames, in one or more blocks */
+    static int first[SCHED_MAX_FRAMES + 1];         /* first block for the best way to write k frames */
+
+    if (num_ready <= 0)
+        return 0;
+    
+    /* plan for no more frames than the tables can handle (the rest will go in the next write) */
+    int max_frames = MAX(1, MIN(SCHED_MAX_FRAMES, WRITE_MODEL_MAX_SIZE / frame_size));
+    int num_planned = MIN(num_ready, max_frames);
+    
+    /* the frames ready to be saved can be written as a single block, or split in a few smaller ones;
+     * choose the split with the lowest total time (best sustained speed) */
+    cost[0] = 0;
+    for (int k = 1; k <= num_planned; k++)
+    {
+        int size = frame_size * k;
+        write_time[k] = size / 1024 * 1000.0f / write_model_predict(m, size);
+        
+        cost[k] = write_time[k];
+        first[k] = k;
+        for (int n = 1; n < k; n++)
+        {
+            /* split only if it's at least 1% faster */
+            float c = write_time[n] + cost[k - n];
+            if (c * 1.01f < cost[k])
+            {
+                cost[k] = c;
+                first[k] = n;
+            }
+        }
+    }
+    
+    int n = first[num_planned];
+    
+    /* very small frames, all of them best written in a single block? the longer run will be even faster,
+     * as long as the model still covers it (otherwise, with a large overhead per call, we would fall behind) */
+    if (n == max_frames)
+        n = MIN(num_ready, MAX(max_frames, WRITE_MODEL_MAX_SIZE / frame_size));
+    
+    /* about to overflow? write fewer frames, so they can be freed quicker */
+    /* only if the buffer would get full during this write: trimming earlier would only slow us down */
+    while (n > 1 && sched_incoming(m, n, fps, frame_size) > free_slots)
+        n--;
+    
+    return n;
+}
+
+int slots_sustained_speed(struct write_model * m, int* chunk_list, int chunk_list_len, int frame_size)
+{
+    int max_chunk = 0;
+    for (int i = 0; i < chunk_list_len; i++)
+        max_chunk = MAX(max_chunk, chunk_list[i]);
+    
+    int max_frames = MIN(SCHED_MAX_FRAMES, MIN(max_chunk, WRITE_MODEL_MAX_SIZE) / frame_size);
+    
+    int best = write_model_predict(m, frame_size);
+    for (int k = 2; k <= max_frames; k++)
+        best = MAX(best, write_model_predict(m, k * frame_size));
+    
+    return best;
+}
@@ -0,0 +1,216 @@
+/**
+ * Frame slots and writing queue for raw_rec (buffering logic only)
+ *
+ * No camera dependencies: the same code runs in raw_rec and in the recording simulator (rawsim.c).
+ * The slots are pieces of memory that can hold one video frame; contiguous slots are written
+ * to card with a single call, so the allocator tries to keep filling contiguous areas.
+ *
+ * Threading model (camera):
+ * - the allocator is only touched from the capture side (vsync CBR), so it needs no locking;
+ *   every operation there is O(1), or bounded by the number of slots / 32;
+ * - frames go to the writer through a single-producer/single-consumer queue (writing_queue);
+ * - frames written to card go back to the capture side through another one (freed_queue).
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _frame_slots_h_
+#define _frame_slots_h_
+
+#include <stdint.h>
+
+#define MAX_SLOTS 512
+
+/* one video frame */
+struct frame_slot
+{
+    void* ptr;          /* image data, size=frame_size */
+    int frame_number;   /* from 0 to n */
+    enum {SLOT_FREE, SLOT_FULL, SLOT_WRITING} status;
+};
+
+/* a piece of memory we may use for buffering */
+struct mem_chunk
+{
+    void* ptr;
+    int size;
+};
+
+/**
+ * Split the memory chunks into frame slots:
+ * - the smallest chunk that fits buf_size is reserved for the full-size (uncropped) frame
+ *   (returned in fullsize_buffer; what's left after it is still used for slots);
+ * - every other chunk is aligned at 4K and filled with as many frames as possible (8K margin).
+ * Chunk sizes are also written in chunk_list (for frame count predictions): chunk_list[0] = waste from the fullsize chunk.
+ * Returns the number of slots, or -1 if no chunk is large enough for the full-size buffer.
+ */
+int slots_setup(struct frame_slot * slots, int max_slots, struct mem_chunk * chunks, int num_chunks,
+                int buf_size, int frame_size, void** fullsize_buffer, int* chunk_list, int chunk_list_len);
+
+/**
+ * Take a buffer (aligned at 4K) from the smallest chunk that can hold it; the chunk is shrunk accordingly.
+ * Used for the 14-bit staging buffers in 12/10-bit modes (call it before slots_setup).
+ * Returns 0 if no chunk is large enough.
+ */
+void* chunks_reserve(struct mem_chunk * chunks, int num_chunks, int size);
+
+/* 12/10-bit modes: 14-bit frames copied by EDMAC, waiting to be packed into slots */
+#define STAGING_BUFFERS 3
+
+/* raw_rec runs on a single core, where a compiler barrier is enough; the PC tools may not */
+#if defined(__arm__)
+#define memory_barrier() asm volatile("" : : : "memory")
+#else
+#define memory_barrier() __sync_synchronize()
+#endif
+
+/**
+ * Lock-free queue of slot indices, for one producer task and one consumer task.
+ * The producer only writes tail, the consumer only writes head; the barriers make sure
+ * the other side never sees an index before the item (or the slot data) behind it.
+ */
+struct frame_queue
+{
+    int items[MAX_SLOTS + 1];
+    volatile int head;              /* consumer: extract items from here */
+    volatile int tail;              /* producer: place new items here */
+};
+
+void frame_queue_init(struct frame_queue * q);
+
+/* producer; returns 0 if full (can't happen if the queue is only used for slot indices) */
+int frame_queue_push(struct frame_queue * q, int item);
+
+/* consumer: number of items, i-th item from head, remove n items from head */
+int frame_queue_count(struct frame_queue * q);
+int frame_queue_peek(struct frame_queue * q, int i);
+void frame_queue_pop(struct frame_queue * q, int n);
+
+/**
+ * Free slot allocator
+ * 
+ * Free slots are kept as runs of contiguous slots, with their ends linked (boundary tags), so a freed slot
+ * is merged with its neighbours in O(1). Runs are indexed by length: one list for each length,
+ * plus a bitmap of the non-empty lists, so the largest run is found without scanning the slots.
+ * Slot status is updated here: SLOT_FULL when allocated, SLOT_FREE when released.
+ */
+struct slot_allocator
+{
+    struct frame_slot * slots;
+    int slot_count;
+    int frame_size;
+    volatile int free_count;
+    int16_t run_end[MAX_SLOTS];     /* for the first slot of a free run */
+    int16_t run_start[MAX_SLOTS];   /* for the last slot of a free run */
+    int16_t next[MAX_SLOTS];        /* list of free runs with the same length (by first slot) */
+    int16_t prev[MAX_SLOTS];
+    int16_t first_run[MAX_SLOTS + 1];               /* by length; -1 = none */
+    uint32_t run_lengths[(MAX_SLOTS + 32) / 32];    /* bitmap: bit n set = there are free runs of length n */
+};
+
+/* all slots free (call it after slots_setup) */
+void slots_alloc_init(struct slot_allocator * a, struct frame_slot * slots, int slot_count, int frame_size);
+
+/**
+ * Where to save the next frame?
+ * Keep filling the current contiguous area if possible; otherwise (or if force_new_buffer is set),
+ * pick the largest contiguous free area. Clears force_new_buffer when it searches for a new area.
+ * The slot is marked as SLOT_FULL. Returns -1 if all slots are busy (overflow).
+ */
+int slots_choose_capture(struct slot_allocator * a, int capture_slot, volatile int* force_new_buffer);
+
+/* give a slot back (marked as SLOT_FREE) */
+void slots_release(struct slot_allocator * a, int slot_index);
+
+/**
+ * How many frames from the head of the writing queue can be written with a single call?
+ * (as long as they are contiguous in memory, in queue order)
+ */
+int slots_group_writes(struct frame_slot * slots, struct frame_queue * q, int frame_size);
+
+/**
+ * Old write size logic (now replaced by slots_schedule_writes; still used by rawsim --old for comparison):
+ * if we are about to overflow, save a smaller number of frames, so they can be freed quicker.
+ * write_speed: measured write speed, in 0.01 MB/s (0 = unknown, no limit); fps x1000.
+ * Returns the number of frames to write (at least 1).
+ */
+int slots_limit_writes(int num_frames, int free_slots, int fps, int write_speed, int frame_size);
+
+/**
+ * How many frames can we record before the buffers are full?
+ * write_speed in bytes/s, fps x1000; returns INT_MAX if the card keeps up.
+ */
+int slots_predict_frames(int* chunk_list, int chunk_list_len, int frame_size, int fps, int write_speed);
+
+/**
+ * Write size scheduler
+ * 
+ * Online model of the card speed vs. block size, learned from the time taken by each FIO_WriteFile call:
+ * - a moving average of the speed for each half-octave of block size (64K ... 64M);
+ * - a least squares fit of time = latency + size / speed, used for block sizes not tried yet.
+ * 
+ * The frames ready to be saved are written as the block (or the sequence of blocks) with the best
+ * expected speed (e.g. a 32MB write may be slower than 24MB + 8MB); if the buffer would get full
+ * during this write, the block is trimmed, so these frames are freed quicker.
+ * The writer never waits for more frames: with speed increasing with block size, writing whatever is
+ * available already converges to the block size the card can sustain (if any).
+ */
+
+#define WRITE_MODEL_BUCKETS 24
+
+struct write_model
+{
+    int speed[WRITE_MODEL_BUCKETS];     /* KB/s, moving average for each block size range, 0 = not tried yet */
+    float sw, sx, sy, sxx, sxy;         /* weighted sums for the fit: x = size in MB, y = time in ms */
+    int prior_speed;                    /* KB/s, used until we have some measurements */
+};
+
+/* prior_speed in 0.01 MB/s (same unit as measured_write_speed); 0 = use a default */
+void write_model_init(struct write_model * m, int prior_speed);
+
+/* one FIO_WriteFile call: size in bytes, time in ms */
+void write_model_update(struct write_model * m, int size, int time_ms);
+
+/* expected speed in KB/s for a block of this size */
+int write_model_predict(struct write_model * m, int size);
+
+/**
+ * Start from a benchmark curve (card_bench.c): speeds in KB/s for a few block sizes, 0 = not measured.
+ * The block sizes in between are interpolated (write time is assumed linear between two measurements);
+ * the measured points also go into the fit, as if they were regular writes.
+ */
+void write_model_add_curve(struct write_model * m, const int* sizes, const int* speeds, int n);
+
+/**
+ * How many frames to write now?
+ * - num_ready: contiguous frames at the head of the queue (from slots_group_writes);
+ * - free_slots, fps (x1000): for the overflow check.
+ * Returns the number of frames to write (1...num_ready; long runs of small frames are capped to the largest write the model knows about).
+ */
+int slots_schedule_writes(struct write_model * m, int num_ready, int free_slots, int fps, int frame_size);
+
+/**
+ * Speed we can sustain once the card falls behind and the frames pile up in the buffer:
+ * the scheduler may then pick any block size (in whole frames) that fits in a contiguous memory chunk.
+ * Returns KB/s (for slots_predict_frames).
+ */
+int slots_sustained_speed(struct write_model * m, int* chunk_list, int chunk_list_len, int frame_size);
+
+#endif
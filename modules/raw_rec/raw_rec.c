@@ -4,6 +4,8 @@
  * - buffering strategy:
  *      - group the frames in contiguous chunks, up to 32MB, to maximize writing speed
  *        (speed profile depends on buffer size: http://www.magiclantern.fm/forum/index.php?topic=5471 )
+ *      - the block size for each write is chosen from a speed profile learned while recording
+ *        (e.g. a 32MB block may be split if smaller ones are faster; see frame_slots.c)
  *      - always write if there's something to write, even if that means using a small buffer
  *        (this minimizes idle time for the writing task, keeps memory free in the startup phase,
  *        and has no impact on the sustained write speeds
@@ -11,12 +13,20 @@
  *        (small chunks will only be used in extreme situations, to squeeze the last few frames)
  *      - use any memory chunks that can contain at least one video frame
  *        (they will only be used when recording is about to stop, so no negative impact in sustained write speed)
+ *      - the vsync CBR does bounded work: free slots are indexed by contiguous run length,
+ *        and the writer task gets frames (and gives them back) through lock-free queues
  * 
  * - edmac_copy_rectangle: we can crop the image and trim the black borders!
+ * - optional 12/10-bit recording: EDMAC crops into 14-bit staging buffers, a separate task packs them
+ *   into the frame slots (with a black level offset and a linear or log-ish curve, see raw_pack.c)
  * - edmac operation done outside the LV task (in background, synchronized)
  * - on buffer overflow, it stops or skips frames (user-selected)
+ * - optional pre-record: the first REC press starts capturing, but only the last few seconds are kept in memory;
+ *   the second press starts saving them, followed by the live frames (the buffers are reused as a ring until then)
  * - using generic raw routines, no hardcoded stuff (should be easier to port)
  * - only for RAW in a single file (do one thing and do it well)
+ * - optional indexed container: a small header for each frame and an index every few frames, no footer needed
+ *   (a clip cut short by a full card is still usable, and there's no backup file to write at startup; see lv_rec.h)
  * - goal #1: 1920x1080 on 1000x cards (achieved and exceeded, reports say 1920x1280 continuous!)
  * - goal #2: maximize number of frames for any given resolution + buffer + card speed configuration
  *   (see buffering strategy; I believe it's close to optimal, though I have no idea how to write a mathematical proof for it)
@@ -66,6 +76,11 @@
 #include "edmac.h"
 #include "../file_man/file_man.h"
 #include "cache_hacks.h"
+#include "frame_slots.h"
+#include "card_bench.h"
+#include "clip_writer.h"
+#include "raw_trigger.h"
+#include <raw_pack.h>
 
 /* camera-specific tricks */
 /* todo: maybe add generic functions like is_digic_v, is_5d2 or stuff like that? */
@@ -114,6 +129,66 @@ static CONFIG_INT("raw.warm.up", warm_up, 0);
 static CONFIG_INT("raw.memory.hack", memory_hack, 0);
 static CONFIG_INT("raw.small.hacks", small_hacks, 0);
 
+static CONFIG_INT("raw.bit.depth", bit_depth_index, 0);
+static CONFIG_INT("raw.curve", pack_curve, RAW_CURVE_SQRT);
+static int bit_depth_presets[] = { 14, 12, 10 };
+
+static CONFIG_INT("raw.indexed", indexed_format, 0);
+static CONFIG_INT("raw.dual.card", dual_card, 0);
+
+/* dual card recording needs the indexed container (frame numbers in the frame headers, for merging the two files) */
+#define USE_INDEXED_FORMAT (indexed_format || dual_card)
+
+static CONFIG_INT("raw.pre.record", pre_record, 0);
+static int pre_record_presets[] = { 0, 1, 2, 5, 10 };   /* seconds */
+
+/* trigger mode: 0 = off, otherwise n x n zones (see raw_trigger.h) */
+static CONFIG_INT("raw.trigger", trigger_mode, 0);
+static CONFIG_INT("raw.trigger.sens", trigger_sens, 2);
+static CONFIG_INT("raw.trigger.pre", trigger_pre, 2);
+static CONFIG_INT("raw.trigger.post", trigger_post, 2);
+static int trigger_sens_presets[] = { 1200, 800, 600, 400, 300 };     /* threshold, in 1/100 standard deviations */
+static int trigger_pre_presets[] = { 0, 5, 10, 25, 50 };              /* frames */
+static int trigger_post_presets[] = { 5, 10, 25, 50, 100, 250 };      /* frames */
+
+/* card benchmark results, one profile per card (see card_bench.h) */
+#define CARD_PROFILES 3
+static struct card_profile card_profiles[CARD_PROFILES];
+static CONFIG_INT("raw.card.next", card_profile_next, 0);
+
+/* card_profiles[p].field is saved as raw.card<p>.<key> */
+#define CARD_PROFILE_VAR(p, var, key, field) \
+    static struct config_var __config_##var = { .name = "raw.card" #p "." key, .value = &card_profiles[p].field, .default_value = 0 };
+
+#define CARD_PROFILE_CONFIG(p) \
+    CARD_PROFILE_VAR(p, card##p##_id,   "id",        card_id)   \
+    CARD_PROFILE_VAR(p, card##p##_s0,   "256K",      speed[0])  \
+    CARD_PROFILE_VAR(p, card##p##_s1,   "512K",      speed[1])  \
+    CARD_PROFILE_VAR(p, card##p##_s2,   "1M",        speed[2])  \
+    CARD_PROFILE_VAR(p, card##p##_s3,   "2M",        speed[3])  \
+    CARD_PROFILE_VAR(p, card##p##_s4,   "4M",        speed[4])  \
+    CARD_PROFILE_VAR(p, card##p##_s5,   "8M",        speed[5])  \
+    CARD_PROFILE_VAR(p, card##p##_s6,   "16M",       speed[6])  \
+    CARD_PROFILE_VAR(p, card##p##_s7,   "32M",       speed[7])  \
+    CARD_PROFILE_VAR(p, card##p##_s8,   "64M",       speed[8])  \
+    CARD_PROFILE_VAR(p, card##p##_a512, "align512",  align512)  \
+    CARD_PROFILE_VAR(p, card##p##_ua,   "unaligned", unaligned) \
+    CARD_PROFILE_VAR(p, card##p##_late, "late",      late)
+
+#define CARD_PROFILE_MODULE_CONFIGS(p) \
+    MODULE_CONFIG(card##p##_id)   MODULE_CONFIG(card##p##_s0)   MODULE_CONFIG(card##p##_s1) \
+    MODULE_CONFIG(card##p##_s2)   MODULE_CONFIG(card##p##_s3)   MODULE_CONFIG(card##p##_s4) \
+    MODULE_CONFIG(card##p##_s5)   MODULE_CONFIG(card##p##_s6)   MODULE_CONFIG(card##p##_s7) \
+    MODULE_CONFIG(card##p##_s8)   MODULE_CONFIG(card##p##_a512) MODULE_CONFIG(card##p##_ua) \
+    MODULE_CONFIG(card##p##_late)
+
+CARD_PROFILE_CONFIG(0)
+CARD_PROFILE_CONFIG(1)
+CARD_PROFILE_CONFIG(2)
+
+static volatile int card_bench_running = 0;
+static volatile int card_bench_cancel = 0;
+
 /* state variables */
 static int res_x = 0;
 static int res_y = 0;
@@ -122,6 +197,11 @@ static int max_res_y = 0;
 static float squeeze_factor = 0;
 static int frame_size = 0;
 static int frame_size_real = 0;
+static int slot_header = 0;                       /* indexed container: block header before the frame data (RAW_FRAME_HEADER_SIZE), otherwise 0 */
+static int slot_size = 0;                         /* frame_size + slot_header */
+static int bits_per_pixel = 14;
+static int staging_size = 0;                      /* 14-bit frame with room for EDMAC checks (12/10-bit modes) */
+static int staging_size_real = 0;
 static int skip_x = 0;
 static int skip_y = 0;
 
@@ -144,38 +224,75 @@ static int raw_previewing = 0;
 #define RAW_IS_RECORDING (raw_recording_state == RAW_RECORDING)
 #define RAW_IS_FINISHING (raw_recording_state == RAW_FINISHING)
 
-/* one video frame */
-struct frame_slot
-{
-    void* ptr;          /* image data, size=frame_size */
-    int frame_number;   /* from 0 to n */
-    enum {SLOT_FREE, SLOT_FULL, SLOT_WRITING} status;
-};
-
 static struct memSuite * mem_suite = 0;           /* memory suite for our buffers */
 
 static void * fullsize_buffers[2];                /* original image, before cropping, double-buffered */
 static int fullsize_buffer_pos = 0;               /* which of the full size buffers (double buffering) is currently in use */
 static int chunk_list[20];                       /* list of free memory chunk sizes, used for frame estimations */
 
-static struct frame_slot slots[512];              /* frame slots */
+static struct frame_slot slots[MAX_SLOTS];        /* frame slots */
 static int slot_count = 0;                        /* how many frame slots we have */
+static struct slot_allocator slot_alloc;          /* free slots, only used from the vsync CBR */
 static int capture_slot = -1;                     /* in what slot are we capturing now (index) */
 static volatile int force_new_buffer = 0;         /* if some other task decides it's better to search for a new buffer */
 
-static int writing_queue[COUNT(slots)];           /* queue of completed frames (slot indices) waiting to be saved */
-static int writing_queue_tail = 0;                /* place captured frames here */
-static int writing_queue_head = 0;                /* extract frames to be written from here */ 
+static struct frame_queue writing_queue;          /* completed frames (slot indices) waiting to be saved: vsync CBR (or pack task) => writer(s) */
+
+/* one writer for each card we are recording on (dual card: two of them, striping groups of frames between the cards) */
+struct raw_writer
+{
+    struct clip_writer clip;                      /* movie file on this card */
+    struct write_model model;                     /* card speed vs. block size, learned while recording */
+    struct frame_queue freed_queue;               /* saved frames, to be reused: this writer => vsync CBR */
+    int writing_time;                             /* time spent in FIO_WriteFile calls */
+    int idle_time;                                /* time spent doing something else */
+    int last_write_timestamp;
+    volatile int busy;                            /* busy: in the middle of a write operation */
+};
+
+static struct raw_writer writers[RAW_MAX_STRIPES];
+static int num_writers = 1;
+static struct semaphore * writing_queue_sem = 0;  /* dual card: the writers take turns at the head of the writing queue */
+static volatile int stripe_task_running = 0;      /* dual card: writer for the second card */
+static volatile int writer_error = 0;             /* dual card: second card full, stop recording */
+static int last_processed_frame = 0;              /* for checking the frame order */
 
 static int frame_count = 0;                       /* how many frames we have processed */
 static int frame_skips = 0;                       /* how many frames were dropped/skipped */
 static char* movie_filename = 0;                  /* file name for current (or last) movie */
-static char* chunk_filename = 0;                  /* file name for current movie chunk */
-static uint32_t written = 0;                      /* how many KB we have written in this movie */
-static int writing_time = 0;                      /* time spent by raw_video_rec_task in FIO_WriteFile calls */
-static int idle_time = 0;                         /* time spent by raw_video_rec_task doing something else */
-static volatile int writing_task_busy = 0;        /* busy: in the middle of a write operation */
 static volatile int frame_countdown = 0;          /* for waiting X frames */
+static int capture_start_time = 0;                /* for frame timestamps (indexed container) */
+
+static volatile int pre_recording = 0;            /* capturing, but not saving yet (waiting for the second REC press) */
+static int pre_record_frames = 0;                 /* how many frames to keep while pre-recording (limited by memory) */
+static int pre_record_dropped = 0;                /* frames captured while pre-recording, but too old to be saved */
+
+/* trigger mode: pre-recording while waiting, with pre_record_frames = pre-trigger frames */
+static struct raw_trigger trigger;
+static int trigger_running = 0;                   /* this clip is recorded in trigger mode */
+static volatile int trigger_task_running = 0;
+static void * trigger_buffer = 0;                 /* decimated copy of a frame: every trigger_row_step-th row of the recorded area */
+static int trigger_rows = 0;
+static int trigger_row_step = 0;
+static volatile int trigger_frame = 0;            /* frame number of the copy in trigger_buffer; 0 = free */
+static volatile int trigger_evaluated = 0;        /* last frame evaluated by raw_video_trigger_task */
+static void * trigger_source = 0;                 /* full copy of a frame, to be copied into trigger_buffer at the next vsync */
+static int trigger_source_frame = 0;
+static int trigger_dma_in_progress = 0;
+static volatile int trigger_saving = 0;           /* triggered, or within the post-trigger frames */
+static volatile int trigger_save_until = 0;       /* after saving stops, frames are still written up to this one */
+
+/* 12/10-bit modes: EDMAC copies the frame into a staging buffer, raw_video_pack_task packs it into its slot and queues it for writing */
+static void * staging_buffers[STAGING_BUFFERS];
+static int staging_slots[STAGING_BUFFERS];        /* destination slot for each staging buffer */
+static volatile int staging_added = 0;            /* frames sent to staging buffers (buffer index = counter % STAGING_BUFFERS) */
+static volatile int staging_ready = 0;            /* frames with EDMAC transfer finished */
+static volatile int staging_packed = 0;           /* frames packed and sent to the writing queue */
+static volatile int pack_task_running = 0;
+static uint16_t* pack_lut = 0;                    /* 14-bit => N-bit */
+static int pack_black = 0;                        /* black and white levels used for the curve (saved in the footer) */
+static int pack_white = 0;
+static int pack_curve_used = 0;                   /* the menu setting may change while recording */
 
 /* interface to other modules:
  *
@@ -193,12 +310,28 @@ static volatile int frame_countdown = 0;          /* for waiting X frames */
  *      Whenever the buffers are full, this function is called with the buffer index that is subject to being dropped, the number of frames in this buffer and the total buffer count.
  *      If it returns zero, this buffer will not get thrown away, but the next frame will get dropped.
  *      Default: Do not throw away buffer, but throw away incoming frame (0)
+ *
+ *    unsigned int raw_rec_cbr_trigger_setup(struct raw_trigger * trigger)
+ *      Called when recording starts, with the trigger engine already set up from the menu (zones, thresholds, pre/post frames).
+ *      The module may change the setup (see raw_trigger.h); if it returns nonzero, the clip is recorded in trigger mode
+ *      even if the trigger is disabled in the menu.
+ *      Default: use the menu settings (0)
+ *
+ *    unsigned int raw_rec_cbr_trigger_event(unsigned int frame_number, unsigned int active_zones, unsigned int saving)
+ *      Trigger mode: called when saving starts (saving = 1; active_zones is a bit mask) or stops (0, after the post-trigger frames).
+ *      Default: nothing (0)
  */
 extern WEAK_FUNC(ret_0) unsigned int raw_rec_cbr_starting();
 extern WEAK_FUNC(ret_0) unsigned int raw_rec_cbr_stopping();
 extern WEAK_FUNC(ret_0) unsigned int raw_rec_cbr_skip_frame(unsigned char *frame_data);
 extern WEAK_FUNC(ret_1) unsigned int raw_rec_cbr_save_buffer(unsigned int used, unsigned int buffer_index, unsigned int frame_count, unsigned int buffer_count);
 extern WEAK_FUNC(ret_0) unsigned int raw_rec_cbr_skip_buffer(unsigned int buffer_index, unsigned int frame_count, unsigned int buffer_count);
+extern WEAK_FUNC(ret_0) unsigned int raw_rec_cbr_trigger_setup(struct raw_trigger * trigger);
+extern WEAK_FUNC(ret_0) unsigned int raw_rec_cbr_trigger_event(unsigned int frame_number, unsigned int active_zones, unsigned int saving);
+
+/* from flexinfo; only some cameras know the card maker and model */
+extern WEAK_FUNC(ret_0) char* info_get_cardmaker(char drv);
+extern WEAK_FUNC(ret_0) char* info_get_cardmodel(char drv);
 
 static int calc_res_y(int res_x, int num, int den, float squeeze)
 {
@@ -271,14 +404,17 @@ static void update_resolution_params()
     int den = aspect_ratio_presets_den[aspect_ratio_index];
     res_y = MIN(calc_res_y(res_x, num, den, squeeze_factor), max_res_y);
 
+    /* bits per pixel (res_x is a multiple of 16, so rows are still a whole number of pixel blocks) */
+    bits_per_pixel = bit_depth_presets[COERCE(bit_depth_index, 0, COUNT(bit_depth_presets)-1)];
+
     /* frame size */
     /* should be multiple of 512, so there's no write speed penalty (see http://chdk.setepontos.com/index.php?topic=9970 ; confirmed by benchmarks) */
     /* should be multiple of 4096 for proper EDMAC alignment */
-    int frame_size_padded = (res_x * res_y * 14/8 + 4095) & ~4095;
+    int frame_size_padded = (res_x * res_y * bits_per_pixel/8 + 4095) & ~4095;
     
     /* frame size without rounding */
     /* must be multiple of 4 */
-    frame_size_real = res_x * res_y * 14/8;
+    frame_size_real = res_x * res_y * bits_per_pixel/8;
     ASSERT(frame_size_real % 4 == 0);
     
     /* needed for EDMAC double-checking; unlikely to happen, but possible */
@@ -287,6 +423,14 @@ static void update_resolution_params()
     
     frame_size = frame_size_padded;
     
+    /* indexed container: each frame is saved together with its block header */
+    slot_header = USE_INDEXED_FORMAT ? RAW_FRAME_HEADER_SIZE : 0;
+    slot_size = frame_size + slot_header;
+    
+    /* 12/10-bit: EDMAC still copies 14-bit data, in a staging buffer */
+    staging_size_real = res_x * res_y * 14/8;
+    staging_size = (staging_size_real + 4 + 4095) & ~4095;
+    
     update_cropping_offsets();
 }
 
@@ -341,28 +485,74 @@ static char* guess_aspect_ratio(int res_x, int res_y)
 static int predict_frames(int write_speed)
 {
     int fps = fps_get_current_x1000();
-    int capture_speed = frame_size / 1000 * fps;
-    int buffer_fill_speed = capture_speed - write_speed;
-    if (buffer_fill_speed <= 0)
-        return INT_MAX;
+    return slots_predict_frames(chunk_list, COUNT(chunk_list), slot_size, fps, write_speed);
+}
+
+/* benchmark profile for the card in this drive (A or B), if any */
+static struct card_profile * card_profile_for(char drive)
+{
+    int card_id = card_bench_card_id(drive, info_get_cardmaker(drive), info_get_cardmodel(drive));
+    return card_profile_find(card_profiles, COUNT(card_profiles), card_id);
+}
+
+/* seed the write model with the benchmark curve, corrected for how our frames are laid out in the file */
+static void write_model_add_profile(struct write_model * m, struct card_profile * profile, int late)
+{
+    int start = USE_INDEXED_FORMAT ? RAW_CLIP_HEADER_SIZE : 0;
+    int factor = card_profile_factor(profile, start, slot_size, late);
+
+    int sizes[CARD_BENCH_SIZES];
+    int speeds[CARD_BENCH_SIZES];
+    for (int i = 0; i < CARD_BENCH_SIZES; i++)
+    {
+        sizes[i] = CARD_BENCH_BLOCK_SIZE(i);
+        speeds[i] = profile->speed[i] * factor / 100;
+    }
+    write_model_add_curve(m, sizes, speeds, CARD_BENCH_SIZES);
+}
+
+/* sustained speed of one card, from its profile (at the block sizes our buffers allow), in 0.01 MB/s; 0 = no profile */
+static int card_expected_speed(char drive)
+{
+    struct card_profile * profile = card_profile_for(drive);
+    if (!profile || !slot_size)
+        return 0;
+    
+    struct write_model model;
+    write_model_init(&model, measured_write_speed);
+    write_model_add_profile(&model, profile, 1);
+    int speed = slots_sustained_speed(&model, chunk_list, COUNT(chunk_list), slot_size);
+    return speed * 100 / 1024;
+}
+
+/**
+ * Write speed for frame predictions, in 0.01 MB/s (0 = unknown):
+ * from the card profile if we have one, otherwise the speed measured during the last recording.
+ * Dual card: the frames are split between the cards, so their speeds add up (roughly).
+ */
+static int expected_write_speed()
+{
+    char drive = get_dcim_dir()[0];
+    int speed = card_expected_speed(drive);
     
-    int total_slots = 0;
-    for (int i = 0; i < COUNT(chunk_list); i++)
-        total_slots += chunk_list[i] / frame_size;
+    if (speed && dual_card && cam_5d3)
+    {
+        int speed2 = card_expected_speed(drive == 'A' ? 'B' : 'A');
+        speed = speed2 ? speed + speed2 : 0;
+    }
     
-    float buffer_fill_time = total_slots * frame_size / (float) buffer_fill_speed;
-    int frames = buffer_fill_time * fps / 1000;
-    return frames;
+    return speed ? speed : measured_write_speed;
 }
 
 /* how many frames can we record with current settings, without dropping? */
 static char* guess_how_many_frames()
 {
-    if (!measured_write_speed) return "";
+    int expected_speed = expected_write_speed();
+    if (!expected_speed) return "";
     if (!chunk_list[0]) return "";
     
-    int write_speed_lo = measured_write_speed * 1024 / 100 * 1024 - 512 * 1024;
-    int write_speed_hi = measured_write_speed * 1024 / 100 * 1024 + 512 * 1024;
+    int write_speed_lo = expected_speed * 1024 / 100 * 1024 - 512 * 1024;
+    int write_speed_hi = expected_speed * 1024 / 100 * 1024 + 512 * 1024;
     
     int f_lo = predict_frames(write_speed_lo);
     int f_hi = predict_frames(write_speed_hi);
@@ -388,8 +578,9 @@ static char* guess_how_many_frames()
 static MENU_UPDATE_FUNC(write_speed_update)
 {
     int fps = fps_get_current_x1000();
-    int speed = (res_x * res_y * 14/8 / 1024) * fps / 10 / 1024;
-    int ok = speed < measured_write_speed;
+    int speed = (res_x * res_y * bits_per_pixel/8 / 1024) * fps / 10 / 1024;
+    int expected_speed = expected_write_speed();
+    int ok = speed < expected_speed;
     speed /= 10;
 
     if (frame_size % 512)
@@ -398,7 +589,7 @@ static MENU_UPDATE_FUNC(write_speed_update)
     }
     else
     {
-        if (!measured_write_speed)
+        if (!expected_speed)
             MENU_SET_WARNING(ok ? MENU_WARN_INFO : MENU_WARN_ADVICE, 
                 "Write speed needed: %d.%d MB/s at %d.%03d fps.",
                 speed/10, speed%10, fps/1000, fps%1000
@@ -446,7 +637,7 @@ static MENU_UPDATE_FUNC(raw_main_update)
 
     if (!RAW_IS_IDLE)
     {
-        MENU_SET_VALUE(RAW_IS_RECORDING ? "Recording..." : RAW_IS_PREPARING ? "Starting..." : RAW_IS_FINISHING ? "Stopping..." : "err");
+        MENU_SET_VALUE(RAW_IS_RECORDING ? (pre_recording ? "Pre-recording..." : "Recording...") : RAW_IS_PREPARING ? "Starting..." : RAW_IS_FINISHING ? "Stopping..." : "err");
         MENU_SET_ICON(MNI_RECORD, 0);
     }
     else
@@ -529,24 +720,75 @@ static MENU_UPDATE_FUNC(aspect_ratio_update)
     write_speed_update(entry, info);
 }
 
-/* add a footer to given file handle to  */
-static unsigned int lv_rec_save_footer(FILE *save_file)
+/* indexed container */
+
+static void frame_add_header(int slot_index)
 {
-    lv_rec_file_footer_t footer;
-    
-    strcpy((char*)footer.magic, "RAWM");
-    footer.xRes = res_x;
-    footer.yRes = res_y;
-    footer.frameSize = frame_size;
-    footer.frameCount = frame_count - 1; /* last frame is usually gibberish */
-    footer.frameSkip = 1;
+    if (!slot_header)
+        return;
     
-    footer.sourceFpsx1000 = fps_get_current_x1000();
-    footer.raw_info = raw_info;
+    raw_block_header_t * hdr = slots[slot_index].ptr;
+    raw_block_header_init(hdr, "RAWF", slot_size, slot_header, frame_size);
+    hdr->frame_number = slots[slot_index].frame_number;
+    hdr->timestamp = get_ms_clock_value_fast() - capture_start_time;
+    /* frame_index is filled by the writer (skipped frames don't count) */
+}
 
-    int written = FIO_WriteFile(save_file, &footer, sizeof(lv_rec_file_footer_t));
+static void lv_rec_fill_footer(lv_rec_file_footer_t * footer)
+{
+    memcpy(footer->magic, "RAWM", 4);
+    footer->xRes = res_x;
+    footer->yRes = res_y;
+    footer->frameSize = frame_size;
+    footer->frameCount = frame_count - 1 - pre_record_dropped; /* last frame is usually gibberish */
+    footer->frameSkip = 1;
+    
+    footer->sourceFpsx1000 = fps_get_current_x1000();
+    footer->packing = 0;
+    footer->reserved4 = 0;
+    footer->raw_info = raw_info;
+    
+    if (bits_per_pixel < 14)
+    {
+        /* the decoder needs the exact levels used for building the curve */
+        footer->packing = pack_curve_used;
+        footer->raw_info.bits_per_pixel = bits_per_pixel;
+        footer->raw_info.black_level = pack_black;
+        footer->raw_info.white_level = pack_white;
+    }
+}
+
+static unsigned int lv_rec_use_footer(lv_rec_file_footer_t * footer)
+{
+    /* check if the footer is in the right format */
+    if(strncmp((char*)footer->magic, "RAWM", 4))
+    {
+        bmp_printf(FONT_MED, 30, 190, "Footer format mismatch");
+        beep();
+        msleep(1000);
+        return 0;
+    }
+        
+    /* update global variables with data from footer */
+    res_x = footer->xRes;
+    res_y = footer->yRes;
+    frame_count = footer->frameCount + 1;
+    frame_size = footer->frameSize;
+    // raw_info = footer->raw_info;
+    raw_info.white_level = footer->raw_info.white_level;
+    raw_info.black_level = footer->raw_info.black_level;
+    bits_per_pixel = footer->raw_info.bits_per_pixel;
+    pack_curve_used = footer->packing;
+    
+    if (bits_per_pixel != 14 && bits_per_pixel != 12 && bits_per_pixel != 10)
+    {
+        bmp_printf(FONT_MED, 30, 190, "Unsupported bit depth: %d", bits_per_pixel);
+        beep();
+        msleep(1000);
+        return 0;
+    }
     
-    return written == sizeof(lv_rec_file_footer_t);
+    return 1;
 }
 
 static unsigned int lv_rec_read_footer(FILE *f)
@@ -567,27 +809,40 @@ static unsigned int lv_rec_read_footer(FILE *f)
         msleep(1000);
     }
     
-    /* check if the footer is in the right format */
-    if(strncmp(footer.magic, "RAWM", 4))
-    {
-        bmp_printf(FONT_MED, 30, 190, "Footer format mismatch");
-        beep();
-        msleep(1000);
+    return lv_rec_use_footer(&footer);
+}
+
+/* indexed container: the metadata is in the clip header (first block)
+ * returns 1 if found, 0 for classic files (no changes), -1 for invalid headers */
+static int lv_rec_read_clip_header(FILE *f)
+{
+    /* not recording, so we can borrow this buffer */
+    uint32_t * index_block = writers[0].clip.index_block;
+    raw_block_header_t * hdr = (void*) index_block;
+    
+    int read = FIO_ReadFile(f, index_block, RAW_CLIP_HEADER_SIZE);
+    FIO_SeekFile(f, 0, SEEK_SET);
+    if (read != RAW_CLIP_HEADER_SIZE || strncmp((char*)hdr->magic, "RAWH", 4))
         return 0;
-    }
-        
-    /* update global variables with data from footer */
-    res_x = footer.xRes;
-    res_y = footer.yRes;
-    frame_count = footer.frameCount + 1;
-    frame_size = footer.frameSize;
-    // raw_info = footer.raw_info;
-    raw_info.white_level = footer.raw_info.white_level;
-    raw_info.black_level = footer.raw_info.black_level;
+    
+    if (hdr->data_offset + sizeof(lv_rec_file_footer_t) > RAW_CLIP_HEADER_SIZE)
+        return -1;
+    
+    if (!lv_rec_use_footer((void*) index_block + hdr->data_offset))
+        return -1;
     
     return 1;
 }
 
+/* indexed container: save the metadata at the beginning (frame count is not known yet) */
+/* dual card: stripe = which file of the clip (one for each card) */
+static int lv_rec_save_clip_header(struct clip_writer * w, int stripe, uint32_t clip_id)
+{
+    lv_rec_file_footer_t footer;
+    lv_rec_fill_footer(&footer);
+    return clip_writer_save_header(w, &footer, stripe, num_writers > 1 ? num_writers : 0, clip_id);
+}
+
 static int setup_buffers()
 {
     /* allocate the entire memory, but only use large chunks */
@@ -613,82 +868,48 @@ static int setup_buffers()
     /* allocate memory for double buffering */
     int buf_size = raw_info.width * raw_info.height * 14/8 * 33/32; /* leave some margin, just in case */
 
-    /* find the smallest chunk that we can use for buf_size */
-    fullsize_buffers[0] = 0;
+    /* list the memory chunks we got */
+    struct mem_chunk chunks[64];
+    int num_chunks = 0;
     struct memChunk * chunk = GetFirstChunkFromSuite(mem_suite);
-    int waste = INT_MAX;
-    while(chunk)
+    while(chunk && num_chunks < COUNT(chunks))
     {
-        int size = GetSizeOfMemoryChunk(chunk);
-        if (size >= buf_size)
-        {
-            if (size - buf_size < waste)
-            {
-                waste = size - buf_size;
-                fullsize_buffers[0] = GetMemoryAddressOfMemoryChunk(chunk);
-            }
-        }
+        chunks[num_chunks].ptr = GetMemoryAddressOfMemoryChunk(chunk);
+        chunks[num_chunks].size = GetSizeOfMemoryChunk(chunk);
+        num_chunks++;
         chunk = GetNextMemoryChunk(mem_suite, chunk);
     }
-    if (fullsize_buffers[0] == 0) return 0;
-
-    //~ console_printf("fullsize buffer %x\n", fullsize_buffers[0]);
-    
-    /* reuse Canon's buffer */
-    fullsize_buffers[1] = UNCACHEABLE(raw_info.buffer);
-    if (fullsize_buffers[1] == 0) return 0;
-    
-    chunk_list[0] = waste;
-    int chunk_index = 1;
 
-    /* use all chunks larger than frame_size for recording */
-    chunk = GetFirstChunkFromSuite(mem_suite);
-    slot_count = 0;
-    while(chunk)
+    /* 12/10-bit: take the staging buffers first */
+    if (bits_per_pixel < 14)
     {
-        int size = GetSizeOfMemoryChunk(chunk);
-        void* ptr = GetMemoryAddressOfMemoryChunk(chunk);
-        if (ptr != fullsize_buffers[0]) /* already used */
+        for (int i = 0; i < STAGING_BUFFERS; i++)
         {
-            /* write it down for future frame predictions */
-            if (chunk_index < COUNT(chunk_list) && size > 8192)
-            {
-                chunk_list[chunk_index] = size - 8192;
-                chunk_index++;
-            }
-
-            /* align at 4K */
-            ptr = (void*)(((intptr_t)ptr + 4095) & ~4095);
-            
-            /* fit as many frames as we can */
-            while (size >= frame_size + 8192 && slot_count < COUNT(slots))
-            {
-                slots[slot_count].ptr = ptr;
-                slots[slot_count].status = SLOT_FREE;
-                ptr += frame_size;
-                size -= frame_size;
-                slot_count++;
-                //~ console_printf("slot #%d: %d %x\n", slot_count, tag, ptr);
-            }
+            staging_buffers[i] = chunks_reserve(chunks, num_chunks, staging_size);
+            if (!staging_buffers[i]) return 0;
         }
-        chunk = GetNextMemoryChunk(mem_suite, chunk);
     }
-    
-    /* try to recycle the waste */
-    if (waste >= frame_size + 8192)
+
+    /* trigger mode: room for the decimated copies */
+    if (trigger_running)
     {
-        int size = waste;
-        void* ptr = (void*)(((intptr_t)(fullsize_buffers[0] + buf_size) + 4095) & ~4095);
-        while (size >= frame_size + 8192 && slot_count < COUNT(slots))
-        {
-            slots[slot_count].ptr = ptr;
-            slots[slot_count].status = SLOT_FREE;
-            ptr += frame_size;
-            size -= frame_size;
-            slot_count++;
-            //~ console_printf("slot #%d: %d %x\n", slot_count, tag, ptr);
-        }
+        trigger_buffer = chunks_reserve(chunks, num_chunks, trigger_rows * res_x * 14/8);
+        if (!trigger_buffer) return 0;
+    }
+
+    /* split them into frame slots; the smallest chunk that fits buf_size is reserved for the full-size frame */
+    slot_count = slots_setup(slots, COUNT(slots), chunks, num_chunks, buf_size, slot_size, &fullsize_buffers[0], chunk_list, COUNT(chunk_list));
+    if (slot_count < 0)
+    {
+        slot_count = 0;
+        return 0;
     }
+
+    //~ console_printf("fullsize buffer %x\n", fullsize_buffers[0]);
+    
+    /* reuse Canon's buffer */
+    fullsize_buffers[1] = UNCACHEABLE(raw_info.buffer);
+    if (fullsize_buffers[1] == 0) return 0;
     
     char msg[100];
     snprintf(msg, sizeof(msg), "Alloc: %d frames", slot_count);
@@ -698,6 +919,11 @@ static int setup_buffers()
     if (slot_count < 3)
         return 0;
     
+    slots_alloc_init(&slot_alloc, slots, slot_count, slot_size);
+    frame_queue_init(&writing_queue);
+    for (int i = 0; i < COUNT(writers); i++)
+        frame_queue_init(&writers[i].freed_queue);
+    
     return 1;
 }
 
@@ -709,10 +935,10 @@ static void free_buffers()
 
 static int get_free_slots()
 {
-    int free_slots = 0;
-    for (int i = 0; i < slot_count; i++)
-        if (slots[i].status == SLOT_FREE)
-            free_slots++;
+    /* including the ones not yet given back to the allocator */
+    int free_slots = slot_alloc.free_count;
+    for (int i = 0; i < num_writers; i++)
+        free_slots += frame_queue_count(&writers[i].freed_queue);
     return free_slots;
 }
 
@@ -725,7 +951,7 @@ static void show_buffer_status()
     int y = 50;
     for (int i = 0; i < slot_count; i++)
     {
-        if (i > 0 && slots[i].ptr != slots[i-1].ptr + frame_size)
+        if (i > 0 && slots[i].ptr != slots[i-1].ptr + slot_size)
             x += MAX(2, scale);
 
         int color = slots[i].status == SLOT_FREE ? COLOR_BLACK : slots[i].status == SLOT_WRITING ? COLOR_GREEN1 : slots[i].status == SLOT_FULL ? COLOR_LIGHT_BLUE : COLOR_RED;
@@ -762,7 +988,7 @@ static void show_buffer_status()
         prev_y = y;
         bmp_draw_rect(COLOR_BLACK, 0, ymin, 720, ymax-ymin);
         
-        int xp = predict_frames(measured_write_speed * 1024 / 100 * 1024) % 720;
+        int xp = predict_frames(expected_write_speed() * 1024 / 100 * 1024) % 720;
         draw_line(xp, ymax, xp, ymin, COLOR_RED);
     }
 #endif
@@ -896,42 +1122,81 @@ static unsigned int raw_rec_polling_cbr(unsigned int unused)
     
     /* update status messages */
     static int auxrec = INT_MIN;
-    if (RAW_IS_RECORDING && liveview_display_idle() && should_run_polling_action(DEBUG_REDRAW_INTERVAL, &auxrec))
+    if (RAW_IS_RECORDING && trigger_running && liveview_display_idle() && should_run_polling_action(DEBUG_REDRAW_INTERVAL, &auxrec))
+    {
+        bmp_printf( FONT_MED, 30, 70, 
+            "%s: %d event%s, %d frames kept  ",
+            trigger_saving ? "Triggered" : pre_recording ? "Waiting for trigger" : "Saving",
+            trigger.events, trigger.events == 1 ? "" : "s",
+            frame_count - 1 - pre_record_dropped
+        );
+        show_buffer_status();
+    }
+    else if (RAW_IS_RECORDING && pre_recording && liveview_display_idle() && should_run_polling_action(DEBUG_REDRAW_INTERVAL, &auxrec))
+    {
+        int fps = fps_get_current_x1000();
+        int buffered = frame_count - 1 - pre_record_dropped;
+        int t = (buffered * 1000 + fps/2) / fps;
+        bmp_printf( FONT_MED, 30, 70, 
+            "Pre-recording: %d.%ds (%d frames), press REC to save  ",
+            t / 1000, t % 1000 / 100,
+            buffered
+        );
+        show_buffer_status();
+    }
+    else if (RAW_IS_RECORDING && liveview_display_idle() && should_run_polling_action(DEBUG_REDRAW_INTERVAL, &auxrec))
     {
         int fps = fps_get_current_x1000();
-        int t = (frame_count * 1000 + fps/2) / fps;
-        int predicted = predict_frames(measured_write_speed * 1024 / 100 * 1024);
+        int saved_frames = frame_count - pre_record_dropped;
+        int t = (saved_frames * 1000 + fps/2) / fps;
+        int predicted = predict_frames(expected_write_speed() * 1024 / 100 * 1024);
         if (predicted < 10000)
             bmp_printf( FONT_MED, 30, 70, 
                 "%02d:%02d, %d frames / %d expected  ",
                 t/60, t%60,
-                frame_count,
+                saved_frames,
                 predicted
             );
         else
             bmp_printf( FONT_MED, 30, 70, 
                 "%02d:%02d, %d frames, continuous OK  ",
                 t/60, t%60,
-                frame_count
+                saved_frames
             );
 
         show_buffer_status();
 
         /* how fast are we writing? does this speed match our benchmarks? */
-        if (writing_time)
+        if (writers[0].writing_time)
         {
-            int speed = written * 100 / writing_time * 1000 / 1024; // MB/s x100
-            int idle_percent = idle_time * 100 / (writing_time + idle_time);
+            /* dual card: the speeds add up */
+            int speeds[RAW_MAX_STRIPES] = {0};
+            int speed = 0;
+            int written = 0;
+            for (int i = 0; i < num_writers; i++)
+            {
+                struct raw_writer * w = &writers[i];
+                if (w->writing_time)
+                    speeds[i] = w->clip.written * 100 / w->writing_time * 1000 / 1024; // MB/s x100
+                speed += speeds[i];
+                written += w->clip.written;
+            }
+            int idle_time = writers[0].idle_time;
+            int idle_percent = idle_time * 100 / (writers[0].writing_time + idle_time);
             measured_write_speed = speed;
             speed /= 10;
 
-            char msg[50];
+            char msg[60];
             snprintf(msg, sizeof(msg),
                 "%s: %d MB, %d.%d MB/s",
-                chunk_filename + 17, /* skip A:/DCIM/100CANON/ */
+                writers[0].clip.chunk_filename + 17, /* skip A:/DCIM/100CANON/ */
                 written / 1024,
                 speed/10, speed%10
             );
+            if (num_writers > 1)
+            {
+                STR_APPEND(msg, " (%d+%d)", speeds[0] / 100, speeds[1] / 100);
+            }
             if (idle_time)
             {
                 if (idle_percent) { STR_APPEND(msg, ", %d%% idle ", idle_percent); }
@@ -1113,82 +1378,44 @@ static void hack_liveview(int unhack)
 
 static int FAST choose_next_capture_slot()
 {
-    /* keep on rolling? */
-    /* O(1) */
-    if (
-        capture_slot >= 0 && 
-        capture_slot + 1 < slot_count && 
-        slots[capture_slot + 1].ptr == slots[capture_slot].ptr + frame_size && 
-        slots[capture_slot + 1].status == SLOT_FREE &&
-        !force_new_buffer
-       )
-        return capture_slot + 1;
-
-    /* choose a new buffer? */
-    /* choose the largest contiguous free section */
-    /* O(n), n = slot_count */
-    int len = 0;
-    void* prev_ptr = INVALID_PTR;
-    int best_len = 0;
-    int best_index = -1;
-    for (int i = 0; i < slot_count; i++)
+    /* slots saved since the last frame can be reused (O(1) each) */
+    for (int k = 0; k < num_writers; k++)
     {
-        if (slots[i].status == SLOT_FREE)
-        {
-            if (slots[i].ptr == prev_ptr + frame_size)
-            {
-                len++;
-                prev_ptr = slots[i].ptr;
-                if (len > best_len)
-                {
-                    best_len = len;
-                    best_index = i - len + 1;
-                }
-            }
-            else
-            {
-                len = 1;
-                prev_ptr = slots[i].ptr;
-                if (len > best_len)
-                {
-                    best_len = len;
-                    best_index = i;
-                }
-            }
-        }
-        else
-        {
-            len = 0;
-            prev_ptr = INVALID_PTR;
-        }
+        struct frame_queue * q = &writers[k].freed_queue;
+        int freed = frame_queue_count(q);
+        for (int i = 0; i < freed; i++)
+            slots_release(&slot_alloc, frame_queue_peek(q, i));
+        frame_queue_pop(q, freed);
     }
-
-    /* fixme: */
-    /* avoid 32MB writes, they are slower (they require two DMA calls) */
-    /* go back a few K and the speed is restored */
-    //~ best_len = MIN(best_len, (32*1024*1024 - 8192) / frame_size);
     
-    force_new_buffer = 0;
-
-    return best_index;
+    return slots_choose_capture(&slot_alloc, capture_slot, &force_new_buffer);
 }
 
 #define FRAME_SENTINEL 0xA5A5A5A5 /* for double-checking EDMAC operations */
 
-static void frame_add_checks(int slot_index)
+static void buffer_add_checks(void* ptr, int size)
 {
-    void* ptr = slots[slot_index].ptr;
-    uint32_t* frame_end = ptr + frame_size_real - 4;
-    uint32_t* after_frame = ptr + frame_size_real;
+    uint32_t* frame_end = ptr + size - 4;
+    uint32_t* after_frame = ptr + size;
     *(volatile uint32_t*) frame_end = FRAME_SENTINEL; /* this will be overwritten by EDMAC */
     *(volatile uint32_t*) after_frame = FRAME_SENTINEL; /* this shalt not be overwritten */
 }
 
-static int frame_check_saved(int slot_index)
+/* where the image data goes (after the block header, in indexed mode) */
+static void* frame_data(int slot_index)
+{
+    return slots[slot_index].ptr + slot_header;
+}
+
+static void frame_add_checks(int slot_index)
+{
+    buffer_add_checks(frame_data(slot_index), frame_size_real);
+}
+
+static int buffer_check_saved(void* ptr, int size)
 {
-    void* ptr = slots[slot_index].ptr;
-    uint32_t* frame_end = ptr + frame_size_real - 4;
-    uint32_t* after_frame = ptr + frame_size_real;
+    uint32_t* frame_end = ptr + size - 4;
+    uint32_t* after_frame = ptr + size;
     if (*(volatile uint32_t*) after_frame != FRAME_SENTINEL)
     {
         /* EDMAC overflow */
@@ -1205,6 +1432,41 @@ static int frame_check_saved(int slot_index)
     return 1;
 }
 
+static int frame_check_saved(int slot_index)
+{
+    return buffer_check_saved(frame_data(slot_index), frame_size_real);
+}
+
+/* trigger mode: every trigger_row_step-th row of the last frame, from its full copy, for raw_video_trigger_task */
+/* started from the vsync CBR, after the full copy is done, and finished before the next one */
+static void trigger_copy_start()
+{
+    if (!trigger_source)
+        return;
+
+    /* still busy with the previous copy? skip this frame */
+    if (!trigger_frame)
+    {
+        edmac_copy_rectangle_start(trigger_buffer, trigger_source, res_x*14/8 * trigger_row_step, 0, 0, res_x*14/8, trigger_rows);
+        trigger_dma_in_progress = 1;
+    }
+    else
+    {
+        trigger_source = 0;
+    }
+}
+
+static void trigger_copy_finish()
+{
+    if (!trigger_dma_in_progress)
+        return;
+
+    edmac_copy_rectangle_finish();
+    trigger_dma_in_progress = 0;
+    trigger_frame = trigger_source_frame;
+    trigger_source = 0;
+}
+
 static int FAST process_frame()
 {
     /* skip the first frame, it will be gibberish */
@@ -1214,24 +1476,39 @@ static int FAST process_frame()
         return 0;
     }
     
+    /* 12/10-bit: we also need a staging buffer */
+    int packed = bits_per_pixel < 14;
+    void* staging = 0;
+    if (packed && staging_added - staging_packed < STAGING_BUFFERS)
+        staging = staging_buffers[staging_added % STAGING_BUFFERS];
+
     /* where to save the next frame? */
-    capture_slot = choose_next_capture_slot(capture_slot);
+    capture_slot = (packed && !staging) ? -1 : choose_next_capture_slot(capture_slot);
     
-    if (capture_slot >= 0)
+    if (capture_slot >= 0 && packed)
+    {
+        /* the packing task will send it for saving */
+        slots[capture_slot].frame_number = frame_count;
+        frame_add_header(capture_slot);
+        buffer_add_checks(staging, staging_size_real);
+        staging_slots[staging_added % STAGING_BUFFERS] = capture_slot;
+        memory_barrier();
+        staging_added++;
+    }
+    else if (capture_slot >= 0)
     {
         /* okay */
         slots[capture_slot].frame_number = frame_count;
-        slots[capture_slot].status = SLOT_FULL;
+        frame_add_header(capture_slot);
         frame_add_checks(capture_slot);
 
         /* send it for saving, even if it isn't done yet */
         /* it's quite unlikely that FIO DMA will be faster than EDMAC */
-        writing_queue[writing_queue_tail] = capture_slot;
-        writing_queue_tail = mod(writing_queue_tail + 1, COUNT(writing_queue));
+        frame_queue_push(&writing_queue, capture_slot);
     }
     else
     {
-        /* card too slow */
+        /* card (or packing) too slow */
         frame_skips++;
         if (allow_frame_skip)
         {
@@ -1243,7 +1520,7 @@ static int FAST process_frame()
     }
 
     /* copy current frame to our buffer and crop it to its final size */
-    void* ptr = slots[capture_slot].ptr;
+    void* ptr = packed ? staging : frame_data(capture_slot);
     void* fullSizeBuffer = fullsize_buffers[(fullsize_buffer_pos+1) % 2];
 
     /* advance to next buffer for the upcoming capture */
@@ -1257,8 +1534,18 @@ static int FAST process_frame()
 
     //~ console_printf("saving frame %d: slot %d ptr %x\n", frame_count, capture_slot, ptr);
 
+    /* EDMAC does one transfer at a time */
+    trigger_copy_finish();
+
     int ans = edmac_copy_rectangle_start(ptr, fullSizeBuffer, raw_info.pitch, (skip_x+7)/8*14, skip_y/2*2, res_x*14/8, res_y);
 
+    /* trigger mode: a few rows of this frame will be copied at the next vsync, from its full copy */
+    if (trigger_running && !trigger_source)
+    {
+        trigger_source = ptr;
+        trigger_source_frame = frame_count;
+    }
+
     /* advance to next frame */
     frame_count++;
 
@@ -1276,6 +1563,14 @@ static unsigned int FAST raw_rec_vsync_cbr(unsigned int unused)
         dma_transfer_in_progress = 0;
     }
 
+    /* trigger mode: the small copy runs while we get ready for the next frame; process_frame finishes it */
+    trigger_copy_finish();
+    if (RAW_IS_RECORDING)
+        trigger_copy_start();
+    
+    /* all the staging buffers sent so far are complete (12/10-bit) */
+    staging_ready = staging_added;
+
     if (!raw_video_enabled) return 0;
     if (!is_movie_mode()) return 0;
     
@@ -1299,7 +1594,22 @@ static unsigned int FAST raw_rec_vsync_cbr(unsigned int unused)
     return 0;
 }
 
-static char* get_next_raw_movie_file_name()
+/* dual card: same file name on the other card */
+static void get_partner_file_name(char* out, int maxlen, char* filename)
+{
+    snprintf(out, maxlen, "%s", filename);
+    out[0] = (out[0] == 'A') ? 'B' : 'A';
+}
+
+static int movie_file_free(char* filename)
+{
+    uint32_t size;
+    if( FIO_GetFileSize( filename, &size ) != 0 ) return 1;
+    return size == 0;
+}
+
+/* dual card: the name must be free on both cards */
+static char* get_next_raw_movie_file_name(int dual)
 {
     static char filename[100];
 
@@ -1315,26 +1625,14 @@ static char* get_next_raw_movie_file_name()
         snprintf(filename, sizeof(filename), "%s/M%02d-%02d%02d.RAW", get_dcim_dir(), now.tm_mday, now.tm_hour, COERCE(now.tm_min + number, 0, 99));
         
         /* already existing file? */
-        uint32_t size;
-        if( FIO_GetFileSize( filename, &size ) != 0 ) break;
-        if (size == 0) break;
+        char partner[100];
+        get_partner_file_name(partner, sizeof(partner), filename);
+        if (movie_file_free(filename) && (!dual || movie_file_free(partner))) break;
     }
     
     return filename;
 }
 
-static char* get_next_chunk_file_name(char* base_name, int chunk)
-{
-    static char filename[100];
-
-    /* change file extension, according to chunk number: RAW, R00, R01 and so on */
-    snprintf(filename, sizeof(filename), "%s", base_name);
-    int len = strlen(filename);
-    snprintf(filename + len - 2, 3, "%02d", chunk-1);
-    
-    return filename;
-}
-
 static char* get_wav_file_name(char* movie_filename)
 {
     /* same name as movie, but with wav extension */
@@ -1350,302 +1648,515 @@ static char* get_wav_file_name(char* movie_filename)
     return wavfile;
 }
 
-static void raw_video_rec_task()
+/* 12/10-bit modes: pack the frames from the staging buffers, in capture order, and send them to the writing queue */
+static void raw_video_pack_task()
 {
-    //~ console_show();
-    /* init stuff */
-    raw_recording_state = RAW_PREPARING;
-    slot_count = 0;
-    capture_slot = -1;
-    fullsize_buffer_pos = 0;
-    writing_task_busy = 0;
-    frame_count = 0;
-    frame_skips = 0;
-    FILE* f = 0;
-    written = 0; /* in KB */
-    uint32_t written_chunk = 0; /* in bytes, for current chunk */
-    int last_block_size = 0; /* for detecting early stops */
-
-    /* create a backup file, to make sure we can save the file footer even if the card is full */
-    char backup_filename[100];
-    snprintf(backup_filename, sizeof(backup_filename), "%s/backup.raw", get_dcim_dir());
-    FILE* bf = FIO_CreateFileEx(backup_filename);
-    if (bf == INVALID_PTR)
+    while (1)
     {
-        bmp_printf( FONT_MED, 30, 50, "File create error");
-        goto cleanup;
-    }
-    FIO_WriteFile(bf, (void*)0x40000000, 512*1024);
-    FIO_CloseFile(bf);
-    
-    
-    /* create output file */
-    int chunk = 0;
-    movie_filename = get_next_raw_movie_file_name();
-    chunk_filename = movie_filename;
-    f = FIO_CreateFileEx(movie_filename);
-    if (f == INVALID_PTR)
-    {
-        bmp_printf( FONT_MED, 30, 50, "File create error");
-        goto cleanup;
+        if (staging_packed == staging_ready)
+        {
+            /* nothing more will arrive after recording stopped (the writer waits for us before flushing the queue) */
+            if (!RAW_IS_RECORDING && staging_ready == staging_added)
+                break;
+            msleep(10);
+            continue;
+        }
+
+        int k = staging_packed % STAGING_BUFFERS;
+        void* src = staging_buffers[k];
+        int slot_index = staging_slots[k];
+
+        if (buffer_check_saved(src, staging_size_real) != 1)
+        {
+            bmp_printf( FONT_MED, 30, 110, 
+                "Data corruption at slot %d, frame %d ", slot_index, slots[slot_index].frame_number
+            );
+            beep();
+        }
+
+        /* the sentinel at the end of the frame gets overwritten by the packed data */
+        frame_add_checks(slot_index);
+        raw_repack_row(src, 14, frame_data(slot_index), bits_per_pixel, pack_lut, res_x * res_y);
+
+        frame_queue_push(&writing_queue, slot_index);
+        staging_packed++;
     }
     
-    /* wait for two frames to be sure everything is refreshed */
-    frame_countdown = 2;
-    for (int i = 0; i < 200; i++)
-    {
-        msleep(20);
-        if (frame_countdown == 0) break;
-    }
+    pack_task_running = 0;
+}
+
+/* tables for packing (12/10-bit), built from the current black and white levels */
+static int setup_packing()
+{
+    pack_black = raw_info.black_level;
+    pack_white = raw_info.white_level;
+    pack_curve_used = pack_curve;
     
-    /* detect raw parameters (geometry, black level etc) */
-    raw_set_dirty();
-    if (!raw_update_params())
+    uint16_t* decode_table = malloc((1 << bits_per_pixel) * sizeof(decode_table[0]));
+    pack_lut = malloc(16384 * sizeof(pack_lut[0]));
+    if (!decode_table || !pack_lut)
     {
-        bmp_printf( FONT_MED, 30, 50, "Raw detect error");
-        goto cleanup;
+        if (decode_table) free(decode_table);
+        return 0;
     }
     
-    update_resolution_params();
+    raw_curve_decode_table(decode_table, bits_per_pixel, pack_curve_used, pack_black, pack_white);
+    raw_curve_encode_lut(pack_lut, decode_table, bits_per_pixel);
+    free(decode_table);
+    return 1;
+}
 
-    /* allocate memory */
-    if (!setup_buffers())
-    {
-        bmp_printf( FONT_MED, 30, 50, "Memory error");
-        goto cleanup;
-    }
+/* dual card recording: 5D3 with both cards inserted */
+static int dual_card_available()
+{
+    return cam_5d3 && is_dir("A:/") && is_dir("B:/");
+}
 
-    if (sound_rec == 1)
+static void writing_queue_lock()
+{
+    if (num_writers > 1)
+        take_semaphore(writing_queue_sem, 0);
+}
+
+static void writing_queue_unlock()
+{
+    if (num_writers > 1)
+        give_semaphore(writing_queue_sem);
+}
+
+/**
+ * Save the next group of frames from the writing queue (one write call, plus the index block when it's time for it).
+ * Dual card: both writers call this, and they take turns at the head of the writing queue;
+ * the frames are removed from the queue before writing, so the other writer can take the next group meanwhile.
+ * Returns the number of frames saved, 0 if there's nothing to save yet, or -1 if the card is full.
+ */
+static int raw_writer_step(struct raw_writer * w, int fps)
+{
+    writing_queue_lock();
+
+    int queued = frame_queue_count(&writing_queue); /* more frames may arrive meanwhile, ignore them for now */
+
+    /* writing queue empty? nothing to do */
+    if (queued == 0)
     {
-        char* wavfile = get_wav_file_name(movie_filename);
-        bmp_printf( FONT_MED, 30, 90, "Sound: %s%s", wavfile + 17, wavfile[0] == 'B' && movie_filename[0] == 'A' ? " on SD card" : "");
-        bmp_printf( FONT_MED, 30, 90, "%s", wavfile);
-        WAV_StartRecord(wavfile);
+        writing_queue_unlock();
+        return 0;
     }
-    
-    hack_liveview(0);
-    
-    /* get exclusive access to our edmac channels */
-    edmac_memcpy_res_lock();
 
-    /* this will enable the vsync CBR and the other task(s) */
-    raw_recording_state = RAW_RECORDING;
+    int first_slot = frame_queue_peek(&writing_queue, 0);
 
-    /* try a sync beep (not very precise, but better than nothing) */
-    if (sound_rec == 2)
+    /* check whether the first frame was filled by EDMAC (it may be sent in advance) */
+    /* probably not needed */
+    int check = frame_check_saved(first_slot);
+    if (check == 0)
     {
-        beep();
+        writing_queue_unlock();
+        return 0;
     }
 
-    /* signal that we are starting */
-    raw_rec_cbr_starting();
-    
-    writing_time = 0;
-    idle_time = 0;
-    int last_write_timestamp = 0;
-    
-    /* fake recording status, to integrate with other ml stuff (e.g. hdr video */
-    recording = -1;
-    
-    int fps = fps_get_current_x1000();
-    
-    int last_processed_frame = 0;
-    
-    /* main recording loop */
-    while (RAW_IS_RECORDING && lv)
+    /* group items from the queue in a contiguous block - as many as we can */
+    int num_frames = slots_group_writes(slots, &writing_queue, slot_size);
+
+    int free_slots = get_free_slots();
+
+    /* how many frames to write now? best sustained speed, without getting too close to overflow */
+    num_frames = slots_schedule_writes(&w->model, num_frames, free_slots, fps, slot_size);
+
+    /* indexed container: stop at the next index block */
+    if (slot_header)
+        num_frames = MIN(num_frames, CLIP_WRITER_INDEX_ROOM(&w->clip));
+
+    /* write queue empty? better search for a new larger buffer */
+    if (num_frames == queued)
     {
-        if (!allow_frame_skip && frame_skips)
-            goto abort_and_check_early_stop;
-        
-        int w_tail = writing_queue_tail; /* this one can be modified outside the loop, so grab it here, just in case */
-        int w_head = writing_queue_head; /* this one is modified only here, but use it just for the shorter name */
+        force_new_buffer = 1;
+    }
 
-        /* writing queue empty? nothing to do */ 
-        if (w_head == w_tail)
+    /* mark these frames as "writing" (contiguous in memory, so they are slots first_slot ... first_slot + num_frames - 1) */
+    for (int i = 0; i < num_frames; i++)
+    {
+        int slot_index = frame_queue_peek(&writing_queue, i);
+        if (slots[slot_index].status != SLOT_FULL)
         {
-            msleep(20);
-            continue;
+            bmp_printf(FONT_LARGE, 30, 70, "Slot check error");
+            beep();
         }
+        slots[slot_index].status = SLOT_WRITING;
 
-        int first_slot = writing_queue[w_head];
+        if (slot_header)
+            ((raw_block_header_t *) slots[slot_index].ptr)->frame_index = w->clip.frames_saved + i;
 
-        /* check whether the first frame was filled by EDMAC (it may be sent in advance) */
-        /* probably not needed */
-        int check = frame_check_saved(first_slot);
-        if (check == 0)
+        if (slots[slot_index].frame_number != last_processed_frame + 1 && !allow_frame_skip)
         {
-            msleep(20);
-            continue;
+            bmp_printf( FONT_MED, 30, 110,
+                "Frame order error: slot %d, frame %d, expected %d ", slot_index, slots[slot_index].frame_number, last_processed_frame + 1
+            );
+            beep();
         }
+        last_processed_frame++;
+    }
 
-        /* group items from the queue in a contiguous block - as many as we can */
-        int last_grouped = w_head;
-        
-        for (int i = w_head; i != w_tail; i = mod(i+1, COUNT(writing_queue)))
+    /* these frames are ours now; the other writer (if any) can take the next ones */
+    frame_queue_pop(&writing_queue, num_frames);
+    writing_queue_unlock();
+
+    void* ptr = slots[first_slot].ptr;
+    int size_used = slot_size * num_frames;
+
+    w->busy = 1;
+
+    int t0 = get_ms_clock_value();
+    if (!w->last_write_timestamp) w->last_write_timestamp = t0;
+    w->idle_time += t0 - w->last_write_timestamp;
+    int r = clip_writer_write(&w->clip, ptr, size_used);
+    w->last_write_timestamp = get_ms_clock_value();
+
+    if (r == 1)
+    {
+        /* learn the card speed for this block size (not from the split writes at the 4GB limit) */
+        write_model_update(&w->model, size_used, w->last_write_timestamp - t0);
+    }
+
+    w->writing_time += w->last_write_timestamp - t0;
+    w->busy = 0;
+
+    /* give these frames back, so they can be reused */
+    for (int i = 0; i < num_frames; i++)
+    {
+        int slot_index = first_slot + i;
+
+        if (r && frame_check_saved(slot_index) != 1)
         {
-            int slot_index = writing_queue[i];
-            int group_pos = mod(i - w_head, COUNT(writing_queue));
+            bmp_printf( FONT_MED, 30, 110,
+                "Data corruption at slot %d, frame %d ", slot_index, slots[slot_index].frame_number
+            );
+            beep();
+        }
 
-            /* TBH, I don't care if these are part of the same group or not,
-             * as long as pointers are ordered correctly */
-            if (slots[slot_index].ptr == slots[first_slot].ptr + frame_size * group_pos)
-                last_grouped = i;
-            else
-                break;
+        if (r && slot_header)
+            clip_writer_index_add(&w->clip, slots[slot_index].ptr);
+
+        frame_queue_push(&w->freed_queue, slot_index);
+    }
+
+    if (r == 0) /* card full */
+        return -1;
+
+    /* indexed container: time for a new index block? */
+    if (slot_header && w->clip.frames_saved % RAW_INDEX_INTERVAL == 0)
+    {
+        if (!clip_writer_save_index(&w->clip, 0))
+            return -1;
+    }
+
+    return num_frames;
+}
+
+/* trigger mode: zones and budget from the menu, then other modules may change them */
+static void setup_trigger()
+{
+    /* every Nth row of the recorded area (N even, so it's always the same kind of Bayer row) */
+    trigger_row_step = MAX(2, (res_y / RAW_TRIGGER_ROWS + 1) & ~1);
+    trigger_rows = MIN(RAW_TRIGGER_ROWS, res_y / trigger_row_step);
+
+    int threshold = trigger_sens_presets[COERCE(trigger_sens, 0, COUNT(trigger_sens_presets)-1)];
+    raw_trigger_setup_grid(&trigger, MAX(trigger_mode, 1), MAX(trigger_mode, 1), threshold, threshold / 2, 16);
+    trigger.adapt = 4;
+    trigger.warmup = 32;
+    trigger.pre_frames = trigger_pre_presets[COERCE(trigger_pre, 0, COUNT(trigger_pre_presets)-1)];
+    trigger.post_frames = trigger_post_presets[COERCE(trigger_post, 0, COUNT(trigger_post_presets)-1)];
+
+    trigger_running = raw_rec_cbr_trigger_setup(&trigger) || trigger_mode;
+    raw_trigger_reset(&trigger);
+    trigger_frame = 0;
+    trigger_evaluated = 0;
+    trigger_source = 0;
+    trigger_saving = 0;
+    trigger_save_until = 0;
+}
+
+/* trigger mode: evaluates the copies made in process_frame; the rec task decides what to keep */
+static void raw_video_trigger_task()
+{
+    while (RAW_IS_RECORDING)
+    {
+        int frame_number = trigger_frame;
+        if (!frame_number)
+        {
+            msleep(10);
+            continue;
         }
-        
-        /* grouped frames from w_head to last_grouped (including both ends) */
-        int num_frames = mod(last_grouped - w_head + 1, COUNT(writing_queue));
-        
-        int free_slots = get_free_slots();
-        
-        /* if we are about to overflow, save a smaller number of frames, so they can be freed quicker */
-        if (measured_write_speed)
+
+        raw_trigger_load_rows(&trigger, trigger_buffer, trigger_rows, res_x);
+        trigger_frame = 0;
+
+        int r = raw_trigger_evaluate(&trigger, frame_number);
+        trigger_save_until = trigger.save_until;
+        trigger_evaluated = frame_number;
+
+        if (r == RAW_TRIGGER_START)
         {
-            /* measured_write_speed unit: 0.01 MB/s */
-            /* FPS unit: 0.001 Hz */
-            /* overflow time unit: 0.1 seconds */
-            int overflow_time = free_slots * 1000 * 10 / fps;
-            /* better underestimate write speed a little */
-            int frame_limit = overflow_time * 1024 / 10 * (measured_write_speed * 9 / 100) * 1024 / frame_size / 10;
-            if (frame_limit >= 0 && frame_limit < num_frames)
-            {
-                //~ console_printf("careful, will overflow in %d.%d seconds, better write only %d frames\n", overflow_time/10, overflow_time%10, frame_limit);
-                num_frames = MAX(1, frame_limit - 1);
-            }
+            trigger_saving = 1;
+            raw_rec_cbr_trigger_event(frame_number, trigger.active_zones, 1);
         }
-        
-        int after_last_grouped = mod(w_head + num_frames, COUNT(writing_queue));
+        else if (r == RAW_TRIGGER_STOP)
+        {
+            trigger_saving = 0;
+            raw_rec_cbr_trigger_event(frame_number, 0, 0);
+        }
+    }
+
+    trigger_task_running = 0;
+}
+
+/* dual card: the writer for the second card (the first one runs in raw_video_rec_task) */
+static void raw_video_stripe_task()
+{
+    int fps = fps_get_current_x1000();
 
-        /* write queue empty? better search for a new larger buffer */
-        if (after_last_grouped == writing_queue_tail)
+    while (RAW_IS_RECORDING && !writer_error)
+    {
+        /* while pre-recording, raw_video_rec_task decides which frames to keep */
+        if (pre_recording)
         {
-            force_new_buffer = 1;
+            msleep(20);
+            continue;
         }
 
-        void* ptr = slots[first_slot].ptr;
-        int size_used = frame_size * num_frames;
+        int r = raw_writer_step(&writers[1], fps);
+        if (r < 0)
+            writer_error = 1;   /* card full; raw_video_rec_task will stop the recording */
+        else if (r == 0)
+            msleep(20);
+    }
+
+    stripe_task_running = 0;
+}
+
+static void raw_video_rec_task()
+{
+    //~ console_show();
+    /* init stuff */
+    raw_recording_state = RAW_PREPARING;
+    slot_count = 0;
+    capture_slot = -1;
+    fullsize_buffer_pos = 0;
+    frame_count = 0;
+    frame_skips = 0;
+    pre_recording = 0;
+    pre_record_dropped = 0;
+    last_processed_frame = 0;
+    writer_error = 0;
+    staging_added = staging_ready = staging_packed = 0;
+    int last_block_size = 0; /* for detecting early stops */
+    int pre_record_cancelled = 0;
+
+    /* dual card: one file on each card, both written at the same time (the indexed container is needed for merging them) */
+    num_writers = dual_card && dual_card_available() ? 2 : 1;
+    for (int i = 0; i < COUNT(writers); i++)
+        memset(&writers[i], 0, sizeof(writers[i]));
 
-        /* mark these frames as "writing" */
-        for (int i = w_head; i != after_last_grouped; i = mod(i+1, COUNT(writing_queue)))
+    /* create a backup file, to make sure we can save the file footer even if the card is full */
+    /* (not needed for the indexed container, where the metadata is saved at the beginning) */
+    char backup_filename[100];
+    snprintf(backup_filename, sizeof(backup_filename), "%s/backup.raw", get_dcim_dir());
+    if (!USE_INDEXED_FORMAT)
+    {
+        FILE* bf = FIO_CreateFileEx(backup_filename);
+        if (bf == INVALID_PTR)
         {
-            int slot_index = writing_queue[i];
-            if (slots[slot_index].status != SLOT_FULL)
-            {
-                bmp_printf(FONT_LARGE, 30, 70, "Slot check error");
-                beep();
-            }
-            slots[slot_index].status = SLOT_WRITING;
+            bmp_printf( FONT_MED, 30, 50, "File create error");
+            goto cleanup;
         }
+        FIO_WriteFile(bf, (void*)0x40000000, 512*1024);
+        FIO_CloseFile(bf);
+    }
+
+
+    /* create output file(s) */
+    char* filename = get_next_raw_movie_file_name(num_writers > 1);
+    if (!clip_writer_create(&writers[0].clip, filename))
+    {
+        bmp_printf( FONT_MED, 30, 50, "File create error");
+        goto cleanup;
+    }
+    movie_filename = writers[0].clip.filename;
 
-        /* ask an optional external routine if this buffer should get saved now. if none registered, it will return 1 */
-        int ext_gating = 1;
-        if (ext_gating)
+    if (num_writers > 1)
+    {
+        char partner[100];
+        get_partner_file_name(partner, sizeof(partner), filename);
+        if (!clip_writer_create(&writers[1].clip, partner))
         {
-            writing_task_busy = 1;
-            
-            int t0 = get_ms_clock_value();
-            if (!last_write_timestamp) last_write_timestamp = t0;
-            idle_time += t0 - last_write_timestamp;
-            int r = FIO_WriteFile(f, ptr, size_used);
-            last_write_timestamp = get_ms_clock_value();
-
-            if (r != size_used) /* 4GB limit or card full? */
-            {
-                /* it failed right away? card must be full */
-                if (written == 0) goto abort;
+            bmp_printf( FONT_MED, 30, 50, "File create error (%c: card)", partner[0]);
+            goto cleanup;
+        }
+    }
 
-                if (r == -1)
-                {
-                    /* 4GB limit? it stops after writing 4294967295 bytes, but FIO_WriteFile may return -1 */
-                    //if ((uint64_t)written_chunk + size_used > 4294967295)
-                    if (1) // renato says it's not working?!
-                    {
-                        r = 4294967295 - written_chunk;
-                        
-                        /* 5D2 does not write anything if the call failed, but 5D3 writes exactly 4294967295 */
-                        /* this one should cover both cases in a portable way */
-                        /* on 5D2 will succeed, on 5D3 should fail right away */
-                        FIO_WriteFile(f, ptr, r);
-                    }
-                    else /* idk */
-                    {
-                        r = 0;
-                    }
-                }
-                
-                /* try to create a new chunk */
-                chunk_filename = get_next_chunk_file_name(movie_filename, ++chunk);
-                FILE* g = FIO_CreateFileEx(chunk_filename);
-                if (g == INVALID_PTR) goto abort;
-                
-                /* write the remaining data in the new chunk */
-                int r2 = FIO_WriteFile(g, ptr + r, size_used - r);
-                if (r2 == size_used - r) /* new chunk worked, continue with it */
-                {
-                    FIO_CloseFile(f);
-                    f = g;
-                    written += size_used / 1024;
-                    written_chunk = r2;
-                }
-                else /* new chunk didn't work, card full */
-                {
-                    /* let's hope we can still save the footer in the current chunk (don't create a new one) */
-                    FIO_CloseFile(g);
-                    FIO_RemoveFile(chunk_filename);
-                    chunk--;
-                    goto abort;
-                }
-            }
-            else
+    /* wait for two frames to be sure everything is refreshed */
+    frame_countdown = 2;
+    for (int i = 0; i < 200; i++)
+    {
+        msleep(20);
+        if (frame_countdown == 0) break;
+    }
+
+    /* detect raw parameters (geometry, black level etc) */
+    raw_set_dirty();
+    if (!raw_update_params())
+    {
+        bmp_printf( FONT_MED, 30, 50, "Raw detect error");
+        goto cleanup;
+    }
+
+    update_resolution_params();
+    setup_trigger();
+
+    /* allocate memory */
+    if (!setup_buffers() || (bits_per_pixel < 14 && !setup_packing()))
+    {
+        bmp_printf( FONT_MED, 30, 50, "Memory error");
+        goto cleanup;
+    }
+
+    int fps = fps_get_current_x1000();
+
+    /* pre-record: keep some free slots for the live frames, so recording can continue after the second REC press */
+    pre_record_frames = MIN(pre_record_presets[COERCE(pre_record, 0, COUNT(pre_record_presets)-1)] * fps / 1000, slot_count * 3 / 4);
+    pre_recording = pre_record_frames > 0;
+
+    /* trigger mode: same thing while waiting for the trigger, with the pre-trigger frames */
+    if (trigger_running)
+    {
+        pre_record_frames = MIN(trigger.pre_frames, slot_count * 3 / 4);
+        pre_recording = 1;
+    }
+
+    if (slot_header)
+    {
+        /* dual card: both parts get the same clip id, so raw2dng can check they belong together */
+        uint32_t clip_id = get_ms_clock_value() | 1;
+        for (int i = 0; i < num_writers; i++)
+        {
+            if (!lv_rec_save_clip_header(&writers[i].clip, i, clip_id))
             {
-                /* all fine */
-                written += size_used / 1024;
-                written_chunk += size_used;
+                bmp_printf( FONT_MED, 30, 50, "File write error");
+                goto cleanup;
             }
-            
-            writing_time += last_write_timestamp - t0;
-            writing_task_busy = 0;
         }
+    }
 
-        /* for detecting early stops */
-        last_block_size = mod(after_last_grouped - w_head, COUNT(writing_queue));
+    if (sound_rec == 1)
+    {
+        char* wavfile = get_wav_file_name(movie_filename);
+        bmp_printf( FONT_MED, 30, 90, "Sound: %s%s", wavfile + 17, wavfile[0] == 'B' && movie_filename[0] == 'A' ? " on SD card" : "");
+        bmp_printf( FONT_MED, 30, 90, "%s", wavfile);
+        WAV_StartRecord(wavfile);
+    }
+
+    hack_liveview(0);
+
+    /* get exclusive access to our edmac channels */
+    edmac_memcpy_res_lock();
+
+    /* each card learns its own speed, starting from its benchmark profile (if any) */
+    for (int i = 0; i < num_writers; i++)
+    {
+        struct raw_writer * w = &writers[i];
+        write_model_init(&w->model, measured_write_speed);
+        struct card_profile * profile = card_profile_for(w->clip.filename[0]);
+        if (profile) write_model_add_profile(&w->model, profile, 0);
+    }
+
+    /* this will enable the vsync CBR and the other task(s) */
+    capture_start_time = get_ms_clock_value_fast();
+    raw_recording_state = RAW_RECORDING;
+
+    if (bits_per_pixel < 14)
+    {
+        pack_task_running = 1;
+        task_create("raw_pack_task", 0x1a, 0x1000, raw_video_pack_task, (void*)0);
+    }
+
+    if (num_writers > 1)
+    {
+        stripe_task_running = 1;
+        task_create("raw_stripe_task", 0x19, 0x1000, raw_video_stripe_task, (void*)0);
+    }
 
-        /* mark these frames as "free" so they can be reused */
-        for (int i = w_head; i != after_last_grouped; i = mod(i+1, COUNT(writing_queue)))
+    if (trigger_running)
+    {
+        trigger_task_running = 1;
+        task_create("raw_trigger_task", 0x1c, 0x1000, raw_video_trigger_task, (void*)0);
+    }
+
+    /* try a sync beep (not very precise, but better than nothing) */
+    /* when pre-recording, we'll beep when saving starts */
+    if (sound_rec == 2 && !pre_recording)
+    {
+        beep();
+    }
+
+    /* signal that we are starting */
+    raw_rec_cbr_starting();
+
+    /* fake recording status, to integrate with other ml stuff (e.g. hdr video */
+    recording = -1;
+
+    /* main recording loop */
+    while (RAW_IS_RECORDING && lv)
+    {
+        if (!allow_frame_skip && frame_skips)
+            goto abort_and_check_early_stop;
+
+        /* dual card: the other card is full */
+        if (writer_error)
+            goto abort;
+
+        /* trigger mode: save while triggered, and until the last post-trigger frame is written; otherwise wait */
+        if (trigger_running)
+            pre_recording = !trigger_saving && last_processed_frame >= trigger_save_until;
+
+        /* pre-recording? keep the last frames only, and give the older ones back to the capture side */
+        if (pre_recording)
         {
-            if (i == writing_queue_tail)
+            writing_queue_lock();
+            int old = frame_queue_count(&writing_queue) - pre_record_frames;
+            int dropped = 0;
+            for (int i = 0; i < old; i++)
             {
-                bmp_printf( FONT_MED, 30, 110, 
-                    "Queue overflow"
-                );
-                beep();
-            }
-            
-            int slot_index = writing_queue[i];
+                int slot_index = frame_queue_peek(&writing_queue, i);
 
-            if (frame_check_saved(slot_index) != 1)
-            {
-                bmp_printf( FONT_MED, 30, 110, 
-                    "Data corruption at slot %d, frame %d ", slot_index, slots[slot_index].frame_number
-                );
-                beep();
+                /* trigger mode: the frames not evaluated yet may still be needed as pre-trigger frames */
+                if (trigger_running && slots[slot_index].frame_number >= trigger_evaluated - trigger.pre_frames)
+                    break;
+
+                last_processed_frame = slots[slot_index].frame_number;
+                frame_queue_push(&writers[0].freed_queue, slot_index);
+                dropped++;
             }
-            
-            if (slots[slot_index].frame_number != last_processed_frame + 1 && !allow_frame_skip)
+            if (dropped > 0)
             {
-                bmp_printf( FONT_MED, 30, 110, 
-                    "Frame order error: slot %d, frame %d, expected ", slot_index, slots[slot_index].frame_number, last_processed_frame + 1
-                );
-                beep();
+                frame_queue_pop(&writing_queue, dropped);
+                pre_record_dropped += dropped;
             }
-            last_processed_frame++;
+            writing_queue_unlock();
+            msleep(20);
+            continue;
+        }
+
+        int r = raw_writer_step(&writers[0], fps);
+        if (r < 0)
+            goto abort;
 
-            slots[slot_index].status = SLOT_FREE;
+        if (r == 0)
+        {
+            msleep(20);
+            continue;
         }
-        
-        /* remove these frames from the queue */
-        writing_queue_head = after_last_grouped;
+
+        /* for detecting early stops */
+        last_block_size = r;
 
         /* error handling */
         if (0)
@@ -1657,14 +2168,14 @@ abort_and_check_early_stop:
 
             if (last_block_size > 2)
             {
-                bmp_printf( FONT_MED, 30, 90, 
+                bmp_printf( FONT_MED, 30, 90,
                     "Early stop (%d). This is a bug, please report it.", last_block_size
                 );
                 beep_times(last_block_size);
             }
             else
             {
-                bmp_printf( FONT_MED, 30, 90, 
+                bmp_printf( FONT_MED, 30, 90,
                     "Movie recording stopped automagically         "
                 );
                 /* this is error beep, not audio sync beep */
@@ -1673,10 +2184,10 @@ abort_and_check_early_stop:
             break;
         }
     }
-    
+
     /* signal that we are stopping */
     raw_rec_cbr_stopping();
-    
+
     /* done, this will stop the vsync CBR and the copying task */
     raw_recording_state = RAW_FINISHING;
 
@@ -1686,6 +2197,10 @@ abort_and_check_early_stop:
     /* exclusive edmac access no longer needed */
     edmac_memcpy_res_unlock();
 
+    /* the last frames may still be waiting to be packed, and the other card may still be writing */
+    while (pack_task_running || stripe_task_running || trigger_task_running)
+        msleep(20);
+
     recording = 0;
 
     if (sound_rec == 1)
@@ -1693,19 +2208,30 @@ abort_and_check_early_stop:
         WAV_StopRecord();
     }
 
-    bmp_printf( FONT_MED, 30, 70, 
-        "Frames captured: %d               ", 
+    bmp_printf( FONT_MED, 30, 70,
+        "Frames captured: %d               ",
         frame_count - 1
     );
 
-    /* write remaining frames */
-    for (; writing_queue_head != writing_queue_tail; writing_queue_head = mod(writing_queue_head + 1, COUNT(slots)))
+    /* still pre-recording? REC was not pressed again (or nothing triggered since the last event), so the buffered frames are not needed */
+    if (pre_recording)
+    {
+        pre_record_dropped += frame_queue_count(&writing_queue);
+        frame_queue_pop(&writing_queue, frame_queue_count(&writing_queue));
+        pre_recording = 0;
+        pre_record_cancelled = 1;
+    }
+
+    /* write remaining frames (all of them on the first card; dual card clips are merged by frame number anyway) */
+    /* (the vsync CBR no longer runs, so the slots can be marked as free right away) */
+    struct clip_writer * cw = &writers[0].clip;
+    for (; frame_queue_count(&writing_queue); frame_queue_pop(&writing_queue, 1))
     {
-        int slot_index = writing_queue[writing_queue_head];
+        int slot_index = frame_queue_peek(&writing_queue, 0);
 
         if (slots[slot_index].status != SLOT_FULL || frame_check_saved(slot_index) != 1)
         {
-            bmp_printf( FONT_MED, 30, 110, 
+            bmp_printf( FONT_MED, 30, 110,
                 "Data corruption at slot %d, frame %d ", slot_index, slots[slot_index].frame_number
             );
             beep();
@@ -1713,7 +2239,7 @@ abort_and_check_early_stop:
 
         if (slots[slot_index].frame_number != last_processed_frame + 1 && !allow_frame_skip)
         {
-            bmp_printf( FONT_MED, 30, 110, 
+            bmp_printf( FONT_MED, 30, 110,
                 "Frame order error: slot %d, frame %d, expected %d ", slot_index, slots[slot_index].frame_number, last_processed_frame + 1
             );
             beep();
@@ -1722,7 +2248,16 @@ abort_and_check_early_stop:
 
         slots[slot_index].status = SLOT_WRITING;
         show_buffer_status();
-        written += FIO_WriteFile(f, slots[slot_index].ptr, frame_size) / 1024;
+        if (slot_header)
+            ((raw_block_header_t *) slots[slot_index].ptr)->frame_index = cw->frames_saved;
+        if (!clip_writer_write(cw, slots[slot_index].ptr, slot_size))
+            break;
+        if (slot_header)
+        {
+            clip_writer_index_add(cw, slots[slot_index].ptr);
+            if (cw->frames_saved % RAW_INDEX_INTERVAL == 0 && !clip_writer_save_index(cw, 0))
+                break;
+        }
         slots[slot_index].status = SLOT_FREE;
     }
 
@@ -1730,36 +2265,44 @@ abort_and_check_early_stop:
     FIO_RemoveFile(backup_filename);
     msleep(500);
 
-    if (written && f)
+    int written = 0;
+    for (int i = 0; i < num_writers; i++)
+        written += writers[i].clip.written;
+
+    if (written && slot_header)
     {
-        /* write footer (metadata) */
-        int footer_ok = lv_rec_save_footer(f);
-        if (!footer_ok)
+        /* indexed container: the metadata was saved at the beginning; the clip is still usable without the last index */
+        for (int i = 0; i < num_writers; i++)
         {
-            /* try to save footer in a new chunk */
-            FIO_CloseFile(f); f = 0;
-            chunk_filename = get_next_chunk_file_name(movie_filename, ++chunk);
-            FILE* g = FIO_CreateFileEx(chunk_filename);
-            if (g != INVALID_PTR)
+            if (writers[i].clip.written && !clip_writer_save_index(&writers[i].clip, 1))
             {
-                footer_ok = lv_rec_save_footer(g);
-                FIO_CloseFile(g);
+                bmp_printf( FONT_MED, 30, 110,
+                    "Could not save the last index (card full?)"
+                );
+                beep();
             }
         }
+    }
+    else if (written && cw->f)
+    {
+        /* write footer (metadata) */
+        lv_rec_file_footer_t footer;
+        lv_rec_fill_footer(&footer);
+        int footer_ok = clip_writer_save_footer(cw, &footer);
 
         /* still didn't succeed? */
         if (!footer_ok)
         {
-            bmp_printf( FONT_MED, 30, 110, 
+            bmp_printf( FONT_MED, 30, 110,
                 "Footer save error"
             );
             beep_times(3);
             msleep(2000);
         }
     }
-    else
+    else if (!pre_record_cancelled)
     {
-        bmp_printf( FONT_MED, 30, 110, 
+        bmp_printf( FONT_MED, 30, 110,
             "Nothing saved, card full maybe."
         );
         beep_times(3);
@@ -1767,11 +2310,14 @@ abort_and_check_early_stop:
     }
 
 cleanup:
-    if (f) FIO_CloseFile(f);
-    if (!written) { FIO_RemoveFile(movie_filename); movie_filename = 0; }
+    /* empty files are removed */
+    for (int i = 0; i < COUNT(writers); i++)
+        clip_writer_close(&writers[i].clip);
+    if (!writers[0].clip.written) movie_filename = 0;
     FIO_RemoveFile(backup_filename);
     free_buffers();
-    
+    if (pack_lut) { free(pack_lut); pack_lut = 0; }
+
     #ifdef DEBUG_BUFFERING_GRAPH
     take_screenshot(0);
     #endif
@@ -1782,7 +2328,14 @@ cleanup:
 
 static MENU_SELECT_FUNC(raw_start_stop)
 {
-    if (!RAW_IS_IDLE)
+    /* in trigger mode, REC just stops */
+    if (RAW_IS_RECORDING && pre_recording && !trigger_running)
+    {
+        /* the buffered frames will be saved first, then the live ones */
+        pre_recording = 0;
+        if (sound_rec == 2) beep();
+    }
+    else if (!RAW_IS_IDLE)
     {
         raw_recording_state = RAW_FINISHING;
         if (sound_rec == 2) beep();
@@ -1798,6 +2351,8 @@ static MENU_SELECT_FUNC(raw_start_stop)
 static void raw_video_playback_task()
 {
     void* buf = NULL;
+    void* buf14 = NULL;                 /* 12/10-bit clips are unpacked here */
+    uint16_t* decode_table = NULL;
     FILE* f = INVALID_PTR;
 
     /* prepare display */
@@ -1818,8 +2373,17 @@ static void raw_video_playback_task()
         goto cleanup;
     }
     
+    /* indexed clips start with a header block; classic ones only have the footer */
+    int indexed = lv_rec_read_clip_header(f);
+    if (indexed < 0)
+        goto cleanup;
+
     /* read footer information and update global variables, will seek automatically */
-    lv_rec_read_footer(f);
+    if (!indexed && !lv_rec_read_footer(f))
+        goto cleanup;
+
+    slot_header = indexed ? RAW_FRAME_HEADER_SIZE : 0;
+    slot_size = frame_size + slot_header;
 
     raw_set_geometry(res_x, res_y, 0, 0, 0, 0);
     
@@ -1827,18 +2391,35 @@ static void raw_video_playback_task()
      * (which should be greater or equal, because of rounding) */
     ASSERT(raw_info.frame_size <= frame_size);
     
-    buf = shoot_malloc(frame_size);
+    buf = shoot_malloc(slot_size);
     if (!buf)
         goto cleanup;
 
+    if (bits_per_pixel < 14)
+    {
+        buf14 = shoot_malloc(res_x * res_y * 14/8);
+        decode_table = malloc((1 << bits_per_pixel) * sizeof(decode_table[0]));
+        if (!buf14 || !decode_table)
+            goto cleanup;
+        raw_curve_decode_table(decode_table, bits_per_pixel, pack_curve_used, raw_info.black_level, raw_info.white_level);
+    }
+
     vram_clear_lv();
     
-    for (int i = 0; i < frame_count-1; i++)
+    /* indexed clips: the frame count is not known, play until the first incomplete frame */
+    for (int i = 0; indexed || i < frame_count-1; i++)
     {
-        bmp_printf(FONT_MED, os.x_max - font_med.width*10, os.y_max - 20, "%d/%d", i+1, frame_count-1);
+        if (indexed)
+            bmp_printf(FONT_MED, os.x_max - font_med.width*10, os.y_max - 20, "%d", i+1);
+        else
+            bmp_printf(FONT_MED, os.x_max - font_med.width*10, os.y_max - 20, "%d/%d", i+1, frame_count-1);
         bmp_printf(FONT_MED, 0, os.y_max - font_med.height, "%s: %dx%d", movie_filename, res_x, res_y);
-        int r = FIO_ReadFile(f, buf, frame_size);
-        if (r != frame_size)
+        if (indexed)
+            FIO_SeekFile(f, RAW_FRAME_BLOCK_OFFSET(i, frame_size), SEEK_SET);
+        int r = FIO_ReadFile(f, buf, slot_size);
+        if (r != slot_size)
+            break;
+        if (indexed && strncmp((char*)((raw_block_header_t *) buf)->magic, "RAWF", 4))
             break;
         
         if (get_halfshutter_pressed())
@@ -1847,7 +2428,12 @@ static void raw_video_playback_task()
         if (gui_state != GUISTATE_PLAYMENU)
             break;
 
-        raw_info.buffer = buf;
+        raw_info.buffer = buf + slot_header;
+        if (buf14)
+        {
+            raw_repack_row(buf + slot_header, bits_per_pixel, buf14, 14, decode_table, res_x * res_y);
+            raw_info.buffer = buf14;
+        }
         raw_set_geometry(res_x, res_y, 0, 0, 0, 0);
         raw_force_aspect_ratio_1to1();
         raw_preview_fast();
@@ -1857,6 +2443,8 @@ cleanup:
     vram_clear_lv();
     if (f != INVALID_PTR) FIO_CloseFile(f);
     if (buf) shoot_free(buf);
+    if (buf14) shoot_free(buf14);
+    if (decode_table) free(decode_table);
     raw_playing = 0;
     SetGUIRequestMode(0);
     ui_lock(UILOCK_NONE);
@@ -1901,6 +2489,138 @@ static MENU_SELECT_FUNC(raw_playback_start)
     }
 }
 
+static MENU_UPDATE_FUNC(bit_depth_update)
+{
+    if (bits_per_pixel < 14)
+        MENU_SET_WARNING(MENU_WARN_INFO, "%d%% less data. Use raw2dng from this version to convert.", (14 - bits_per_pixel) * 100 / 14);
+}
+
+static MENU_UPDATE_FUNC(file_format_update)
+{
+    if (dual_card && !indexed_format)
+        MENU_SET_WARNING(MENU_WARN_INFO, "Dual card recording always uses the indexed format.");
+    else if (indexed_format)
+        MENU_SET_WARNING(MENU_WARN_INFO, "Frames are %d bytes larger. Use raw2dng from this version to convert.", RAW_FRAME_HEADER_SIZE);
+}
+
+static MENU_UPDATE_FUNC(dual_card_update)
+{
+    if (!dual_card)
+        return;
+    
+    if (!dual_card_available())
+        MENU_SET_WARNING(MENU_WARN_NOT_WORKING, "Needs both cards (CF and SD). Recording on one card only.");
+    else
+        MENU_SET_WARNING(MENU_WARN_INFO, "Same file name on both cards. Convert with raw2dng --merge=<file on SD>.");
+}
+
+static MENU_UPDATE_FUNC(pre_record_update)
+{
+    if (pre_record && trigger_mode)
+        MENU_SET_WARNING(MENU_WARN_NOT_WORKING, "Not used in trigger mode (see Pre-trigger frames).");
+    else if (pre_record && RAW_IS_RECORDING && pre_recording)
+        MENU_SET_WARNING(MENU_WARN_INFO, "Pre-recording now: keeping the last %d frames in memory.", pre_record_frames);
+}
+
+static MENU_UPDATE_FUNC(trigger_update)
+{
+    if (RAW_IS_RECORDING && trigger_running)
+        MENU_SET_WARNING(MENU_WARN_INFO, "%s: %d events so far.", trigger_saving ? "Triggered" : "Waiting", trigger.events);
+}
+
+static MENU_UPDATE_FUNC(trigger_option_update)
+{
+    if (!trigger_mode)
+        MENU_SET_WARNING(MENU_WARN_NOT_WORKING, "Only used in trigger mode.");
+}
+
+static MENU_UPDATE_FUNC(pack_curve_update)
+{
+    if (bits_per_pixel == 14)
+        MENU_SET_WARNING(MENU_WARN_NOT_WORKING, "Only used for 12-bit and 10-bit recording.");
+}
+
+static void card_bench_progress(int test, int block_size, int percent)
+{
+    NotifyBox(10000, "Card benchmark %d/%d: %dK blocks, %d%%", test + 1, CARD_BENCH_TESTS, block_size / 1024, percent);
+}
+
+static void card_bench_task()
+{
+    /* same card as the movies (see the note about the 5D3 in debug.c) */
+    char filename[100];
+    snprintf(filename, sizeof(filename), "%s/bench.tmp", get_dcim_dir());
+
+    struct card_bench_params p = {
+        .filename = filename,
+        .buf = (void*)0x40000000,       /* like the card warm-up: contents don't matter */
+        .buf_size = CARD_BENCH_BLOCK_SIZE(CARD_BENCH_SIZES - 1) + 16,
+        .test_size = 64*1024*1024,
+        .long_size = 1024*1024*1024,
+        .pause = 1000,
+        .progress = card_bench_progress,
+        .cancel = &card_bench_cancel,
+    };
+
+    char drive = get_dcim_dir()[0];
+    struct card_profile profile = {
+        .card_id = card_bench_card_id(drive, info_get_cardmaker(drive), info_get_cardmodel(drive)),
+    };
+
+    int r = card_bench_run(&p, &profile);
+    if (r == CARD_BENCH_OK)
+    {
+        card_profile_store(card_profiles, COUNT(card_profiles), &profile, &card_profile_next);
+        int lo = profile.speed[0] * 10 / 1024;
+        int hi = profile.speed[CARD_BENCH_SIZES - 1] * 10 / 1024;
+        NotifyBox(5000, "Card profile saved: %d.%d MB/s (256K) ... %d.%d MB/s (64M)", lo/10, lo%10, hi/10, hi%10);
+    }
+    else if (r == CARD_BENCH_CANCELLED)
+        NotifyBox(2000, "Card benchmark cancelled.");
+    else if (r == CARD_BENCH_ERR_CREATE)
+        NotifyBox(5000, "Card benchmark: could not create %s", filename);
+    else
+        NotifyBox(5000, "Card benchmark: write error (card full?)");
+
+    card_bench_running = 0;
+}
+
+static MENU_SELECT_FUNC(card_bench_start)
+{
+    if (!card_bench_running && !raw_playing && RAW_IS_IDLE)
+    {
+        card_bench_cancel = 0;
+        card_bench_running = 1;
+        gui_stop_menu();
+        task_create("card_bench_task", 0x1e, 0x1000, card_bench_task, (void*)0);
+    }
+}
+
+static MENU_UPDATE_FUNC(card_bench_update)
+{
+    if (card_bench_running)
+    {
+        MENU_SET_VALUE("Running...");
+        return;
+    }
+
+    struct card_profile * profile = card_profile_for(get_dcim_dir()[0]);
+    if (!profile)
+    {
+        MENU_SET_VALUE("No profile");
+        MENU_SET_WARNING(MENU_WARN_ADVICE, "No profile for this card; frame estimates use the last recording.");
+        return;
+    }
+
+    int lo = profile->speed[0] * 10 / 1024;
+    int mid = profile->speed[4] * 10 / 1024;
+    int hi = profile->speed[CARD_BENCH_SIZES - 1] * 10 / 1024;
+    MENU_SET_VALUE("%d-%d MB/s", lo/10, hi/10);
+    MENU_SET_WARNING(MENU_WARN_INFO, "256K:%d.%d 4M:%d.%d 64M:%d.%d MB/s, misaligned %d%%, long files %d%%.",
+        lo/10, lo%10, mid/10, mid%10, hi/10, hi%10, profile->unaligned, profile->late
+    );
+}
+
 static MENU_UPDATE_FUNC(raw_playback_update)
 {
     if (movie_filename)
@@ -1953,6 +2673,87 @@ static struct menu_entry raw_video_menu[] =
                 .help = "Sound recording options.",
             },
             */
+            {
+                .name = "Bit depth",
+                .priv = &bit_depth_index,
+                .max = COUNT(bit_depth_presets) - 1,
+                .choices = CHOICES("14-bit", "12-bit", "10-bit"),
+                .update = bit_depth_update,
+                .help  = "Lower bit depth: less data to write, higher resolutions on slow cards.",
+                .help2 = "12/10-bit frames are packed by the CPU; may skip frames at high res.",
+            },
+            {
+                .name = "Curve",
+                .priv = &pack_curve,
+                .max = 1,
+                .choices = CHOICES("Linear", "Log-ish"),
+                .update = pack_curve_update,
+                .help  = "How the 14-bit data is mapped to 12 or 10 bits (above black level).",
+                .help2 = "Linear: uniform steps.\n"
+                         "Log-ish: full detail in shadows, coarser steps in highlights.\n",
+            },
+            {
+                .name = "File format",
+                .priv = &indexed_format,
+                .max = 1,
+                .choices = CHOICES("Classic", "Indexed"),
+                .update = file_format_update,
+                .help  = "Classic: metadata at the end of the file (needs a backup file to be safe).",
+                .help2 = "Indexed: frame headers + index. Crash-safe, faster start. New raw2dng only.\n",
+            },
+            {
+                .name = "Dual card",
+                .priv = &dual_card,
+                .max = 1,
+                .update = dual_card_update,
+                .help  = "Record on CF and SD at the same time: groups of frames go to either card.",
+                .help2 = "More speed (both cards add up). Two files per clip, merged by raw2dng.\n",
+            },
+            {
+                .name = "Pre-record",
+                .priv = &pre_record,
+                .max = COUNT(pre_record_presets) - 1,
+                .choices = CHOICES("OFF", "1 second", "2 seconds", "5 seconds", "10 seconds"),
+                .update = pre_record_update,
+                .help  = "Keep the last few seconds in memory, before you actually start recording.",
+                .help2 = "1st REC press: start buffering. 2nd: save buffered frames, keep recording.\n"
+                         "Limited by memory: at most 3/4 of the buffers are used for this.\n",
+            },
+            {
+                .name = "Trigger",
+                .priv = &trigger_mode,
+                .max = 4,
+                .choices = CHOICES("OFF", "1 zone", "2x2 zones", "3x3 zones", "4x4 zones"),
+                .update = trigger_update,
+                .help  = "Save only when something changes in the image (lightning, motion...).",
+                .help2 = "REC starts watching; frames are saved when any zone changes. REC stops.\n"
+                         "Each zone learns its own baseline (average level and noise).\n",
+            },
+            {
+                .name = "Trigger sensitivity",
+                .priv = &trigger_sens,
+                .max = COUNT(trigger_sens_presets) - 1,
+                .choices = CHOICES("Very low", "Low", "Medium", "High", "Very high"),
+                .update = trigger_option_update,
+                .help  = "How far from the baseline a zone must go (12, 8, 6, 4 or 3 x noise).",
+                .help2 = "It stays triggered until it gets back within half of that.\n",
+            },
+            {
+                .name = "Pre-trigger frames",
+                .priv = &trigger_pre,
+                .max = COUNT(trigger_pre_presets) - 1,
+                .choices = CHOICES("0", "5", "10", "25", "50"),
+                .update = trigger_option_update,
+                .help  = "Frames kept in memory while waiting, saved when the trigger fires.",
+            },
+            {
+                .name = "Post-trigger frames",
+                .priv = &trigger_post,
+                .max = COUNT(trigger_post_presets) - 1,
+                .choices = CHOICES("5", "10", "25", "50", "100", "250"),
+                .update = trigger_option_update,
+                .help  = "Frames saved after the image settles down again.",
+            },
             {
                 .name = "Preview",
                 .priv = &preview_mode,
@@ -1985,6 +2786,14 @@ static struct menu_entry raw_video_menu[] =
                 .help  = "Write a large file on the card at camera startup.",
                 .help2 = "Some cards seem to get a bit faster after this.",
             },
+            {
+                .name = "Card benchmark",
+                .select = card_bench_start,
+                .update = card_bench_update,
+                .icon_type = IT_ACTION,
+                .help  = "Measure the card with 256K...64M blocks, misaligned writes and a 1GB file.",
+                .help2 = "Saved for each card; used for frame estimates and write sizes. SET: cancel.\n",
+            },
             {
                 .name = "Memory hack",
                 .priv = &memory_hack,
@@ -2012,6 +2821,17 @@ static struct menu_entry raw_video_menu[] =
 
 static unsigned int raw_rec_keypress_cbr(unsigned int key)
 {
+    /* cancel the card benchmark (and don't start recording meanwhile) */
+    if (card_bench_running)
+    {
+        if (key == MODULE_KEY_PRESS_SET || key == MODULE_KEY_REC || key == MODULE_KEY_LV)
+        {
+            card_bench_cancel = 1;
+            return 0;
+        }
+        return 1;
+    }
+
     if (!raw_video_enabled)
         return 1;
 
@@ -2171,6 +2991,13 @@ static unsigned int raw_rec_init()
             //sound_rec = 0;
         }
 
+        /* only 5D3 has two card slots */
+        if (streq(e->name, "Dual card") && !cam_5d3)
+        {
+            e->shidden = 1;
+            dual_card = 0;
+        }
+
         /* Memory hack confirmed to work only on 5D3 and 6D */
         if (streq(e->name, "Memory hack") && !(cam_5d3 || cam_6d))
         {
@@ -2184,6 +3011,8 @@ static unsigned int raw_rec_init()
        raw_video_menu[0].help = "Record 14-bit RAW video. Press SET to start.";
     }
 
+    writing_queue_sem = create_named_semaphore("raw_writer", 1);
+
     menu_add("Movie", raw_video_menu, COUNT(raw_video_menu));
     fileman_register_type("RAW", "RAW Video", raw_rec_filehandler);
 
@@ -2239,4 +3068,17 @@ MODULE_CONFIGS_START()
     MODULE_CONFIG(memory_hack)
     MODULE_CONFIG(small_hacks)
     MODULE_CONFIG(warm_up)
+    MODULE_CONFIG(bit_depth_index)
+    MODULE_CONFIG(pack_curve)
+    MODULE_CONFIG(pre_record)
+    MODULE_CONFIG(trigger_mode)
+    MODULE_CONFIG(trigger_sens)
+    MODULE_CONFIG(trigger_pre)
+    MODULE_CONFIG(trigger_post)
+    MODULE_CONFIG(indexed_format)
+    MODULE_CONFIG(dual_card)
+    MODULE_CONFIG(card_profile_next)
+    CARD_PROFILE_MODULE_CONFIGS(0)
+    CARD_PROFILE_MODULE_CONFIGS(1)
+    CARD_PROFILE_MODULE_CONFIGS(2)
 MODULE_CONFIGS_END()
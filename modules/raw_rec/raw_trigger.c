@@ -0,0 +1,211 @@
+/**
+ * Trigger engine for raw_rec (see raw_trigger.h)
+ * This file must not depend on camera stuff (it's also compiled on the PC).
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifdef MODULE
+#include <dryos.h>
+#else
+#include <string.h>
+#define FAST
+#endif
+#include "raw_trigger.h"
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+#define GW RAW_TRIGGER_GRID_W
+#define GH RAW_TRIGGER_GRID_H
+
+void raw_trigger_reset(struct raw_trigger * t)
+{
+    t->frames = 0;
+    t->saving = 0;
+    t->save_until = 0;
+    t->events = 0;
+    t->active_zones = 0;
+
+    for (int i = 0; i < t->num_zones; i++)
+    {
+        struct raw_trigger_zone * z = &t->zones[i];
+        z->level = 0;
+        z->mean = 0;
+        z->var = 0;
+        z->active = 0;
+    }
+}
+
+void raw_trigger_setup_grid(struct raw_trigger * t, int nx, int ny, int threshold, int release, int min_delta)
+{
+    nx = MAX(1, MIN(nx, GW));
+    ny = MAX(1, MIN(ny, GH));
+    while (nx * ny > RAW_TRIGGER_MAX_ZONES)
+    {
+        if (nx >= ny) nx--; else ny--;
+    }
+
+    t->num_zones = nx * ny;
+    for (int j = 0; j < ny; j++)
+    {
+        for (int i = 0; i < nx; i++)
+        {
+            struct raw_trigger_zone * z = &t->zones[j * nx + i];
+            z->x = i * GW / nx;
+            z->y = j * GH / ny;
+            z->w = (i + 1) * GW / nx - z->x;
+            z->h = (j + 1) * GH / ny - z->y;
+            z->threshold = threshold;
+            z->release = MIN(release, threshold);
+            z->min_delta = min_delta;
+        }
+    }
+
+    raw_trigger_reset(t);
+}
+
+void FAST raw_trigger_load_rows(struct raw_trigger * t, void * rows, int num_rows, int width)
+{
+    int blocks = width / 8;
+    int row_words = blocks * 7;
+    if (blocks <= 0 || num_rows <= 0)
+        return;
+
+    /* which raw_pixblocks we sample on each row (evenly spread, RAW_TRIGGER_SAMPLES or fewer for each cell) */
+    int per_cell = MAX(1, MIN(RAW_TRIGGER_SAMPLES, blocks / GW));
+    int offsets[GW * RAW_TRIGGER_SAMPLES];
+    for (int i = 0; i < GW * per_cell; i++)
+        offsets[i] = (i * blocks / (GW * per_cell)) * 7;
+
+    for (int cy = 0; cy < GH; cy++)
+    {
+        /* decimated rows for this row of cells (at least one, even if we got fewer rows than cells) */
+        int r0 = MIN(cy * num_rows / GH, num_rows - 1);
+        int r1 = MAX((cy + 1) * num_rows / GH, r0 + 1);
+        uint32_t sums[GW] = {0};
+
+        for (int r = r0; r < r1; r++)
+        {
+            uint16_t * row = (uint16_t *) rows + r * row_words;
+            int * off = offsets;
+            for (int cx = 0; cx < GW; cx++)
+            {
+                /* first pixel of each raw_pixblock is in the top 14 bits of its first word */
+                uint32_t sum = 0;
+                for (int s = 0; s < per_cell; s++)
+                    sum += row[*off++] >> 2;
+                sums[cx] += sum;
+            }
+        }
+
+        int count = (r1 - r0) * per_cell;
+        for (int cx = 0; cx < GW; cx++)
+            t->cells[cy][cx] = sums[cx] / count;
+    }
+
+    /* summed area table: any rectangle of cells in 4 lookups */
+    for (int cx = 0; cx <= GW; cx++)
+        t->sat[0][cx] = 0;
+    for (int cy = 0; cy < GH; cy++)
+    {
+        uint32_t row_sum = 0;
+        t->sat[cy+1][0] = 0;
+        for (int cx = 0; cx < GW; cx++)
+        {
+            row_sum += t->cells[cy][cx];
+            t->sat[cy+1][cx+1] = t->sat[cy][cx+1] + row_sum;
+        }
+    }
+}
+
+static int zone_level(struct raw_trigger * t, struct raw_trigger_zone * z)
+{
+    int x1 = MAX(0, MIN(z->x, GW - 1));
+    int y1 = MAX(0, MIN(z->y, GH - 1));
+    int x2 = MAX(x1 + 1, MIN(z->x + z->w, GW));
+    int y2 = MAX(y1 + 1, MIN(z->y + z->h, GH));
+    uint32_t sum = t->sat[y2][x2] - t->sat[y1][x2] - t->sat[y2][x1] + t->sat[y1][x1];
+    return sum / ((x2 - x1) * (y2 - y1));
+}
+
+int raw_trigger_evaluate(struct raw_trigger * t, int frame_number)
+{
+    int learning = t->frames < t->warmup;
+    uint32_t active_zones = 0;
+
+    for (int i = 0; i < t->num_zones; i++)
+    {
+        struct raw_trigger_zone * z = &t->zones[i];
+        int level = zone_level(t, z);
+        z->level = level;
+
+        if (t->frames == 0)
+        {
+            z->mean = level << 4;
+            z->var = 0;
+        }
+
+        /* far enough from the baseline? (hysteresis: a different limit for staying active) */
+        int diff = level - (z->mean >> 4);
+        int limit = z->active ? z->release : z->threshold;
+        uint64_t d2 = (uint64_t)(diff * diff) * 10000;
+        uint64_t l2 = (uint64_t)(limit * limit) * z->var;
+        z->active = !learning && (diff > z->min_delta || diff < -z->min_delta) && d2 > l2;
+
+        if (z->active)
+        {
+            active_zones |= 1 << i;
+        }
+        else
+        {
+            /* the baseline only follows the scene while nothing is happening */
+            z->mean += ((level << 4) - z->mean) >> t->adapt;
+            int64_t dv = (int64_t)(diff * diff) - (int64_t)z->var;
+            z->var += dv >> t->adapt;
+        }
+    }
+
+    t->active_zones = active_zones;
+    t->frames++;
+
+    if (active_zones)
+    {
+        t->save_until = frame_number + t->post_frames;
+        if (!t->saving)
+        {
+            t->saving = 1;
+            t->events++;
+            return RAW_TRIGGER_START;
+        }
+    }
+    else if (t->saving && frame_number >= t->save_until)
+    {
+        t->saving = 0;
+        return RAW_TRIGGER_STOP;
+    }
+
+    return RAW_TRIGGER_IDLE;
+}
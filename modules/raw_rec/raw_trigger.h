@@ -0,0 +1,108 @@
+/**
+ * Trigger engine for raw_rec: start saving when something happens in the image (lightning, motion...)
+ *
+ * Works on a decimated copy of each frame (every Nth row of the recorded area, copied by EDMAC),
+ * reduced to a fixed grid of cells (RAW_TRIGGER_GRID_W x RAW_TRIGGER_GRID_H), so the CPU cost per frame
+ * is the same for any resolution and any number of zones:
+ * - cells: average of a fixed number of samples (first pixel of some raw_pixblocks) on each decimated row;
+ * - zones: rectangles of cells; their level comes from a summed area table (4 lookups per zone);
+ * - baseline: running mean and variance for each zone (exponential, updated in place, frozen while the zone is active);
+ * - hysteresis: a zone becomes active when its level is more than `threshold` standard deviations away
+ *   from the baseline, and stays active until it gets back under `release` standard deviations.
+ *
+ * Pre/post-frame budget: raw_rec keeps the last pre_frames frames in memory while waiting; once a zone fires,
+ * those are saved, together with everything until post_frames after the last active frame.
+ *
+ * Other modules can set up the zones through the raw_rec_cbr_trigger_* hooks (see raw_rec.c).
+ * No camera dependencies here (it's also compiled on the PC, see triggersim.c).
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _raw_trigger_h_
+#define _raw_trigger_h_
+
+#include <stdint.h>
+
+#define RAW_TRIGGER_GRID_W    32
+#define RAW_TRIGGER_GRID_H    18
+#define RAW_TRIGGER_MAX_ZONES 16
+#define RAW_TRIGGER_ROWS      36        /* decimated rows copied from each frame (at most) */
+#define RAW_TRIGGER_SAMPLES   8         /* samples for each cell, on each decimated row (at most) */
+
+struct raw_trigger_zone
+{
+    /* setup */
+    int x, y, w, h;                     /* rectangle, in grid cells */
+    int threshold;                      /* becomes active at threshold/100 standard deviations from the baseline */
+    int release;                        /* ... and inactive under release/100 standard deviations (release <= threshold) */
+    int min_delta;                      /* ignore smaller differences (raw units), e.g. on a very clean baseline */
+
+    /* state */
+    int level;                          /* average of the cells in the last frame */
+    int32_t mean;                       /* baseline, x16 */
+    uint32_t var;                       /* baseline variance, raw units squared */
+    int active;
+};
+
+struct raw_trigger
+{
+    /* setup */
+    int num_zones;
+    struct raw_trigger_zone zones[RAW_TRIGGER_MAX_ZONES];
+    int adapt;                          /* baseline follows the scene with a time constant of 2^adapt frames */
+    int warmup;                         /* frames used only for learning the baseline */
+    int pre_frames;                     /* frames saved before the trigger */
+    int post_frames;                    /* frames saved after the last active frame */
+
+    /* state */
+    int frames;                         /* frames evaluated */
+    int saving;                         /* 1 = triggered, or still within the post-trigger budget */
+    int save_until;                     /* while saving: last frame to save (if nothing else happens) */
+    int events;                         /* how many times it started saving */
+    uint32_t active_zones;              /* bit mask */
+    uint16_t cells[RAW_TRIGGER_GRID_H][RAW_TRIGGER_GRID_W];
+    uint32_t sat[RAW_TRIGGER_GRID_H + 1][RAW_TRIGGER_GRID_W + 1];   /* summed area table of the cells */
+};
+
+/* raw_trigger_evaluate return values */
+#define RAW_TRIGGER_IDLE   0
+#define RAW_TRIGGER_START  1            /* start saving (the pre-trigger frames too) */
+#define RAW_TRIGGER_STOP   2            /* post-trigger budget used up */
+
+/* forget the baselines and the saving state (keeps the setup) */
+void raw_trigger_reset(struct raw_trigger * t);
+
+/* setup helper: nx * ny zones covering the whole grid, all with the same thresholds */
+void raw_trigger_setup_grid(struct raw_trigger * t, int nx, int ny, int threshold, int release, int min_delta);
+
+/**
+ * Reduce the decimated copy to the grid of cells.
+ * rows: num_rows rows of packed 14-bit pixels, width pixels each (multiple of 8), one after the other.
+ */
+void raw_trigger_load_rows(struct raw_trigger * t, void * rows, int num_rows, int width);
+
+/**
+ * Update the zones from the grid of cells, for this frame; frame_number must increase
+ * (evaluating only some of the frames is OK, the budget is counted in frame numbers).
+ */
+int raw_trigger_evaluate(struct raw_trigger * t, int frame_number);
+
+#endif
@@ -0,0 +1,148 @@
+/**
+ * Benchmark for the 14-bit raw unpack/pack kernels (src/raw_pack.c)
+ *
+ * Checks all versions against the raw_pixblock bitfields, then reports Mpix/s.
+ * Usage: rawbench [width height frames]
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include <sys/time.h>
+
+#include <raw.h>
+#include <raw_pack.h>
+
+#define FAIL(fmt,...) { fprintf(stderr, "Error: "); fprintf(stderr, fmt, ## __VA_ARGS__); fprintf(stderr, "\n"); exit(1); }
+#define CHECK(ok, fmt,...) { if (!(ok)) FAIL(fmt, ## __VA_ARGS__); }
+
+typedef void (*unpack_func_t)(void* packed, uint16_t* out, int num_pixels);
+typedef void (*pack_func_t)(uint16_t* in, void* packed, int num_pixels);
+
+static struct
+{
+    char* name;
+    unpack_func_t unpack;
+    pack_func_t pack;
+    int avx2;
+} kernels[] = {
+    { "C",    raw_unpack_row_c,    raw_pack_row_c,    0 },
+#if defined(__i386__) || defined(__x86_64__)
+    { "SSE2", raw_unpack_row_sse2, raw_pack_row_sse2, 0 },
+    { "AVX2", raw_unpack_row_avx2, raw_pack_row_avx2, 1 },
+#endif
+};
+
+/* reference implementation, same as raw_get_pixel in raw.c */
+static int ref_get_pixel(void* row, int x)
+{
+    struct raw_pixblock * p = row + (x/8)*14;
+    switch (x%8) {
+        case 0: return p->a;
+        case 1: return p->b_lo | (p->b_hi << 12);
+        case 2: return p->c_lo | (p->c_hi << 10);
+        case 3: return p->d_lo | (p->d_hi << 8);
+        case 4: return p->e_lo | (p->e_hi << 6);
+        case 5: return p->f_lo | (p->f_hi << 4);
+        case 6: return p->g_lo | (p->g_hi << 2);
+        case 7: return p->h;
+    }
+    return p->a;
+}
+
+static double get_time()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+int main(int argc, char** argv)
+{
+    int width = 1920;
+    int height = 1080;
+    int frames = 100;
+
+    if (argc == 4)
+    {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+        frames = atoi(argv[3]);
+    }
+    CHECK(width > 0 && width % 8 == 0, "width must be a multiple of 8");
+    CHECK(height > 0 && frames > 0, "bad args");
+
+    int pitch = width * 14 / 8;
+    int size = pitch * height;
+    uint8_t* packed = malloc(size);
+    uint8_t* packed2 = malloc(size);
+    uint16_t* unpacked = malloc(width * height * 2);
+    CHECK(packed && packed2 && unpacked, "malloc");
+
+    srand(1234);
+    for (int i = 0; i < size; i++)
+        packed[i] = rand();
+
+    printf("Frame size: %dx%d, %d frames\n", width, height, frames);
+
+    for (int k = 0; k < (int)(sizeof(kernels)/sizeof(kernels[0])); k++)
+    {
+#if defined(__i386__) || defined(__x86_64__)
+        if (kernels[k].avx2 && !raw_pack_have_avx2())
+        {
+            printf("%-5s: not supported by this CPU\n", kernels[k].name);
+            continue;
+        }
+#endif
+
+        /* check correctness first */
+        memset(unpacked, 0, width * height * 2);
+        memset(packed2, 0, size);
+        for (int y = 0; y < height; y++)
+        {
+            kernels[k].unpack(packed + y * pitch, unpacked + y * width, width);
+            for (int x = 0; x < width; x++)
+                CHECK(unpacked[y * width + x] == ref_get_pixel(packed + y * pitch, x), "%s unpack mismatch at (%d,%d)", kernels[k].name, x, y);
+
+            kernels[k].pack(unpacked + y * width, packed2 + y * pitch, width);
+        }
+        CHECK(memcmp(packed, packed2, size) == 0, "%s pack mismatch", kernels[k].name);
+
+        double t0 = get_time();
+        for (int f = 0; f < frames; f++)
+            for (int y = 0; y < height; y++)
+                kernels[k].unpack(packed + y * pitch, unpacked + y * width, width);
+        double t1 = get_time();
+        for (int f = 0; f < frames; f++)
+            for (int y = 0; y < height; y++)
+                kernels[k].pack(unpacked + y * width, packed2 + y * pitch, width);
+        double t2 = get_time();
+
+        double mpix = (double)width * height * frames / 1e6;
+        printf("%-5s: unpack %8.1f Mpix/s, pack %8.1f Mpix/s\n", kernels[k].name, mpix / (t1 - t0), mpix / (t2 - t1));
+    }
+
+    free(packed);
+    free(packed2);
+    free(unpacked);
+    return 0;
+}
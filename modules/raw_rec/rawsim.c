@@ -0,0 +1,588 @@
+/**
+ * Recording simulator for raw_rec
+ *
+ * Runs the same buffering code as the camera (frame_slots.c) against a model of the card:
+ * frames arrive at vsync (at the chosen FPS), the writer task groups contiguous frames
+ * and the card needs some time to save them (latency + size / speed, speed depends on block size).
+ *
+ * Reports how many frames you can record before overflow, how efficient the writes are,
+ * and the buffer occupancy over time.
+ *
+ * Usage: rawsim [options]   (see rawsim --help)
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "math.h"
+#include <stdint.h>
+#include <limits.h>
+
+#include "frame_slots.h"
+
+#define FAIL(fmt,...) { fprintf(stderr, "Error: "); fprintf(stderr, fmt, ## __VA_ARGS__); fprintf(stderr, "\n"); exit(1); }
+#define CHECK(ok, fmt,...) { if (!(ok)) FAIL(fmt, ## __VA_ARGS__); }
+
+#define COUNT(x) ((int)(sizeof(x)/sizeof((x)[0])))
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define mod(x,m) ((((x) % (m)) + (m)) % (m))
+
+#define MB (1024.0 * 1024.0)
+
+/* memory we get from shoot_malloc_suite (same presets as speedsim.py) */
+/* raw buffer sizes are approximate; they only matter for the full-size buffer (the smallest chunk that fits it is reserved) */
+static struct
+{
+    char* name;
+    int raw_width;
+    int raw_height;
+    int chunks_mb[16];      /* zero-terminated */
+} mem_presets[] = {
+    { "5d3",      2080, 1318, { 32, 32, 32, 32 } },
+    { "5d3-zoom", 3744, 1380, { 32, 32, 32, 22 } },
+    { "60d",      1808, 1190, { 32, 32, 32, 32, 32, 32, 32, 32, 8 } },
+    { "550d",     1808, 1190, { 32, 32, 8 } },
+};
+
+/* card speed vs block size, fitted from benchmarks (same models as speedsim.py) */
+/* speed = nominal * clamp(p0 + p1 * size + p2 * log2(size) + p3 * sqrt(size), 0, 1) */
+static struct
+{
+    char* name;
+    float nominal;          /* MB/s */
+    double pfit[4];
+} card_presets[] = {
+    { "5d3",      90, { -8.5500e-01, 4.5050e-09, 8.7998e-02, -8.5642e-05 } },  /* 5D3 movie mode, favors large buffers */
+    { "hoodman",  90, { -9.1988e-01, 6.5760e-09, 9.4763e-02, -1.1569e-04 } },  /* Hoodman 1000x */
+    { "550d",     21, { -1.9838e-02, 3.0481e-09, 5.0033e-02, -5.7829e-05 } },  /* 550D SanDisk Extreme 32GB 45MBs, favors smaller buffers */
+};
+
+/* the card model: either one of the presets, or a measured curve loaded from file */
+static int card_preset = 0;
+static float card_nominal = 0;          /* MB/s; 0 = preset default */
+static float card_latency = 0;          /* ms, for each write call */
+static int curve_points = 0;
+static double curve_size[64];           /* bytes, increasing */
+static double curve_speed[64];          /* MB/s */
+
+static void load_curve(char* filename)
+{
+    FILE* f = fopen(filename, "r");
+    CHECK(f, "could not open %s", filename);
+
+    /* one point per line: block size in KB, speed in MB/s; lines starting with # are ignored */
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        double size_kb, speed;
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%lf %lf", &size_kb, &speed) != 2) continue;
+        CHECK(curve_points < COUNT(curve_size), "%s: too many points", filename);
+        CHECK(size_kb > 0 && speed > 0, "%s: bad point (%g KB, %g MB/s)", filename, size_kb, speed);
+        CHECK(curve_points == 0 || size_kb * 1024 > curve_size[curve_points-1], "%s: block sizes must be increasing", filename);
+        curve_size[curve_points] = size_kb * 1024;
+        curve_speed[curve_points] = speed;
+        curve_points++;
+    }
+    fclose(f);
+    CHECK(curve_points > 0, "%s: no data", filename);
+}
+
+/* card speed in MB/s for a given block size */
+static double card_speed(int size)
+{
+    if (curve_points)
+    {
+        /* interpolate in log2(size), clamp at the ends */
+        if (size <= curve_size[0]) return curve_speed[0];
+        if (size >= curve_size[curve_points-1]) return curve_speed[curve_points-1];
+        int i = 1;
+        while (curve_size[i] < size) i++;
+        double a = (log2(size) - log2(curve_size[i-1])) / (log2(curve_size[i]) - log2(curve_size[i-1]));
+        return curve_speed[i-1] + (curve_speed[i] - curve_speed[i-1]) * a;
+    }
+
+    double* p = card_presets[card_preset].pfit;
+    double factor = p[0] + p[1] * size + p[2] * log2(size) + p[3] * sqrt(size);
+    factor = MAX(0, MIN(1, factor));
+    return card_nominal * factor;
+}
+
+/* how long it takes to write one block, in seconds */
+static double card_write_time(int size)
+{
+    double speed = card_speed(size);
+    CHECK(speed > 0, "card model gives zero speed for %d bytes", size);
+    return card_latency / 1000.0 + size / (speed * MB);
+}
+
+static int startswith(char* str, char* prefix)
+{
+    char* s = str;
+    char* p = prefix;
+    for (; *p; s++,p++)
+        if (*s != *p) return 0;
+    return 1;
+}
+
+static void show_usage(char* progname)
+{
+    printf("Usage: %s [options]\n", progname);
+    printf("  --res=WxH        recording resolution (default 1920x1080)\n");
+    printf("  --fps=F          frame rate (default 23.976)\n");
+    printf("  --bits=N         bits per pixel: 14 (default), 12 or 10 (packed modes, with 14-bit staging buffers)\n");
+    printf("  --mem=NAME       memory preset: ");
+    for (int i = 0; i < COUNT(mem_presets); i++) printf("%s%s", mem_presets[i].name, i < COUNT(mem_presets)-1 ? ", " : " (default 5d3)\n");
+    printf("  --mem=A,B,...    memory chunks in MB\n");
+    printf("  --raw=WxH        size of the LiveView raw buffer (default from the memory preset)\n");
+    printf("  --card=NAME      card speed model: ");
+    for (int i = 0; i < COUNT(card_presets); i++) printf("%s%s", card_presets[i].name, i < COUNT(card_presets)-1 ? ", " : " (default 5d3)\n");
+    printf("  --card=FILE      measured speed curve: one line per point, block size in KB and speed in MB/s\n");
+    printf("  --speed=MB/s     nominal card speed for the fitted models\n");
+    printf("  --latency=ms     overhead for each write call (default 0)\n");
+    printf("  --measured=MB/s  measured_write_speed from a previous recording (default 0 = unknown)\n");
+    printf("  --old            old write size logic: all contiguous frames, limited near overflow using measured_write_speed\n");
+    printf("  --time=s         stop after this many seconds (default 60)\n");
+    printf("  --interval=s     how often to show the buffer occupancy (default 1)\n");
+    printf("  --csv=FILE       save buffer occupancy at every frame\n");
+    printf("  -v               print every write\n");
+}
+
+/* simulation state (the same variables as in raw_rec.c) */
+static struct frame_slot slots[MAX_SLOTS];
+static int slot_count = 0;
+static struct slot_allocator slot_alloc;
+static int capture_slot = -1;
+static volatile int force_new_buffer = 0;
+static struct frame_queue writing_queue;
+static struct frame_queue freed_queue;
+static int chunk_list[20];
+static int frame_count = 0;
+
+static int get_used_slots(int status)
+{
+    int n = 0;
+    for (int i = 0; i < slot_count; i++)
+        if (slots[i].status == status)
+            n++;
+    return n;
+}
+
+int main(int argc, char** argv)
+{
+    int res_x = 1920;
+    int res_y = 1080;
+    int raw_width = 0;
+    int raw_height = 0;
+    double fps = 23.976;
+    int mem_preset = 0;
+    int custom_chunks[16] = {0};
+    int num_custom_chunks = 0;
+    float measured_speed = 0;
+    double max_time = 60;
+    double interval = 1;
+    char* csv_filename = 0;
+    int verbose = 0;
+    int old_scheduler = 0;
+    int bits = 14;
+
+    for (int k = 1; k < argc; k++)
+    {
+        if (startswith(argv[k], "--res="))
+        {
+            CHECK(sscanf(argv[k] + 6, "%dx%d", &res_x, &res_y) == 2, "bad resolution: %s", argv[k]);
+        }
+        else if (startswith(argv[k], "--raw="))
+        {
+            CHECK(sscanf(argv[k] + 6, "%dx%d", &raw_width, &raw_height) == 2, "bad raw buffer size: %s", argv[k]);
+        }
+        else if (startswith(argv[k], "--fps="))
+        {
+            fps = atof(argv[k] + 6);
+        }
+        else if (startswith(argv[k], "--bits="))
+        {
+            bits = atoi(argv[k] + 7);
+        }
+        else if (startswith(argv[k], "--mem="))
+        {
+            char* arg = argv[k] + 6;
+            int found = 0;
+            for (int i = 0; i < COUNT(mem_presets); i++)
+            {
+                if (strcmp(arg, mem_presets[i].name) == 0)
+                {
+                    mem_preset = i;
+                    found = 1;
+                }
+            }
+            if (!found)
+            {
+                for (char* p = arg; *p; )
+                {
+                    CHECK(num_custom_chunks < COUNT(custom_chunks), "too many memory chunks");
+                    int mb = strtol(p, &p, 10);
+                    CHECK(mb > 0 && mb <= 1024, "bad memory chunks: %s", arg);
+                    custom_chunks[num_custom_chunks++] = mb;
+                    if (*p == ',') p++;
+                    else CHECK(*p == 0, "bad memory chunks: %s", arg);
+                }
+            }
+        }
+        else if (startswith(argv[k], "--card="))
+        {
+            char* arg = argv[k] + 7;
+            int found = 0;
+            for (int i = 0; i < COUNT(card_presets); i++)
+            {
+                if (strcmp(arg, card_presets[i].name) == 0)
+                {
+                    card_preset = i;
+                    found = 1;
+                }
+            }
+            if (!found)
+                load_curve(arg);
+        }
+        else if (startswith(argv[k], "--speed="))
+        {
+            card_nominal = atof(argv[k] + 8);
+        }
+        else if (startswith(argv[k], "--latency="))
+        {
+            card_latency = atof(argv[k] + 10);
+        }
+        else if (startswith(argv[k], "--measured="))
+        {
+            measured_speed = atof(argv[k] + 11);
+        }
+        else if (startswith(argv[k], "--time="))
+        {
+            max_time = atof(argv[k] + 7);
+        }
+        else if (startswith(argv[k], "--interval="))
+        {
+            interval = atof(argv[k] + 11);
+        }
+        else if (startswith(argv[k], "--csv="))
+        {
+            csv_filename = argv[k] + 6;
+        }
+        else if (strcmp(argv[k], "--old") == 0)
+        {
+            old_scheduler = 1;
+        }
+        else if (strcmp(argv[k], "-v") == 0)
+        {
+            verbose = 1;
+        }
+        else
+        {
+            show_usage(argv[0]);
+            return strcmp(argv[k], "--help") == 0 ? 0 : 1;
+        }
+    }
+
+    CHECK(res_x > 0 && res_x % 16 == 0 && res_y > 0, "bad resolution %dx%d (width must be a multiple of 16)", res_x, res_y);
+    CHECK(fps > 0 && fps < 1000, "bad fps: %g", fps);
+    CHECK(bits == 14 || bits == 12 || bits == 10, "bad bits per pixel: %d", bits);
+    CHECK(card_latency >= 0 && measured_speed >= 0 && max_time > 0 && interval > 0, "bad args");
+    if (!card_nominal) card_nominal = card_presets[card_preset].nominal;
+    if (!raw_width) raw_width = MAX(res_x, mem_presets[mem_preset].raw_width);
+    if (!raw_height) raw_height = MAX(res_y, mem_presets[mem_preset].raw_height);
+    CHECK(raw_width >= res_x && raw_height >= res_y, "raw buffer %dx%d smaller than resolution %dx%d", raw_width, raw_height, res_x, res_y);
+
+    /* frame size, same as in update_resolution_params */
+    int frame_size = (res_x * res_y * bits/8 + 4095) & ~4095;
+    if (frame_size == res_x * res_y * bits/8)
+        frame_size += 4096;
+    int staging_size = (res_x * res_y * 14/8 + 4 + 4095) & ~4095;
+    int buf_size = raw_width * raw_height * 14/8 * 33/32;
+    int fps_x1000 = (int)(fps * 1000 + 0.5);
+
+    /* fake memory chunks; leave gaps between them, so they are never contiguous */
+    struct mem_chunk chunks[16];
+    int num_chunks = 0;
+    for (int i = 0; i < COUNT(chunks); i++)
+    {
+        int mb = num_custom_chunks ? (i < num_custom_chunks ? custom_chunks[i] : 0) : mem_presets[mem_preset].chunks_mb[i];
+        if (!mb) break;
+        chunks[num_chunks].ptr = (void*)(intptr_t)(0x10000000 + num_chunks * 0x4000000);
+        chunks[num_chunks].size = mb * 1024 * 1024;
+        num_chunks++;
+    }
+
+    /* packed modes: the staging buffers are taken first, as in raw_rec */
+    int num_staging = 0;
+    for (int i = 0; bits < 14 && i < STAGING_BUFFERS; i++)
+    {
+        CHECK(chunks_reserve(chunks, num_chunks, staging_size), "no memory for the staging buffers");
+        num_staging++;
+    }
+
+    void* fullsize_buffer = 0;
+    slot_count = slots_setup(slots, COUNT(slots), chunks, num_chunks, buf_size, frame_size, &fullsize_buffer, chunk_list, COUNT(chunk_list));
+    CHECK(slot_count >= 0, "no memory chunk can hold the full-size buffer (%.1f MB)", buf_size / MB);
+    CHECK(slot_count >= 3, "only %d frame slots, raw_rec needs at least 3", slot_count);
+    slots_alloc_init(&slot_alloc, slots, slot_count, frame_size);
+    frame_queue_init(&writing_queue);
+    frame_queue_init(&freed_queue);
+
+    /* the largest block we might write, for the efficiency figures */
+    int max_block = 0;
+    for (int i = 0; i < COUNT(chunk_list); i++)
+        max_block = MAX(max_block, chunk_list[i] / frame_size * frame_size);
+    double top_speed = 0;
+    int top_speed_block = frame_size;
+    for (int n = 1; n * frame_size <= max_block; n++)
+    {
+        double s = frame_size * n / card_write_time(frame_size * n) / MB;
+        if (s > top_speed)
+        {
+            top_speed = s;
+            top_speed_block = frame_size * n;
+        }
+    }
+
+    printf("Resolution  : %dx%d, %d-bit, %.3f fps, frame size %.2f MB\n", res_x, res_y, bits, fps, frame_size / MB);
+    printf("Needs       : %.1f MB/s for continuous recording\n", frame_size * fps / MB);
+    printf("Memory      : ");
+    for (int i = 0; i < num_chunks; i++) printf("%s%.0f", i ? "+" : "", chunks[i].size / MB);
+    printf(" MB, full-size buffer %.1f MB, %d frame slots", buf_size / MB, slot_count);
+    if (num_staging)
+        printf(", %d x %.1f MB staging", num_staging, staging_size / MB);
+    printf("\n");
+    if (curve_points)
+        printf("Card        : measured curve (%d points), latency %.1f ms\n", curve_points, card_latency);
+    else
+        printf("Card        : '%s' model, %.1f MB/s nominal, latency %.1f ms\n", card_presets[card_preset].name, card_nominal, card_latency);
+    printf("Card speed  : %.1f MB/s with 1 frame, %.1f MB/s at best (%.1f MB blocks)\n",
+        frame_size / card_write_time(frame_size) / MB, top_speed, top_speed_block / MB);
+
+    FILE* csv = 0;
+    if (csv_filename)
+    {
+        csv = fopen(csv_filename, "w");
+        CHECK(csv, "could not create %s", csv_filename);
+        fprintf(csv, "time,frame,free,full,writing\n");
+    }
+
+    /* measured_write_speed unit: 0.01 MB/s */
+    int measured_write_speed = (int)(measured_speed * 100 + 0.5);
+
+    struct write_model write_model;
+    write_model_init(&write_model, measured_write_speed);
+
+    /* event loop: vsync on one side, the writer task on the other */
+    double frame_period = 1.0 / fps;
+    int vsync_count = 0;
+    double next_vsync = 0;
+    double writer_wakeup = 0;       /* when the writer task runs again */
+    int writer_busy = 0;            /* 1 = FIO_WriteFile in progress, until writer_wakeup */
+
+    double busy_time = 0;
+    double t_end = 0;
+    int overflow = 0;
+    long long written = 0;
+    int num_writes = 0;
+    int min_group = INT_MAX;
+    int max_group = 0;
+    int frames_written = 0;
+    double current_dt = 0;          /* the write in progress */
+    int current_frames = 0;
+    int current_size = 0;
+
+    /* buffer occupancy, sampled at regular intervals */
+    int occupancy_max = 0;
+    double next_sample = interval;
+
+    while (1)
+    {
+        if (next_vsync <= writer_wakeup)
+        {
+            /* vsync: process_frame */
+            double t = next_vsync;
+            if (t > max_time) { t_end = max_time; break; }
+            vsync_count++;
+            next_vsync = vsync_count * frame_period;
+
+            /* skip the first frame, it will be gibberish */
+            if (frame_count == 0)
+            {
+                frame_count++;
+                continue;
+            }
+
+            /* slots saved since the last frame can be reused */
+            int freed = frame_queue_count(&freed_queue);
+            for (int i = 0; i < freed; i++)
+                slots_release(&slot_alloc, frame_queue_peek(&freed_queue, i));
+            frame_queue_pop(&freed_queue, freed);
+
+            capture_slot = slots_choose_capture(&slot_alloc, capture_slot, &force_new_buffer);
+            if (capture_slot < 0)
+            {
+                /* card too slow */
+                overflow = 1;
+                t_end = t;
+                break;
+            }
+
+            slots[capture_slot].frame_number = frame_count;
+            frame_queue_push(&writing_queue, capture_slot);
+            frame_count++;
+
+            int free_slots = slot_alloc.free_count;
+            int used = slot_count - free_slots;
+            occupancy_max = MAX(occupancy_max, used);
+
+            if (csv)
+                fprintf(csv, "%.4f,%d,%d,%d,%d\n", t, frame_count - 1, free_slots, get_used_slots(SLOT_FULL), get_used_slots(SLOT_WRITING));
+
+            while (t >= next_sample)
+            {
+                char bar[41];
+                int n = used * 40 / slot_count;
+                for (int i = 0; i < 40; i++) bar[i] = i < n ? '#' : '.';
+                bar[40] = 0;
+                printf("%6.1fs  %3d/%d slots used  [%s]\n", next_sample, used, slot_count, bar);
+                next_sample += interval;
+            }
+        }
+        else
+        {
+            /* writer task: raw_video_rec_task main loop */
+            double t = writer_wakeup;
+
+            if (writer_busy)
+            {
+                /* FIO_WriteFile done: free these frames */
+                for (int i = 0; i < current_frames; i++)
+                    frame_queue_push(&freed_queue, frame_queue_peek(&writing_queue, i));
+                frame_queue_pop(&writing_queue, current_frames);
+                writer_busy = 0;
+                
+                /* the camera measures it with the ms clock */
+                write_model_update(&write_model, current_size, (int)(current_dt * 1000 + 0.5));
+                /* no delay, go straight to the next iteration */
+            }
+
+            int queued = frame_queue_count(&writing_queue);
+
+            /* writing queue empty? nothing to do */
+            if (queued == 0)
+            {
+                writer_wakeup = t + 0.020;
+                continue;
+            }
+
+            int first_slot = frame_queue_peek(&writing_queue, 0);
+
+            /* group items from the queue in a contiguous block - as many as we can */
+            int num_frames = slots_group_writes(slots, &writing_queue, frame_size);
+
+            int free_slots = slot_alloc.free_count + frame_queue_count(&freed_queue);
+
+            if (old_scheduler)
+            {
+                /* if we are about to overflow, save a smaller number of frames, so they can be freed quicker */
+                num_frames = slots_limit_writes(num_frames, free_slots, fps_x1000, measured_write_speed, frame_size);
+            }
+            else
+            {
+                /* how many frames to write now? (best sustained speed without getting too close to overflow) */
+                num_frames = slots_schedule_writes(&write_model, num_frames, free_slots, fps_x1000, frame_size);
+            }
+
+            /* write queue empty? better search for a new larger buffer */
+            if (num_frames == queued)
+                force_new_buffer = 1;
+
+            for (int i = 0; i < num_frames; i++)
+            {
+                int slot_index = frame_queue_peek(&writing_queue, i);
+                CHECK(slots[slot_index].status == SLOT_FULL, "slot check error");
+                slots[slot_index].status = SLOT_WRITING;
+            }
+
+            int size_used = frame_size * num_frames;
+            double dt = card_write_time(size_used);
+            if (verbose)
+                printf("[%.3f] writing %d frames from slot %d (%.1f MB), %.1f MB/s, done at %.3f\n",
+                    t, num_frames, first_slot, size_used / MB, size_used / dt / MB, t + dt);
+
+            busy_time += dt;
+            written += size_used;
+            num_writes++;
+            frames_written += num_frames;
+            min_group = MIN(min_group, num_frames);
+            max_group = MAX(max_group, num_frames);
+
+            current_dt = dt;
+            current_frames = num_frames;
+            current_size = size_used;
+            writer_busy = 1;
+            writer_wakeup = t + dt;
+        }
+    }
+
+    if (csv) fclose(csv);
+
+    /* the write in progress did not finish; count only the part done so far */
+    if (writer_busy)
+    {
+        double unfinished = writer_wakeup - t_end;
+        busy_time -= unfinished;
+        written -= (long long)(current_frames * (double) frame_size * unfinished / current_dt);
+        frames_written -= current_frames;
+        num_writes--;
+    }
+
+    /* frames that could be recorded (the first one is skipped) */
+    int frames = frame_count - 1;
+    printf("\n");
+    if (overflow)
+        printf("Overflow    : after %d frames (%.1f s)\n", frames, t_end);
+    else
+        printf("Overflow    : none in %.0f s (%d frames); continuous recording looks OK\n", t_end, frames);
+
+    if (num_writes)
+    {
+        double achieved = written / busy_time / MB;
+        printf("Writes      : %d calls, %.1f frames per call on average (min %d, max %d), %d frames saved\n",
+            num_writes, (double) frames_written / num_writes, min_group, max_group, frames_written);
+        printf("Efficiency  : %.1f MB/s while writing = %.0f%% of the best card speed; writer busy %.0f%% of the time\n",
+            achieved, achieved * 100 / top_speed, busy_time * 100 / t_end);
+        printf("Buffer      : at most %d of %d slots used\n", occupancy_max, slot_count);
+
+        /* compare with the estimate from raw_rec menu (predict_frames), using the speed measured here */
+        int write_speed = (int)(achieved * 100) * 1024 / 100 * 1024;
+        int predicted = slots_predict_frames(chunk_list, COUNT(chunk_list), frame_size, fps_x1000, write_speed);
+        if (predicted == INT_MAX)
+            printf("Predicted   : continuous (predict_frames at %.1f MB/s)\n", achieved);
+        else
+            printf("Predicted   : %d frames (predict_frames at %.1f MB/s)\n", predicted, achieved);
+    }
+
+    return overflow ? 2 : 0;
+}
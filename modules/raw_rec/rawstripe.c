@@ -0,0 +1,345 @@
+/**
+ * Dual card recording on the PC (same writer code as raw_rec, on top of fio_host.c)
+ *
+ * Plays back an existing clip as if it was coming from the sensor, and records it the way raw_rec does
+ * in dual card mode: frame slots and writing queue from frame_slots.c, one writer thread for each output
+ * directory (standing in for the CF and SD cards), taking turns at the head of the queue, each with its own
+ * clip_writer and write size model. With one directory, it's a regular indexed clip.
+ *
+ * Check the result with raw2dng dir1/file.RAW --merge=dir2/file.RAW (the DNGs should match the original clip).
+ * Usage: rawstripe [--fps=N] [--mem=MB] input.RAW dir1 [dir2]
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "frame_slots.h"
+#include "clip_writer.h"
+#include "../lv_rec/raw_reader.h"
+
+#define FAIL(fmt,...) { fprintf(stderr, "Error: "); fprintf(stderr, fmt, ## __VA_ARGS__); fprintf(stderr, "\n"); exit(1); }
+#define CHECK(ok, fmt,...) { if (!(ok)) FAIL(fmt, ## __VA_ARGS__); }
+
+#define COUNT(x) ((int)(sizeof(x)/sizeof((x)[0])))
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+#define MB (1024.0 * 1024.0)
+#define CHUNK_SIZE (32*1024*1024)   /* like the shoot_malloc chunks on 5D3 */
+
+static struct frame_slot slots[MAX_SLOTS];
+static int slot_count = 0;
+static int slot_size = 0;
+static struct slot_allocator slot_alloc;
+static struct frame_queue writing_queue;
+static pthread_mutex_t writing_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int force_new_buffer = 0;
+static volatile int capture_done = 0;
+static int last_processed_frame = 0;
+static int fps_x1000 = 0;
+
+/* same as struct raw_writer in raw_rec */
+struct writer
+{
+    struct clip_writer clip;
+    struct write_model model;
+    struct frame_queue freed_queue;
+    pthread_t thread;
+    double writing_time;
+    int num_writes;
+    int error;
+};
+
+static struct writer writers[RAW_MAX_STRIPES];
+static int num_writers = 0;
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int get_free_slots()
+{
+    int free_slots = slot_alloc.free_count;
+    for (int i = 0; i < num_writers; i++)
+        free_slots += frame_queue_count(&writers[i].freed_queue);
+    return free_slots;
+}
+
+/* raw_writer_step from raw_rec */
+static int writer_step(struct writer * w)
+{
+    pthread_mutex_lock(&writing_queue_lock);
+
+    int queued = frame_queue_count(&writing_queue);
+    if (queued == 0)
+    {
+        pthread_mutex_unlock(&writing_queue_lock);
+        return 0;
+    }
+
+    int first_slot = frame_queue_peek(&writing_queue, 0);
+    int num_frames = slots_group_writes(slots, &writing_queue, slot_size);
+    /* no real-time deadline without --fps: pretend we are at 24p */
+    num_frames = slots_schedule_writes(&w->model, num_frames, get_free_slots(), fps_x1000 ? fps_x1000 : 24000, slot_size);
+    num_frames = MIN(num_frames, CLIP_WRITER_INDEX_ROOM(&w->clip));
+
+    if (num_frames == queued)
+        force_new_buffer = 1;
+
+    for (int i = 0; i < num_frames; i++)
+    {
+        int slot_index = frame_queue_peek(&writing_queue, i);
+        CHECK(slot_index == first_slot + i, "slot %d is not contiguous", slot_index);
+        CHECK(slots[slot_index].status == SLOT_FULL, "slot check error");
+        slots[slot_index].status = SLOT_WRITING;
+        ((raw_block_header_t *) slots[slot_index].ptr)->frame_index = w->clip.frames_saved + i;
+
+        /* skipped frames are fine, but the order must be kept */
+        CHECK(slots[slot_index].frame_number > last_processed_frame, "frame order error: frame %d after %d", slots[slot_index].frame_number, last_processed_frame);
+        last_processed_frame = slots[slot_index].frame_number;
+    }
+
+    frame_queue_pop(&writing_queue, num_frames);
+    pthread_mutex_unlock(&writing_queue_lock);
+
+    int size_used = slot_size * num_frames;
+    double t0 = now();
+    int r = clip_writer_write(&w->clip, slots[first_slot].ptr, size_used);
+    double dt = now() - t0;
+
+    if (r == 1)
+        write_model_update(&w->model, size_used, (int)(dt * 1000 + 0.5));
+    w->writing_time += dt;
+    w->num_writes++;
+
+    for (int i = 0; i < num_frames; i++)
+    {
+        if (r)
+            clip_writer_index_add(&w->clip, slots[first_slot + i].ptr);
+        frame_queue_push(&w->freed_queue, first_slot + i);
+    }
+
+    if (r == 0)
+        return -1;
+
+    if (w->clip.frames_saved % RAW_INDEX_INTERVAL == 0 && !clip_writer_save_index(&w->clip, 0))
+        return -1;
+
+    return num_frames;
+}
+
+static void* writer_thread(void* arg)
+{
+    struct writer * w = arg;
+
+    while (1)
+    {
+        int r = writer_step(w);
+        if (r < 0)
+        {
+            w->error = 1;
+            break;
+        }
+        if (r == 0)
+        {
+            if (capture_done && frame_queue_count(&writing_queue) == 0)
+                break;
+            usleep(2000);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    int fps = 0;
+    int mem_mb = 256;
+    char* input = 0;
+    char* dirs[RAW_MAX_STRIPES];
+    int num_dirs = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--fps=", 6) == 0)
+            fps = atoi(argv[i] + 6);
+        else if (strncmp(argv[i], "--mem=", 6) == 0)
+            mem_mb = atoi(argv[i] + 6);
+        else if (argv[i][0] == '-')
+        {
+            FAIL("Unknown option: %s", argv[i]);
+        }
+        else if (!input)
+            input = argv[i];
+        else if (num_dirs < RAW_MAX_STRIPES)
+            dirs[num_dirs++] = argv[i];
+        else
+        {
+            FAIL("Too many output directories");
+        }
+    }
+
+    if (!input || !num_dirs)
+    {
+        printf("Dual card recording on the PC (raw_rec writer code; directories stand in for the cards)\n");
+        printf("Usage: %s [--fps=N] [--mem=MB] input.RAW dir1 [dir2]\n", argv[0]);
+        printf("  --fps: frames arrive at this rate, and are skipped if the buffers are full\n");
+        printf("         (default: as fast as the cards can take them, nothing skipped)\n");
+        printf("  --mem: buffer memory (default 256, in 32 MB chunks)\n");
+        printf("Output: dir1/input.RAW (and dir2/input.RAW), indexed container.\n");
+        return 0;
+    }
+
+    CHECK(mem_mb >= 32 && mem_mb <= 2048, "Invalid memory size");
+    fps_x1000 = fps * 1000;
+
+    static struct raw_reader rr;
+    CHECK(raw_reader_open(&rr, input), "Could not open %s", input);
+    CHECK(!rr.stripes || rr.num_parts, "%s is part of a striped clip", input);
+    int frame_size = rr.frame_size;
+    slot_size = RAW_FRAME_BLOCK_SIZE(frame_size);
+
+    /* buffers: one small chunk for the full-size buffer (not needed here), the rest in 32 MB chunks */
+    struct mem_chunk chunks[65];
+    int num_chunks = 0;
+    chunks[num_chunks].ptr = malloc(4096);
+    chunks[num_chunks++].size = 4096;
+    for (int i = 0; i < mem_mb / 32; i++)
+    {
+        chunks[num_chunks].ptr = malloc(CHUNK_SIZE);
+        CHECK(chunks[num_chunks].ptr, "malloc");
+        chunks[num_chunks++].size = CHUNK_SIZE;
+    }
+    void* fullsize_buffer = 0;
+    int chunk_list[70];
+    slot_count = slots_setup(slots, COUNT(slots), chunks, num_chunks, 4096, slot_size, &fullsize_buffer, chunk_list, COUNT(chunk_list));
+    CHECK(slot_count >= 3, "only %d frame slots, raw_rec needs at least 3", slot_count);
+    slots_alloc_init(&slot_alloc, slots, slot_count, slot_size);
+    frame_queue_init(&writing_queue);
+
+    /* same file name in each directory */
+    const char* base = strrchr(input, '/');
+    base = base ? base + 1 : input;
+    uint32_t clip_id = (uint32_t) time(0) | 1;
+    num_writers = num_dirs;
+    for (int i = 0; i < num_writers; i++)
+    {
+        struct writer * w = &writers[i];
+        char filename[100];
+        snprintf(filename, sizeof(filename), "%s/%s", dirs[i], base);
+        CHECK(clip_writer_create(&w->clip, filename), "Could not create %s", filename);
+        CHECK(clip_writer_save_header(&w->clip, &rr.footer, i, num_writers > 1 ? num_writers : 0, clip_id), "Could not write %s", filename);
+        frame_queue_init(&w->freed_queue);
+        write_model_init(&w->model, 0);
+    }
+
+    printf("Input       : %s, %d frames, %d x %d\n", input, rr.frame_count, rr.footer.xRes, rr.footer.yRes);
+    printf("Buffers     : %d frame slots\n", slot_count);
+
+    for (int i = 0; i < num_writers; i++)
+        pthread_create(&writers[i].thread, 0, writer_thread, &writers[i]);
+
+    /* capture side: raw_rec_vsync_cbr */
+    double t0 = now();
+    int capture_slot = -1;
+    int skipped = 0;
+    for (int i = 0; i < rr.frame_count; i++)
+    {
+        /* real time? wait for the next vsync */
+        if (fps)
+        {
+            double t = t0 + i * 1000.0 / fps_x1000;
+            double dt = t - now();
+            if (dt > 0) usleep(dt * 1e6);
+        }
+
+        /* slots saved since the last frame can be reused */
+        for (int k = 0; k < num_writers; k++)
+        {
+            struct frame_queue * q = &writers[k].freed_queue;
+            int freed = frame_queue_count(q);
+            for (int j = 0; j < freed; j++)
+                slots_release(&slot_alloc, frame_queue_peek(q, j));
+            frame_queue_pop(q, freed);
+        }
+
+        int slot = slots_choose_capture(&slot_alloc, capture_slot, &force_new_buffer);
+        if (slot < 0)
+        {
+            int error = 0;
+            for (int k = 0; k < num_writers; k++)
+                error |= writers[k].error;
+            CHECK(!error, "Write error (disk full?)");
+
+            /* buffers full: skip this frame, or wait */
+            if (fps) { skipped++; continue; }
+            usleep(1000);
+            i--;
+            continue;
+        }
+        capture_slot = slot;
+
+        struct raw_frame frame;
+        CHECK(raw_reader_get_frame(&rr, i, &frame), "Could not read frame %d", i);
+        raw_block_header_t * hdr = slots[slot].ptr;
+        raw_block_header_init(hdr, "RAWF", slot_size, RAW_FRAME_HEADER_SIZE, frame_size);
+        hdr->frame_number = i + 1;
+        hdr->timestamp = (uint32_t)((now() - t0) * 1000);
+        memcpy(slots[slot].ptr + RAW_FRAME_HEADER_SIZE, frame.data, frame_size);
+        raw_reader_release_frame(&frame);
+
+        slots[slot].frame_number = i + 1;
+        frame_queue_push(&writing_queue, slot);
+    }
+    capture_done = 1;
+
+    for (int i = 0; i < num_writers; i++)
+        pthread_join(writers[i].thread, 0);
+    double elapsed = now() - t0;
+
+    int frames = 0;
+    double total = 0;
+    for (int i = 0; i < num_writers; i++)
+    {
+        struct writer * w = &writers[i];
+        CHECK(!w->error, "%s: write error (disk full?)", w->clip.filename);
+        CHECK(clip_writer_save_index(&w->clip, 1), "%s: could not save the last index", w->clip.filename);
+        double size = w->clip.written * 1024.0;
+        printf("%-12s: %d frames, %.1f MB, %d writes (%.1f MB average), %.1f MB/s\n",
+            w->clip.filename, w->clip.frames_saved, size / MB, w->num_writes,
+            size / MB / MAX(w->num_writes, 1), size / MB / MAX(w->writing_time, 1e-6));
+        frames += w->clip.frames_saved;
+        total += size;
+        clip_writer_close(&w->clip);
+    }
+    raw_reader_close(&rr);
+
+    printf("Total       : %d frames saved, %d skipped, %.1f MB/s overall\n", frames, skipped, total / MB / elapsed);
+    return 0;
+}
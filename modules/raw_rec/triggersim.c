@@ -0,0 +1,221 @@
+/**
+ * Test bench for the raw_rec trigger engine (raw_trigger.c)
+ *
+ * Feeds a scripted scene to the trigger, as decimated rows of packed 14-bit pixels (like the copies made in raw_rec),
+ * and checks the events: nothing during warmup or small changes, hysteresis (a level between release and threshold
+ * keeps an active zone active, but doesn't wake up an idle one), the post-trigger budget (also when a second event
+ * comes before it runs out), and that the pre-trigger frames are still in memory when saving starts.
+ *
+ * The scene is evaluated every frame, and also with only some of the frames evaluated, some frames late
+ * (like the trigger task on the camera, which skips frames while busy).
+ *
+ * Usage: triggersim [-v]
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "math.h"
+
+#include <raw_pack.h>
+#include "raw_trigger.h"
+
+#define FAIL(fmt,...) { fprintf(stderr, "Error: "); fprintf(stderr, fmt, ## __VA_ARGS__); fprintf(stderr, "\n"); exit(1); }
+#define CHECK(ok, fmt,...) { if (!(ok)) FAIL(fmt, ## __VA_ARGS__); }
+
+#define COUNT(x) ((int)(sizeof(x)/sizeof((x)[0])))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+/* same setup as raw_rec with Trigger = 2x2, default presets */
+#define WIDTH       1920
+#define THRESHOLD   600
+#define RELEASE     300
+#define MIN_DELTA   16
+#define PRE_FRAMES  10
+#define POST_FRAMES 25
+#define NUM_FRAMES  300
+
+#define BLACK       2048
+#define FLICKER     20          /* every frame, the whole image gets +/- FLICKER (the standard deviation of the baseline) */
+#define EVENT       400         /* much more than THRESHOLD/100 standard deviations */
+#define HOLD        (FLICKER * 9 / 2)   /* between RELEASE and THRESHOLD, with the flicker too */
+
+static int verbose = 0;
+
+/* small LCG, so the scene is the same on every platform */
+static int flicker(int frame)
+{
+    unsigned int seed = frame * 1103515245 + 12345;
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 1 ? FLICKER : -FLICKER;
+}
+
+/* the script: level of each zone (0 = top left, 1 = top right, 2 = bottom left, 3 = bottom right) */
+static int scene(int frame, int zone)
+{
+    int level = BLACK + 1000 + zone * 200 + flicker(frame);
+
+    if (zone == 3 && frame >= 101 && frame <= 103)
+        level += EVENT;                             /* first event: flash */
+    if (zone == 3 && frame >= 104 && frame <= 110)
+        level += HOLD;                              /* ... then something smaller, still there */
+    if (zone == 2 && frame >= 160 && frame <= 170)
+        level += HOLD;                              /* not enough to start saving */
+    if (zone == 0 && ((frame >= 200 && frame <= 202) || (frame >= 210 && frame <= 212)))
+        level += EVENT;                             /* second event, twice within the post-trigger budget */
+
+    return level;
+}
+
+/* decimated rows for this frame, packed like the camera does */
+static void make_rows(void * rows, int frame)
+{
+    uint16_t line[WIDTH];
+    for (int r = 0; r < RAW_TRIGGER_ROWS; r++)
+    {
+        for (int x = 0; x < WIDTH; x++)
+        {
+            int zone = (r >= RAW_TRIGGER_ROWS / 2) * 2 + (x >= WIDTH / 2);
+            line[x] = scene(frame, zone);
+        }
+        raw_pack_row_c(line, (uint8_t *) rows + r * WIDTH * 14 / 8, WIDTH);
+    }
+}
+
+/* with one frame evaluated out of step (1, 1+step, 1+2*step...), the first one evaluated at or after this frame */
+static int first_evaluated(int frame, int step)
+{
+    return frame + (step - (frame - 1) % step) % step;
+}
+
+/* the last one evaluated at or before this frame */
+static int last_evaluated(int frame, int step)
+{
+    return frame - (frame - 1) % step;
+}
+
+static void run(int step, int lag)
+{
+    static uint8_t rows[RAW_TRIGGER_ROWS * WIDTH * 14 / 8];
+
+    struct raw_trigger t;
+    memset(&t, 0, sizeof(t));
+    raw_trigger_setup_grid(&t, 2, 2, THRESHOLD, RELEASE, MIN_DELTA);
+    t.adapt = 4;
+    t.warmup = 32;
+    t.pre_frames = PRE_FRAMES;
+    t.post_frames = POST_FRAMES;
+    raw_trigger_reset(&t);
+
+    /* what we expect from the script */
+    int start1 = first_evaluated(101, step);
+    int stop1 = first_evaluated(last_evaluated(110, step) + POST_FRAMES, step);
+    int start2 = first_evaluated(200, step);
+    int stop2 = first_evaluated(last_evaluated(212, step) + POST_FRAMES, step);
+
+    /* frames kept in memory, like the rec task: oldest first, contiguous up to the last captured one */
+    int oldest = 1;
+    int max_kept = 0;
+
+    int evaluated = 0;
+    int next = 1;
+    int events = 0;
+
+    for (int frame = 1; frame <= NUM_FRAMES; frame++)
+    {
+        /* the trigger task runs lag frames behind the capture */
+        while (next + lag <= frame)
+        {
+            make_rows(rows, next);
+            raw_trigger_load_rows(&t, rows, RAW_TRIGGER_ROWS, WIDTH);
+            int r = raw_trigger_evaluate(&t, next);
+            evaluated = next;
+
+            if (verbose && (r || t.active_zones))
+                printf("  frame %3d: %s zones %x, save until %d\n", next,
+                    r == RAW_TRIGGER_START ? "START" : r == RAW_TRIGGER_STOP ? "STOP " : "     ", t.active_zones, t.save_until);
+
+            int expected = (next == start1 || next == start2) ? RAW_TRIGGER_START :
+                           (next == stop1  || next == stop2)  ? RAW_TRIGGER_STOP  : RAW_TRIGGER_IDLE;
+            CHECK(r == expected, "step %d, lag %d, frame %d: got %d, expected %d", step, lag, next, r, expected);
+
+            if (next >= 101 && next <= 110)
+                CHECK(t.active_zones == 1 << 3, "step %d, lag %d, frame %d: active zones %x (hysteresis)", step, lag, next, t.active_zones);
+            if (next >= 160 && next <= 170)
+                CHECK(t.active_zones == 0, "step %d, lag %d, frame %d: active zones %x (hysteresis)", step, lag, next, t.active_zones);
+
+            if (r == RAW_TRIGGER_START)
+            {
+                events++;
+                CHECK(oldest <= next - PRE_FRAMES, "step %d, lag %d, frame %d: pre-trigger frames from %d already dropped", step, lag, next, oldest);
+            }
+
+            next += step;
+        }
+
+        if (t.saving)
+        {
+            /* everything is saved (we assume the card is fast enough) */
+            oldest = frame + 1;
+        }
+        else
+        {
+            /* same rule as raw_video_rec_task: keep the last PRE_FRAMES frames, and the ones not evaluated yet */
+            while (frame - oldest + 1 > PRE_FRAMES && oldest < evaluated - PRE_FRAMES)
+                oldest++;
+        }
+
+        max_kept = MAX(max_kept, frame - oldest + 1);
+    }
+
+    CHECK(events == 2, "step %d, lag %d: %d events, expected 2", step, lag, events);
+
+    printf("step %d, lag %d: %d events, at most %d frames in memory while waiting, baseline %d +/- %.1f\n",
+        step, lag, events, max_kept, t.zones[1].mean >> 4, sqrt(t.zones[1].var));
+}
+
+int main(int argc, char** argv)
+{
+    for (int k = 1; k < argc; k++)
+    {
+        if (strcmp(argv[k], "-v") == 0)
+        {
+            verbose = 1;
+        }
+        else
+        {
+            printf("usage: %s [-v]\n", argv[0]);
+            return strcmp(argv[k], "--help") == 0 ? 0 : 1;
+        }
+    }
+
+    /* every frame, or some of them (the trigger task is busy), possibly a few frames late */
+    int steps[] = { 1, 2, 3 };
+    int lags[] = { 0, 1, 4 };
+
+    for (int i = 0; i < COUNT(steps); i++)
+        for (int j = 0; j < COUNT(lags); j++)
+            run(steps[i], lags[j]);
+
+    printf("\nAll trigger tests passed.\n");
+    return 0;
+}
@@ -42,7 +42,10 @@ static int get_tick_count() { return get_ms_clock_value_fast(); }
 #include "stdlib.h"
 #include "string.h"
 #include "math.h"
+#include <stdint.h>
 #include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
 #define FAST
 #define UNCACHEABLE(x) (x)
 #define umalloc malloc
@@ -59,24 +62,92 @@ static int get_tick_count() { return get_ms_clock_value_fast(); }
 
 /* adaptations from CHDK to ML */
 #define camera_sensor raw_info
-#define get_raw_pixel raw_get_pixel
 #define raw_rowpix width
 #define raw_rows height
 #define raw_size frame_size
 #define write FIO_WriteFile
 
-static void FAST reverse_bytes_order(char* buf, int count)
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+/**
+ * The image data is not written straight from raw_info.buffer, but in blocks, through a small scratch buffer:
+ * 14-bit data must be stored big endian in the DNG, so we swap the bytes on the fly, while copying.
+ * The source buffer is left untouched (it used to be byte-swapped in place).
+ */
+#ifdef CONFIG_MAGICLANTERN
+#define DNG_BLOCK_SIZE (256*1024)   /* small writes are slow on the card */
+#else
+#define DNG_BLOCK_SIZE (64*1024)    /* fits in L2 cache */
+#endif
+
+/* count = number of bytes, must be even */
+static void FAST swap_bytes_c(void* dst, void* src, int count)
+{
+    if ((((size_t)dst | (size_t)src) & 3) == 0)
+    {
+        /* two 16-bit words at a time */
+        uint32_t* d = dst;
+        uint32_t* s = src;
+        uint32_t* end = s + count/4;
+        for ( ; s < end; s++, d++)
+        {
+            uint32_t x = *s;
+            *d = ((x & 0x00FF00FF) << 8) | ((x >> 8) & 0x00FF00FF);
+        }
+        if (count & 2)
+        {
+            uint16_t x = *(uint16_t*)s;
+            *(uint16_t*)d = (x << 8) | (x >> 8);
+        }
+    }
+    else
+    {
+        uint16_t* d = dst;
+        uint16_t* s = src;
+        uint16_t* end = s + count/2;
+        for ( ; s < end; s++, d++)
+        {
+            uint16_t x = *s;
+            *d = (x << 8) | (x >> 8);
+        }
+    }
+}
+
+#if !defined(CONFIG_MAGICLANTERN) && (defined(__i386__) || defined(__x86_64__))
+
+#include <emmintrin.h>
+
+__attribute__((target("sse2")))
+static void swap_bytes_sse2(void* dst, void* src, int count)
 {
-    short* buf16 = (short*) buf;
+    int n = count / 16;
     int i;
-    for (i = 0; i < count/2; i++)
+    for (i = 0; i < n; i++)
     {
-        short x = buf16[i];
-        buf[2*i+1] = x;
-        buf[2*i] = x >> 8;
+        __m128i x = _mm_loadu_si128((__m128i*)src + i);
+        _mm_storeu_si128((__m128i*)dst + i, _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8)));
     }
+    swap_bytes_c((char*)dst + n*16, (char*)src + n*16, count - n*16);
 }
 
+static void swap_bytes(void* dst, void* src, int count)
+{
+    /* no cached flag: this may run on several threads at once */
+    if (__builtin_cpu_supports("sse2"))
+        swap_bytes_sse2(dst, src, count);
+    else
+        swap_bytes_c(dst, src, count);
+}
+
+#else
+#define swap_bytes swap_bytes_c
+#endif
+
 //thumbnail
 #define DNG_TH_WIDTH 128
 #define DNG_TH_HEIGHT 96
@@ -108,7 +179,7 @@ static char dng_artist_name[64]             = "";
 static char dng_copyright[64]               = "";
 static const short cam_PreviewBitsPerSample[]  = {8,8,8};
 static const int cam_Resolution[]              = {180,1};
-static int cam_AsShotNeutral[]          = {1000000,1000000,1000000,1000000,1000000,1000000};
+static const int cam_AsShotNeutral[]    = {473635,1000000,1000000,1000000,624000,1000000}; // Daylight
 static char cam_datetime[20]            = "";                   // DateTimeOriginal
 static char cam_subsectime[4]           = "";                   // DateTimeOriginal (milliseconds component)
 static int cam_shutter[2]               = { 0, 1000000 };       // Shutter speed
@@ -212,8 +283,15 @@ struct dir_entry ifd0[]={
 
 // Index of specific entries in ifd1 below.
 // *** warning - if entries are added or removed these should be updated ***
+#define COMPRESSION_INDEX           4       // tag 0x103
 #define RAW_DATA_INDEX              6       // tag 0x111
-#define BADPIXEL_OPCODE_INDEX       21      // tag 0xC740
+#define ROWS_PER_STRIP_INDEX        8       // tag 0x116
+#define RAW_SIZE_INDEX              9       // tag 0x117
+#define TILE_WIDTH_INDEX            14      // tag 0x142
+#define TILE_LENGTH_INDEX           15      // tag 0x143
+#define TILE_OFFSETS_INDEX          16      // tag 0x144
+#define TILE_BYTE_COUNTS_INDEX      17      // tag 0x145
+#define BADPIXEL_OPCODE_INDEX       25      // tag 0xC740
 
 struct dir_entry ifd1[]={
     {0xFE,   T_LONG,       1,  0},                                 // NewSubFileType: Main Image
@@ -230,6 +308,10 @@ struct dir_entry ifd1[]={
     {0x11B,  T_RATIONAL,   1,  (int)cam_Resolution},               // YResolution
     {0x11C,  T_SHORT,      1,  1},                                 // PlanarConfiguration: 1
     {0x128,  T_SHORT,      1,  2},                                 // ResolutionUnit: inch
+    {0x142,  T_LONG|T_SKIP,        1,  0},                         // TileWidth      (only for compressed output)
+    {0x143,  T_LONG|T_SKIP,        1,  0},                         // TileLength
+    {0x144,  T_LONG|T_PTR|T_SKIP,  1,  0},                         // TileOffsets
+    {0x145,  T_LONG|T_PTR|T_SKIP,  1,  0},                         // TileByteCounts
     {0x828D, T_SHORT,      2,  0x00020002},                        // CFARepeatPatternDim: Rows = 2, Cols = 2
     {0x828E, T_BYTE|T_PTR, 4,  (int)&camera_sensor.cfa_pattern},
     {0xC61A, T_LONG|T_PTR, 1,  (int)&camera_sensor.black_level},   // BlackLevel
@@ -289,34 +371,84 @@ static int get_type_size(int type)
 
 #define DIR_SIZE(ifd)   (sizeof(ifd)/sizeof(ifd[0]))
 
-struct
+struct ifd_info
 {
     struct dir_entry* entry;
     int count;                  // Number of entries to be saved
     int entry_count;            // Total number of entries
-} ifd_list[] = 
-{
-    {ifd0,      DIR_SIZE(ifd0),     DIR_SIZE(ifd0)}, 
-    {ifd1,      DIR_SIZE(ifd1),     DIR_SIZE(ifd1)}, 
-    {exif_ifd,  DIR_SIZE(exif_ifd), DIR_SIZE(exif_ifd)}, 
 };
 
 #define TIFF_HDR_SIZE (8)
 
-static char* dng_header_buf;
-static int dng_header_buf_size;
-static int dng_header_buf_offset;
-static char *thumbnail_buf;
+struct ljpeg_tile;
 
-static void add_to_buf(void* var, int size)
+/**
+ * Everything needed for saving one DNG file.
+ * The tables above are only templates (filled by the set_* functions); each file gets its own copy,
+ * so several DNGs can be saved at the same time, from different threads (raw2dng -j).
+ */
+struct dng_writer
 {
-    memcpy(dng_header_buf+dng_header_buf_offset,var,size);
-    dng_header_buf_offset += size;
+    /* image data: from a contiguous buffer, or one row at a time, from a callback (save_dng_rows) */
+    void* buffer;
+    dng_row_func_t row_func;
+    void* row_arg;
+
+    /* IFDs for this file */
+    struct dir_entry ifd0[DIR_SIZE(ifd0)];
+    struct dir_entry ifd1[DIR_SIZE(ifd1)];
+    struct dir_entry exif_ifd[DIR_SIZE(exif_ifd)];
+    struct ifd_info ifd_list[3];
+    unsigned int badpixel_opcode[DIR_SIZE(badpixel_opcode)];
+
+    char* header_buf;
+    int header_buf_size;
+    int header_buf_offset;
+    char* thumbnail_buf;
+
+    /* scratch buffer for the image data */
+    char* block_buf;
+    int block_size;
+    int block_used;
+
+#ifndef CONFIG_MAGICLANTERN
+    /* lossless JPEG tiles */
+    unsigned short * ljpeg_image;                   /* whole image, 16 bits per pixel */
+    struct ljpeg_tile * ljpeg_tiles;
+    int ljpeg_tiles_across, ljpeg_tiles_down, ljpeg_num_tiles;
+    int ljpeg_next_tile;
+    int ljpeg_error;
+    unsigned int * ljpeg_tile_offsets;
+    unsigned int * ljpeg_tile_sizes;
+#endif
+};
+
+static void init_dng_writer(struct dng_writer * w)
+{
+    memcpy(w->ifd0, ifd0, sizeof(ifd0));
+    memcpy(w->ifd1, ifd1, sizeof(ifd1));
+    memcpy(w->exif_ifd, exif_ifd, sizeof(exif_ifd));
+    memcpy(w->badpixel_opcode, badpixel_opcode, sizeof(badpixel_opcode));
+    w->ifd1[BADPIXEL_OPCODE_INDEX].offset = (int)w->badpixel_opcode;
+
+    struct ifd_info ifd_list[] =
+    {
+        {w->ifd0,       DIR_SIZE(ifd0),     DIR_SIZE(ifd0)},
+        {w->ifd1,       DIR_SIZE(ifd1),     DIR_SIZE(ifd1)},
+        {w->exif_ifd,   DIR_SIZE(exif_ifd), DIR_SIZE(exif_ifd)},
+    };
+    memcpy(w->ifd_list, ifd_list, sizeof(ifd_list));
 }
 
-static void add_val_to_buf(int val, int size)
+static void add_to_buf(struct dng_writer * w, void* var, int size)
 {
-    add_to_buf(&val,size);
+    memcpy(w->header_buf+w->header_buf_offset,var,size);
+    w->header_buf_offset += size;
+}
+
+static void add_val_to_buf(struct dng_writer * w, int val, int size)
+{
+    add_to_buf(w,&val,size);
 }
 
 
@@ -326,7 +458,125 @@ void set_framerate(int fpsx1000)
     cam_FrameRate[1] = 1000;
 }
 
-static void create_dng_header(){
+/* EXIF info, for desktop tools that convert from other raw formats (e.g. cr2hdr) */
+void set_camera_name(char* name)
+{
+    snprintf(cam_name, sizeof(cam_name), "%s", name);
+}
+
+void set_exif_datetime(char* datetime)
+{
+    snprintf(cam_datetime, sizeof(cam_datetime), "%s", datetime);
+}
+
+void set_exif_exposure(int shutter_num, int shutter_den, int aperture_num, int aperture_den, int iso)
+{
+    cam_shutter[0] = shutter_num;
+    cam_shutter[1] = shutter_den;
+    cam_aperture[0] = aperture_num;
+    cam_aperture[1] = aperture_den;
+    exif_data.iso = iso;
+}
+
+void set_exif_focal_length(int num, int den)
+{
+    cam_focal_length[0] = num;
+    cam_focal_length[1] = den;
+}
+
+void set_orientation(int orientation)
+{
+    ifd0[ORIENTATION_INDEX].offset = orientation ? orientation : 1;
+}
+
+//-------------------------------------------------------------------
+// Lossless JPEG compression (DNG compression 7), desktop only
+//
+// The image is split in tiles, each of them encoded as a separate lossless JPEG stream
+// (ITU T.81 process 14, predictor 1), on several threads, with Huffman tables optimized for each tile.
+// Like Adobe DNG Converter, each tile is encoded as 2 interleaved components, half as wide as the tile,
+// so the predictor always uses a pixel of the same color.
+
+#ifndef CONFIG_MAGICLANTERN
+
+#define DNG_TILE_SIZE 256   /* must be a multiple of 16 (TIFF) */
+
+struct ljpeg_tile
+{
+    unsigned char * data;
+    int size;
+    int capacity;
+};
+
+static int dng_compression = 1;
+static int dng_num_threads = 0;
+
+static int ljpeg_tile_size = DNG_TILE_SIZE;
+
+void set_dng_compression(int compression, int num_threads)
+{
+    dng_compression = compression;
+    dng_num_threads = num_threads;
+}
+
+#endif
+
+static void setup_image_data_tags(struct dng_writer * w)
+{
+    struct dir_entry * ifd1 = w->ifd1;
+#ifndef CONFIG_MAGICLANTERN
+    if (dng_compression == 7 && w->ljpeg_tiles)
+    {
+        ifd1[COMPRESSION_INDEX].offset = 7;
+        ifd1[RAW_DATA_INDEX].type |= T_SKIP;
+        ifd1[ROWS_PER_STRIP_INDEX].type |= T_SKIP;
+        ifd1[RAW_SIZE_INDEX].type |= T_SKIP;
+        ifd1[TILE_WIDTH_INDEX].type &= ~T_SKIP;
+        ifd1[TILE_LENGTH_INDEX].type &= ~T_SKIP;
+        ifd1[TILE_OFFSETS_INDEX].type &= ~T_SKIP;
+        ifd1[TILE_BYTE_COUNTS_INDEX].type &= ~T_SKIP;
+        ifd1[TILE_WIDTH_INDEX].offset = ljpeg_tile_size;
+        ifd1[TILE_LENGTH_INDEX].offset = ljpeg_tile_size;
+        ifd1[TILE_OFFSETS_INDEX].count = w->ljpeg_num_tiles;
+        ifd1[TILE_OFFSETS_INDEX].offset = (int)w->ljpeg_tile_offsets;
+        ifd1[TILE_BYTE_COUNTS_INDEX].count = w->ljpeg_num_tiles;
+        ifd1[TILE_BYTE_COUNTS_INDEX].offset = (int)w->ljpeg_tile_sizes;
+    }
+    else
+#endif
+    {
+        ifd1[COMPRESSION_INDEX].offset = 1;
+        ifd1[RAW_DATA_INDEX].type &= ~T_SKIP;
+        ifd1[ROWS_PER_STRIP_INDEX].type &= ~T_SKIP;
+        ifd1[RAW_SIZE_INDEX].type &= ~T_SKIP;
+        ifd1[TILE_WIDTH_INDEX].type |= T_SKIP;
+        ifd1[TILE_LENGTH_INDEX].type |= T_SKIP;
+        ifd1[TILE_OFFSETS_INDEX].type |= T_SKIP;
+        ifd1[TILE_BYTE_COUNTS_INDEX].type |= T_SKIP;
+    }
+}
+
+static void set_tile_offsets(struct dng_writer * w, int data_offset)
+{
+#ifndef CONFIG_MAGICLANTERN
+    int i;
+    if (!w->ljpeg_tiles)
+        return;
+
+    for (i = 0; i < w->ljpeg_num_tiles; i++)
+    {
+        w->ljpeg_tile_offsets[i] = data_offset;
+        w->ljpeg_tile_sizes[i] = w->ljpeg_tiles[i].size;
+        data_offset += w->ljpeg_tiles[i].size;
+    }
+#endif
+}
+
+static void create_dng_header(struct dng_writer * w)
+{
+    struct dir_entry * ifd0 = w->ifd0;
+    struct dir_entry * ifd1 = w->ifd1;
+    struct ifd_info * ifd_list = w->ifd_list;
     int i,j;
     int extra_offset;
     int raw_offset;
@@ -338,21 +588,21 @@ static void create_dng_header(){
         switch (camera_sensor.cfa_pattern)
         {
         case 0x02010100:
-            badpixel_opcode[BADPIX_CFA_INDEX] = BE(1);              // BayerPhase = 1 (top left pixel is green in a green/red row)
+            w->badpixel_opcode[BADPIX_CFA_INDEX] = BE(1);              // BayerPhase = 1 (top left pixel is green in a green/red row)
             break;
         case 0x01020001:
-            badpixel_opcode[BADPIX_CFA_INDEX] = BE(0);              // BayerPhase = 0 (top left pixel is red)
+            w->badpixel_opcode[BADPIX_CFA_INDEX] = BE(0);              // BayerPhase = 0 (top left pixel is red)
             break;
         case 0x01000201:
-            badpixel_opcode[BADPIX_CFA_INDEX] = BE(3);              // BayerPhase = 3 (top left pixel is blue)
+            w->badpixel_opcode[BADPIX_CFA_INDEX] = BE(3);              // BayerPhase = 3 (top left pixel is blue)
             break;
         case 0x00010102:
-            badpixel_opcode[BADPIX_CFA_INDEX] = BE(2);              // BayerPhase = 2 (top left pixel is green in a green/blue row)
+            w->badpixel_opcode[BADPIX_CFA_INDEX] = BE(2);              // BayerPhase = 2 (top left pixel is green in a green/blue row)
             break;
         }
 
     // filling EXIF fields
-    int ifd_count = DIR_SIZE(ifd_list);
+    int ifd_count = DIR_SIZE(w->ifd_list);
 
     // Fix the counts and offsets where needed
     ifd0[CAMERA_NAME_INDEX].count = ifd0[UNIQUE_CAMERA_MODEL_INDEX].count = strlen(cam_name) + 1;
@@ -367,16 +617,21 @@ static void create_dng_header(){
     //~ exif_ifd[FLASH_MODE_INDEX].offset = get_flash_mode_for_exif(exif_data.flash_mode, exif_data.flash_fired);
     //~ exif_ifd[SSTIME_INDEX].count = exif_ifd[SSTIME_ORIG_INDEX].count = strlen(cam_subsectime)+1;
 
+    // image data: uncompressed strip or lossless JPEG tiles
+    setup_image_data_tags(w);
+
     // calculating offset of RAW data and count of entries for each IFD
     raw_offset=TIFF_HDR_SIZE;
 
     for (j=0;j<ifd_count;j++)
     {
         raw_offset+=6; // IFD header+footer
+        ifd_list[j].count = 0;
         for(i=0; i<ifd_list[j].entry_count; i++)
         {
             if ((ifd_list[j].entry[i].type & T_SKIP) == 0)  // Exclude skipped entries (e.g. GPS info if camera doesn't have GPS)
             {
+                ifd_list[j].count++;
                 raw_offset+=12; // IFD directory entry size
                 int size_ext=get_type_size(ifd_list[j].entry[i].type)*ifd_list[j].entry[i].count;
                 if (size_ext>4) raw_offset+=size_ext+(size_ext&1);
@@ -386,17 +641,17 @@ static void create_dng_header(){
 
     // creating buffer for writing data
     raw_offset=(raw_offset/512+1)*512; // exlusively for CHDK fast file writing
-    dng_header_buf_size=raw_offset;
-    dng_header_buf=umalloc(raw_offset);
-    dng_header_buf_offset=0;
-    if (!dng_header_buf) return;
+    w->header_buf_size=raw_offset;
+    w->header_buf=umalloc(raw_offset);
+    w->header_buf_offset=0;
+    if (!w->header_buf) return;
 
     // create buffer for thumbnail
-    thumbnail_buf = malloc(DNG_TH_WIDTH*DNG_TH_HEIGHT*3);
-    if (!thumbnail_buf)
+    w->thumbnail_buf = malloc(DNG_TH_WIDTH*DNG_TH_HEIGHT*3);
+    if (!w->thumbnail_buf)
     {
-        ufree(dng_header_buf);
-        dng_header_buf = 0;
+        ufree(w->header_buf);
+        w->header_buf = 0;
         return;
     }
 
@@ -408,6 +663,7 @@ static void create_dng_header(){
     ifd0[EXIF_IFD_INDEX].offset = TIFF_HDR_SIZE + (ifd_list[0].count + ifd_list[1].count) * 12 + 6 + 6; // EXIF IFD offset
     ifd0[THUMB_DATA_INDEX].offset = raw_offset;                                     //StripOffsets for thumbnail
     ifd1[RAW_DATA_INDEX].offset = raw_offset + DNG_TH_WIDTH * DNG_TH_HEIGHT * 3;    //StripOffsets for main image
+    set_tile_offsets(w, raw_offset + DNG_TH_WIDTH * DNG_TH_HEIGHT * 3);              //TileOffsets (if compressed)
 
     for (j=0;j<ifd_count;j++)
     {
@@ -416,43 +672,43 @@ static void create_dng_header(){
 
     // TIFF file header
 
-    add_val_to_buf(0x4949, sizeof(short));      // little endian
-    add_val_to_buf(42, sizeof(short));          // An arbitrary but carefully chosen number that further identifies the file as a TIFF file.
-    add_val_to_buf(TIFF_HDR_SIZE, sizeof(int)); // offset of first IFD
+    add_val_to_buf(w, 0x4949, sizeof(short));   // little endian
+    add_val_to_buf(w, 42, sizeof(short));       // An arbitrary but carefully chosen number that further identifies the file as a TIFF file.
+    add_val_to_buf(w, TIFF_HDR_SIZE, sizeof(int)); // offset of first IFD
 
     // writing IFDs
 
     for (j=0;j<ifd_count;j++)
     {
         int size_ext;
-        add_val_to_buf(ifd_list[j].count, sizeof(short));
+        add_val_to_buf(w, ifd_list[j].count, sizeof(short));
         for(i=0; i<ifd_list[j].entry_count; i++)
         {
             if ((ifd_list[j].entry[i].type & T_SKIP) == 0)
             {
-                add_val_to_buf(ifd_list[j].entry[i].tag, sizeof(short));
-                add_val_to_buf(ifd_list[j].entry[i].type & 0xFF, sizeof(short));
-                add_val_to_buf(ifd_list[j].entry[i].count, sizeof(int));
+                add_val_to_buf(w, ifd_list[j].entry[i].tag, sizeof(short));
+                add_val_to_buf(w, ifd_list[j].entry[i].type & 0xFF, sizeof(short));
+                add_val_to_buf(w, ifd_list[j].entry[i].count, sizeof(int));
                 size_ext=get_type_size(ifd_list[j].entry[i].type)*ifd_list[j].entry[i].count;
                 if (size_ext<=4) 
                 {
                     if (ifd_list[j].entry[i].type & T_PTR)
                     {
-                        add_to_buf((void*)ifd_list[j].entry[i].offset, sizeof(int));
+                        add_to_buf(w, (void*)ifd_list[j].entry[i].offset, sizeof(int));
                     }
                     else
                     {
-                        add_val_to_buf(ifd_list[j].entry[i].offset, sizeof(int));
+                        add_val_to_buf(w, ifd_list[j].entry[i].offset, sizeof(int));
                     }
                 }
                 else
                 {
-                    add_val_to_buf(extra_offset, sizeof(int));
+                    add_val_to_buf(w, extra_offset, sizeof(int));
                     extra_offset += size_ext+(size_ext&1);    
                 }
             }
         }
-        add_val_to_buf(0, sizeof(int));
+        add_val_to_buf(w, 0, sizeof(int));
     }
 
     // writing extra data
@@ -467,28 +723,28 @@ static void create_dng_header(){
                 size_ext=get_type_size(ifd_list[j].entry[i].type)*ifd_list[j].entry[i].count;
                 if (size_ext>4)
                 {
-                    add_to_buf((void*)ifd_list[j].entry[i].offset, size_ext);
-                    if (size_ext&1) add_val_to_buf(0, 1);
+                    add_to_buf(w, (void*)ifd_list[j].entry[i].offset, size_ext);
+                    if (size_ext&1) add_val_to_buf(w, 0, 1);
                 }
             }
         }
     }
 
     // writing zeros to tail of dng header (just for fun)
-    for (i=dng_header_buf_offset; i<dng_header_buf_size; i++) dng_header_buf[i]=0;
+    for (i=w->header_buf_offset; i<w->header_buf_size; i++) w->header_buf[i]=0;
 }
 
-static void free_dng_header(void)
+static void free_dng_header(struct dng_writer * w)
 {
-    if (dng_header_buf)
+    if (w->header_buf)
     {
-        ufree(dng_header_buf);
-        dng_header_buf=NULL;
+        ufree(w->header_buf);
+        w->header_buf=NULL;
     }
-    if (thumbnail_buf)
+    if (w->thumbnail_buf)
     {
-        free(thumbnail_buf);
-        thumbnail_buf = 0;
+        free(w->thumbnail_buf);
+        w->thumbnail_buf = 0;
     }
 }
 
@@ -518,10 +774,45 @@ static void fill_gamma_buf(void)
     for (i=64; i<=255; i++) gammma[i]=pow_calc_2(255, i, 255, 0.25, 1);
 }
 
-static void create_thumbnail()
+//-------------------------------------------------------------------
+// Image data access: straight from raw_info.buffer, or one row at a time, from a callback (save_dng_rows)
+
+static void* get_raw_row(struct dng_writer * w, int y)
 {
-    register int i, j, x, y, yadj, xadj;
-    register char *buf = thumbnail_buf;
+    if (w->row_func)
+        return w->row_func(y, w->row_arg);
+    return (char*)w->buffer + y * camera_sensor.pitch;
+}
+
+/* one pixel from a row returned by get_raw_row */
+static int get_row_pixel(void* row, int x)
+{
+    if (camera_sensor.bits_per_pixel == 16)
+        return ((unsigned short*)row)[x];
+
+    struct raw_pixblock * p = (void*)((char*)row + (x/8)*14);
+    switch (x%8) {
+        case 0: return p->a;
+        case 1: return p->b_lo | (p->b_hi << 12);
+        case 2: return p->c_lo | (p->c_hi << 10);
+        case 3: return p->d_lo | (p->d_hi << 8);
+        case 4: return p->e_lo | (p->e_hi << 6);
+        case 5: return p->f_lo | (p->f_hi << 4);
+        case 6: return p->g_lo | (p->g_hi << 2);
+        case 7: return p->h;
+    }
+    return p->a;
+}
+
+static int thumb_x(int j, int xadj)
+{
+    return ((camera_sensor.active_area.x1 + camera_sensor.jpeg.x + (camera_sensor.jpeg.width  * j) / DNG_TH_WIDTH)  & 0xFFFFFFFE) + xadj;
+}
+
+/* decimated pass: only the two raw rows needed for each thumbnail row are read */
+static void create_thumbnail(struct dng_writer * w)
+{
+    register int i, j, y, yadj, xadj;
     register int shift = camera_sensor.bits_per_pixel - 8;
 
     // The sensor bayer patterns are:
@@ -535,36 +826,543 @@ static void create_thumbnail()
     xadj = (camera_sensor.cfa_pattern == 0x01020001) ? 1 : 0;
 
     for (i=0; i<DNG_TH_HEIGHT; i++)
+    {
+        char* buf = w->thumbnail_buf + i * DNG_TH_WIDTH * 3;
+        y = ((camera_sensor.active_area.y1 + camera_sensor.jpeg.y + (camera_sensor.jpeg.height * i) / DNG_TH_HEIGHT) & 0xFFFFFFFE) + yadj;
+
+        /* a row from the callback is only valid until the next call, so we take red and green first, then blue */
+        void* row = get_raw_row(w, y);
+        for (j=0; j<DNG_TH_WIDTH; j++)
+        {
+            int x = thumb_x(j, xadj);
+            buf[3*j]   = gammma[get_row_pixel(row, x)>>shift];              // red pixel
+            buf[3*j+1] = gammma[6*(get_row_pixel(row, x+1)>>shift)/10];     // green pixel
+        }
+
+        row = get_raw_row(w, y+1);
         for (j=0; j<DNG_TH_WIDTH; j++)
         {
-            x = ((camera_sensor.active_area.x1 + camera_sensor.jpeg.x + (camera_sensor.jpeg.width  * j) / DNG_TH_WIDTH)  & 0xFFFFFFFE) + xadj;
-            y = ((camera_sensor.active_area.y1 + camera_sensor.jpeg.y + (camera_sensor.jpeg.height * i) / DNG_TH_HEIGHT) & 0xFFFFFFFE) + yadj;
+            int x = thumb_x(j, xadj);
+            buf[3*j+2] = gammma[get_row_pixel(row, x+1)>>shift];            // blue pixel
+        }
+    }
+}
+
+//-------------------------------------------------------------------
+// Buffered output for the image data
+
+static void block_flush(struct dng_writer * w, FILE* fd)
+{
+    if (w->block_used)
+        write(fd, UNCACHEABLE(w->block_buf), w->block_used);
+    w->block_used = 0;
+}
+
+/* 14-bit data is byte-swapped into the scratch buffer; 16-bit data is already in the right order and written as is */
+static void block_write(struct dng_writer * w, FILE* fd, void* data, int size)
+{
+    if (camera_sensor.bits_per_pixel == 16)
+    {
+        block_flush(w, fd);
+        write(fd, data, size);
+        return;
+    }
+
+    char* src = data;
+    while (size > 0)
+    {
+        int n = MIN(size, w->block_size - w->block_used);
+        swap_bytes(UNCACHEABLE(w->block_buf + w->block_used), src, n);
+        w->block_used += n;
+        src += n;
+        size -= n;
+        if (w->block_used == w->block_size)
+            block_flush(w, fd);
+    }
+}
+
+static void block_write_zeros(struct dng_writer * w, FILE* fd, int size)
+{
+    while (size > 0)
+    {
+        int n = MIN(size, w->block_size - w->block_used);
+        memset(UNCACHEABLE(w->block_buf + w->block_used), 0, n);
+        w->block_used += n;
+        size -= n;
+        if (w->block_used == w->block_size)
+            block_flush(w, fd);
+    }
+}
+
+static void write_image_data(struct dng_writer * w, FILE* fd)
+{
+    if (!w->row_func)
+    {
+        /* contiguous buffer */
+        block_write(w, fd, w->buffer, camera_sensor.raw_size);
+    }
+    else
+    {
+        /* one row at a time; if raw_size is larger than the image (padding), fill the rest with zeros */
+        int remaining = camera_sensor.raw_size;
+        int y;
+        for (y = 0; y < camera_sensor.raw_rows && remaining > 0; y++)
+        {
+            int n = MIN(camera_sensor.pitch, remaining);
+            block_write(w, fd, get_raw_row(w, y), n);
+            remaining -= n;
+        }
+        block_write_zeros(w, fd, remaining);
+    }
+    block_flush(w, fd);
+}
+
+#ifndef CONFIG_MAGICLANTERN
+
+/* the whole image, unpacked to 16 bits (tiles are encoded in parallel, but get_raw_row is not thread-safe) */
+static int ljpeg_unpack_image(struct dng_writer * w)
+{
+    int width = camera_sensor.raw_rowpix;
+    int height = camera_sensor.raw_rows;
+    w->ljpeg_image = malloc(width * height * sizeof(w->ljpeg_image[0]));
+    if (!w->ljpeg_image) return 0;
+
+    int x, y;
+    for (y = 0; y < height; y++)
+    {
+        void* row = get_raw_row(w, y);
+        unsigned short * out = w->ljpeg_image + y * width;
+        if (camera_sensor.bits_per_pixel == 16)
+        {
+            memcpy(out, row, width * 2);
+            continue;
+        }
+        for (x = 0; x < width; x += 8)
+        {
+            struct raw_pixblock * p = (void*)((char*)row + (x/8)*14);
+            out[x]   = p->a;
+            out[x+1] = p->b_lo | (p->b_hi << 12);
+            out[x+2] = p->c_lo | (p->c_hi << 10);
+            out[x+3] = p->d_lo | (p->d_hi << 8);
+            out[x+4] = p->e_lo | (p->e_hi << 6);
+            out[x+5] = p->f_lo | (p->f_hi << 4);
+            out[x+6] = p->g_lo | (p->g_hi << 2);
+            out[x+7] = p->h;
+        }
+    }
+    return 1;
+}
+
+/* coordinates outside the image (in the right/bottom tiles) are mirrored back, keeping the Bayer phase */
+static inline int ljpeg_clip(int x, int size)
+{
+    return x < size ? x : x - 2 * ((x - size) / 2 + 1);
+}
+
+/* number of bits needed for a difference (SSSS); -32768 => 16 */
+static inline int ljpeg_ssss(int diff)
+{
+    int a = diff < 0 ? -diff : diff;
+    return a ? 32 - __builtin_clz(a) : 0;
+}
 
-            *buf++ = gammma[get_raw_pixel(x,y)>>shift];           // red pixel
-            *buf++ = gammma[6*(get_raw_pixel(x+1,y)>>shift)/10];  // green pixel
-            *buf++ = gammma[get_raw_pixel(x+1,y+1)>>shift];       // blue pixel
+/* prediction differences for one tile (predictor 1, 2 components), modulo 2^16 */
+static void ljpeg_tile_diffs(struct dng_writer * w, int tx, int ty, short * diffs)
+{
+    int width = camera_sensor.raw_rowpix;
+    int height = camera_sensor.raw_rows;
+    int ts = ljpeg_tile_size;
+    int x0 = tx * ts;
+    int y0 = ty * ts;
+    int x, y;
+    int xs[DNG_TILE_SIZE];
+
+    for (x = 0; x < ts; x++)
+        xs[x] = ljpeg_clip(x0 + x, width);
+
+    for (y = 0; y < ts; y++)
+    {
+        unsigned short * row = w->ljpeg_image + ljpeg_clip(y0 + y, height) * width;
+        unsigned short * above = y > 0 ? w->ljpeg_image + ljpeg_clip(y0 + y - 1, height) * width : row;
+        short * d = diffs + y * ts;
+
+        for (x = 0; x < ts; x++)
+        {
+            int pred;
+            if (x >= 2)
+                pred = row[xs[x-2]];                            /* left pixel from the same component */
+            else if (y > 0)
+                pred = above[xs[x]];                            /* first column: pixel above */
+            else
+                pred = 1 << (camera_sensor.bits_per_pixel - 1); /* first pixel of the tile */
+
+            d[x] = (short)(row[xs[x]] - pred);
         }
+    }
 }
 
+/* optimal Huffman code lengths, limited to 16 bits (ITU T.81 Annex K.2) */
+static void ljpeg_huff_optimize(int* freq_in, unsigned char * bits, unsigned char * huffval, int* nsym)
+{
+    int freq[18];
+    int codesize[18];
+    int others[18];
+    int count[33];
+    int i, j;
+
+    for (i = 0; i < 17; i++)
+        freq[i] = freq_in[i];
+    freq[17] = 1;   /* reserved, so no code is made of all 1 bits */
+
+    for (i = 0; i < 18; i++)
+    {
+        codesize[i] = 0;
+        others[i] = -1;
+    }
+
+    while (1)
+    {
+        /* two least frequent symbols (prefer the larger index on ties, like libjpeg) */
+        int c1 = -1, c2 = -1;
+        int v = 0x7FFFFFFF;
+        for (i = 0; i < 18; i++)
+            if (freq[i] && freq[i] <= v) { v = freq[i]; c1 = i; }
+        v = 0x7FFFFFFF;
+        for (i = 0; i < 18; i++)
+            if (freq[i] && freq[i] <= v && i != c1) { v = freq[i]; c2 = i; }
+        if (c2 < 0)
+            break;
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+
+        codesize[c1]++;
+        while (others[c1] >= 0) { c1 = others[c1]; codesize[c1]++; }
+        others[c1] = c2;
+        codesize[c2]++;
+        while (others[c2] >= 0) { c2 = others[c2]; codesize[c2]++; }
+    }
+
+    for (i = 0; i < 33; i++)
+        count[i] = 0;
+    for (i = 0; i < 18; i++)
+        if (codesize[i])
+            count[MIN(codesize[i], 32)]++;
+
+    for (i = 32; i > 16; i--)
+    {
+        while (count[i] > 0)
+        {
+            j = i - 2;
+            while (count[j] == 0) j--;
+            count[i] -= 2;
+            count[i-1]++;
+            count[j+1] += 2;
+            count[j]--;
+        }
+    }
+
+    /* remove the reserved code (the longest one) */
+    i = 16;
+    while (count[i] == 0) i--;
+    count[i]--;
+
+    for (i = 1; i <= 16; i++)
+        bits[i] = count[i];
+
+    *nsym = 0;
+    for (i = 1; i <= 32; i++)
+        for (j = 0; j < 17; j++)
+            if (codesize[j] == i)
+                huffval[(*nsym)++] = j;
+}
+
+struct ljpeg_writer
+{
+    struct ljpeg_tile * t;
+    unsigned int acc;
+    int nbits;
+};
+
+static int ljpeg_reserve(struct ljpeg_tile * t, int size)
+{
+    if (t->size + size <= t->capacity)
+        return 1;
+    int cap = MAX(t->capacity * 2, t->size + size);
+    unsigned char * data = realloc(t->data, cap);
+    if (!data) return 0;
+    t->data = data;
+    t->capacity = cap;
+    return 1;
+}
+
+static void ljpeg_put_byte(struct ljpeg_tile * t, int b)
+{
+    t->data[t->size++] = b;
+}
+
+static void ljpeg_put_marker(struct ljpeg_tile * t, int marker, int length)
+{
+    ljpeg_put_byte(t, 0xFF);
+    ljpeg_put_byte(t, marker);
+    if (length)
+    {
+        ljpeg_put_byte(t, length >> 8);
+        ljpeg_put_byte(t, length);
+    }
+}
+
+/* n <= 16 */
+static inline void ljpeg_put_bits(struct ljpeg_writer * bw, unsigned int code, int n)
+{
+    bw->acc = (bw->acc << n) | (code & ((1 << n) - 1));
+    bw->nbits += n;
+    while (bw->nbits >= 8)
+    {
+        int b = (bw->acc >> (bw->nbits - 8)) & 0xFF;
+        ljpeg_put_byte(bw->t, b);
+        if (b == 0xFF)
+            ljpeg_put_byte(bw->t, 0);   /* byte stuffing */
+        bw->nbits -= 8;
+    }
+}
+
+static int ljpeg_encode_tile(struct dng_writer * w, int index, short * diffs)
+{
+    struct ljpeg_tile * t = &w->ljpeg_tiles[index];
+    int ts = ljpeg_tile_size;
+    int n = ts * ts;
+    int i;
+
+    ljpeg_tile_diffs(w, index % w->ljpeg_tiles_across, index / w->ljpeg_tiles_across, diffs);
+
+    int freq[17] = {0};
+    for (i = 0; i < n; i++)
+        freq[ljpeg_ssss(diffs[i])]++;
+
+    unsigned char bits[17];
+    unsigned char huffval[17];
+    int nsym;
+    ljpeg_huff_optimize(freq, bits, huffval, &nsym);
+
+    /* code for each symbol (ITU T.81 Annex C) */
+    unsigned short code[17];
+    unsigned char size[17];
+    int c = 0, k = 0, len;
+    for (len = 1; len <= 16; len++)
+    {
+        for (i = 0; i < bits[len]; i++, k++)
+        {
+            code[huffval[k]] = c++;
+            size[huffval[k]] = len;
+        }
+        c <<= 1;
+    }
+
+    /* headers */
+    if (!ljpeg_reserve(t, 64 + nsym))
+        return 0;
+    ljpeg_put_marker(t, 0xD8, 0);                       /* SOI */
+    ljpeg_put_marker(t, 0xC4, 2 + 1 + 16 + nsym);       /* DHT */
+    ljpeg_put_byte(t, 0x00);                            /* DC table 0 */
+    for (len = 1; len <= 16; len++)
+        ljpeg_put_byte(t, bits[len]);
+    for (i = 0; i < nsym; i++)
+        ljpeg_put_byte(t, huffval[i]);
+    ljpeg_put_marker(t, 0xC3, 8 + 2*3);                 /* SOF3 */
+    ljpeg_put_byte(t, camera_sensor.bits_per_pixel);
+    ljpeg_put_byte(t, ts >> 8);                         /* height */
+    ljpeg_put_byte(t, ts);
+    ljpeg_put_byte(t, (ts/2) >> 8);                     /* width: 2 components per sample */
+    ljpeg_put_byte(t, ts/2);
+    ljpeg_put_byte(t, 2);
+    for (i = 1; i <= 2; i++)
+    {
+        ljpeg_put_byte(t, i);                           /* component ID */
+        ljpeg_put_byte(t, 0x11);                        /* sampling factors */
+        ljpeg_put_byte(t, 0);                           /* quantization table (unused) */
+    }
+    ljpeg_put_marker(t, 0xDA, 6 + 2*2);                 /* SOS */
+    ljpeg_put_byte(t, 2);
+    for (i = 1; i <= 2; i++)
+    {
+        ljpeg_put_byte(t, i);
+        ljpeg_put_byte(t, 0x00);                        /* Huffman table 0 */
+    }
+    ljpeg_put_byte(t, 1);                               /* predictor 1 */
+    ljpeg_put_byte(t, 0);
+    ljpeg_put_byte(t, 0);                               /* point transform */
+
+    /* entropy-coded data */
+    struct ljpeg_writer bw = { t, 0, 0 };
+    for (i = 0; i < n; i++)
+    {
+        /* worst case: 16+16 bits, all stuffed */
+        if (!ljpeg_reserve(t, 8))
+            return 0;
+
+        int d = diffs[i];
+        int ssss = ljpeg_ssss(d);
+        ljpeg_put_bits(&bw, code[ssss], size[ssss]);
+        if (ssss && ssss < 16)
+            ljpeg_put_bits(&bw, d < 0 ? d - 1 : d, ssss);
+    }
+
+    if (!ljpeg_reserve(t, 4))
+        return 0;
+    if (bw.nbits)
+        ljpeg_put_bits(&bw, 0x7F, 8 - bw.nbits);        /* pad with 1 bits */
+    ljpeg_put_marker(t, 0xD9, 0);                       /* EOI */
+    return 1;
+}
+
+static void* ljpeg_worker(void* arg)
+{
+    struct dng_writer * w = arg;
+    short * diffs = malloc(ljpeg_tile_size * ljpeg_tile_size * sizeof(diffs[0]));
+    if (!diffs)
+    {
+        w->ljpeg_error = 1;
+        return 0;
+    }
+
+    while (1)
+    {
+        int i = __sync_fetch_and_add(&w->ljpeg_next_tile, 1);
+        if (i >= w->ljpeg_num_tiles)
+            break;
+        if (!ljpeg_encode_tile(w, i, diffs))
+            w->ljpeg_error = 1;
+    }
+
+    free(diffs);
+    return 0;
+}
+
+static int get_num_cpus()
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+#else
+    char* n = getenv("NUMBER_OF_PROCESSORS");
+    return n && atoi(n) > 0 ? atoi(n) : 1;
+#endif
+}
+
+static void ljpeg_free(struct dng_writer * w)
+{
+    int i;
+    if (w->ljpeg_tiles)
+        for (i = 0; i < w->ljpeg_num_tiles; i++)
+            free(w->ljpeg_tiles[i].data);
+    free(w->ljpeg_tiles); w->ljpeg_tiles = 0;
+    free(w->ljpeg_tile_offsets); w->ljpeg_tile_offsets = 0;
+    free(w->ljpeg_tile_sizes); w->ljpeg_tile_sizes = 0;
+    free(w->ljpeg_image); w->ljpeg_image = 0;
+}
+
+/* encode all the tiles in memory; on error, we'll fall back to uncompressed output */
+static int ljpeg_compress(struct dng_writer * w)
+{
+    if (camera_sensor.bits_per_pixel != 14 && camera_sensor.bits_per_pixel != 16)
+        return 0;
+    if (camera_sensor.raw_rowpix < 2 || camera_sensor.raw_rows < 2)
+        return 0;
+
+    w->ljpeg_tiles_across = (camera_sensor.raw_rowpix + ljpeg_tile_size - 1) / ljpeg_tile_size;
+    w->ljpeg_tiles_down = (camera_sensor.raw_rows + ljpeg_tile_size - 1) / ljpeg_tile_size;
+    w->ljpeg_num_tiles = w->ljpeg_tiles_across * w->ljpeg_tiles_down;
+    w->ljpeg_next_tile = 0;
+    w->ljpeg_error = 0;
+
+    w->ljpeg_tiles = calloc(w->ljpeg_num_tiles, sizeof(w->ljpeg_tiles[0]));
+    w->ljpeg_tile_offsets = malloc(w->ljpeg_num_tiles * sizeof(w->ljpeg_tile_offsets[0]));
+    w->ljpeg_tile_sizes = malloc(w->ljpeg_num_tiles * sizeof(w->ljpeg_tile_sizes[0]));
+    if (!w->ljpeg_tiles || !w->ljpeg_tile_offsets || !w->ljpeg_tile_sizes || !ljpeg_unpack_image(w))
+        goto err;
+
+    int num_threads = dng_num_threads > 0 ? dng_num_threads : get_num_cpus();
+    num_threads = MIN(num_threads, w->ljpeg_num_tiles);
+    pthread_t threads[64];
+    int started = 0;
+    int i;
+    for (i = 1; i < MIN(num_threads, 64); i++)
+        if (pthread_create(&threads[started], 0, ljpeg_worker, w) == 0)
+            started++;
+
+    ljpeg_worker(w);
+
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], 0);
+
+    free(w->ljpeg_image); w->ljpeg_image = 0;
+
+    if (w->ljpeg_error)
+        goto err;
+    return 1;
+
+err:
+    ljpeg_free(w);
+    return 0;
+}
+
+static void ljpeg_write_tiles(struct dng_writer * w, FILE* fd)
+{
+    int i;
+    for (i = 0; i < w->ljpeg_num_tiles; i++)
+        write(fd, w->ljpeg_tiles[i].data, w->ljpeg_tiles[i].size);
+}
+
+#endif
+
 //-------------------------------------------------------------------
 // Write DNG header, thumbnail and data to file
 
-static void write_dng(FILE* fd, char* rawadr) 
+static void write_dng(struct dng_writer * w, FILE* fd)
 {
-    create_dng_header();
+    /* scratch buffer for the image data; if memory is tight, a smaller one will do */
+    for (w->block_size = DNG_BLOCK_SIZE; w->block_size >= 4096; w->block_size /= 2)
+        if ((w->block_buf = umalloc(w->block_size)))
+            break;
+    if (!w->block_buf)
+        return;
+    w->block_used = 0;
 
-    if (dng_header_buf)
+#ifndef CONFIG_MAGICLANTERN
+    /* tile sizes must be known before creating the header */
+    if (dng_compression == 7)
+        ljpeg_compress(w);
+#endif
+
+    create_dng_header(w);
+
+    if (w->header_buf)
     {
+#ifdef CONFIG_MAGICLANTERN
         fill_gamma_buf();
-        create_thumbnail();
-        write(fd, dng_header_buf, dng_header_buf_size);
-        write(fd, thumbnail_buf, DNG_TH_WIDTH*DNG_TH_HEIGHT*3);
+#else
+        static pthread_once_t gamma_once = PTHREAD_ONCE_INIT;
+        pthread_once(&gamma_once, fill_gamma_buf);
+#endif
+        create_thumbnail(w);
+        write(fd, w->header_buf, w->header_buf_size);
+        write(fd, w->thumbnail_buf, DNG_TH_WIDTH*DNG_TH_HEIGHT*3);
+#ifndef CONFIG_MAGICLANTERN
+        if (w->ljpeg_tiles)
+            ljpeg_write_tiles(w, fd);
+        else
+#endif
+        write_image_data(w, fd);
+        free_dng_header(w);
+    }
 
-        reverse_bytes_order(UNCACHEABLE(rawadr), camera_sensor.raw_size);
-        write(fd, UNCACHEABLE(rawadr), camera_sensor.raw_size);
+#ifndef CONFIG_MAGICLANTERN
+    ljpeg_free(w);
+#endif
 
-        free_dng_header();
-    }
+    ufree(w->block_buf);
+    w->block_buf = 0;
 }
 
 #ifdef CONFIG_MAGICLANTERN
@@ -574,11 +1372,8 @@ PROP_HANDLER(PROP_CAM_MODEL)
 }
 #endif
 
-int save_dng(char* filename)
+static int save_dng_from(char* filename, void* buffer, dng_row_func_t get_row, void* arg)
 {
-    cam_AsShotNeutral[0] = 473635; /* Daylight */
-    cam_AsShotNeutral[4] = 624000;
-    
     #ifdef RAW_DEBUG_BLACK
     raw_info.active_area.x1 = 0;
     raw_info.active_area.x2 = raw_info.width;
@@ -590,9 +1385,30 @@ int save_dng(char* filename)
     raw_info.jpeg.height = raw_info.height;
     #endif
     
+    struct dng_writer * w = malloc(sizeof(*w));
+    if (!w) return 0;
+    memset(w, 0, sizeof(*w));
+    init_dng_writer(w);
+    w->buffer = buffer;
+    w->row_func = get_row;
+    w->row_arg = arg;
+
     FILE* f = FIO_CreateFileEx(filename);
-    if (!f) return 0;
-    write_dng(f, raw_info.buffer);
-    FIO_CloseFile(f);
-    return 1;
+    if (f)
+    {
+        write_dng(w, f);
+        FIO_CloseFile(f);
+    }
+    free(w);
+    return f ? 1 : 0;
+}
+
+int save_dng(char* filename)
+{
+    return save_dng_from(filename, raw_info.buffer, 0, 0);
+}
+
+int save_dng_rows(char* filename, dng_row_func_t get_row, void* arg)
+{
+    return save_dng_from(filename, 0, get_row, arg);
 }
@@ -2,6 +2,23 @@
 #define __CHDK_DNG_H_
 
 void set_framerate(int fpsx1000);
+void set_camera_name(char* name);
+void set_exif_datetime(char* datetime);
+void set_exif_exposure(int shutter_num, int shutter_den, int aperture_num, int aperture_den, int iso);
+void set_exif_focal_length(int num, int den);
+void set_orientation(int orientation);
 int save_dng(char* filename);
 
+/* streaming version: instead of reading raw_info.buffer, the image data is requested one row at a time */
+/* get_row must return raw_info.pitch bytes in the same format as raw_info.buffer (may point to its own buffer, valid until the next call) */
+/* rows may be requested more than once (the thumbnail is created first) */
+typedef void* (*dng_row_func_t)(int y, void* arg);
+int save_dng_rows(char* filename, dng_row_func_t get_row, void* arg);
+
+/* several DNGs can be saved at the same time, from different threads (save_dng_rows, with a different buffer for each one),
+ * as long as raw_info and the settings above are not changed meanwhile */
+
+/* desktop only: 1 = uncompressed (default), 7 = lossless JPEG (tiles encoded on num_threads threads, 0 = one per CPU) */
+void set_dng_compression(int compression, int num_threads);
+
 #endif // __CHDK_DNG_H_
@@ -7,6 +7,7 @@
 #include "lens.h"
 #include "math.h"
 #include "raw.h"
+#include "raw_pack.h"
 #include "menu.h"
 
 #include "imgconv.h"
@@ -44,9 +45,7 @@ void FAST hist_build_raw()
     int step = lv ? 4 : 2;
 
     /* only show a 12-bit hisogram, since the rest is just noise */
-    char r2ev[4096];
-    for (int i = 0; i < 4095; i++)
-        r2ev[i] = COERCE((raw_to_ev(i*4) + 12) * (HIST_WIDTH-1) / 12, 0, HIST_WIDTH-1);
+    const unsigned char* r2ev = raw_get_luts()->hist;
 
     for (int i = os.y0; i < os.y_max; i += step)
     {
@@ -390,53 +389,33 @@ int FAST raw_hist_get_percentile_levels(int* percentiles_x10, int* output_raw_va
     {
         /* time: 1-2 seconds on full raw 5D3 */
         //~ int t0 = get_ms_clock_value();
-        for (struct raw_pixblock * row = (struct raw_pixblock *) raw_info.buffer + raw_info.active_area.y1 * raw_info.width / 8 + (raw_info.active_area.x1 + 7) / 8; (void*)row < (void*)raw_info.buffer + raw_info.pitch * raw_info.active_area.y2; row += 2 * raw_info.width / 8)
+        /* unpack two rows at a time (RG and GB) and take the green pixels from each */
+        int xs = (raw_info.active_area.x1 + 7) & ~7;
+        int n = (raw_info.jpeg.width * 14/8 + 13) / 14 * 8;
+        uint16_t* line = SmallAlloc(n * 2 * 2);
+        if (!line)
         {
-            struct raw_pixblock * row2 = row + raw_info.pitch / sizeof(struct raw_pixblock);
+            SmallFree(hist);
+            return -1;
+        }
+        uint16_t* line2 = line + n;
 
-            struct raw_pixblock * p;
-            struct raw_pixblock * q;
-            for (p = row, q = row2; (void*)p < (void*)row + raw_info.jpeg.width * 14/8; p++, q++)
+        for (int y = raw_info.active_area.y1; y < raw_info.active_area.y2; y += 2)
+        {
+            /**
+             *  line:  rgrgrgrg rgrgrgrg
+             *  line2: gbgbgbgb gbgbgbgb
+             */
+            raw_unpack_row(raw_info.buffer + y * raw_info.pitch + xs * 14/8, line, n);
+            raw_unpack_row(raw_info.buffer + (y+1) * raw_info.pitch + xs * 14/8, line2, n);
+
+            for (int x = 0; x < n; x += 2)
             {
-
-                /**
-                 *  p: abcdefgh abcdefgh
-                 *  q: abcdefgh abcdefgh
-                 *
-                 *     rgrgrgrg rgrgrgrg
-                 *     gbgbgbgb gbgbgbgb
-                 */
-
-                //~ int pa = ((int)(p->a));
-                int pb = ((int)(p->b_lo | (p->b_hi << 12)));
-                //~ int pc = ((int)(p->c_lo | (p->c_hi << 10)));
-                int pd = ((int)(p->d_lo | (p->d_hi << 8)));
-                //~ int pe = ((int)(p->e_lo | (p->e_hi << 6)));
-                int pf = ((int)(p->f_lo | (p->f_hi << 4)));
-                //~ int pg = ((int)(p->g_lo | (p->g_hi << 2)));
-                int ph = ((int)(p->h));
-                int qa = ((int)(q->a));
-                //~ int qb = ((int)(q->b_lo | (q->b_hi << 12)));
-                int qc = ((int)(q->c_lo | (q->c_hi << 10)));
-                //~ int qd = ((int)(q->d_lo | (q->d_hi << 8)));
-                int qe = ((int)(q->e_lo | (q->e_hi << 6)));
-                //~ int qf = ((int)(q->f_lo | (q->f_hi << 4)));
-                int qg = ((int)(q->g_lo | (q->g_hi << 2)));
-                //~ int qh = ((int)(q->h));
-
-                hist[pb]++;
-                hist[pd]++;
-                hist[pf]++;
-                hist[ph]++;
-                hist[qa]++;
-                hist[qc]++;
-                hist[qe]++;
-                hist[qg]++;
-
-                /* to check if we sample only the active area */
-                //~ p->a = rand();
+                hist[line[x+1]]++;
+                hist[line2[x]]++;
             }
         }
+        SmallFree(line);
         //~ int t1 = get_ms_clock_value();
         //~ NotifyBox(5000, "%d ", t1 - t0);
         //~ save_dng("A:/foo.dng");
@@ -29,6 +29,9 @@ struct Histogram
 
 extern struct Histogram histogram;
 
+/* the rest is only for the camera (struct Histogram is also used by the PC tools, see zebra_kernels.h) */
+#ifdef CONFIG_MAGICLANTERN
+
 void hist_build();
 
 void hist_build_raw();
@@ -66,4 +69,6 @@ MENU_UPDATE_FUNC(raw_histo_update);
 
 extern int raw_histogram_enable;
 
+#endif
+
 #endif /* _histogram_h_ */
@@ -20,10 +20,12 @@
 
 #include "dryos.h"
 #include "raw.h"
+#include "raw_pack.h"
 #include "property.h"
 #include "math.h"
 #include "bmp.h"
 #include "lens.h"
+#include "histogram.h"
 
 #undef RAW_DEBUG        /* define it to help with porting */
 #undef RAW_DEBUG_DUMP   /* if you want to save the raw image buffer and the DNG from here */
@@ -695,12 +697,14 @@ int raw_update_params()
     
     dbg_printf("black=%d white=%d\n", raw_info.black_level, raw_info.white_level);
 
+    /* rebuild the overlay lookup tables here (if needed), rather than from the overlay loops */
+    raw_get_luts();
+
     #ifdef RAW_DEBUG_DUMP
     dbg_printf("saving raw buffer...\n");
     dump_seg(raw_info.buffer, MAX(raw_info.frame_size, 1000000), CARD_DRIVE"raw.buf");
     dbg_printf("saving DNG...\n");
     save_dng(CARD_DRIVE"raw.dng");
-    reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
     dbg_printf("done\n");
     #endif
     
@@ -1000,14 +1004,25 @@ int FAST ev_to_raw(float ev)
 
 static void autodetect_black_level_calc(int x1, int x2, int y1, int y2, int dx, int dy, float* out_mean, float* out_stdev)
 {
+    /* we only unpack the part of each row that we are going to sample */
+    int xa = x1 & ~7;
+    int xb = (x2 + 7) & ~7;
+    uint16_t* line = SmallAlloc((xb - xa) * 2);
+    if (!line)
+    {
+        *out_mean = *out_stdev = 0;
+        return;
+    }
+    
     int black = 0;
     int num = 0;
     /* compute average level */
     for (int y = y1; y < y2; y += dy)
     {
+        raw_unpack_row(raw_info.buffer + y * raw_info.pitch + xa * 14/8, line, xb - xa);
         for (int x = x1; x < x2; x += dx)
         {
-            black += raw_get_pixel(x, y);
+            black += line[x - xa];
             num++;
         }
     }
@@ -1018,9 +1033,10 @@ static void autodetect_black_level_calc(int x1, int x2, int y1, int y2, int dx,
     float stdev = 0;
     for (int y = y1; y < y2; y += dy)
     {
+        raw_unpack_row(raw_info.buffer + y * raw_info.pitch + xa * 14/8, line, xb - xa);
         for (int x = x1; x < x2; x += dx)
         {
-            int dif = raw_get_pixel(x, y) - mean;
+            int dif = line[x - xa] - mean;
             stdev += dif * dif;
             
             #ifdef RAW_DEBUG_BLACK
@@ -1032,6 +1048,8 @@ static void autodetect_black_level_calc(int x1, int x2, int y1, int y2, int dx,
     stdev /= num;
     stdev = sqrtf(stdev);
     
+    SmallFree(line);
+    
     *out_mean = mean;
     *out_stdev = stdev;
 }
@@ -1143,6 +1161,48 @@ int raw_lv_settings_still_valid()
     return 1;
 }
 
+static struct raw_luts raw_luts;
+
+const struct raw_luts* raw_get_luts()
+{
+    static int black_level = -1;
+    static int white_level = -1;
+    static int dynamic_range = -1;
+
+    if (likely(
+            raw_info.black_level == black_level &&
+            raw_info.white_level == white_level &&
+            raw_info.dynamic_range == dynamic_range
+       ))
+    {
+        return &raw_luts;
+    }
+
+    /* this may be called from several tasks: build the tables first, and only then update the keys,
+     * so nobody gets the new keys with half-built tables (if two tasks rebuild them at once, they write the same values) */
+    int new_black = raw_info.black_level;
+    int new_white = raw_info.white_level;
+    int new_range = raw_info.dynamic_range;
+
+    for (int i = 0; i < 4096; i++)
+        raw_luts.hist[i] = COERCE((raw_to_ev(i*4) + 12) * (HIST_WIDTH-1) / 12, 0, HIST_WIDTH-1);
+
+    for (int i = 0; i < 1024; i++)
+    {
+        int g = (i > (new_black>>4)) ? log2f(i - (new_black>>4)) * 255 / 10 : 0;
+        raw_luts.gamma[i] = g * g / 255; /* idk, looks better this way */
+    }
+
+    raw_luts.underexposed = ev_to_raw(- (new_range - 100) / 100.0);
+
+    asm volatile("" : : : "memory");    /* tables before keys */
+    black_level = new_black;
+    white_level = new_white;
+    dynamic_range = new_range;
+
+    return &raw_luts;
+}
+
 static void FAST raw_preview_fast_work(void* raw_buffer, void* lv_buffer, int y1, int y2, int ultra_fast)
 {
     uint16_t* lv16 = CACHEABLE(lv_buffer);
@@ -1152,13 +1212,8 @@ static void FAST raw_preview_fast_work(void* raw_buffer, void* lv_buffer, int y1
     struct raw_pixblock * raw = CACHEABLE(raw_buffer);
     if (!raw) return;
     
-    uint8_t gamma[1024];
-    
-    for (int i = 0; i < 1024; i++)
-    {
-        int g = (i > (raw_info.black_level>>4)) ? log2f(i - (raw_info.black_level>>4)) * 255 / 10 : 0;
-        gamma[i] = g * g / 255; /* idk, looks better this way */
-    }
+    /* raw_info may come from a file (pic_view), so don't assume raw_update_params was called */
+    const uint8_t* gamma = raw_get_luts()->gamma;
     
     int x1 = BM2LV_X(os.x0);
     int x2 = BM2LV_X(os.x_max);
@@ -1174,6 +1229,11 @@ static void FAST raw_preview_fast_work(void* raw_buffer, void* lv_buffer, int y1
     for (int x = x1; x < x2; x++)
         lv2rx[x] = LV2RAW_X(x) & ~1;
 
+    /* in crop modes (at most 2 raw pixels for each LV pixel), it's faster to unpack the entire row */
+    uint16_t* line = 0;
+    if (!ultra_fast && lv2raw.sx <= 2048)
+        line = SmallAlloc(raw_info.width * 2);
+
     for (int y = y1; y < y2; y++)
     {
         int yr = LV2RAW_Y(y) | 1;
@@ -1203,6 +1263,16 @@ static void FAST raw_preview_fast_work(void* raw_buffer, void* lv_buffer, int y1
                 lv64[idx + vram_lv.pitch/8] = Y;
             }
         }
+        else if (line) /* full-res, from unpacked row */
+        {
+            raw_unpack_row(row, line, raw_info.width);
+            for (int x = x1; x < x2; x++)
+            {
+                int c = line[lv2rx[x]];
+                uint16_t Y = gamma[c >> 4];
+                lv16[LV(x,y)/2] = Y << 8;
+            }
+        }
         else /* prefer full-res, don't care if it's a little slower */
         {
             for (int x = x1; x < x2; x++)
@@ -1215,6 +1285,7 @@ static void FAST raw_preview_fast_work(void* raw_buffer, void* lv_buffer, int y1
         }
     }
     SmallFree(lv2rx);
+    if (line) SmallFree(line);
 }
 
 void FAST raw_preview_fast_ex(void* raw_buffer, void* lv_buffer, int y1, int y2, int ultra_fast)
@@ -110,6 +110,17 @@ int raw_blue_pixel_bright(int x, int y);
 float raw_to_ev(int raw);
 int ev_to_raw(float ev);
 
+/* lookup tables for the raw overlays, so they don't call log2f/powf for every pixel (or every frame) */
+struct raw_luts
+{
+    unsigned char hist[4096];       /* raw/4 => raw histogram bin (12 EV on HIST_WIDTH bins) */
+    unsigned char gamma[1024];      /* raw/16 => luma for the quick raw preview */
+    int underexposed;               /* raw level for underexposure zebras (dynamic range - 1 EV) */
+};
+
+/* the tables for the current raw_info; only rebuilt when black level, white level or dynamic range change */
+const struct raw_luts* raw_get_luts();
+
 /* save a DNG file; all parameters are taken from raw_info */
 int save_dng(char* filename);
 
@@ -0,0 +1,435 @@
+/**
+ * Row-level conversion between 14-bit packed RAW and 16-bit pixels
+ *
+ * The 14-byte raw_pixblock is easier to handle as 7 little-endian 16-bit words,
+ * with the 8 pixels stored MSB first (see raw.h):
+ *
+ *   w0 = a << 2  | b >> 12
+ *   w1 = b << 4  | c >> 10
+ *   w2 = c << 6  | d >> 8
+ *   w3 = d << 8  | e >> 6
+ *   w4 = e << 10 | f >> 4
+ *   w5 = f << 12 | g >> 2
+ *   w6 = g << 14 | h
+ *
+ * The C version is written for ARM (halfword loads, shifts folded into ORR) and is used on the camera.
+ * On x86, the SIMD versions are selected at runtime (no special compiler flags needed).
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include "raw_pack.h"
+
+#ifdef CONFIG_MAGICLANTERN
+#include "dryos.h"
+#else
+#define FAST
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define ABS(a) ((a) > 0 ? (a) : -(a))
+#endif
+
+void FAST raw_unpack_row_c(void* packed, uint16_t* out, int num_pixels)
+{
+    uint16_t* w = packed;
+    uint16_t* end = out + num_pixels;
+
+    for ( ; out < end; w += 7, out += 8)
+    {
+        uint32_t w0 = w[0];
+        uint32_t w1 = w[1];
+        uint32_t w2 = w[2];
+        uint32_t w3 = w[3];
+        uint32_t w4 = w[4];
+        uint32_t w5 = w[5];
+        uint32_t w6 = w[6];
+
+        out[0] = w0 >> 2;
+        out[1] = ((w0 << 12) | (w1 >> 4))  & 0x3FFF;
+        out[2] = ((w1 << 10) | (w2 >> 6))  & 0x3FFF;
+        out[3] = ((w2 << 8)  | (w3 >> 8))  & 0x3FFF;
+        out[4] = ((w3 << 6)  | (w4 >> 10)) & 0x3FFF;
+        out[5] = ((w4 << 4)  | (w5 >> 12)) & 0x3FFF;
+        out[6] = ((w5 << 2)  | (w6 >> 14)) & 0x3FFF;
+        out[7] = w6 & 0x3FFF;
+    }
+}
+
+void FAST raw_pack_row_c(uint16_t* in, void* packed, int num_pixels)
+{
+    uint16_t* w = packed;
+    uint16_t* end = in + num_pixels;
+
+    for ( ; in < end; w += 7, in += 8)
+    {
+        uint32_t a = in[0] & 0x3FFF;
+        uint32_t b = in[1] & 0x3FFF;
+        uint32_t c = in[2] & 0x3FFF;
+        uint32_t d = in[3] & 0x3FFF;
+        uint32_t e = in[4] & 0x3FFF;
+        uint32_t f = in[5] & 0x3FFF;
+        uint32_t g = in[6] & 0x3FFF;
+        uint32_t h = in[7] & 0x3FFF;
+
+        w[0] = (a << 2)  | (b >> 12);
+        w[1] = (b << 4)  | (c >> 10);
+        w[2] = (c << 6)  | (d >> 8);
+        w[3] = (d << 8)  | (e >> 6);
+        w[4] = (e << 10) | (f >> 4);
+        w[5] = (f << 12) | (g >> 2);
+        w[6] = (g << 14) | h;
+    }
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+
+#include <immintrin.h>
+
+/**
+ * SIMD trick: one raw_pixblock is loaded in a 128-bit register (8 words, the last one unused).
+ * Each output pixel is made of two neighbouring words, shifted by a different amount in each lane.
+ * SSE2 has no per-lane shifts, so we multiply by powers of two instead:
+ * mullo gives the left shift, mulhi (unsigned) gives the right shift.
+ *
+ * Loads and stores are 16 bytes wide, so the last block of each row is done in plain C,
+ * to avoid touching memory past the end of the row.
+ */
+
+/* unpack: out[i] = (w[i-1] << (16-r[i]) | w[i] >> r[i]) & 0x3FFF, r = 2,4,...,14,16 */
+#define UNPACK_MULHI 1<<14, 1<<12, 1<<10, 1<<8, 1<<6, 1<<4, 1<<2, 1
+#define UNPACK_MULLO 0,     1<<12, 1<<10, 1<<8, 1<<6, 1<<4, 1<<2, 1
+
+/* pack: w[k] = p[k] << (2k+2) | p[k+1] >> (12-2k); for k=6, the right shift is 0 and is handled separately */
+#define PACK_MULLO   1<<2, 1<<4, 1<<6, 1<<8, 1<<10, 1<<12, 1<<14, 0
+#define PACK_MULHI   1<<4, 1<<6, 1<<8, 1<<10, 1<<12, 1<<14, 0,    0
+#define PACK_LANE6   0, 0, 0, 0, 0, 0, -1, 0
+
+__attribute__((target("sse2")))
+void raw_unpack_row_sse2(void* packed, uint16_t* out, int num_pixels)
+{
+    uint8_t* src = packed;
+    int n = num_pixels / 8 - 1;
+
+    const __m128i mhi = _mm_setr_epi16(UNPACK_MULHI);
+    const __m128i mlo = _mm_setr_epi16(UNPACK_MULLO);
+    const __m128i mask = _mm_set1_epi16(0x3FFF);
+
+    for (int i = 0; i < n; i++)
+    {
+        __m128i w = _mm_loadu_si128((__m128i*)(src + i * 14));
+        __m128i prev = _mm_slli_si128(w, 2);
+        __m128i p = _mm_or_si128(_mm_mullo_epi16(prev, mlo), _mm_mulhi_epu16(w, mhi));
+        _mm_storeu_si128((__m128i*)(out + i * 8), _mm_and_si128(p, mask));
+    }
+
+    if (n >= 0)
+        raw_unpack_row_c(src + n * 14, out + n * 8, 8);
+}
+
+__attribute__((target("sse2")))
+void raw_pack_row_sse2(uint16_t* in, void* packed, int num_pixels)
+{
+    uint8_t* dst = packed;
+    int n = num_pixels / 8 - 1;
+
+    const __m128i mhi = _mm_setr_epi16(PACK_MULHI);
+    const __m128i mlo = _mm_setr_epi16(PACK_MULLO);
+    const __m128i lane6 = _mm_setr_epi16(PACK_LANE6);
+    const __m128i mask = _mm_set1_epi16(0x3FFF);
+
+    for (int i = 0; i < n; i++)
+    {
+        __m128i p = _mm_and_si128(_mm_loadu_si128((__m128i*)(in + i * 8)), mask);
+        __m128i next = _mm_srli_si128(p, 2);
+        __m128i lo = _mm_mullo_epi16(p, mlo);
+        __m128i hi = _mm_or_si128(_mm_mulhi_epu16(next, mhi), _mm_and_si128(next, lane6));
+
+        /* 2 bytes too many; they will be overwritten by the next block */
+        _mm_storeu_si128((__m128i*)(dst + i * 14), _mm_or_si128(lo, hi));
+    }
+
+    if (n >= 0)
+        raw_pack_row_c(in + n * 8, dst + n * 14, 8);
+}
+
+/* AVX2: same as SSE2, with two blocks at a time (one in each 128-bit lane) */
+
+__attribute__((target("avx2")))
+void raw_unpack_row_avx2(void* packed, uint16_t* out, int num_pixels)
+{
+    uint8_t* src = packed;
+    int n = (num_pixels / 8 - 1) & ~1;
+
+    const __m256i mhi = _mm256_setr_epi16(UNPACK_MULHI, UNPACK_MULHI);
+    const __m256i mlo = _mm256_setr_epi16(UNPACK_MULLO, UNPACK_MULLO);
+    const __m256i mask = _mm256_set1_epi16(0x3FFF);
+
+    for (int i = 0; i < n; i += 2)
+    {
+        __m128i w0 = _mm_loadu_si128((__m128i*)(src + i * 14));
+        __m128i w1 = _mm_loadu_si128((__m128i*)(src + i * 14 + 14));
+        __m256i w = _mm256_inserti128_si256(_mm256_castsi128_si256(w0), w1, 1);
+        __m256i prev = _mm256_slli_si256(w, 2);
+        __m256i p = _mm256_or_si256(_mm256_mullo_epi16(prev, mlo), _mm256_mulhi_epu16(w, mhi));
+        _mm256_storeu_si256((__m256i*)(out + i * 8), _mm256_and_si256(p, mask));
+    }
+
+    raw_unpack_row_c(src + n * 14, out + n * 8, num_pixels - n * 8);
+}
+
+__attribute__((target("avx2")))
+void raw_pack_row_avx2(uint16_t* in, void* packed, int num_pixels)
+{
+    uint8_t* dst = packed;
+    int n = (num_pixels / 8 - 1) & ~1;
+
+    const __m256i mhi = _mm256_setr_epi16(PACK_MULHI, PACK_MULHI);
+    const __m256i mlo = _mm256_setr_epi16(PACK_MULLO, PACK_MULLO);
+    const __m256i lane6 = _mm256_setr_epi16(PACK_LANE6, PACK_LANE6);
+    const __m256i mask = _mm256_set1_epi16(0x3FFF);
+
+    for (int i = 0; i < n; i += 2)
+    {
+        __m256i p = _mm256_and_si256(_mm256_loadu_si256((__m256i*)(in + i * 8)), mask);
+        __m256i next = _mm256_srli_si256(p, 2);
+        __m256i lo = _mm256_mullo_epi16(p, mlo);
+        __m256i hi = _mm256_or_si256(_mm256_mulhi_epu16(next, mhi), _mm256_and_si256(next, lane6));
+        __m256i w = _mm256_or_si256(lo, hi);
+
+        /* store the first block first; the second store overwrites its 2 extra bytes */
+        _mm_storeu_si128((__m128i*)(dst + i * 14), _mm256_castsi256_si128(w));
+        _mm_storeu_si128((__m128i*)(dst + i * 14 + 14), _mm256_extracti128_si256(w, 1));
+    }
+
+    raw_pack_row_c(in + n * 8, dst + n * 14, num_pixels - n * 8);
+}
+
+int raw_pack_have_avx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+static void (*unpack_func)(void* packed, uint16_t* out, int num_pixels) = 0;
+static void (*pack_func)(uint16_t* in, void* packed, int num_pixels) = 0;
+
+static void raw_pack_init()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        /* the AVX2 unpack is slower than the SSE2 one (rawbench), only the pack is faster */
+        unpack_func = raw_unpack_row_sse2;
+        pack_func = raw_pack_row_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        unpack_func = raw_unpack_row_sse2;
+        pack_func = raw_pack_row_sse2;
+    }
+    else
+    {
+        unpack_func = raw_unpack_row_c;
+        pack_func = raw_pack_row_c;
+    }
+}
+
+void raw_unpack_row(void* packed, uint16_t* out, int num_pixels)
+{
+    if (!unpack_func) raw_pack_init();
+    unpack_func(packed, out, num_pixels);
+}
+
+void raw_pack_row(uint16_t* in, void* packed, int num_pixels)
+{
+    if (!pack_func) raw_pack_init();
+    pack_func(in, packed, num_pixels);
+}
+
+#else
+
+void FAST raw_unpack_row(void* packed, uint16_t* out, int num_pixels)
+{
+    raw_unpack_row_c(packed, out, num_pixels);
+}
+
+void FAST raw_pack_row(uint16_t* in, void* packed, int num_pixels)
+{
+    raw_pack_row_c(in, packed, num_pixels);
+}
+
+#endif
+
+/**
+ * Reduced bit depth (raw_rec 12/10-bit modes)
+ * 
+ * 12-bit: 8 pixels in 6 words          10-bit: 8 pixels in 5 words
+ * 
+ *   w0 = a << 4  | b >> 8                w0 = a << 6  | b >> 4
+ *   w1 = b << 8  | c >> 4                w1 = b << 12 | c << 2 | d >> 8
+ *   w2 = c << 12 | d                     w2 = d << 8  | e >> 2
+ *   w3 = e << 4  | f >> 8                w3 = e << 14 | f << 4 | g >> 6
+ *   w4 = f << 8  | g >> 4                w4 = g << 10 | h
+ *   w5 = g << 12 | h
+ * 
+ * Conversion is fused: unpack 8 pixels in registers, look them up, pack them back.
+ * Each combination of bit depths gets its own loop, so the compiler can keep everything in registers.
+ */
+
+/* pedestal: number of codes below black level */
+static int raw_curve_pedestal(int bits)
+{
+    return 1 << (bits - 6);
+}
+
+void raw_curve_decode_table(uint16_t* table, int bits, int curve, int black, int white)
+{
+    int n = 1 << bits;
+    int ped = raw_curve_pedestal(bits);
+    int step = 1 << (14 - bits);
+    int cmax = n - 1 - ped;
+    int range = white - black;
+
+    if (range <= cmax)
+        curve = RAW_CURVE_LINEAR;
+
+    for (int c = 0; c < n; c++)
+    {
+        int x;
+        if (c < ped)
+        {
+            x = black - (ped - c) * step;
+        }
+        else if (curve == RAW_CURVE_SQRT)
+        {
+            /* x = c + c^2 * (range - cmax) / cmax^2: slope 1 at black level, x(cmax) = range */
+            int64_t k = c - ped;
+            int64_t cm2 = (int64_t) cmax * cmax;
+            x = black + k + (k * k * (range - cmax) + cm2 / 2) / cm2;
+        }
+        else
+        {
+            int k = c - ped;
+            x = black + (k * range + cmax / 2) / cmax;
+        }
+        table[c] = MIN(MAX(x, 0), 16383);
+    }
+}
+
+void raw_curve_encode_lut(uint16_t* lut, uint16_t* decode_table, int bits)
+{
+    /* the decode table is non-decreasing, so we can find the nearest code in a single sweep */
+    int n = 1 << bits;
+    int c = 0;
+    for (int x = 0; x < 16384; x++)
+    {
+        while (c + 1 < n && ABS(decode_table[c+1] - x) <= ABS(decode_table[c] - x))
+            c++;
+        lut[x] = c;
+    }
+}
+
+#define UNPACK8_14(w) \
+    uint32_t p0 = w[0] >> 2; \
+    uint32_t p1 = ((w[0] << 12) | (w[1] >> 4))  & 0x3FFF; \
+    uint32_t p2 = ((w[1] << 10) | (w[2] >> 6))  & 0x3FFF; \
+    uint32_t p3 = ((w[2] << 8)  | (w[3] >> 8))  & 0x3FFF; \
+    uint32_t p4 = ((w[3] << 6)  | (w[4] >> 10)) & 0x3FFF; \
+    uint32_t p5 = ((w[4] << 4)  | (w[5] >> 12)) & 0x3FFF; \
+    uint32_t p6 = ((w[5] << 2)  | (w[6] >> 14)) & 0x3FFF; \
+    uint32_t p7 = w[6] & 0x3FFF;
+
+#define UNPACK8_12(w) \
+    uint32_t p0 = w[0] >> 4; \
+    uint32_t p1 = ((w[0] << 8) | (w[1] >> 8))  & 0xFFF; \
+    uint32_t p2 = ((w[1] << 4) | (w[2] >> 12)) & 0xFFF; \
+    uint32_t p3 = w[2] & 0xFFF; \
+    uint32_t p4 = w[3] >> 4; \
+    uint32_t p5 = ((w[3] << 8) | (w[4] >> 8))  & 0xFFF; \
+    uint32_t p6 = ((w[4] << 4) | (w[5] >> 12)) & 0xFFF; \
+    uint32_t p7 = w[5] & 0xFFF;
+
+#define UNPACK8_10(w) \
+    uint32_t p0 = w[0] >> 6; \
+    uint32_t p1 = ((w[0] << 4) | (w[1] >> 12)) & 0x3FF; \
+    uint32_t p2 = (w[1] >> 2) & 0x3FF; \
+    uint32_t p3 = ((w[1] << 8) | (w[2] >> 8))  & 0x3FF; \
+    uint32_t p4 = ((w[2] << 2) | (w[3] >> 14)) & 0x3FF; \
+    uint32_t p5 = (w[3] >> 4) & 0x3FF; \
+    uint32_t p6 = ((w[3] << 6) | (w[4] >> 10)) & 0x3FF; \
+    uint32_t p7 = w[4] & 0x3FF;
+
+#define LOOKUP8(lut) \
+    p0 = lut[p0]; p1 = lut[p1]; p2 = lut[p2]; p3 = lut[p3]; \
+    p4 = lut[p4]; p5 = lut[p5]; p6 = lut[p6]; p7 = lut[p7];
+
+/* values from the LUT are already in range, so no masking is needed */
+#define PACK8_14(w) \
+    w[0] = (p0 << 2)  | (p1 >> 12); \
+    w[1] = (p1 << 4)  | (p2 >> 10); \
+    w[2] = (p2 << 6)  | (p3 >> 8); \
+    w[3] = (p3 << 8)  | (p4 >> 6); \
+    w[4] = (p4 << 10) | (p5 >> 4); \
+    w[5] = (p5 << 12) | (p6 >> 2); \
+    w[6] = (p6 << 14) | p7;
+
+#define PACK8_12(w) \
+    w[0] = (p0 << 4)  | (p1 >> 8); \
+    w[1] = (p1 << 8)  | (p2 >> 4); \
+    w[2] = (p2 << 12) | p3; \
+    w[3] = (p4 << 4)  | (p5 >> 8); \
+    w[4] = (p5 << 8)  | (p6 >> 4); \
+    w[5] = (p6 << 12) | p7;
+
+#define PACK8_10(w) \
+    w[0] = (p0 << 6)  | (p1 >> 4); \
+    w[1] = (p1 << 12) | (p2 << 2) | (p3 >> 8); \
+    w[2] = (p3 << 8)  | (p4 >> 2); \
+    w[3] = (p4 << 14) | (p5 << 4) | (p6 >> 6); \
+    w[4] = (p6 << 10) | p7;
+
+/* all pixels are read before writing anything, so dst may overlap src if it doesn't run ahead of it */
+#define REPACK_FUNC(src_bits, dst_bits) \
+static void FAST raw_repack_##src_bits##_##dst_bits(uint16_t* src, uint16_t* dst, uint16_t* lut, int num_pixels) \
+{ \
+    for (int i = 0; i < num_pixels; i += 8, src += src_bits/2, dst += dst_bits/2) \
+    { \
+        UNPACK8_##src_bits(src) \
+        LOOKUP8(lut) \
+        PACK8_##dst_bits(dst) \
+    } \
+}
+
+REPACK_FUNC(14, 12)
+REPACK_FUNC(14, 10)
+REPACK_FUNC(12, 14)
+REPACK_FUNC(10, 14)
+
+int raw_repack_row(void* src, int src_bits, void* dst, int dst_bits, uint16_t* lut, int num_pixels)
+{
+    switch (src_bits * 100 + dst_bits)
+    {
+        case 1412: raw_repack_14_12(src, dst, lut, num_pixels); return 1;
+        case 1410: raw_repack_14_10(src, dst, lut, num_pixels); return 1;
+        case 1214: raw_repack_12_14(src, dst, lut, num_pixels); return 1;
+        case 1014: raw_repack_10_14(src, dst, lut, num_pixels); return 1;
+    }
+    return 0;
+}
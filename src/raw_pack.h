@@ -0,0 +1,83 @@
+/**
+ * Row-level conversion between 14-bit packed RAW (struct raw_pixblock) and 16-bit pixels,
+ * and between 14-bit and reduced bit depth (12/10-bit) packed RAW (raw_rec)
+ *
+ * Shared by raw.c (camera) and the desktop tools (raw2dng & co).
+ * Prefer these over raw_get_pixel/raw_set_pixel when processing whole rows.
+ **/
+
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _raw_pack_h_
+#define _raw_pack_h_
+
+#include <stdint.h>
+
+/* num_pixels must be a multiple of 8 (one raw_pixblock = 8 pixels = 14 bytes) */
+
+/* 14-bit packed => 16-bit */
+void raw_unpack_row(void* packed, uint16_t* out, int num_pixels);
+
+/* 16-bit => 14-bit packed; input values are truncated to 14 bits */
+void raw_pack_row(uint16_t* in, void* packed, int num_pixels);
+
+/* plain C versions, always available (reference for the optimized ones) */
+void raw_unpack_row_c(void* packed, uint16_t* out, int num_pixels);
+void raw_pack_row_c(uint16_t* in, void* packed, int num_pixels);
+
+#if defined(__i386__) || defined(__x86_64__)
+/* x86 versions; raw_unpack_row/raw_pack_row pick the best one at runtime */
+void raw_unpack_row_sse2(void* packed, uint16_t* out, int num_pixels);
+void raw_pack_row_sse2(uint16_t* in, void* packed, int num_pixels);
+void raw_unpack_row_avx2(void* packed, uint16_t* out, int num_pixels);
+void raw_pack_row_avx2(uint16_t* in, void* packed, int num_pixels);
+int raw_pack_have_avx2();
+#endif
+
+/**
+ * Reduced bit depth (12 or 10 bits per pixel)
+ * 
+ * Same layout as raw_pixblock: 8 pixels in 6 (12-bit) or 5 (10-bit) little-endian 16-bit words, MSB first.
+ * 
+ * The 14-bit values are mapped to N-bit codes with a curve that depends only on (bits, curve, black, white),
+ * so the camera and the PC tools build exactly the same tables:
+ * - a few codes below black level (2^(14-N) units per code), to keep the noise floor centered;
+ * - from black to white: linear, or a square root (log-ish) curve, that keeps all the shadow levels
+ *   and uses coarser steps in highlights, where they are hidden by photon noise.
+ */
+
+#define RAW_CURVE_LINEAR 0
+#define RAW_CURVE_SQRT   1
+
+/* N-bit code => 14-bit value; table has 1 << bits entries */
+void raw_curve_decode_table(uint16_t* table, int bits, int curve, int black, int white);
+
+/* 14-bit value => nearest N-bit code (from the decode table); lut has 16384 entries */
+void raw_curve_encode_lut(uint16_t* lut, uint16_t* decode_table, int bits);
+
+/**
+ * Convert packed data between bit depths (14 => 12/10 with an encode LUT, 12/10 => 14 with a decode table).
+ * num_pixels must be a multiple of 8; in-place operation is OK when dst_bits <= src_bits.
+ * Returns 0 if the conversion is not supported.
+ */
+int raw_repack_row(void* src, int src_bits, void* dst, int dst_bits, uint16_t* lut, int num_pixels);
+
+#endif
@@ -1569,7 +1569,7 @@ static void silent_pic_save_dng(char* filename, void* buffer)
     bmp_printf(FONT_MED, 0, 60, "Saving %d x %d...", raw_info.jpeg.width, raw_info.jpeg.height);
 
     #ifdef FEATURE_POST_DEFLICKER
-    /* this must be computed before saving, because save_dng will scramble the bytes */
+    /* post-deflicker correction, from the raw histogram */
     float correction = 0;
     if (post_deflicker)
     {
@@ -54,6 +54,7 @@ void update_vram_params();
 // cached LUTs for BM2LV-like macros
 
 int bm2lv_x_cache[BMP_W_PLUS - BMP_W_MINUS];
+int bm2lv_r_cache[BMP_H_PLUS - BMP_H_MINUS];
 //~ int bm2n_x_cache [BMP_W_PLUS - BMP_W_MINUS];
 //~ int bm2hd_r_cache[BMP_H_PLUS - BMP_H_MINUS];
 int y_times_BMPPITCH_cache[BMP_H_PLUS - BMP_H_MINUS];
@@ -68,6 +69,7 @@ static void vram_update_luts()
 
     for (int y = BMP_H_MINUS; y < BMP_H_PLUS; y++) 
     {
+        bm2lv_r_cache[y - BMP_H_MINUS] = BM2LV_R(y);
         //~ bm2hd_r_cache[y - BMP_H_MINUS] = BM2HD_Ru(y);
         y_times_BMPPITCH_cache[y - BMP_H_MINUS] = y * BMPPITCH;
     }
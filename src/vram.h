@@ -168,6 +168,9 @@ extern int bm2lv_x_cache[];
 #define BM2HD_R(y) (BM2HD_Y(y) * vram_hd.pitch)
 #define HD2BM_R(y) (HD2BM_Y(y) * BMPPITCH     )
 
+extern int bm2lv_r_cache[];
+#define BM2LV_Rc(y) bm2lv_r_cache[(y) - BMP_H_MINUS]
+
 //~ extern int bm2hd_r_cache[];
 //~ #define BM2HD_Rc(y) bm2hd_r_cache[y - BMP_H_MINUS]
 
@@ -37,6 +37,7 @@
 #include "imgconv.h"
 #include "falsecolor.h"
 #include "histogram.h"
+#include "zebra_kernels.h"
 
 #if defined(FEATURE_RAW_HISTOGRAM) || defined(FEATURE_RAW_ZEBRAS) || defined(FEATURE_RAW_SPOTMETER)
 #define FEATURE_RAW_OVERLAYS
@@ -68,10 +69,7 @@ static void transparent_overlay_offset_clear(void* priv, int delta);
 static void schedule_transparent_overlay();
 //~ static void defish_draw();
 //~ static void defish_draw_lv_color();
-static int zebra_color_word_row(int c, int y);
 static void spotmeter_step();
-static int zebra_rgb_color(int underexposed, int clipR, int clipG, int clipB, int y);
-static int zebra_rgb_solid_color(int underexposed, int clipR, int clipG, int clipB);
 
 static void cropmark_cache_update_signature();
 static int cropmark_cache_is_valid();
@@ -88,6 +86,8 @@ void lens_display_set_dirty();
 void cropmark_clear_cache();
 void draw_histogram_and_waveform(int);
 void update_disp_mode_bits_from_params();
+int get_ms_clock_value();
+uint64_t get_us_clock_value();
 //~ void uyvy2yrgb(uint32_t , int* , int* , int* , int* );
 int toggle_disp_mode();
 static void toggle_disp_mode_menu(void *priv, int delta);
@@ -186,6 +186,7 @@ static CONFIG_INT( "zebra.colorspace",    zebra_colorspace,   2 );// luma/rgb/lu
 static CONFIG_INT( "zebra.thr.hi",    zebra_level_hi, 99 );
 static CONFIG_INT( "zebra.thr.lo",    zebra_level_lo, 0 );
 static CONFIG_INT( "zebra.rec", zebra_rec,  1 );
+static CONFIG_INT( "zebra.budget", zebra_budget, 0 ); // CPU time for each refresh: OFF, 1, 2, 5, 10 ms
 static CONFIG_INT( "crop.enable",   crop_enabled,   0 ); // index of crop file
 static CONFIG_INT( "crop.index",    crop_index, 0 ); // index of crop file
 static CONFIG_INT( "crop.movieonly", cropmark_movieonly, 0);
@@ -382,6 +383,35 @@ static CONFIG_INT("idle.blink", idle_blink, 1);
 static uint8_t* bvram_mirror_start = 0;
 static uint8_t* bvram_mirror = 0;
 uint8_t* get_bvram_mirror() { return bvram_mirror; }
+
+/* what the overlay kernels (zebra_kernels.c) need to know about the image buffers */
+static void overlay_vram_get(struct overlay_vram * v, uint8_t * bvram)
+{
+    v->lv = get_yuv422_vram()->vram;
+    v->lv_pitch = vram_lv.pitch;
+    v->bmp = bvram;
+    v->mirror = bvram_mirror;
+    v->bmp_pitch = BMPPITCH;
+    v->bmp_h = BMP_H_PLUS;
+    v->x0 = os.x0;
+    v->y0 = os.y0;
+    v->x_max = os.x_max;
+    v->y_max = os.y_max;
+    v->bm2lv_x = bm2lv_x_cache - BMP_W_MINUS;
+    v->bm2lv_sy = bm2lv.sy;
+    v->bm2lv_ty = bm2lv.ty;
+    v->bm2lv_r = bm2lv_r_cache - BMP_H_MINUS;
+    v->raw = raw_info.buffer;
+    v->raw_width = raw_info.width;
+    v->raw_x1 = raw_info.active_area.x1;
+    v->raw_y1 = raw_info.active_area.y1;
+    v->raw_x2 = raw_info.active_area.x2;
+    v->raw_y2 = raw_info.active_area.y2;
+    v->lv2raw_sx = lv2raw.sx;
+    v->lv2raw_tx = lv2raw.tx;
+    v->lv2raw_sy = lv2raw.sy;
+    v->lv2raw_ty = lv2raw.ty;
+}
 //~ #define bvram_mirror bmp_vram_idle()
 
 
@@ -468,8 +498,6 @@ int get_global_draw_setting() // whatever is set in menu
  * 128 levels
  */
 static uint8_t* waveform = 0;
-#define WAVEFORM_UNSAFE(x,y) (waveform[(x) + (y) * WAVEFORM_WIDTH])
-#define WAVEFORM(x,y) (waveform[COERCE((x), 0, WAVEFORM_WIDTH-1) + COERCE((y), 0, WAVEFORM_HEIGHT-1) * WAVEFORM_WIDTH])
 
 #ifdef FEATURE_VECTORSCOPE
 
@@ -549,65 +577,6 @@ vectorscope_init()
     }
 }
 
-static int vectorscope_coord_uv_to_pos(int U, int V)
-{
-    /* convert YUV to vectorscope position */
-    V *= vectorscope_height;
-    V >>= 8;
-    V += vectorscope_height >> 1;
-
-    U *= vectorscope_width;
-    U >>= 8;
-    U += vectorscope_width >> 1;
-
-    int pos = U + V * vectorscope_width;
-    
-    return pos;
-}
-
-static void
-vectorscope_addpixel(uint8_t y, int8_t u, int8_t v)
-{
-    if(vectorscope == NULL)
-    {
-        return;
-    }
-    
-    int V = -v << vectorscope_gain;
-    int U = u << vectorscope_gain;
-    
-    int r = U*U + V*V;
-    const int r_sqrt = (int)sqrtf(r);
-    if (r > 124*124)
-    {
-        /* almost out of circle, mark it with red */
-        for (int R = 124; R < 128; R++)
-        {
-            int c = U * R / r_sqrt;
-            int s = V * R / r_sqrt;
-            int pos = vectorscope_coord_uv_to_pos(c, s);
-            vectorscope[pos] = 255 - COLOR_RED;
-        }
-    }
-    else
-    {
-        if (vectorscope_gain)
-        {
-            /* simulate better resolution */
-            U += rand()%2;
-            V += rand()%2;
-        }
-        
-        int pos = vectorscope_coord_uv_to_pos(U, V);
-        
-        /* increase luminance at this position. when reaching 4*0x2A, we are at maximum. */
-        if(vectorscope[pos] < (0x2A << 2))
-        {
-            vectorscope[pos]++;
-        }
-    }
-}
-
 /* memcpy the second part of vectorscope buffer. uses only few resources */
 static void
 vectorscope_draw_image(uint32_t x_origin, uint32_t y_origin)
@@ -723,22 +692,26 @@ static MENU_UPDATE_FUNC(vectorscope_update)
  */
 
 #if defined(FEATURE_HISTOGRAM) || defined(FEATURE_WAVEFORM) || defined(FEATURE_VECTORSCOPE)
-void // fixme: should be static
-hist_build()
-{
-    struct vram_info * lv = get_yuv422_vram();
-    uint32_t* buf = (uint32_t*)lv->vram;
 
-    int x,y;
+/* clear histogram, waveform and vectorscope, and tell the kernels where to put them */
+static void hist_setup_scopes(struct overlay_scopes * s)
+{
+    memset(s, 0, sizeof(*s));
+    s->skip_mz = nondigic_zoom_overlay_enabled();
 
     #ifdef FEATURE_HISTOGRAM
     memset(&histogram, 0, sizeof(histogram));
+    s->hist = &histogram;
+    s->hist_rgb = (hist_colorspace == 1 && !EXT_MONITOR_RCA);
     #endif
 
     #ifdef FEATURE_WAVEFORM
     if (waveform_draw)
     {
         waveform_init();
+        s->waveform = waveform;
+        s->waveform_w = WAVEFORM_WIDTH;
+        s->waveform_h = WAVEFORM_HEIGHT;
     }
     #endif
     
@@ -747,80 +720,38 @@ hist_build()
     {
         vectorscope_init();
         vectorscope_clear();
+        s->vectorscope = vectorscope;
+        s->vectorscope_w = vectorscope_width;
+        s->vectorscope_h = vectorscope_height;
+        s->vectorscope_gain = vectorscope_gain;
     }
     #endif
-    
-    int mz = nondigic_zoom_overlay_enabled();
-    int off = get_y_skip_offset_for_histogram();
-    int yoffset = 0;
-    for( y = os.y0 + off, yoffset = y * vram_lv.pitch; y < os.y_max - off; y += 2, yoffset += vram_lv.pitch )
-    {
-        for( x = os.x0 ; x < os.x_max ; x += 2 )
-        {
-            uint32_t pixel = buf[(yoffset + (BM2LV_X(x) << 1)) >> 2];
-
-            // ignore magic zoom borders
-            if (mz && (pixel == MZ_WHITE || pixel == MZ_BLACK || pixel == MZ_GREEN))
-                continue;
-
-            int Y;
-
-            #ifdef FEATURE_HISTOGRAM
-            if (hist_colorspace == 1 && !EXT_MONITOR_RCA) // rgb
-            {
-                int R, G, B;
-                //~ uyvy2yrgb(pixel, &Y, &R, &G, &B);
-                COMPUTE_UYVY2YRGB(pixel, Y, R, G, B);
-                // YRGB range: 0-255
-                uint32_t R_level = (R * HIST_WIDTH) >> 8;
-                uint32_t G_level = (G * HIST_WIDTH) >> 8;
-                uint32_t B_level = (B * HIST_WIDTH) >> 8;
-                
-                histogram.hist_r[R_level & (HIST_WIDTH-1)]++;
-                histogram.hist_g[G_level & (HIST_WIDTH-1)]++;
-                histogram.hist_b[B_level & (HIST_WIDTH-1)]++;
-            }
-            else // luma
-            #endif
-
-            #if defined(FEATURE_HISTOGRAM) || defined(FEATURE_WAVEFORM)
-            {
-                uint32_t p1 = ((pixel >> 16) & 0xFF00) >> 8;
-                uint32_t p2 = ((pixel >>  0) & 0xFF00) >> 8;
-                Y = (p1+p2) >> 1; 
-            }
-            #endif
+}
 
-            #ifdef FEATURE_HISTOGRAM
-            histogram.total_px++;
-            uint32_t hist_level = (Y * HIST_WIDTH) >> 8;
+void // fixme: should be static
+hist_build()
+{
+    struct overlay_vram v;
+    overlay_vram_get(&v, 0);
 
-            // Ignore the 0 bin.  It generates too much noise
-            unsigned count = ++ (histogram.hist[ hist_level & (HIST_WIDTH-1)]);
-            if( hist_level && count > histogram.max )
-                histogram.max = count;
-            #endif
-            
-            #ifdef FEATURE_WAVEFORM
-            // Update the waveform plot
-            if (waveform_draw) 
-            {
-                uint8_t* w = &WAVEFORM(((x-os.x0) * WAVEFORM_WIDTH) / os.x_ex, (Y * WAVEFORM_HEIGHT) >> 8);
-                if ((*w) < 250) (*w)++;
-            }
-            #endif
-            
-            #ifdef FEATURE_VECTORSCOPE
-            if (vectorscope_draw)
-            {
-                int8_t U = (pixel >>  0) & 0xFF;
-                int8_t V = (pixel >> 16) & 0xFF;
-                vectorscope_addpixel(Y, U, V);
-            }
-            #endif
-        }
-    }
+    struct overlay_scopes s;
+    hist_setup_scopes(&s);
+    overlay_hist_build(&v, get_y_skip_offset_for_histogram(), &s);
 }
+
+/**
+ * When the zebras are on, the scopes are computed by the zebras, in the same pass over the LV image
+ * (see draw_zebras); the low priority task only draws them.
+ * 
+ * Handshake: draw_histogram_and_waveform asks for a new set (SCOPES_WANTED) after it's done drawing,
+ * and only the zebras may fill the buffers while it's in that state. If the zebras didn't deliver them
+ * recently (turned off, fast zebras, raw zebras, not refreshed...), hist_build does it as before.
+ */
+#define SCOPES_BUSY     0   /* the low priority task is using (or building) them */
+#define SCOPES_WANTED   1   /* the zebras may compute the next set */
+#define SCOPES_READY    2   /* computed by the zebras, at scopes_fused_time */
+static volatile int scopes_fused_state = SCOPES_BUSY;
+static volatile int scopes_fused_time = 0;
 #endif
 
 #ifdef FEATURE_RAW_OVERLAYS
@@ -863,6 +794,77 @@ int can_use_raw_overlays_menu()
 
 #endif
 
+#ifdef FEATURE_ZEBRA
+
+/* CPU time for each zebra refresh, in microseconds (0 = draw everything at once) */
+static int zebra_budget_us()
+{
+    static const int budgets[] = { 0, 1000, 2000, 5000, 10000 };
+    return lv ? budgets[COERCE(zebra_budget, 0, COUNT(budgets) - 1)] : 0;
+}
+
+struct zebra_params
+{
+    int raw;                /* from the RAW buffer (hi = white level, lo = underexposed) or from the LV image */
+    int hi, lo;
+    int rgb;
+};
+
+static struct overlay_tiles zebra_tiles = {
+    .threshold = 8,
+};
+
+static void zebra_draw_area(const struct overlay_vram * v, int y_skip, struct zebra_params * p)
+{
+    #ifdef FEATURE_RAW_ZEBRAS
+    if (p->raw)
+    {
+        overlay_zebras_raw_lv(v, y_skip, p->hi, p->lo);
+        return;
+    }
+    #endif
+
+    overlay_zebras_yuv(v, y_skip, p->hi, p->lo, p->rgb);
+}
+
+/* draw the zebras on the whole overlay area, or, with a CPU budget, only on as many tiles as it allows */
+static void zebra_refresh(const struct overlay_vram * v, struct zebra_params * p)
+{
+    int y_skip = get_y_skip_offset_for_overlays();
+    int budget = zebra_budget_us();
+    if (!budget)
+    {
+        zebra_draw_area(v, y_skip, p);
+        return;
+    }
+
+    /* tiles drawn with other settings are out of date */
+    static struct zebra_params prev;
+    if (memcmp(p, &prev, sizeof(prev)))
+    {
+        overlay_tiles_reset(&zebra_tiles);
+        prev = *p;
+    }
+
+    overlay_tiles_update(&zebra_tiles, v, y_skip);
+
+    /* at least one tile each time, changed tiles first (see overlay_tiles_next) */
+    uint64_t t0 = get_us_clock_value();
+    int i;
+    while ((i = overlay_tiles_next(&zebra_tiles)) >= 0)
+    {
+        struct overlay_vram tile;
+        overlay_tiles_get(&zebra_tiles, v, i, &tile);
+        zebra_draw_area(&tile, 0, p);
+        overlay_tiles_done(&zebra_tiles, i);
+
+        if ((int)(get_us_clock_value() - t0) >= budget)
+            break;
+    }
+}
+
+#endif
+
 #ifdef FEATURE_RAW_ZEBRAS
 
 static CONFIG_INT("raw.zebra", raw_zebra_enable, 1);
@@ -875,7 +877,7 @@ static void FAST draw_zebras_raw()
     if (!bvram) return;
 
     int white = raw_info.white_level;
-    int underexposed = ev_to_raw(- (raw_info.dynamic_range - 100) / 100.0);
+    int underexposed = raw_get_luts()->underexposed;
 
     for (int i = os.y0; i < os.y_max; i ++)
     {
@@ -944,50 +946,17 @@ static void FAST draw_zebras_raw_lv()
 
     int white = raw_info.white_level;
     if (white > 16383) white = 15000;
-    int underexposed = ev_to_raw(- (raw_info.dynamic_range - 100) / 100.0);
+    int underexposed = raw_get_luts()->underexposed;
 
-    int off = get_y_skip_offset_for_overlays();
-    for(int i = os.y0 + off; i < os.y_max - off; i += 2 )
-    {
-        uint64_t * const b_row = (uint64_t*)( bvram        + BM_R(i)       );  // 2 pixels
-        uint64_t * const m_row = (uint64_t*)( bvram_mirror + BM_R(i)       );  // 2 pixels
-        
-        uint64_t* bp;  // through bmp vram
-        uint64_t* mp;  // through mirror
+    struct overlay_vram v;
+    overlay_vram_get(&v, bvram);
 
-        int y = BM2RAW_Y(i);
-        if (y < raw_info.active_area.y1 || y > raw_info.active_area.y2) continue;
-        
-        for (int j = os.x0; j < os.x_max; j += 8)
-        {
-            bp = b_row + j/8;
-            mp = m_row + j/8;
-            
-            #define BP (*bp)
-            #define MP (*mp)
-            
-            if (BP != 0 && BP != MP) { little_cleanup(bp, mp); continue; }
-            if ((MP & 0x80808080)) continue;
-            
-            int x = BM2RAW_X(j);
-            
-            if (x < raw_info.active_area.x1 || x > raw_info.active_area.x2) continue;
-            
-            /* for dual ISO: use dark lines for overexposure and bright lines for underexposure */
-            int r = raw_red_pixel_dark(x, y);
-            int g = raw_green_pixel_dark(x, y);
-            int b = raw_blue_pixel_dark(x, y);
-            int u = raw_green_pixel_bright(x, y);
-
-            uint64_t c = zebra_rgb_solid_color(u <= underexposed, r > white, g > white, b > white);
-            c = c | (c << 32);
-
-            MP = BP = c;
-
-            #undef BP
-            #undef MP
-        }
-    }
+    struct zebra_params p = {
+        .raw = 1,
+        .hi = white,
+        .lo = underexposed,
+    };
+    zebra_refresh(&v, &p);
 }
 
 static MENU_UPDATE_FUNC(raw_zebra_update)
@@ -1032,47 +1001,6 @@ int get_under_and_over_exposure(int thr_lo, int thr_hi, int* under, int* over)
     return total;
 }
 
-#ifdef FEATURE_ZEBRA
-#define ZEBRA_COLOR_WORD_SOLID(x) ( (x) | (x)<<8 | (x)<<16 | (x)<<24 )
-static int zebra_rgb_color(int underexposed, int clipR, int clipG, int clipB, int y)
-{
-    if (underexposed) return zebra_color_word_row(79, y);
-    
-    switch ((clipR ? 4 : 0) |
-            (clipG ? 2 : 0) |
-            (clipB ? 1 : 0))
-    {
-        case 0b111: return ZEBRA_COLOR_WORD_SOLID(COLOR_BLACK);
-        case 0b110: return ZEBRA_COLOR_WORD_SOLID(COLOR_YELLOW);
-        case 0b101: return ZEBRA_COLOR_WORD_SOLID(COLOR_MAGENTA);
-        case 0b011: return ZEBRA_COLOR_WORD_SOLID(COLOR_CYAN);
-        case 0b100: return y&2 ? 0 : ZEBRA_COLOR_WORD_SOLID(COLOR_RED);
-        case 0b001: return y&2 ? 0 : ZEBRA_COLOR_WORD_SOLID(COLOR_BLUE);
-        case 0b010: return y&2 ? 0 : ZEBRA_COLOR_WORD_SOLID(COLOR_GREEN2);
-        default: return 0;
-    }
-}
-
-static int zebra_rgb_solid_color(int underexposed, int clipR, int clipG, int clipB)
-{
-    if (underexposed) return ZEBRA_COLOR_WORD_SOLID(79);
-    
-    switch ((clipR ? 4 : 0) |
-            (clipG ? 2 : 0) |
-            (clipB ? 1 : 0))
-    {
-        case 0b111: return ZEBRA_COLOR_WORD_SOLID(COLOR_BLACK);
-        case 0b110: return ZEBRA_COLOR_WORD_SOLID(COLOR_YELLOW);
-        case 0b101: return ZEBRA_COLOR_WORD_SOLID(COLOR_MAGENTA);
-        case 0b011: return ZEBRA_COLOR_WORD_SOLID(COLOR_CYAN);
-        case 0b100: return ZEBRA_COLOR_WORD_SOLID(COLOR_RED);
-        case 0b001: return ZEBRA_COLOR_WORD_SOLID(COLOR_BLUE);
-        case 0b010: return ZEBRA_COLOR_WORD_SOLID(COLOR_GREEN2);
-        default: return 0;
-    }
-}
-#endif
-
 #ifdef FEATURE_WAVEFORM
 /** Draw the waveform image into the bitmap framebuffer.
  *
@@ -1098,76 +1026,13 @@ waveform_draw_image(
     
     uint8_t * const bvram = bmp_vram();
     if (!bvram) return;
-    unsigned pitch = BMPPITCH;
     if( histogram.max == 0 )
         histogram.max = 1;
 
-    int i, y;
-
-    // vertical line up to the hist size
-    for (int k = 0; k < WAVEFORM_FACTOR; k++)
-    {
-        for( y=WAVEFORM_HEIGHT-1 ; y>=0 ; y-- )
-        {
-            int y_bmp = y_origin + y * height / WAVEFORM_HEIGHT + k;
-            if (y_bmp < 0) continue;
-            if (y_bmp >= BMP_H_PLUS) continue;
-
-            uint8_t * row = bvram + x_origin + y_bmp * pitch;
-            //int y_next = (y-1) * height / WAVEFORM_HEIGHT;
-            uint32_t pixel = 0;
-            int w = WAVEFORM_WIDTH*WAVEFORM_FACTOR;
-            for( i=0 ; i<w; i++ )
-            {
-                uint32_t count = WAVEFORM_UNSAFE( i / WAVEFORM_FACTOR, WAVEFORM_HEIGHT - y - 1);
-                if (height < WAVEFORM_HEIGHT)
-                { // smooth it a bit to reduce aliasing; not perfect, but works.. sort of
-                    count += WAVEFORM_UNSAFE( i / WAVEFORM_FACTOR, WAVEFORM_HEIGHT - y - 1);
-                    //~ count /= 2;
-                }
-                // Scale to a grayscale
-                count = (count * 42) >> 7;
-                if( count > 42 - 5 )
-                    count = COLOR_RED;
-                else
-                if( count >  0 )
-                    count += 38 + 5;
-                else
-                // Draw a series of colored scales
-                if( y == (WAVEFORM_HEIGHT*1)>>2 )
-                    count = COLOR_BLUE;
-                else
-                if( y == (WAVEFORM_HEIGHT*2)>>2 )
-                    count = 0xE; // pink
-                else
-                if( y == (WAVEFORM_HEIGHT*3)>>2 )
-                    count = COLOR_BLUE;
-                else
-                    count = waveform_bg; // transparent
-
-                pixel |= (count << ((i & 3)<<3));
-
-                if( (i & 3) != 3 )
-                    continue;
-
-                // Draw the pixel, rounding down to the nearest
-                // quad word write (and then nop to avoid err70).
-                *(uint32_t*) ALIGN32(row + i) = pixel;
-                #ifdef CONFIG_500D // err70?!
-                asm( "nop" );
-                asm( "nop" );
-                asm( "nop" );
-                asm( "nop" );
-                asm( "nop" );
-                asm( "nop" );
-                asm( "nop" );
-                asm( "nop" );
-                #endif
-                pixel = 0;
-            }
-        }
-        bmp_draw_rect(60, x_origin-1, y_origin-1, WAVEFORM_WIDTH*WAVEFORM_FACTOR+1, height+1);
-    }
+    struct overlay_vram v;
+    overlay_vram_get(&v, bvram);
+    overlay_waveform_draw(&v, waveform, WAVEFORM_WIDTH, WAVEFORM_HEIGHT, WAVEFORM_FACTOR, waveform_bg, x_origin, y_origin, height);
+    bmp_draw_rect(60, x_origin-1, y_origin-1, WAVEFORM_WIDTH*WAVEFORM_FACTOR+1, height+1);
 }
 #endif
 
@@ -1289,31 +1154,6 @@ static int get_focus_color(int thr, int d)
 }
 #endif
 
-#ifdef FEATURE_ZEBRA
-static inline int zebra_color_word_row(int c, int y)
-{
-    if (!c) return 0;
-    
-    uint32_t cw = 0;
-    switch(y % 4)
-    {
-        case 0:
-            cw  = c  | c  << 8;
-            break;
-        case 1:
-            cw  = c << 8 | c << 16;
-            break;
-        case 2:
-            cw = c  << 16 | c << 24;
-            break;
-        case 3:
-            cw  = c  << 24 | c ;
-            break;
-    }
-    return cw;
-}
-#endif
-
 #ifdef FEATURE_FOCUS_PEAK
 
 #define MAX_DIRTY_PIXELS 5000
@@ -1455,161 +1295,34 @@ static void draw_zebras( int Z )
         }
         #endif
         
-        uint8_t * lvram = get_yuv422_vram()->vram;
-
-        int zlr = zlh;
-        int zlg = zlh;
-        int zlb = zlh;
+        struct overlay_vram v;
+        overlay_vram_get(&v, bvram);
 
-        // draw zebra in 16:9 frame
-        // y is in BM coords
-        int off = get_y_skip_offset_for_overlays();
-        for(int y = os.y0 + off; y < os.y_max - off; y += 2 )
+        #if defined(FEATURE_HISTOGRAM) || defined(FEATURE_WAVEFORM) || defined(FEATURE_VECTORSCOPE)
+        if (lv && scopes_fused_state == SCOPES_WANTED && !zebra_budget_us())
         {
-            #define color_over           zebra_color_word_row(COLOR_RED,  y)
-            #define color_under          zebra_color_word_row(COLOR_BLUE, y)
-            #define color_over_2         zebra_color_word_row(COLOR_RED,  y+1)
-            #define color_under_2        zebra_color_word_row(COLOR_BLUE, y+1)
-            
-            #define color_rgb_under      zebra_rgb_color(1, 0, 0, 0, y)
-            #define color_rgb_under_2    zebra_rgb_color(1, 0, 0, 0, y+1)
-            
-            #define color_rgb_clipR      zebra_rgb_color(0, 1, 0, 0, y)
-            #define color_rgb_clipR_2    zebra_rgb_color(0, 1, 0, 0, y+1)
-            #define color_rgb_clipG      zebra_rgb_color(0, 0, 1, 0, y)
-            #define color_rgb_clipG_2    zebra_rgb_color(0, 0, 1, 0, y+1)
-            #define color_rgb_clipB      zebra_rgb_color(0, 0, 0, 1, y)
-            #define color_rgb_clipB_2    zebra_rgb_color(0, 0, 0, 1, y+1)
-            
-            #define color_rgb_clipRG     zebra_rgb_color(0, 1, 1, 0, y)
-            #define color_rgb_clipRG_2   zebra_rgb_color(0, 1, 1, 0, y+1)
-            #define color_rgb_clipGB     zebra_rgb_color(0, 0, 1, 1, y)
-            #define color_rgb_clipGB_2   zebra_rgb_color(0, 0, 1, 1, y+1)
-            #define color_rgb_clipRB     zebra_rgb_color(0, 1, 0, 1, y)
-            #define color_rgb_clipRB_2   zebra_rgb_color(0, 1, 0, 1, y+1)
-            
-            #define color_rgb_clipRGB    zebra_rgb_color(0, 1, 1, 1, y)
-            #define color_rgb_clipRGB_2  zebra_rgb_color(0, 1, 1, 1, y+1)
-
-            uint32_t * const v_row = (uint32_t*)( lvram        + BM2LV_R(y)    );  // 2 pixels
-            uint32_t * const b_row = (uint32_t*)( bvram        + BM_R(y)       );  // 4 pixels
-            uint32_t * const m_row = (uint32_t*)( bvram_mirror + BM_R(y)       );  // 4 pixels
-            
-            uint32_t* lvp; // that's a moving pointer through lv vram
-            uint32_t* bp;  // through bmp vram
-            uint32_t* mp;  // through mirror
-
-            for (int x = os.x0; x < os.x_max; x += 4)
-            {
-                lvp = v_row + (BM2LV_X(x) >> 1);
-                bp = b_row + (x >> 2);
-                mp = m_row + (x >> 2);
-                #define BP (*bp)
-                #define MP (*mp)
-                #define BN (*(bp + BMPPITCH/4))
-                #define MN (*(mp + BMPPITCH/4))
-                if (BP != 0 && BP != MP) { little_cleanup(bp, mp); continue; }
-                if (BN != 0 && BN != MN) { little_cleanup(bp + (BMPPITCH >> 2), mp + (BMPPITCH >> 2)); continue; }
-                if ((MP & 0x80808080) || (MN & 0x80808080)) continue;
-                
-                if (zebra_colorspace == 1 && !EXT_MONITOR_RCA) // rgb
-                {
-                    int Y, R, G, B;
-                    //~ uyvy2yrgb(*lvp, &Y, &R, &G, &B);
-                    COMPUTE_UYVY2YRGB(*lvp, Y, R, G, B);
-
-                    if(unlikely(Y < zll)) // underexposed
-                    {
-                        BP = MP = color_rgb_under;
-                        BN = MN = color_rgb_under_2;
-                    }
-                    else
-                    {
-                        //~ BP = MP = zebra_rgb_color(Y < zll, R > zlh, G > zlh, B > zlh, y);
-                        //~ BN = MN = zebra_rgb_color(Y < zll, R > zlh, G > zlh, B > zlh, y+1);
-
-                        if (unlikely(R > zlr)) // R clipped
-                        {
-                            if (unlikely(G > zlg)) // RG clipped
-                            {
-                                if (B > zlb) // RGB clipped (all of them)
-                                {
-                                    BP = MP = color_rgb_clipRGB;
-                                    BN = MN = color_rgb_clipRGB_2;
-                                }
-                                else // only R and G clipped
-                                {
-                                    BP = MP = color_rgb_clipRG;
-                                    BN = MN = color_rgb_clipRG_2;
-                                }
-                            }
-                            else // R clipped, G not clipped
-                            {
-                                if (unlikely(B > zlb)) // only R and B clipped
-                                {
-                                    BP = MP = color_rgb_clipRB;
-                                    BN = MN = color_rgb_clipRB_2;
-                                }
-                                else // only R clipped
-                                {
-                                    BP = MP = color_rgb_clipR;
-                                    BN = MN = color_rgb_clipR_2;
-                                }
-                            }
-                        }
-                        else // R not clipped
-                        {
-                            if (unlikely(G > zlg)) // R not clipped, G clipped
-                            {
-                                if (unlikely(B > zlb)) // only G and B clipped
-                                {
-                                    BP = MP = color_rgb_clipGB;
-                                    BN = MN = color_rgb_clipGB_2;
-                                }
-                                else // only G clipped
-                                {
-                                    BP = MP = color_rgb_clipG;
-                                    BN = MN = color_rgb_clipG_2;
-                                }
-                            }
-                            else // R not clipped, G not clipped
-                            {
-                                if (unlikely(B > zlb)) // only B clipped
-                                {
-                                    BP = MP = color_rgb_clipB;
-                                    BN = MN = color_rgb_clipB_2;
-                                }
-                                else // nothing clipped
-                                {
-                                    BN = MN = BP = MP = 0;
-                                }
-                            }
-                        }
-                    }
-                }
-                else // luma
-                {
-                    int p0 = (*lvp) >> 8 & 0xFF;
-                    if (unlikely(p0 > zlh))
-                    {
-                        BP = MP = color_over;
-                        BN = MN = color_over_2;
-                    }
-                    else if (unlikely(p0 < zll))
-                    {
-                        BP = MP = color_under;
-                        BN = MN = color_under_2;
-                    }
-                    else
-                        BN = MN = BP = MP = 0;
-                }
-                    
-                #undef MP
-                #undef BP
-                #undef BN
-                #undef MN
-            }
+            /* one pass for zebras and scopes */
+            struct overlay_scopes s;
+            hist_setup_scopes(&s);
+            struct overlay_zebra z = {
+                .y_skip = get_y_skip_offset_for_overlays(),
+                .zlh = zlh,
+                .zll = zll,
+                .rgb = zebra_colorspace == 1 && !EXT_MONITOR_RCA,
+            };
+            overlay_analyze(&v, get_y_skip_offset_for_histogram(), &s, &z);
+            scopes_fused_time = get_ms_clock_value();
+            scopes_fused_state = SCOPES_READY;
+            return;
         }
+        #endif
+
+        struct zebra_params p = {
+            .hi = zlh,
+            .lo = zll,
+            .rgb = zebra_colorspace == 1 && !EXT_MONITOR_RCA,
+        };
+        zebra_refresh(&v, &p);
     }
 }
 #endif
@@ -1630,43 +1343,9 @@ static inline int peak_d1xy(uint8_t* p8)
     return peak_scaling[MIN(e, 255)];
 }*/
 
-static inline int peak_d2xy_sharpen(uint8_t* p8)
-{
-    int orig = (int)(*p8);
-    int diff = orig * 4 - (int)(*(p8 + 2));
-    diff -= (int)(*(p8 - 2));
-    diff -= (int)(*(p8 + vram_lv.pitch));
-    diff -= (int)(*(p8 - vram_lv.pitch));
-    int v = orig + (diff << 2);
-    return COERCE(v, 0, 255);
-}
-
 static inline int FAST calc_peak(const uint8_t* p8, const int pitch)
 {
-    // approximate second derivative with a Laplacian kernel:
-    //     -1
-    //  -1  4 -1
-    //     -1
-    const int p8_xmin1 = (int)(*(p8 - 2));
-    const int p8_xplus1 = (int)(*(p8 + 2));
-    const int p8_ymin1 = (int)(*(p8 - pitch));
-    const int p8_yplus1 = (int)(*(p8 + pitch));
-
-    int result = ((int)(*p8) * 4);
-    result -= p8_xplus1 + p8_xmin1 + p8_yplus1 + p8_ymin1;
-
-    int e = ABS(result);
-
-    if (focus_peaking_filter_edges)
-    {
-        // filter out strong edges where first derivative is strong
-        // as these are usually false positives
-        int d1x = ABS(p8_xplus1 - p8_xmin1);
-        int d1y = ABS(p8_yplus1 - p8_ymin1);
-        int d1 = MAX(d1x, d1y);
-        e = MAX(e - ((d1 << focus_peaking_filter_edges) >> 2), 0) * 2;
-    }
-    return e;
+    return overlay_calc_peak(p8, pitch, focus_peaking_filter_edges);
 }
 
 static inline int FAST peak_d2xy(const uint8_t* p8)
@@ -1681,35 +1360,6 @@ static inline int FAST peak_d2xy_hd(const uint8_t* p8)
 
 #ifdef FEATURE_FOCUS_PEAK_DISP_FILTER
 
-//~ static inline int peak_blend_solid(uint32_t* s, int e, int thr) { return 0x4C7F4CD5; }
-//~ static inline int peak_blend_raw(uint32_t* s, int e) { return (e << 8) | (e << 24); }
-static inline int peak_blend_alpha(uint32_t* s, int e)
-{
-    // e=0 => cold (original color)
-    // e=255 => hot (red)
-    
-    uint8_t* s8u = (uint8_t*)s;
-    int8_t*  s8s = (int8_t*)s;
-
-    int y_cold = *(s8u+1);
-    int u_cold = *(s8s);
-    int v_cold = *(s8s+2);
-    
-    // red (255,0,0)
-    const int y_hot = 76;
-    const int u_hot = -43;
-    const int v_hot = 127;
-    
-    int er = 255-e;
-    int y = (y_cold * er + y_hot * e) >> 8;
-    int u = (u_cold * er + u_hot * e) >> 8;
-    int v = (v_cold * er + v_hot * e) >> 8;
-    
-    return UYVY_PACK(u,y,v,y);
-}
-
-static int peak_scaling[256];
-
 void FAST peak_disp_filter()
 {
     uint32_t* src_buf;
@@ -1736,107 +1386,15 @@ void FAST peak_disp_filter()
     static int thr_increment = 1;
     static int thr_delta = 0;
     
-    #define FOCUSED_THR 64
-    // the percentage selected in menu represents how many pixels are considered in focus
-    // let's say above some FOCUSED_THR
-    // so, let's scale edge value so that e=thr maps to e=FOCUSED_THR
-    for (int i = 0, i_fthr = 0; i < 255; i++, i_fthr += FOCUSED_THR)
-        peak_scaling[i] = MIN(i_fthr / thr, 255);
-    
-    int n_over = 0;
     int n_total = 720 * (os.y_max - os.y0) / 2;
 
-    #define PEAK_LOOP for (int i = 720 * (os.y0/2), max = 720 * (os.y_max/2); i < max; i++)
-    // generic loop:
-    //~ for (int i = 720 * (os.y0/2); i < 720 * (os.y_max/2); i++)
-    //~ {
-        //~ int e = peak_compute((uint8_t*)&src_buf[i] + 1);
-        //~ dst_buf[i] = peak_blend(&src_buf[i], e, blend_thr);
-        //~ if (unlikely(e > FOCUSED_THR)) n_over++;
-    //~ }
-    
-    if (focus_peaking_disp == 4) // raw
-    {
-        PEAK_LOOP
-        {
-            int e = peak_d2xy((uint8_t*)&src_buf[i] + 1);
-            e = MIN(e * 4, 255);
-            dst_buf[i] = (e << 8) | (e << 24);
-        }
-    }
-    
-    else if (focus_peaking_grayscale)
-    {
-        if (focus_peaking_disp == 1) 
-        {
-            PEAK_LOOP
-            {
-                int e = peak_d2xy((uint8_t*)&src_buf[i] + 1);
-                e = peak_scaling[MIN(e, 255)];
-                if (likely(e < FOCUSED_THR)) dst_buf[i] = src_buf[i] & 0xFF00FF00;
-                else 
-                { 
-                    dst_buf[i] = 0x4C7F4CD5; // red
-                    n_over++;
-                }
-            }
-        }
-        else if (focus_peaking_disp == 2) // alpha
-        {
-            PEAK_LOOP
-            {
-                int e = peak_d2xy((uint8_t*)&src_buf[i] + 1);
-                e = peak_scaling[MIN(e, 255)];
-                if (likely(e < 20)) dst_buf[i] = src_buf[i] & 0xFF00FF00;
-                else dst_buf[i] = peak_blend_alpha(&src_buf[i], e);
-                if (unlikely(e > FOCUSED_THR)) n_over++;
-            }
-        }
-        else if (focus_peaking_disp == 3) // sharp
-        {
-            PEAK_LOOP
-            {
-                int e = peak_d2xy_sharpen((uint8_t*)&src_buf[i] + 1);
-                dst_buf[i] = (src_buf[i] & 0xFF000000) | ((e & 0xFF) << 8);
-            }
-        }
-    }
-    else // color
-    {
-        if (focus_peaking_disp == 1) 
-        {
-            PEAK_LOOP
-            {
-                int e = peak_d2xy((uint8_t*)&src_buf[i] + 1);
-                e = peak_scaling[MIN(e, 255)];
-                if (likely(e < FOCUSED_THR)) dst_buf[i] = src_buf[i];
-                else 
-                { 
-                    dst_buf[i] = 0x4C7F4CD5; // red
-                    n_over++;
-                }
-            }
-        }
-        else if (focus_peaking_disp == 2) // alpha
-        {
-            PEAK_LOOP
-            {
-                int e = peak_d2xy((uint8_t*)&src_buf[i] + 1);
-                e = peak_scaling[MIN(e, 255)];
-                if (likely(e < 20)) dst_buf[i] = src_buf[i];
-                else dst_buf[i] = peak_blend_alpha(&src_buf[i], e);
-                if (unlikely(e > FOCUSED_THR)) n_over++;
-            }
-        }
-        else if (focus_peaking_disp == 3) // sharp
-        {
-            PEAK_LOOP
-            {
-                int e = peak_d2xy_sharpen((uint8_t*)&src_buf[i] + 1);
-                dst_buf[i] = (src_buf[i] & 0xFFFF00FF) | ((e & 0xFF) << 8);
-            }
-        }
-    }
+    struct overlay_peak p = {
+        .disp = focus_peaking_disp,
+        .grayscale = focus_peaking_grayscale,
+        .filter_edges = focus_peaking_filter_edges,
+        .thr = thr,
+    };
+    int n_over = overlay_peak_filter(src_buf, dst_buf, 720 * (os.y0/2), 720 * (os.y_max/2), vram_lv.pitch, &p);
 
     // update threshold for next iteration
     if (1000 * n_over / n_total > (int)focus_peaking_pthr)
@@ -3172,6 +2730,14 @@ struct menu_entry zebra_menus[] = {
                 .help = "You can hide zebras when recording.",
             },
             #endif
+            {
+                .name = "CPU budget",
+                .priv = &zebra_budget,
+                .max = 4,
+                .choices = (const char *[]) {"OFF", "1 ms", "2 ms", "5 ms", "10 ms"},
+                .help = "Refresh only parts of the image at a time, within this CPU time.",
+                .help2 = "Changed areas first. Keeps zebras fluid when CPU is busy.",
+            },
             #ifdef FEATURE_RAW_ZEBRAS
             {
                 .name = "Use RAW zebras",
@@ -4461,7 +4027,7 @@ int should_draw_bottom_graphs()
     return 0;
 }
 
-void draw_histogram_and_waveform(int allow_play)
+static void draw_histogram_and_waveform_step(int allow_play)
 {
 
     if (menu_active_and_not_hidden()) return;
@@ -4472,7 +4038,11 @@ void draw_histogram_and_waveform(int allow_play)
 #if defined(FEATURE_HISTOGRAM) || defined(FEATURE_WAVEFORM) || defined(FEATURE_VECTORSCOPE)
     if (hist_draw || waveform_draw || vectorscope_draw)
     {
-        hist_build(); /* also updates waveform and vectorscope */
+        /* already computed by the zebras? (see SCOPES_READY) */
+        int fused = scopes_fused_state == SCOPES_READY && get_ms_clock_value() - scopes_fused_time < 1000;
+        scopes_fused_state = SCOPES_BUSY;
+        if (!fused)
+            hist_build(); /* also updates waveform and vectorscope */
         #ifdef FEATURE_RAW_HISTOGRAM
         if (raw_histogram_enable && can_use_raw_overlays())
             hist_build_raw();
@@ -4540,6 +4110,17 @@ void draw_histogram_and_waveform(int allow_play)
 #endif
 }
 
+void draw_histogram_and_waveform(int allow_play)
+{
+    draw_histogram_and_waveform_step(allow_play);
+
+#if defined(FEATURE_HISTOGRAM) || defined(FEATURE_WAVEFORM) || defined(FEATURE_VECTORSCOPE)
+    /* done with them; the zebras may compute the next set */
+    if (hist_draw || waveform_draw || vectorscope_draw)
+        scopes_fused_state = SCOPES_WANTED;
+#endif
+}
+
 static int idle_countdown_display_dim = 50;
 static int idle_countdown_display_off = 50;
 static int idle_countdown_globaldraw = 50;
@@ -5303,7 +4884,7 @@ livev_hipriority_task( void* unused )
                 BMP_LOCK(
                     if (lv)
                         draw_zebra_and_focus(
-                            k % ((focus_peaking ? 5 : 3) * (recording ? 5 : 1)) == 0, /* should redraw zebras? */
+                            k % ((focus_peaking ? 5 : 3) * (recording ? 5 : 1)) == 0 || zebra_budget, /* should redraw zebras? (with a CPU budget, a few tiles every time) */
                             k % 2 == 1  /* should redraw focus peaking? */
                         ); 
                 )
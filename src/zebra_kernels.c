@@ -0,0 +1,980 @@
+/**
+ * LiveView overlay kernels (see zebra_kernels.h)
+ * This file must not depend on camera stuff (it's also compiled on the PC).
+ */
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifdef CONFIG_MAGICLANTERN
+#include "dryos.h"
+#include "bmp.h"
+#include "menu.h"
+#include "math.h"
+#else
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#define FAST
+#define likely(exp) __builtin_expect(exp,1)
+#define unlikely(exp) __builtin_expect(exp,0)
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define ABS(a) ((a) > 0 ? (a) : -(a))
+#define COERCE(x,lo,hi) MAX(MIN((x),(hi)),(lo))
+#define ALIGN32(x) ((typeof(x))(((uintptr_t)(x)) & ~3))
+/* same as bmp.h */
+#define COLOR_WHITE             0x01
+#define COLOR_BLACK             0x02
+#define COLOR_CYAN              0x05
+#define COLOR_GREEN2            0x07
+#define COLOR_RED               0x08
+#define COLOR_BLUE              0x0B
+#define COLOR_MAGENTA           0x0E
+#define COLOR_YELLOW            0x0F
+#endif
+
+#include "imgconv.h"
+#include "histogram.h"
+#include "zebra_kernels.h"
+
+/* histogram, waveform, vectorscope */
+
+static inline int vectorscope_coord_uv_to_pos(const struct overlay_scopes* s, int U, int V)
+{
+    /* convert YUV to vectorscope position */
+    V *= s->vectorscope_h;
+    V >>= 8;
+    V += s->vectorscope_h >> 1;
+
+    U *= s->vectorscope_w;
+    U >>= 8;
+    U += s->vectorscope_w >> 1;
+
+    int pos = U + V * s->vectorscope_w;
+
+    return pos;
+}
+
+static inline void vectorscope_addpixel(const struct overlay_scopes* s, int8_t u, int8_t v)
+{
+    uint8_t* vectorscope = s->vectorscope;
+
+    int V = -v << s->vectorscope_gain;
+    int U = u << s->vectorscope_gain;
+
+    int r = U*U + V*V;
+    if (r > 124*124)
+    {
+        const int r_sqrt = (int)sqrtf(r);
+        /* almost out of circle, mark it with red */
+        for (int R = 124; R < 128; R++)
+        {
+            int c = U * R / r_sqrt;
+            int s_ = V * R / r_sqrt;
+            int pos = vectorscope_coord_uv_to_pos(s, c, s_);
+            vectorscope[pos] = 255 - COLOR_RED;
+        }
+    }
+    else
+    {
+        if (s->vectorscope_gain)
+        {
+            /* simulate better resolution */
+            U += rand()%2;
+            V += rand()%2;
+        }
+
+        int pos = vectorscope_coord_uv_to_pos(s, U, V);
+
+        /* increase luminance at this position. when reaching 4*0x2A, we are at maximum. */
+        if(vectorscope[pos] < (0x2A << 2))
+        {
+            vectorscope[pos]++;
+        }
+    }
+}
+
+/* one UYVY word (2 pixels) for the scopes; Y, R, G, B from the caller (R, G, B only for the RGB histogram) */
+static inline void scopes_addpixel(struct overlay_scopes* s, uint32_t pixel, int Y, int R, int G, int B, int wx)
+{
+    struct Histogram* histogram = s->hist;
+
+    if (histogram)
+    {
+        if (s->hist_rgb)
+        {
+            // YRGB range: 0-255
+            uint32_t R_level = (R * HIST_WIDTH) >> 8;
+            uint32_t G_level = (G * HIST_WIDTH) >> 8;
+            uint32_t B_level = (B * HIST_WIDTH) >> 8;
+
+            histogram->hist_r[R_level & (HIST_WIDTH-1)]++;
+            histogram->hist_g[G_level & (HIST_WIDTH-1)]++;
+            histogram->hist_b[B_level & (HIST_WIDTH-1)]++;
+        }
+
+        histogram->total_px++;
+        uint32_t hist_level = (Y * HIST_WIDTH) >> 8;
+
+        // Ignore the 0 bin.  It generates too much noise
+        unsigned count = ++ (histogram->hist[ hist_level & (HIST_WIDTH-1)]);
+        if( hist_level && count > histogram->max )
+            histogram->max = count;
+    }
+
+    // Update the waveform plot
+    if (s->waveform)
+    {
+        int wy = COERCE((Y * s->waveform_h) >> 8, 0, s->waveform_h - 1);
+        uint8_t* w = &s->waveform[wx + wy * s->waveform_w];
+        if ((*w) < 250) (*w)++;
+    }
+
+    if (s->vectorscope)
+    {
+        int8_t U = (pixel >>  0) & 0xFF;
+        int8_t V = (pixel >> 16) & 0xFF;
+        vectorscope_addpixel(s, U, V);
+    }
+}
+
+static inline int scopes_skip_pixel(struct overlay_scopes* s, uint32_t pixel)
+{
+    // ignore magic zoom borders
+    return s->skip_mz && (pixel == MZ_WHITE || pixel == MZ_BLACK || pixel == MZ_GREEN);
+}
+
+void FAST overlay_hist_build(const struct overlay_vram* v, int y_skip, struct overlay_scopes* s)
+{
+    uint32_t* buf = (uint32_t*)v->lv;
+    const int rgb = s->hist && s->hist_rgb;
+    const int x_ex = v->x_max - v->x0;
+
+    int x,y;
+    int yoffset = 0;
+    for( y = v->y0 + y_skip, yoffset = y * v->lv_pitch; y < v->y_max - y_skip; y += 2, yoffset += v->lv_pitch )
+    {
+        for( x = v->x0 ; x < v->x_max ; x += 2 )
+        {
+            uint32_t pixel = buf[(yoffset + (v->bm2lv_x[x] << 1)) >> 2];
+
+            if (scopes_skip_pixel(s, pixel))
+                continue;
+
+            int Y, R = 0, G = 0, B = 0;
+
+            if (rgb)
+            {
+                COMPUTE_UYVY2YRGB(pixel, Y, R, G, B);
+            }
+            else // luma
+            {
+                uint32_t p1 = ((pixel >> 16) & 0xFF00) >> 8;
+                uint32_t p2 = ((pixel >>  0) & 0xFF00) >> 8;
+                Y = (p1+p2) >> 1;
+            }
+
+            int wx = s->waveform ? COERCE(((x - v->x0) * s->waveform_w) / x_ex, 0, s->waveform_w - 1) : 0;
+            scopes_addpixel(s, pixel, Y, R, G, B, wx);
+        }
+    }
+}
+
+/* zebras */
+
+#define ZEBRA_COLOR_WORD_SOLID(x) ( (x) | (x)<<8 | (x)<<16 | (x)<<24 )
+
+int zebra_rgb_color(int underexposed, int clipR, int clipG, int clipB, int y)
+{
+    if (underexposed) return zebra_color_word_row(79, y);
+
+    switch ((clipR ? 4 : 0) |
+            (clipG ? 2 : 0) |
+            (clipB ? 1 : 0))
+    {
+        case 0b111: return ZEBRA_COLOR_WORD_SOLID(COLOR_BLACK);
+        case 0b110: return ZEBRA_COLOR_WORD_SOLID(COLOR_YELLOW);
+        case 0b101: return ZEBRA_COLOR_WORD_SOLID(COLOR_MAGENTA);
+        case 0b011: return ZEBRA_COLOR_WORD_SOLID(COLOR_CYAN);
+        case 0b100: return y&2 ? 0 : ZEBRA_COLOR_WORD_SOLID(COLOR_RED);
+        case 0b001: return y&2 ? 0 : ZEBRA_COLOR_WORD_SOLID(COLOR_BLUE);
+        case 0b010: return y&2 ? 0 : ZEBRA_COLOR_WORD_SOLID(COLOR_GREEN2);
+        default: return 0;
+    }
+}
+
+int zebra_rgb_solid_color(int underexposed, int clipR, int clipG, int clipB)
+{
+    if (underexposed) return ZEBRA_COLOR_WORD_SOLID(79);
+
+    switch ((clipR ? 4 : 0) |
+            (clipG ? 2 : 0) |
+            (clipB ? 1 : 0))
+    {
+        case 0b111: return ZEBRA_COLOR_WORD_SOLID(COLOR_BLACK);
+        case 0b110: return ZEBRA_COLOR_WORD_SOLID(COLOR_YELLOW);
+        case 0b101: return ZEBRA_COLOR_WORD_SOLID(COLOR_MAGENTA);
+        case 0b011: return ZEBRA_COLOR_WORD_SOLID(COLOR_CYAN);
+        case 0b100: return ZEBRA_COLOR_WORD_SOLID(COLOR_RED);
+        case 0b001: return ZEBRA_COLOR_WORD_SOLID(COLOR_BLUE);
+        case 0b010: return ZEBRA_COLOR_WORD_SOLID(COLOR_GREEN2);
+        default: return 0;
+    }
+}
+
+void FAST overlay_zebras_yuv(const struct overlay_vram* v, int y_skip, int zlh, int zll, int rgb)
+{
+    uint8_t * const lvram = v->lv;
+    uint8_t * const bvram = v->bmp;
+    uint8_t * const bvram_mirror = v->mirror;
+    const int bmp_pitch = v->bmp_pitch;
+
+    int zlr = zlh;
+    int zlg = zlh;
+    int zlb = zlh;
+
+    // draw zebra in 16:9 frame
+    // y is in BM coords
+    for(int y = v->y0 + y_skip; y < v->y_max - y_skip; y += 2 )
+    {
+        #define color_over           zebra_color_word_row(COLOR_RED,  y)
+        #define color_under          zebra_color_word_row(COLOR_BLUE, y)
+        #define color_over_2         zebra_color_word_row(COLOR_RED,  y+1)
+        #define color_under_2        zebra_color_word_row(COLOR_BLUE, y+1)
+
+        #define color_rgb_under      zebra_rgb_color(1, 0, 0, 0, y)
+        #define color_rgb_under_2    zebra_rgb_color(1, 0, 0, 0, y+1)
+
+        #define color_rgb_clipR      zebra_rgb_color(0, 1, 0, 0, y)
+        #define color_rgb_clipR_2    zebra_rgb_color(0, 1, 0, 0, y+1)
+        #define color_rgb_clipG      zebra_rgb_color(0, 0, 1, 0, y)
+        #define color_rgb_clipG_2    zebra_rgb_color(0, 0, 1, 0, y+1)
+        #define color_rgb_clipB      zebra_rgb_color(0, 0, 0, 1, y)
+        #define color_rgb_clipB_2    zebra_rgb_color(0, 0, 0, 1, y+1)
+
+        #define color_rgb_clipRG     zebra_rgb_color(0, 1, 1, 0, y)
+        #define color_rgb_clipRG_2   zebra_rgb_color(0, 1, 1, 0, y+1)
+        #define color_rgb_clipGB     zebra_rgb_color(0, 0, 1, 1, y)
+        #define color_rgb_clipGB_2   zebra_rgb_color(0, 0, 1, 1, y+1)
+        #define color_rgb_clipRB     zebra_rgb_color(0, 1, 0, 1, y)
+        #define color_rgb_clipRB_2   zebra_rgb_color(0, 1, 0, 1, y+1)
+
+        #define color_rgb_clipRGB    zebra_rgb_color(0, 1, 1, 1, y)
+        #define color_rgb_clipRGB_2  zebra_rgb_color(0, 1, 1, 1, y+1)
+
+        uint32_t * const v_row = (uint32_t*)( lvram        + OVERLAY_BM2LV_Y(v, y) * v->lv_pitch );  // 2 pixels
+        uint32_t * const b_row = (uint32_t*)( bvram        + y * bmp_pitch );  // 4 pixels
+        uint32_t * const m_row = (uint32_t*)( bvram_mirror + y * bmp_pitch );  // 4 pixels
+
+        uint32_t* lvp; // that's a moving pointer through lv vram
+        uint32_t* bp;  // through bmp vram
+        uint32_t* mp;  // through mirror
+
+        for (int x = v->x0; x < v->x_max; x += 4)
+        {
+            lvp = v_row + (v->bm2lv_x[x] >> 1);
+            bp = b_row + (x >> 2);
+            mp = m_row + (x >> 2);
+            #define BP (*bp)
+            #define MP (*mp)
+            #define BN (*(bp + bmp_pitch/4))
+            #define MN (*(mp + bmp_pitch/4))
+            if (BP != 0 && BP != MP) { little_cleanup(bp, mp); continue; }
+            if (BN != 0 && BN != MN) { little_cleanup(bp + (bmp_pitch >> 2), mp + (bmp_pitch >> 2)); continue; }
+            if ((MP & 0x80808080) || (MN & 0x80808080)) continue;
+
+            if (rgb)
+            {
+                int Y, R, G, B;
+                COMPUTE_UYVY2YRGB(*lvp, Y, R, G, B);
+
+                if(unlikely(Y < zll)) // underexposed
+                {
+                    BP = MP = color_rgb_under;
+                    BN = MN = color_rgb_under_2;
+                }
+                else
+                {
+                    if (unlikely(R > zlr)) // R clipped
+                    {
+                        if (unlikely(G > zlg)) // RG clipped
+                        {
+                            if (B > zlb) // RGB clipped (all of them)
+                            {
+                                BP = MP = color_rgb_clipRGB;
+                                BN = MN = color_rgb_clipRGB_2;
+                            }
+                            else // only R and G clipped
+                            {
+                                BP = MP = color_rgb_clipRG;
+                                BN = MN = color_rgb_clipRG_2;
+                            }
+                        }
+                        else // R clipped, G not clipped
+                        {
+                            if (unlikely(B > zlb)) // only R and B clipped
+                            {
+                                BP = MP = color_rgb_clipRB;
+                                BN = MN = color_rgb_clipRB_2;
+                            }
+                            else // only R clipped
+                            {
+                                BP = MP = color_rgb_clipR;
+                                BN = MN = color_rgb_clipR_2;
+                            }
+                        }
+                    }
+                    else // R not clipped
+                    {
+                        if (unlikely(G > zlg)) // R not clipped, G clipped
+                        {
+                            if (unlikely(B > zlb)) // only G and B clipped
+                            {
+                                BP = MP = color_rgb_clipGB;
+                                BN = MN = color_rgb_clipGB_2;
+                            }
+                            else // only G clipped
+                            {
+                                BP = MP = color_rgb_clipG;
+                                BN = MN = color_rgb_clipG_2;
+                            }
+                        }
+                        else // R not clipped, G not clipped
+                        {
+                            if (unlikely(B > zlb)) // only B clipped
+                            {
+                                BP = MP = color_rgb_clipB;
+                                BN = MN = color_rgb_clipB_2;
+                            }
+                            else // nothing clipped
+                            {
+                                BN = MN = BP = MP = 0;
+                            }
+                        }
+                    }
+                }
+            }
+            else // luma
+            {
+                int p0 = (*lvp) >> 8 & 0xFF;
+                if (unlikely(p0 > zlh))
+                {
+                    BP = MP = color_over;
+                    BN = MN = color_over_2;
+                }
+                else if (unlikely(p0 < zll))
+                {
+                    BP = MP = color_under;
+                    BN = MN = color_under_2;
+                }
+                else
+                    BN = MN = BP = MP = 0;
+            }
+
+            #undef MP
+            #undef BP
+            #undef BN
+            #undef MN
+        }
+    }
+}
+
+/* zebra colors for rows y and y+1: 0...7 = clipped channels (RGB bits), 8 = underexposed; luma zebras use 7 and 8 */
+static void zebra_row_colors(uint32_t colors[2][9], int y, int rgb)
+{
+    for (int k = 0; k < 2; k++)
+    {
+        if (rgb)
+        {
+            for (int i = 0; i < 8; i++)
+                colors[k][i] = zebra_rgb_color(0, i & 4, i & 2, i & 1, y + k);
+            colors[k][8] = zebra_rgb_color(1, 0, 0, 0, y + k);
+        }
+        else
+        {
+            for (int i = 0; i < 7; i++)
+                colors[k][i] = 0;
+            colors[k][7] = zebra_color_word_row(COLOR_RED,  y + k);
+            colors[k][8] = zebra_color_word_row(COLOR_BLUE, y + k);
+        }
+    }
+}
+
+/* column tables for overlay_analyze, one entry for every other BMP column of the overlay area */
+#define ANALYZE_MAX_COLUMNS 512
+static uint16_t analyze_col_lv[ANALYZE_MAX_COLUMNS];     /* 32-bit word in the LV row */
+static uint16_t analyze_col_wx[ANALYZE_MAX_COLUMNS];     /* waveform column */
+
+void FAST overlay_analyze(const struct overlay_vram* v, int y_skip, struct overlay_scopes* s, const struct overlay_zebra* z)
+{
+    const int bmp_pitch = v->bmp_pitch;
+    const int x_ex = v->x_max - v->x0;
+    const int hist_rgb = s && s->hist && s->hist_rgb;
+    const int zebra_rgb = z && z->rgb;
+    const int waveform_w = s && s->waveform ? s->waveform_w : 0;
+
+    /* zebra rows: same parity as ours */
+    int zy0 = v->y_max, zy1 = 0;
+    if (z)
+    {
+        zy0 = v->y0 + z->y_skip + ((z->y_skip - y_skip) & 1);
+        zy1 = v->y_max - z->y_skip;
+    }
+
+    int sy0 = v->y_max, sy1 = 0;
+    if (s)
+    {
+        sy0 = v->y0 + y_skip;
+        sy1 = v->y_max - y_skip;
+    }
+
+    int y0 = MIN(sy0, zy0);
+    int y1 = MAX(sy1, zy1);
+
+    /* the columns we sample (x0, x0 + 2, x0 + 4...): LV word and waveform column, so the pixel loop has no divisions */
+    const int n = MIN((x_ex + 1) / 2, ANALYZE_MAX_COLUMNS);
+    for (int i = 0; i < n; i++)
+    {
+        analyze_col_lv[i] = v->bm2lv_x[v->x0 + 2*i] >> 1;
+        analyze_col_wx[i] = waveform_w ? MIN(2*i * waveform_w / x_ex, waveform_w - 1) : 0;
+    }
+
+    uint32_t colors[2][9];
+
+    for (int y = y0; y < y1; y += 2)
+    {
+        const uint32_t* v_row = (uint32_t*)(v->lv + v->bm2lv_r[y]);      // 2 pixels
+        uint32_t* b_row = (uint32_t*)(v->bmp + y * bmp_pitch);            // 4 pixels
+        uint32_t* m_row = (uint32_t*)(v->mirror + y * bmp_pitch);         // 4 pixels
+
+        const int scopes = y >= sy0 && y < sy1;
+        const int zebras = y >= zy0 && y < zy1;
+        if (zebras) zebra_row_colors(colors, y, zebra_rgb);
+
+        /* scopes: every column; zebras: every other column (4 BMP pixels at a time), from the same LV words */
+        for (int i = 0; i < n; i += (scopes ? 1 : 2))
+        {
+            uint32_t pixel = v_row[analyze_col_lv[i]];
+            int zebra = zebras && !(i & 1);
+            int Y, R = 0, G = 0, B = 0;
+
+            if (hist_rgb || (zebra && zebra_rgb))
+            {
+                COMPUTE_UYVY2YRGB(pixel, Y, R, G, B);
+            }
+            else
+            {
+                uint32_t p1 = ((pixel >> 16) & 0xFF00) >> 8;
+                uint32_t p2 = ((pixel >>  0) & 0xFF00) >> 8;
+                Y = (p1+p2) >> 1;
+            }
+
+            if (scopes && !scopes_skip_pixel(s, pixel))
+            {
+                scopes_addpixel(s, pixel, Y, R, G, B, analyze_col_wx[i]);
+            }
+
+            if (!zebra)
+                continue;
+
+            int x = v->x0 + 2*i;
+            uint32_t* bp = b_row + (x >> 2);
+            uint32_t* mp = m_row + (x >> 2);
+            #define BP (*bp)
+            #define MP (*mp)
+            #define BN (*(bp + bmp_pitch/4))
+            #define MN (*(mp + bmp_pitch/4))
+            if (BP != 0 && BP != MP) { little_cleanup(bp, mp); continue; }
+            if (BN != 0 && BN != MN) { little_cleanup(bp + (bmp_pitch >> 2), mp + (bmp_pitch >> 2)); continue; }
+            if ((MP & 0x80808080) || (MN & 0x80808080)) continue;
+
+            int c;
+            if (zebra_rgb)
+            {
+                c = Y < z->zll ? 8 : (R > z->zlh) << 2 | (G > z->zlh) << 1 | (B > z->zlh);
+            }
+            else
+            {
+                int p0 = pixel >> 8 & 0xFF;
+                c = p0 > z->zlh ? 7 : p0 < z->zll ? 8 : 0;
+            }
+            BP = MP = colors[0][c];
+            BN = MN = colors[1][c];
+            #undef MP
+            #undef BP
+            #undef BN
+            #undef MN
+        }
+    }
+}
+
+/* same as raw_*_pixel_dark/bright from raw.c, on any raw buffer: first (a) and last (h) pixel of a raw_pixblock */
+#define RAW_BLOCK(v, i) ((uint16_t*)(v)->raw + (i) * 7)
+#define RAW_A(v, i) (RAW_BLOCK(v, i)[0] >> 2)
+#define RAW_H(v, i) (RAW_BLOCK(v, i)[6] & 0x3FFF)
+
+static inline int raw_red_dark(const struct overlay_vram* v, int x, int y)
+{
+    y = (y/2) * 2;
+    int i = ((y * v->raw_width + x) / 8);
+    return MIN(RAW_A(v, i), RAW_A(v, i - v->raw_width*2/8));
+}
+
+static inline int raw_green_dark(const struct overlay_vram* v, int x, int y)
+{
+    y = (y/2) * 2;
+    int i = ((y * v->raw_width + x) / 8);
+    return MIN(RAW_H(v, i), RAW_H(v, i - v->raw_width*2/8));
+}
+
+static inline int raw_blue_dark(const struct overlay_vram* v, int x, int y)
+{
+    y = (y/2) * 2 - 1;
+    int i = ((y * v->raw_width + x) / 8);
+    return MIN(RAW_H(v, i), RAW_H(v, i - v->raw_width*2/8));
+}
+
+static inline int raw_green_bright(const struct overlay_vram* v, int x, int y)
+{
+    y = (y/2) * 2;
+    int i = ((y * v->raw_width + x) / 8);
+    return MAX(RAW_H(v, i), RAW_H(v, i - v->raw_width*2/8));
+}
+
+void FAST overlay_zebras_raw_lv(const struct overlay_vram* v, int y_skip, int white, int underexposed)
+{
+    uint8_t * const bvram = v->bmp;
+    uint8_t * const bvram_mirror = v->mirror;
+
+    for(int i = v->y0 + y_skip; i < v->y_max - y_skip; i += 2 )
+    {
+        uint64_t * const b_row = (uint64_t*)( bvram        + i * v->bmp_pitch );  // 8 pixels
+        uint64_t * const m_row = (uint64_t*)( bvram_mirror + i * v->bmp_pitch );  // 8 pixels
+
+        uint64_t* bp;  // through bmp vram
+        uint64_t* mp;  // through mirror
+
+        int y = OVERLAY_LV2RAW_Y(v, OVERLAY_BM2LV_Y(v, i));
+        if (y < v->raw_y1 || y > v->raw_y2) continue;
+
+        for (int j = v->x0; j < v->x_max; j += 8)
+        {
+            bp = b_row + j/8;
+            mp = m_row + j/8;
+
+            #define BP (*bp)
+            #define MP (*mp)
+
+            if (BP != 0 && BP != MP) { little_cleanup(bp, mp); continue; }
+            if ((MP & 0x80808080)) continue;
+
+            int x = OVERLAY_LV2RAW_X(v, v->bm2lv_x[j]);
+
+            if (x < v->raw_x1 || x > v->raw_x2) continue;
+
+            /* for dual ISO: use dark lines for overexposure and bright lines for underexposure */
+            int r = raw_red_dark(v, x, y);
+            int g = raw_green_dark(v, x, y);
+            int b = raw_blue_dark(v, x, y);
+            int u = raw_green_bright(v, x, y);
+
+            uint64_t c = zebra_rgb_solid_color(u <= underexposed, r > white, g > white, b > white);
+            c = c | (c << 32);
+
+            MP = BP = c;
+
+            #undef BP
+            #undef MP
+        }
+    }
+}
+
+/* incremental refresh */
+
+#define TILE_SAMPLES 4                      /* TILE_SAMPLES x TILE_SAMPLES luma samples for each tile */
+#define TILE_NO_SIGNATURE 0xFFFF            /* more than 16 * 255, so it always looks changed */
+
+void overlay_tiles_reset(struct overlay_tiles* t)
+{
+    for (int i = 0; i < OVERLAY_TILES; i++)
+        t->signature[i] = TILE_NO_SIGNATURE;
+}
+
+void FAST overlay_tiles_update(struct overlay_tiles* t, const struct overlay_vram* v, int y_skip)
+{
+    const int x0 = v->x0;
+    const int y0 = v->y0 + y_skip;
+    const int w = v->x_max - x0;
+    const int h = v->y_max - y_skip - y0;
+    int moved = 0;
+
+    for (int i = 0; i <= OVERLAY_TILES_X; i++)
+    {
+        int x = i < OVERLAY_TILES_X ? x0 + ((i * w / OVERLAY_TILES_X) & ~7) : v->x_max;
+        moved |= x != t->x[i];
+        t->x[i] = x;
+    }
+
+    for (int j = 0; j <= OVERLAY_TILES_Y; j++)
+    {
+        int y = j < OVERLAY_TILES_Y ? y0 + ((j * h / OVERLAY_TILES_Y) & ~1) : v->y_max - y_skip;
+        moved |= y != t->y[j];
+        t->y[j] = y;
+    }
+
+    if (moved)
+    {
+        overlay_tiles_reset(t);
+    }
+
+    for (int j = 0; j < OVERLAY_TILES_Y; j++)
+    {
+        const int th = t->y[j+1] - t->y[j];
+        for (int i = 0; i < OVERLAY_TILES_X; i++)
+        {
+            const int tw = t->x[i+1] - t->x[i];
+            int sum = 0;
+            for (int sy = 0; sy < TILE_SAMPLES; sy++)
+            {
+                const uint8_t* row = v->lv + v->bm2lv_r[t->y[j] + (2*sy + 1) * th / (2*TILE_SAMPLES)];
+                for (int sx = 0; sx < TILE_SAMPLES; sx++)
+                {
+                    int x = t->x[i] + (2*sx + 1) * tw / (2*TILE_SAMPLES);
+                    sum += row[(v->bm2lv_x[x] << 1) + 1];
+                }
+            }
+
+            int k = i + j * OVERLAY_TILES_X;
+            t->current[k] = sum;
+            if (t->age[k] < 0xFFFF) t->age[k]++;
+        }
+    }
+
+    t->refreshed = 0;
+}
+
+int overlay_tiles_next(struct overlay_tiles* t)
+{
+    const int thr = t->threshold * TILE_SAMPLES * TILE_SAMPLES;
+    int best = -1;
+    int best_priority = -1;
+
+    for (int i = 0; i < OVERLAY_TILES; i++)
+    {
+        if (t->refreshed & (1ULL << i))
+            continue;
+
+        int changed = ABS(t->current[i] - t->signature[i]) > thr;
+        int priority = (changed << 16) + t->age[i];
+        if (priority > best_priority)
+        {
+            best = i;
+            best_priority = priority;
+        }
+    }
+
+    return best;
+}
+
+void overlay_tiles_get(const struct overlay_tiles* t, const struct overlay_vram* v, int i, struct overlay_vram* tile)
+{
+    *tile = *v;
+    tile->x0    = t->x[i % OVERLAY_TILES_X];
+    tile->x_max = t->x[i % OVERLAY_TILES_X + 1];
+    tile->y0    = t->y[i / OVERLAY_TILES_X];
+    tile->y_max = t->y[i / OVERLAY_TILES_X + 1];
+}
+
+void overlay_tiles_done(struct overlay_tiles* t, int i)
+{
+    t->signature[i] = t->current[i];
+    t->age[i] = 0;
+    t->refreshed |= 1ULL << i;
+}
+
+/* focus peaking */
+
+static inline int peak_d2xy_sharpen(const uint8_t* p8, const int pitch)
+{
+    int orig = (int)(*p8);
+    int diff = orig * 4 - (int)(*(p8 + 2));
+    diff -= (int)(*(p8 - 2));
+    diff -= (int)(*(p8 + pitch));
+    diff -= (int)(*(p8 - pitch));
+    int v = orig + (diff << 2);
+    return COERCE(v, 0, 255);
+}
+
+static inline int peak_blend_alpha(const uint32_t* s, int e)
+{
+    // e=0 => cold (original color)
+    // e=255 => hot (red)
+
+    uint8_t* s8u = (uint8_t*)s;
+    int8_t*  s8s = (int8_t*)s;
+
+    int y_cold = *(s8u+1);
+    int u_cold = *(s8s);
+    int v_cold = *(s8s+2);
+
+    // red (255,0,0)
+    const int y_hot = 76;
+    const int u_hot = -43;
+    const int v_hot = 127;
+
+    int er = 255-e;
+    int y = (y_cold * er + y_hot * e) >> 8;
+    int u = (u_cold * er + u_hot * e) >> 8;
+    int v = (v_cold * er + v_hot * e) >> 8;
+
+    return UYVY_PACK(u,y,v,y);
+}
+
+static int peak_scaling[256];
+
+/**
+ * Dots and alpha: most pixels are not on an edge, and they only need the Laplacian.
+ * With the Laplacian below lap_thr (absolute value), the pixel is cold whatever the rest of overlay_calc_peak and the scaling would give
+ * (the edge filter can only lower e, and doubles it at most), so we can skip them;
+ * the others go through the same computation as before, so the output does not change.
+ */
+static inline int peak_lap(const uint8_t* p8, const int pitch)
+{
+    return (int)(*p8) * 4 - (int)(*(p8 - 2)) - (int)(*(p8 + 2)) - (int)(*(p8 - pitch)) - (int)(*(p8 + pitch));
+}
+
+static int peak_lap_thr(int limit, int filter_edges)
+{
+    /* the first edge value that may give a hot pixel; peak_scaling only increases, except for its last entry (0) */
+    int e = 0;
+    while (e < 255 && peak_scaling[e] < limit)
+        e++;
+
+    /* with the edge filter, e is at most twice the Laplacian */
+    return filter_edges ? (e + 1) / 2 : e;
+}
+
+int FAST overlay_peak_filter(const uint32_t* src_buf, uint32_t* dst_buf, int start, int end, int pitch, const struct overlay_peak* p)
+{
+    const int filter_edges = p->filter_edges;
+    int n_over = 0;
+
+    // the percentage selected in menu represents how many pixels are considered in focus
+    // let's say above some FOCUSED_THR
+    // so, let's scale edge value so that e=thr maps to e=FOCUSED_THR
+    for (int i = 0, i_fthr = 0; i < 255; i++, i_fthr += OVERLAY_PEAK_FOCUSED_THR)
+        peak_scaling[i] = MIN(i_fthr / p->thr, 255);
+
+    #define FOCUSED_THR OVERLAY_PEAK_FOCUSED_THR
+    #define PEAK_LOOP for (int i = start; i < end; i++)
+    #define peak_d2xy(p8) overlay_calc_peak(p8, pitch, filter_edges)
+    #define peak_lap_cold(p8) ((unsigned)(peak_lap(p8, pitch) + (int)lap_thr - 1) < 2 * lap_thr - 1)
+
+    if (p->disp == 4) // raw
+    {
+        PEAK_LOOP
+        {
+            int e = peak_d2xy((uint8_t*)&src_buf[i] + 1);
+            e = MIN(e * 4, 255);
+            dst_buf[i] = (e << 8) | (e << 24);
+        }
+    }
+
+    else if (p->grayscale)
+    {
+        if (p->disp == 1)
+        {
+            const unsigned lap_thr = peak_lap_thr(FOCUSED_THR, filter_edges);
+            PEAK_LOOP
+            {
+                if (likely(peak_lap_cold((uint8_t*)&src_buf[i] + 1)))
+                {
+                    dst_buf[i] = src_buf[i] & 0xFF00FF00;
+                    continue;
+                }
+                int e = peak_d2xy((uint8_t*)&src_buf[i] + 1);
+                e = peak_scaling[MIN(e, 255)];
+                if (likely(e < FOCUSED_THR)) dst_buf[i] = src_buf[i] & 0xFF00FF00;
+                else
+                {
+                    dst_buf[i] = 0x4C7F4CD5; // red
+                    n_over++;
+                }
+            }
+        }
+        else if (p->disp == 2) // alpha
+        {
+            const unsigned lap_thr = peak_lap_thr(20, filter_edges);
+            PEAK_LOOP
+            {
+                if (likely(peak_lap_cold((uint8_t*)&src_buf[i] + 1)))
+                {
+                    dst_buf[i] = src_buf[i] & 0xFF00FF00;
+                    continue;
+                }
+                int e = peak_d2xy((uint8_t*)&src_buf[i] + 1);
+                e = peak_scaling[MIN(e, 255)];
+                if (likely(e < 20)) dst_buf[i] = src_buf[i] & 0xFF00FF00;
+                else dst_buf[i] = peak_blend_alpha(&src_buf[i], e);
+                if (unlikely(e > FOCUSED_THR)) n_over++;
+            }
+        }
+        else if (p->disp == 3) // sharp
+        {
+            PEAK_LOOP
+            {
+                int e = peak_d2xy_sharpen((uint8_t*)&src_buf[i] + 1, pitch);
+                dst_buf[i] = (src_buf[i] & 0xFF000000) | ((e & 0xFF) << 8);
+            }
+        }
+    }
+    else // color
+    {
+        if (p->disp == 1)
+        {
+            const unsigned lap_thr = peak_lap_thr(FOCUSED_THR, filter_edges);
+            PEAK_LOOP
+            {
+                if (likely(peak_lap_cold((uint8_t*)&src_buf[i] + 1)))
+                {
+                    dst_buf[i] = src_buf[i];
+                    continue;
+                }
+                int e = peak_d2xy((uint8_t*)&src_buf[i] + 1);
+                e = peak_scaling[MIN(e, 255)];
+                if (likely(e < FOCUSED_THR)) dst_buf[i] = src_buf[i];
+                else
+                {
+                    dst_buf[i] = 0x4C7F4CD5; // red
+                    n_over++;
+                }
+            }
+        }
+        else if (p->disp == 2) // alpha
+        {
+            const unsigned lap_thr = peak_lap_thr(20, filter_edges);
+            PEAK_LOOP
+            {
+                if (likely(peak_lap_cold((uint8_t*)&src_buf[i] + 1)))
+                {
+                    dst_buf[i] = src_buf[i];
+                    continue;
+                }
+                int e = peak_d2xy((uint8_t*)&src_buf[i] + 1);
+                e = peak_scaling[MIN(e, 255)];
+                if (likely(e < 20)) dst_buf[i] = src_buf[i];
+                else dst_buf[i] = peak_blend_alpha(&src_buf[i], e);
+                if (unlikely(e > FOCUSED_THR)) n_over++;
+            }
+        }
+        else if (p->disp == 3) // sharp
+        {
+            PEAK_LOOP
+            {
+                int e = peak_d2xy_sharpen((uint8_t*)&src_buf[i] + 1, pitch);
+                dst_buf[i] = (src_buf[i] & 0xFFFF00FF) | ((e & 0xFF) << 8);
+            }
+        }
+    }
+
+    #undef peak_lap_cold
+    #undef peak_d2xy
+    #undef PEAK_LOOP
+    #undef FOCUSED_THR
+
+    return n_over;
+}
+
+/* waveform */
+
+void overlay_waveform_draw(const struct overlay_vram* v, const uint8_t* waveform, int waveform_w, int waveform_h,
+                           int factor, int bg, unsigned x_origin, unsigned y_origin, unsigned height)
+{
+    // Ensure that x_origin is quad-word aligned
+    x_origin &= ~3;
+
+    uint8_t * const bvram = v->bmp;
+    unsigned pitch = v->bmp_pitch;
+
+    int i, y;
+
+    // vertical line up to the hist size
+    for (int k = 0; k < factor; k++)
+    {
+        for( y=waveform_h-1 ; y>=0 ; y-- )
+        {
+            int y_bmp = y_origin + y * height / waveform_h + k;
+            if (y_bmp < 0) continue;
+            if (y_bmp >= v->bmp_h) continue;
+
+            uint8_t * row = bvram + x_origin + y_bmp * pitch;
+            const uint8_t * w_row = waveform + (waveform_h - y - 1) * waveform_w;
+            uint32_t pixel = 0;
+            int w = waveform_w * factor;
+            for( i=0 ; i<w; i++ )
+            {
+                uint32_t count = w_row[i / factor];
+                if (height < (unsigned) waveform_h)
+                { // smooth it a bit to reduce aliasing; not perfect, but works.. sort of
+                    count += w_row[i / factor];
+                }
+                // Scale to a grayscale
+                count = (count * 42) >> 7;
+                if( count > 42 - 5 )
+                    count = COLOR_RED;
+                else
+                if( count >  0 )
+                    count += 38 + 5;
+                else
+                // Draw a series of colored scales
+                if( y == (waveform_h*1)>>2 )
+                    count = COLOR_BLUE;
+                else
+                if( y == (waveform_h*2)>>2 )
+                    count = 0xE; // pink
+                else
+                if( y == (waveform_h*3)>>2 )
+                    count = COLOR_BLUE;
+                else
+                    count = bg; // transparent
+
+                pixel |= (count << ((i & 3)<<3));
+
+                if( (i & 3) != 3 )
+                    continue;
+
+                // Draw the pixel, rounding down to the nearest
+                // quad word write (and then nop to avoid err70).
+                *(uint32_t*) ALIGN32(row + i) = pixel;
+                #ifdef CONFIG_500D // err70?!
+                asm( "nop" );
+                asm( "nop" );
+                asm( "nop" );
+                asm( "nop" );
+                asm( "nop" );
+                asm( "nop" );
+                asm( "nop" );
+                asm( "nop" );
+                #endif
+                pixel = 0;
+            }
+        }
+    }
+}
@@ -0,0 +1,236 @@
+/**
+ * LiveView overlay kernels: histogram/waveform/vectorscope, zebras (YUV and RAW), focus peaking, waveform drawing
+ *
+ * These are the per-pixel loops from zebra.c, without the camera around them:
+ * everything they need to know about the image buffers is in struct overlay_vram,
+ * which zebra.c fills from the real VRAM (overlay_vram_get), and the PC test bench
+ * (contrib/zebrabench) fills from frames saved on the card.
+ *
+ * No camera dependencies here (the same code runs on the PC, so it can be timed and checked against golden images).
+ **/
+
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _zebra_kernels_h_
+#define _zebra_kernels_h_
+
+#include <stdint.h>
+
+struct Histogram;
+
+struct overlay_vram
+{
+    /* LiveView image, UYVY (2 pixels in 32 bits) */
+    uint8_t* lv;
+    int lv_pitch;
+
+    /* BMP overlay (8-bit palette) and its mirror (what we have drawn there, to leave Canon's drawings alone) */
+    uint8_t* bmp;
+    uint8_t* mirror;
+    int bmp_pitch;
+    int bmp_h;                      /* rows available below the origin (BMP_H_PLUS) */
+
+    /* overlay area (os.*), BMP coordinates */
+    int x0, y0, x_max, y_max;
+
+    /* BMP -> LV: column x is bm2lv_x[x] (any x in the overlay area), row y is ((y * bm2lv_sy) >> 10) + bm2lv_ty */
+    const int* bm2lv_x;
+    int bm2lv_sy, bm2lv_ty;
+    const int* bm2lv_r;             /* the same rows, precomputed as byte offsets in the LV image (any y in the overlay area) */
+
+    /* 14-bit RAW (struct raw_pixblock rows, raw_width pixels each); raw = 0 if not available */
+    void* raw;
+    int raw_width;
+    int raw_x1, raw_y1, raw_x2, raw_y2;     /* active area */
+    int lv2raw_sx, lv2raw_tx, lv2raw_sy, lv2raw_ty;
+};
+
+#define OVERLAY_BM2LV_Y(v, y) ((((y) * (v)->bm2lv_sy) >> 10) + (v)->bm2lv_ty)
+#define OVERLAY_LV2RAW_X(v, x) ((((x) * (v)->lv2raw_sx) >> 10) + (v)->lv2raw_tx)
+#define OVERLAY_LV2RAW_Y(v, y) ((((y) * (v)->lv2raw_sy) >> 10) + (v)->lv2raw_ty)
+
+/* what hist_build computes; null pointers are skipped */
+struct overlay_scopes
+{
+    struct Histogram* hist;
+    int hist_rgb;                   /* RGB histogram, or luma only */
+    int skip_mz;                    /* ignore magic zoom borders */
+
+    uint8_t* waveform;              /* waveform_w x waveform_h counters */
+    int waveform_w, waveform_h;
+
+    uint8_t* vectorscope;           /* vectorscope_w x vectorscope_h counters */
+    int vectorscope_w, vectorscope_h;
+    int vectorscope_gain;
+};
+
+/**
+ * Incremental refresh: the overlay area is split in tiles, and each refresh cycle only redraws some of them,
+ * as many as the caller's CPU budget allows (the caller measures the time; see draw_zebras).
+ * 
+ * Each tile has a luma signature (a few LV samples); tiles that changed since they were last drawn go first,
+ * then the ones that waited the longest, so every tile gets refreshed eventually, even in a static scene.
+ */
+#define OVERLAY_TILES_X 8
+#define OVERLAY_TILES_Y 6
+#define OVERLAY_TILES   (OVERLAY_TILES_X * OVERLAY_TILES_Y)
+
+struct overlay_tiles
+{
+    /* setup */
+    int threshold;                          /* luma change (0-255) that makes a tile a priority */
+
+    /* state */
+    int x[OVERLAY_TILES_X + 1];             /* tile boundaries (BMP); columns are multiples of 8 from the first one */
+    int y[OVERLAY_TILES_Y + 1];             /* ... and rows are multiples of 2 */
+    uint16_t signature[OVERLAY_TILES];      /* sum of the luma samples when the tile was drawn */
+    uint16_t current[OVERLAY_TILES];        /* the same, in the current frame */
+    uint16_t age[OVERLAY_TILES];            /* refresh cycles since the tile was drawn */
+    uint64_t refreshed;                     /* tiles drawn in this cycle (bit mask) */
+};
+
+/* forget the signatures (e.g. settings changed, or the overlay was erased): everything is a priority */
+void overlay_tiles_reset(struct overlay_tiles* t);
+
+/* start a refresh cycle: tile the overlay area (rows y_skip...y_max-y_skip), and sample the current frame */
+void overlay_tiles_update(struct overlay_tiles* t, const struct overlay_vram* v, int y_skip);
+
+/* the tile to draw next in this cycle, or -1 if all of them were drawn */
+int overlay_tiles_next(struct overlay_tiles* t);
+
+/* the overlay area of tile i (a copy of v), to be passed to the kernels with y_skip = 0 */
+void overlay_tiles_get(const struct overlay_tiles* t, const struct overlay_vram* v, int i, struct overlay_vram* tile);
+
+/* tile i was drawn */
+void overlay_tiles_done(struct overlay_tiles* t, int i);
+
+/* focus peaking display filter settings */
+struct overlay_peak
+{
+    int disp;                       /* focus_peaking_disp: 1 = blinking dots, 2 = fine dots (alpha), 3 = sharpen, 4 = raw */
+    int grayscale;                  /* grayscale image under the peaking dots */
+    int filter_edges;               /* prefer texture details rather than strong edges (0...2) */
+    int thr;                        /* edge value that counts as "in focus" (adjusted by the caller from the result) */
+};
+
+/* YUV zebra settings, for overlay_analyze */
+struct overlay_zebra
+{
+    int y_skip;                     /* from get_y_skip_offset_for_overlays */
+    int zlh, zll;                   /* over zlh, under zll */
+    int rgb;                        /* RGB zebras, or luma */
+};
+
+/* the edge value above which a pixel counts as "in focus", after scaling with overlay_peak.thr */
+#define OVERLAY_PEAK_FOCUSED_THR 64
+
+/**
+ * Walk the LV image two pixels at a time (every other row, starting at y0 + y_skip),
+ * and fill histogram, waveform and vectorscope (the buffers are not cleared here).
+ */
+void overlay_hist_build(const struct overlay_vram* v, int y_skip, struct overlay_scopes* s);
+
+/**
+ * Single pass: overlay_hist_build and overlay_zebras_yuv together, reading each LV word only once
+ * (rows and columns from the bm2lv_r / bm2lv_x tables). Either s or z may be null.
+ *
+ * The zebras start on the same row parity as the scopes (z->y_skip may be rounded up by one row).
+ * The scopes sample the same rows as the zebras, over the whole image (overlay_hist_build advances
+ * one LV row for every two BMP rows, so it only looks at the top half), so the counts are the same,
+ * but the histogram itself is not.
+ */
+void overlay_analyze(const struct overlay_vram* v, int y_skip, struct overlay_scopes* s, const struct overlay_zebra* z);
+
+/* zebras from the LV image, on every other row: luma (over zlh, under zll), or RGB */
+void overlay_zebras_yuv(const struct overlay_vram* v, int y_skip, int zlh, int zll, int rgb);
+
+/* zebras from the RAW buffer (LiveView: every other row, 8 pixels at a time) */
+void overlay_zebras_raw_lv(const struct overlay_vram* v, int y_skip, int white, int underexposed);
+
+/**
+ * Focus peaking display filter: src => dst, 32-bit UYVY words start...end-1 (pitch in bytes, for the neighbour rows).
+ * Returns how many pixels were in focus.
+ */
+int overlay_peak_filter(const uint32_t* src, uint32_t* dst, int start, int end, int pitch, const struct overlay_peak* p);
+
+/* draw the waveform counters as an image in the BMP overlay (height rows, each waveform pixel repeated factor times) */
+void overlay_waveform_draw(const struct overlay_vram* v, const uint8_t* waveform, int waveform_w, int waveform_h,
+                           int factor, int bg, unsigned x_origin, unsigned y_origin, unsigned height);
+
+/* zebra colors, packed as 4 BMP pixels */
+int zebra_rgb_color(int underexposed, int clipR, int clipG, int clipB, int y);
+int zebra_rgb_solid_color(int underexposed, int clipR, int clipG, int clipB);
+
+static inline int zebra_color_word_row(int c, int y)
+{
+    if (!c) return 0;
+
+    uint32_t cw = 0;
+    switch(y % 4)
+    {
+        case 0:
+            cw  = c  | c  << 8;
+            break;
+        case 1:
+            cw  = c << 8 | c << 16;
+            break;
+        case 2:
+            cw = c  << 16 | c << 24;
+            break;
+        case 3:
+            cw  = c  << 24 | c ;
+            break;
+    }
+    return cw;
+}
+
+/* approximate second derivative with a Laplacian kernel; p8 points to a luma byte in the UYVY image */
+static inline int overlay_calc_peak(const uint8_t* p8, const int pitch, const int filter_edges)
+{
+    //     -1
+    //  -1  4 -1
+    //     -1
+    const int p8_xmin1 = (int)(*(p8 - 2));
+    const int p8_xplus1 = (int)(*(p8 + 2));
+    const int p8_ymin1 = (int)(*(p8 - pitch));
+    const int p8_yplus1 = (int)(*(p8 + pitch));
+
+    int result = ((int)(*p8) * 4);
+    result -= p8_xplus1 + p8_xmin1 + p8_yplus1 + p8_ymin1;
+
+    int e = result < 0 ? -result : result;
+
+    if (filter_edges)
+    {
+        // filter out strong edges where first derivative is strong
+        // as these are usually false positives
+        int d1x = p8_xplus1 - p8_xmin1;
+        int d1y = p8_yplus1 - p8_ymin1;
+        if (d1x < 0) d1x = -d1x;
+        if (d1y < 0) d1y = -d1y;
+        int d1 = d1x > d1y ? d1x : d1y;
+        e = e - ((d1 << filter_edges) >> 2);
+        e = (e > 0 ? e : 0) * 2;
+    }
+    return e;
+}
+
+#endif